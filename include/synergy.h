@@ -547,12 +547,37 @@ typedef struct {
 #define TSH_ADVANCED_OP_GET_TOKEN 415   /* compiler-generated master/workers */
 #define TSH_RMALL 		  416   /* remove all existing tuples */ 
 
+/* extended ops, dispatched from TSH_OP_XMIN */
+#define TSH_OP_XMIN               417
+#define TSH_OP_XMAX               431
+#define TSH_OP_TAKE               417   /* get under a lease, requeued on expiry */
+#define TSH_OP_RENEW              418   /* extend a lease */
+#define TSH_OP_ACK                419   /* complete a lease, drop the tuple */
+#define TSH_OP_PUTTTL             420   /* put that expires after ttl_ms */
+#define TSH_OP_PUTNX              421   /* put only if the name is absent */
+#define TSH_OP_CAS                422   /* put only if the version matches */
+#define TSH_OP_STAT               423   /* tuple metadata, no payload */
+#define TSH_OP_INCR               424   /* atomic add to a counter tuple */
+#define TSH_OP_ENQ                425   /* append to a named work queue */
+#define TSH_OP_DEQ                426   /* remove the head of a work queue */
+#define TSH_OP_SUB                427   /* be notified of puts matching expr */
+#define TSH_OP_KPUT               428   /* put under an integer key */
+#define TSH_OP_KGET               429   /* get by integer key */
+#define TSH_OP_KREAD              430   /* read by integer key */
+#define TSH_OP_HELLO              431   /* switch the connection to v2 */
+
+#define TSH_WAIT_FOREVER          0xffffffff /* wait_ms of a blocking TSH_OP_DEQ */
+
 #define TSH_ER_NOERROR            400
 #define TSH_ER_INSTALL            401
 #define TSH_ER_NOTUPLE            402
 #define TSH_ER_NOMEM              403
 #define TSH_ER_OVERRT             404
 #define TSH_ER_NOBCAST            405   /* Bcast error */
+#define TSH_ER_NOLEASE            406   /* lease unknown or already expired */
+#define TSH_ER_CONFLICT           407   /* conditional put lost */
+#define TSH_ER_NOTCTR             408   /* tuple is not a counter */
+#define TSH_ER_PROTO              409   /* malformed or unknown v2 request */
 
 typedef struct {
   char appid[NAME_LEN] ;
@@ -579,11 +604,181 @@ typedef struct {
   sng_int16 cidport;  /* local cid port for tid info */
 } tsh_get_it;
 
+typedef struct {
+  sng_int32 ttl_ms ;            /* follows tsh_put_it for TSH_OP_PUTTTL */
+} tsh_ttl_it;
+
+typedef struct {
+  sng_int32 version ;           /* CAS: expected version, 0: must be absent */
+  sng_int32 ttl_ms ;            /* 0: never expires */
+} tsh_cond_it;                  /* follows tsh_put_it for PUTNX/CAS */
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;             /* TSH_ER_CONFLICT if the put lost */
+  sng_int32 version ;           /* version stored, or current on conflict */
+} tsh_cond_ot;
+
+typedef struct {
+  char expr[TUPLENAME_LEN] ;
+} tsh_stat_it;
+
+typedef struct {
+  sng_int16 status ;            /* SUCCESS if a tuple matched */
+  sng_int16 error ;
+  sng_int32 length ;
+  sng_int32 version ;
+  sng_int16 priority ;
+} tsh_stat_ot;
+
+typedef struct {
+  char name[TUPLENAME_LEN] ;
+  sng_int32 delta ;             /* signed; 0 fetches the value */
+  sng_int16 priority ;          /* used if the counter is created */
+} tsh_incr_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;             /* TSH_ER_NOTCTR if not 4 bytes long */
+  sng_int32 value ;             /* value after the add */
+} tsh_incr_ot;
+
 typedef struct {
   sng_int32 host;
   int proc_id;
 } tsh_retrieve_it;
 
+typedef struct {
+  char expr[TUPLENAME_LEN] ;
+  sng_int32 len ;               /* max bytes accepted, 0: whole tuple */
+  sng_int32 lease_ms ;          /* lease duration */
+} tsh_take_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;
+  sng_int32 lease_id ;
+  char name[TUPLENAME_LEN] ;
+  sng_int32 length ;            /* tuple bytes that follow */
+  sng_int16 priority ;
+} tsh_take_ot;
+
+typedef struct {
+  sng_int32 lease_id ;
+  sng_int32 lease_ms ;          /* new duration, unused by TSH_OP_ACK */
+} tsh_lease_it;
+
+typedef struct {
+  char name[TUPLENAME_LEN] ;    /* queue name */
+  sng_int32 length ;            /* item bytes that follow */
+} tsh_enq_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;
+  sng_int32 count ;             /* items queued after this one */
+} tsh_enq_ot;
+
+typedef struct {
+  char name[TUPLENAME_LEN] ;    /* queue name */
+  sng_int32 len ;               /* max bytes accepted, 0: whole item */
+  sng_int32 lease_ms ;          /* 0: the item is removed for good */
+  sng_int32 wait_ms ;           /* 0: fail at once if the queue is empty */
+} tsh_deq_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;             /* TSH_ER_NOTUPLE if the wait ran out */
+  sng_int32 lease_id ;          /* 0 if not leased */
+  sng_int32 length ;            /* item bytes that follow */
+} tsh_deq_ot;
+
+typedef struct {
+  char expr[TUPLENAME_LEN] ;
+  sng_int32 max_len ;           /* payload bytes sent with a note, 0: none */
+} tsh_sub_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;
+} tsh_sub_ot;                   /* followed by tsh_note_ot stream */
+
+typedef struct {
+  char name[TUPLENAME_LEN] ;    /* tuple just put */
+  sng_int32 length ;            /* its full length */
+  sng_int32 sent ;              /* payload bytes that follow */
+  sng_int16 priority ;
+} tsh_note_ot;
+
+/*
+  v2 framing. A client sends TSH_OP_HELLO on a new connection; if the
+  server agrees, the connection stays open and carries frames
+
+     varint hdr_len, varint payload_len, header, payload
+
+  Integers in a header are LEB128 varints, signed ones zigzag encoded,
+  and strings are a varint length followed by the bytes. A request
+  header is op, request id, then the op's fields; a reply header is
+  the request id, the error code (TSH_ER_NOERROR on success), then the
+  reply fields. Replies come back in request order, so requests may be
+  pipelined. Ops and their fields, request / reply:
+
+     TSH_OP_PUT    name, priority, ttl_ms / -                payload: tuple
+     TSH_OP_GET    expr, max_len / name, priority, length    reply payload
+     TSH_OP_READ   as TSH_OP_GET
+     TSH_OP_STAT   expr / length, priority, version
+     TSH_OP_INCR   name, delta / value
+     TSH_OP_KPUT   family, index, priority / -               payload: tuple
+     TSH_OP_KGET   family, index, max_len / length           reply payload
+     TSH_OP_KREAD  as TSH_OP_KGET
+
+  The length in a fetch reply is that of the whole tuple; the payload
+  is cut to max_len if that is smaller. A v2 GET or READ that misses
+  fails with TSH_ER_NOTUPLE; it is not queued. Other ops are v1 only.
+*/
+#define TSH_V2_MAGIC              0x54534832 /* "TSH2" */
+#define TSH_V2                    2
+#define TSH_V2_MAXHDR             512   /* longest header accepted */
+#define TSH_CAP_PIPELINE          0x1   /* several requests in flight */
+#define TSH_CAP_KEYS              0x2   /* TSH_OP_KPUT/KGET/KREAD */
+#define TSH_CAP_ALL               (TSH_CAP_PIPELINE | TSH_CAP_KEYS)
+
+typedef struct {
+  sng_int32 magic ;             /* TSH_V2_MAGIC */
+  sng_int16 version ;           /* highest version the client speaks */
+  sng_int32 caps ;              /* TSH_CAP_* the client wants */
+} tsh_hello_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;
+  sng_int16 version ;           /* version the connection now speaks */
+  sng_int32 caps ;              /* capabilities granted */
+} tsh_hello_ot;
+
+typedef struct {
+  sng_int32 family ;            /* application-chosen family id */
+  sng_int32 index_hi ;          /* 64-bit index within the family */
+  sng_int32 index_lo ;
+} tsh_key_t;
+
+typedef struct {
+  tsh_key_t key ;
+  sng_int32 length ;            /* tuple bytes that follow */
+  sng_int16 priority ;
+} tsh_kput_it;                  /* answered with tsh_put_ot */
+
+typedef struct {
+  tsh_key_t key ;
+  sng_int32 len ;               /* max bytes accepted, 0: whole tuple */
+} tsh_kget_it;
+
+typedef struct {
+  sng_int16 status ;
+  sng_int16 error ;             /* TSH_ER_NOTUPLE, never queued */
+  sng_int32 length ;            /* tuple bytes that follow */
+} tsh_kget_ot;
+
 typedef struct {
   char tpname[TUPLENAME_LEN] ;
 } tsh_tidinfo_it;
@@ -604,7 +799,7 @@ typedef struct {
 typedef struct {
   sng_int16 status ;
   sng_int16 error ;
-} tsh_put_ot, tsh_get_ot1, tsh_exit_ot, tsh_retrieve_ot ;
+} tsh_put_ot, tsh_get_ot1, tsh_exit_ot, tsh_retrieve_ot, tsh_lease_ot ;
 
 typedef struct {
   char appid[NAME_LEN] ;
@@ -0,0 +1,950 @@
+/*.........................................................................*/
+/*                  MATRIX_KERNEL.C ------> Worker multiply kernel          */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "matrix_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+/* Width of the scalar tile */
+#define KERNEL_NR 8
+
+/* Computes a full MR x nr tile of C += A * B over kc */
+typedef void (*kernel_tile_fn)(int kc, const void *A, int lda,
+                               const void *B, int ldb, void *C, int ldc);
+
+/* The same for a partial mr x nr tile at the bottom or right edge */
+typedef void (*kernel_edge_fn)(int mr, int nr, int kc, const void *A, int lda,
+                               const void *B, int ldb, void *C, int ldc);
+
+/* Portable tile and edge kernels for elements of type T summed in type S.
+   The tile adds the product of an MR x kc sliver of A and a kc x NR sliver
+   of B to C, accumulated in one local row per row of A: short fixed-length
+   loops the compiler keeps in (vector) registers */
+#define KERNEL_SCALAR(suffix, T, S)                                             \
+static void kernel_tile_##suffix(int kc, const void *Av, int lda, const void *Bv, \
+                                 int ldb, void *Cv, int ldc)                    \
+{                                                                               \
+    const T *A = Av, *B = Bv;                                                   \
+    S *C = Cv;                                                                  \
+    const T *a0 = A, *a1 = A + lda, *a2 = A + 2 * lda, *a3 = A + 3 * lda;       \
+    S c0[KERNEL_NR], c1[KERNEL_NR], c2[KERNEL_NR], c3[KERNEL_NR];               \
+    int j, p;                                                                   \
+                                                                                \
+    for (j = 0; j < KERNEL_NR; j++) {                                           \
+        c0[j] = C[j];                                                           \
+        c1[j] = C[ldc + j];                                                     \
+        c2[j] = C[2 * ldc + j];                                                 \
+        c3[j] = C[3 * ldc + j];                                                 \
+    }                                                                           \
+                                                                                \
+    for (p = 0; p < kc; p++) {                                                  \
+        const T *b = &B[p * ldb];                                               \
+        S x0 = a0[p], x1 = a1[p], x2 = a2[p], x3 = a3[p];                       \
+        for (j = 0; j < KERNEL_NR; j++) {                                       \
+            c0[j] += x0 * b[j];                                                 \
+            c1[j] += x1 * b[j];                                                 \
+            c2[j] += x2 * b[j];                                                 \
+            c3[j] += x3 * b[j];                                                 \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    for (j = 0; j < KERNEL_NR; j++) {                                           \
+        C[j] = c0[j];                                                           \
+        C[ldc + j] = c1[j];                                                     \
+        C[2 * ldc + j] = c2[j];                                                 \
+        C[3 * ldc + j] = c3[j];                                                 \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static void kernel_edge_##suffix(int mr, int nr, int kc, const void *Av, int lda, \
+                                 const void *Bv, int ldb, void *Cv, int ldc)    \
+{                                                                               \
+    const T *A = Av, *B = Bv;                                                   \
+    S *C = Cv;                                                                  \
+    int i, j, p;                                                                \
+                                                                                \
+    for (i = 0; i < mr; i++) {                                                  \
+        for (p = 0; p < kc; p++) {                                              \
+            S a = A[i * lda + p];                                               \
+            const T *b = &B[p * ldb];                                           \
+            for (j = 0; j < nr; j++)                                            \
+                C[i * ldc + j] += a * b[j];                                     \
+        }                                                                       \
+    }                                                                           \
+}
+
+KERNEL_SCALAR(f64, double, double)
+KERNEL_SCALAR(f32, float, float)
+KERNEL_SCALAR(i8, int8_t, int32_t)
+KERNEL_SCALAR(i16, int16_t, int64_t)
+
+#ifdef KERNEL_X86
+
+/* SSE2: 4 x 4 tile in eight 2-wide registers; SSE2 has no FMA */
+__attribute__((target("sse2")))
+static void kernel_tile_sse2_f64(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                 void *Cv, int ldc)
+{
+    const double *A = Av, *B = Bv;
+    double *C = Cv;
+    __m128d c00 = _mm_loadu_pd(C), c01 = _mm_loadu_pd(C + 2);
+    __m128d c10 = _mm_loadu_pd(C + ldc), c11 = _mm_loadu_pd(C + ldc + 2);
+    __m128d c20 = _mm_loadu_pd(C + 2 * ldc), c21 = _mm_loadu_pd(C + 2 * ldc + 2);
+    __m128d c30 = _mm_loadu_pd(C + 3 * ldc), c31 = _mm_loadu_pd(C + 3 * ldc + 2);
+    __m128d a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm_loadu_pd(&B[p * ldb]);
+        b1 = _mm_loadu_pd(&B[p * ldb + 2]);
+        a = _mm_set1_pd(A[p]);
+        c00 = _mm_add_pd(c00, _mm_mul_pd(a, b0));
+        c01 = _mm_add_pd(c01, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[lda + p]);
+        c10 = _mm_add_pd(c10, _mm_mul_pd(a, b0));
+        c11 = _mm_add_pd(c11, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[2 * lda + p]);
+        c20 = _mm_add_pd(c20, _mm_mul_pd(a, b0));
+        c21 = _mm_add_pd(c21, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[3 * lda + p]);
+        c30 = _mm_add_pd(c30, _mm_mul_pd(a, b0));
+        c31 = _mm_add_pd(c31, _mm_mul_pd(a, b1));
+    }
+
+    _mm_storeu_pd(C, c00);
+    _mm_storeu_pd(C + 2, c01);
+    _mm_storeu_pd(C + ldc, c10);
+    _mm_storeu_pd(C + ldc + 2, c11);
+    _mm_storeu_pd(C + 2 * ldc, c20);
+    _mm_storeu_pd(C + 2 * ldc + 2, c21);
+    _mm_storeu_pd(C + 3 * ldc, c30);
+    _mm_storeu_pd(C + 3 * ldc + 2, c31);
+}
+
+/* AVX2: 4 x 8 tile in eight 4-wide registers, one FMA per register per k */
+__attribute__((target("avx2,fma")))
+static void kernel_tile_avx2_f64(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                 void *Cv, int ldc)
+{
+    const double *A = Av, *B = Bv;
+    double *C = Cv;
+    __m256d c00 = _mm256_loadu_pd(C), c01 = _mm256_loadu_pd(C + 4);
+    __m256d c10 = _mm256_loadu_pd(C + ldc), c11 = _mm256_loadu_pd(C + ldc + 4);
+    __m256d c20 = _mm256_loadu_pd(C + 2 * ldc), c21 = _mm256_loadu_pd(C + 2 * ldc + 4);
+    __m256d c30 = _mm256_loadu_pd(C + 3 * ldc), c31 = _mm256_loadu_pd(C + 3 * ldc + 4);
+    __m256d a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm256_loadu_pd(&B[p * ldb]);
+        b1 = _mm256_loadu_pd(&B[p * ldb + 4]);
+        a = _mm256_broadcast_sd(&A[p]);
+        c00 = _mm256_fmadd_pd(a, b0, c00);
+        c01 = _mm256_fmadd_pd(a, b1, c01);
+        a = _mm256_broadcast_sd(&A[lda + p]);
+        c10 = _mm256_fmadd_pd(a, b0, c10);
+        c11 = _mm256_fmadd_pd(a, b1, c11);
+        a = _mm256_broadcast_sd(&A[2 * lda + p]);
+        c20 = _mm256_fmadd_pd(a, b0, c20);
+        c21 = _mm256_fmadd_pd(a, b1, c21);
+        a = _mm256_broadcast_sd(&A[3 * lda + p]);
+        c30 = _mm256_fmadd_pd(a, b0, c30);
+        c31 = _mm256_fmadd_pd(a, b1, c31);
+    }
+
+    _mm256_storeu_pd(C, c00);
+    _mm256_storeu_pd(C + 4, c01);
+    _mm256_storeu_pd(C + ldc, c10);
+    _mm256_storeu_pd(C + ldc + 4, c11);
+    _mm256_storeu_pd(C + 2 * ldc, c20);
+    _mm256_storeu_pd(C + 2 * ldc + 4, c21);
+    _mm256_storeu_pd(C + 3 * ldc, c30);
+    _mm256_storeu_pd(C + 3 * ldc + 4, c31);
+}
+
+/* AVX-512: 4 x 16 tile in eight 8-wide registers */
+__attribute__((target("avx512f")))
+static void kernel_tile_avx512_f64(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                   void *Cv, int ldc)
+{
+    const double *A = Av, *B = Bv;
+    double *C = Cv;
+    __m512d c00 = _mm512_loadu_pd(C), c01 = _mm512_loadu_pd(C + 8);
+    __m512d c10 = _mm512_loadu_pd(C + ldc), c11 = _mm512_loadu_pd(C + ldc + 8);
+    __m512d c20 = _mm512_loadu_pd(C + 2 * ldc), c21 = _mm512_loadu_pd(C + 2 * ldc + 8);
+    __m512d c30 = _mm512_loadu_pd(C + 3 * ldc), c31 = _mm512_loadu_pd(C + 3 * ldc + 8);
+    __m512d a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm512_loadu_pd(&B[p * ldb]);
+        b1 = _mm512_loadu_pd(&B[p * ldb + 8]);
+        a = _mm512_set1_pd(A[p]);
+        c00 = _mm512_fmadd_pd(a, b0, c00);
+        c01 = _mm512_fmadd_pd(a, b1, c01);
+        a = _mm512_set1_pd(A[lda + p]);
+        c10 = _mm512_fmadd_pd(a, b0, c10);
+        c11 = _mm512_fmadd_pd(a, b1, c11);
+        a = _mm512_set1_pd(A[2 * lda + p]);
+        c20 = _mm512_fmadd_pd(a, b0, c20);
+        c21 = _mm512_fmadd_pd(a, b1, c21);
+        a = _mm512_set1_pd(A[3 * lda + p]);
+        c30 = _mm512_fmadd_pd(a, b0, c30);
+        c31 = _mm512_fmadd_pd(a, b1, c31);
+    }
+
+    _mm512_storeu_pd(C, c00);
+    _mm512_storeu_pd(C + 8, c01);
+    _mm512_storeu_pd(C + ldc, c10);
+    _mm512_storeu_pd(C + ldc + 8, c11);
+    _mm512_storeu_pd(C + 2 * ldc, c20);
+    _mm512_storeu_pd(C + 2 * ldc + 8, c21);
+    _mm512_storeu_pd(C + 3 * ldc, c30);
+    _mm512_storeu_pd(C + 3 * ldc + 8, c31);
+}
+
+/* SSE2: 4 x 8 tile in eight 4-wide registers; SSE2 has no FMA */
+__attribute__((target("sse2")))
+static void kernel_tile_sse2_f32(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                 void *Cv, int ldc)
+{
+    const float *A = Av, *B = Bv;
+    float *C = Cv;
+    __m128 c00 = _mm_loadu_ps(C), c01 = _mm_loadu_ps(C + 4);
+    __m128 c10 = _mm_loadu_ps(C + ldc), c11 = _mm_loadu_ps(C + ldc + 4);
+    __m128 c20 = _mm_loadu_ps(C + 2 * ldc), c21 = _mm_loadu_ps(C + 2 * ldc + 4);
+    __m128 c30 = _mm_loadu_ps(C + 3 * ldc), c31 = _mm_loadu_ps(C + 3 * ldc + 4);
+    __m128 a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm_loadu_ps(&B[p * ldb]);
+        b1 = _mm_loadu_ps(&B[p * ldb + 4]);
+        a = _mm_set1_ps(A[p]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(a, b0));
+        c01 = _mm_add_ps(c01, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(A[lda + p]);
+        c10 = _mm_add_ps(c10, _mm_mul_ps(a, b0));
+        c11 = _mm_add_ps(c11, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(A[2 * lda + p]);
+        c20 = _mm_add_ps(c20, _mm_mul_ps(a, b0));
+        c21 = _mm_add_ps(c21, _mm_mul_ps(a, b1));
+        a = _mm_set1_ps(A[3 * lda + p]);
+        c30 = _mm_add_ps(c30, _mm_mul_ps(a, b0));
+        c31 = _mm_add_ps(c31, _mm_mul_ps(a, b1));
+    }
+
+    _mm_storeu_ps(C, c00);
+    _mm_storeu_ps(C + 4, c01);
+    _mm_storeu_ps(C + ldc, c10);
+    _mm_storeu_ps(C + ldc + 4, c11);
+    _mm_storeu_ps(C + 2 * ldc, c20);
+    _mm_storeu_ps(C + 2 * ldc + 4, c21);
+    _mm_storeu_ps(C + 3 * ldc, c30);
+    _mm_storeu_ps(C + 3 * ldc + 4, c31);
+}
+
+/* AVX2: 4 x 16 tile in eight 8-wide registers */
+__attribute__((target("avx2,fma")))
+static void kernel_tile_avx2_f32(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                 void *Cv, int ldc)
+{
+    const float *A = Av, *B = Bv;
+    float *C = Cv;
+    __m256 c00 = _mm256_loadu_ps(C), c01 = _mm256_loadu_ps(C + 8);
+    __m256 c10 = _mm256_loadu_ps(C + ldc), c11 = _mm256_loadu_ps(C + ldc + 8);
+    __m256 c20 = _mm256_loadu_ps(C + 2 * ldc), c21 = _mm256_loadu_ps(C + 2 * ldc + 8);
+    __m256 c30 = _mm256_loadu_ps(C + 3 * ldc), c31 = _mm256_loadu_ps(C + 3 * ldc + 8);
+    __m256 a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm256_loadu_ps(&B[p * ldb]);
+        b1 = _mm256_loadu_ps(&B[p * ldb + 8]);
+        a = _mm256_broadcast_ss(&A[p]);
+        c00 = _mm256_fmadd_ps(a, b0, c00);
+        c01 = _mm256_fmadd_ps(a, b1, c01);
+        a = _mm256_broadcast_ss(&A[lda + p]);
+        c10 = _mm256_fmadd_ps(a, b0, c10);
+        c11 = _mm256_fmadd_ps(a, b1, c11);
+        a = _mm256_broadcast_ss(&A[2 * lda + p]);
+        c20 = _mm256_fmadd_ps(a, b0, c20);
+        c21 = _mm256_fmadd_ps(a, b1, c21);
+        a = _mm256_broadcast_ss(&A[3 * lda + p]);
+        c30 = _mm256_fmadd_ps(a, b0, c30);
+        c31 = _mm256_fmadd_ps(a, b1, c31);
+    }
+
+    _mm256_storeu_ps(C, c00);
+    _mm256_storeu_ps(C + 8, c01);
+    _mm256_storeu_ps(C + ldc, c10);
+    _mm256_storeu_ps(C + ldc + 8, c11);
+    _mm256_storeu_ps(C + 2 * ldc, c20);
+    _mm256_storeu_ps(C + 2 * ldc + 8, c21);
+    _mm256_storeu_ps(C + 3 * ldc, c30);
+    _mm256_storeu_ps(C + 3 * ldc + 8, c31);
+}
+
+/* AVX-512: 4 x 32 tile in eight 16-wide registers */
+__attribute__((target("avx512f")))
+static void kernel_tile_avx512_f32(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                   void *Cv, int ldc)
+{
+    const float *A = Av, *B = Bv;
+    float *C = Cv;
+    __m512 c00 = _mm512_loadu_ps(C), c01 = _mm512_loadu_ps(C + 16);
+    __m512 c10 = _mm512_loadu_ps(C + ldc), c11 = _mm512_loadu_ps(C + ldc + 16);
+    __m512 c20 = _mm512_loadu_ps(C + 2 * ldc), c21 = _mm512_loadu_ps(C + 2 * ldc + 16);
+    __m512 c30 = _mm512_loadu_ps(C + 3 * ldc), c31 = _mm512_loadu_ps(C + 3 * ldc + 16);
+    __m512 a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm512_loadu_ps(&B[p * ldb]);
+        b1 = _mm512_loadu_ps(&B[p * ldb + 16]);
+        a = _mm512_set1_ps(A[p]);
+        c00 = _mm512_fmadd_ps(a, b0, c00);
+        c01 = _mm512_fmadd_ps(a, b1, c01);
+        a = _mm512_set1_ps(A[lda + p]);
+        c10 = _mm512_fmadd_ps(a, b0, c10);
+        c11 = _mm512_fmadd_ps(a, b1, c11);
+        a = _mm512_set1_ps(A[2 * lda + p]);
+        c20 = _mm512_fmadd_ps(a, b0, c20);
+        c21 = _mm512_fmadd_ps(a, b1, c21);
+        a = _mm512_set1_ps(A[3 * lda + p]);
+        c30 = _mm512_fmadd_ps(a, b0, c30);
+        c31 = _mm512_fmadd_ps(a, b1, c31);
+    }
+
+    _mm512_storeu_ps(C, c00);
+    _mm512_storeu_ps(C + 16, c01);
+    _mm512_storeu_ps(C + ldc, c10);
+    _mm512_storeu_ps(C + ldc + 16, c11);
+    _mm512_storeu_ps(C + 2 * ldc, c20);
+    _mm512_storeu_ps(C + 2 * ldc + 16, c21);
+    _mm512_storeu_ps(C + 3 * ldc, c30);
+    _mm512_storeu_ps(C + 3 * ldc + 16, c31);
+}
+
+/* SSE2 int8: 4 x 8 tile of int32 sums. Bytes of B are widened to 16 bits,
+   where a product of two int8 always fits, and each product to 32 */
+__attribute__((target("sse2")))
+static void kernel_tile_sse2_i8(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                void *Cv, int ldc)
+{
+    const int8_t *A = Av, *B = Bv;
+    int32_t *C = Cv;
+    __m128i c00 = _mm_loadu_si128((const __m128i *)C);
+    __m128i c01 = _mm_loadu_si128((const __m128i *)(C + 4));
+    __m128i c10 = _mm_loadu_si128((const __m128i *)(C + ldc));
+    __m128i c11 = _mm_loadu_si128((const __m128i *)(C + ldc + 4));
+    __m128i c20 = _mm_loadu_si128((const __m128i *)(C + 2 * ldc));
+    __m128i c21 = _mm_loadu_si128((const __m128i *)(C + 2 * ldc + 4));
+    __m128i c30 = _mm_loadu_si128((const __m128i *)(C + 3 * ldc));
+    __m128i c31 = _mm_loadu_si128((const __m128i *)(C + 3 * ldc + 4));
+    __m128i a, b, ab;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b = _mm_loadl_epi64((const __m128i *)&B[p * ldb]);
+        b = _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8);
+        a = _mm_set1_epi16(A[p]);
+        ab = _mm_mullo_epi16(a, b);
+        c00 = _mm_add_epi32(c00, _mm_srai_epi32(_mm_unpacklo_epi16(ab, ab), 16));
+        c01 = _mm_add_epi32(c01, _mm_srai_epi32(_mm_unpackhi_epi16(ab, ab), 16));
+        a = _mm_set1_epi16(A[lda + p]);
+        ab = _mm_mullo_epi16(a, b);
+        c10 = _mm_add_epi32(c10, _mm_srai_epi32(_mm_unpacklo_epi16(ab, ab), 16));
+        c11 = _mm_add_epi32(c11, _mm_srai_epi32(_mm_unpackhi_epi16(ab, ab), 16));
+        a = _mm_set1_epi16(A[2 * lda + p]);
+        ab = _mm_mullo_epi16(a, b);
+        c20 = _mm_add_epi32(c20, _mm_srai_epi32(_mm_unpacklo_epi16(ab, ab), 16));
+        c21 = _mm_add_epi32(c21, _mm_srai_epi32(_mm_unpackhi_epi16(ab, ab), 16));
+        a = _mm_set1_epi16(A[3 * lda + p]);
+        ab = _mm_mullo_epi16(a, b);
+        c30 = _mm_add_epi32(c30, _mm_srai_epi32(_mm_unpacklo_epi16(ab, ab), 16));
+        c31 = _mm_add_epi32(c31, _mm_srai_epi32(_mm_unpackhi_epi16(ab, ab), 16));
+    }
+
+    _mm_storeu_si128((__m128i *)C, c00);
+    _mm_storeu_si128((__m128i *)(C + 4), c01);
+    _mm_storeu_si128((__m128i *)(C + ldc), c10);
+    _mm_storeu_si128((__m128i *)(C + ldc + 4), c11);
+    _mm_storeu_si128((__m128i *)(C + 2 * ldc), c20);
+    _mm_storeu_si128((__m128i *)(C + 2 * ldc + 4), c21);
+    _mm_storeu_si128((__m128i *)(C + 3 * ldc), c30);
+    _mm_storeu_si128((__m128i *)(C + 3 * ldc + 4), c31);
+}
+
+/* AVX2 int8: 4 x 16 tile of int32 sums, products formed 16 at a time in
+   16 bits and widened to 32 */
+__attribute__((target("avx2")))
+static void kernel_tile_avx2_i8(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                void *Cv, int ldc)
+{
+    const int8_t *A = Av, *B = Bv;
+    int32_t *C = Cv;
+    __m256i c00 = _mm256_loadu_si256((const __m256i *)C);
+    __m256i c01 = _mm256_loadu_si256((const __m256i *)(C + 8));
+    __m256i c10 = _mm256_loadu_si256((const __m256i *)(C + ldc));
+    __m256i c11 = _mm256_loadu_si256((const __m256i *)(C + ldc + 8));
+    __m256i c20 = _mm256_loadu_si256((const __m256i *)(C + 2 * ldc));
+    __m256i c21 = _mm256_loadu_si256((const __m256i *)(C + 2 * ldc + 8));
+    __m256i c30 = _mm256_loadu_si256((const __m256i *)(C + 3 * ldc));
+    __m256i c31 = _mm256_loadu_si256((const __m256i *)(C + 3 * ldc + 8));
+    __m256i a, b, ab;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&B[p * ldb]));
+        a = _mm256_set1_epi16(A[p]);
+        ab = _mm256_mullo_epi16(a, b);
+        c00 = _mm256_add_epi32(c00, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(ab)));
+        c01 = _mm256_add_epi32(c01, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(ab, 1)));
+        a = _mm256_set1_epi16(A[lda + p]);
+        ab = _mm256_mullo_epi16(a, b);
+        c10 = _mm256_add_epi32(c10, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(ab)));
+        c11 = _mm256_add_epi32(c11, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(ab, 1)));
+        a = _mm256_set1_epi16(A[2 * lda + p]);
+        ab = _mm256_mullo_epi16(a, b);
+        c20 = _mm256_add_epi32(c20, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(ab)));
+        c21 = _mm256_add_epi32(c21, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(ab, 1)));
+        a = _mm256_set1_epi16(A[3 * lda + p]);
+        ab = _mm256_mullo_epi16(a, b);
+        c30 = _mm256_add_epi32(c30, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(ab)));
+        c31 = _mm256_add_epi32(c31, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(ab, 1)));
+    }
+
+    _mm256_storeu_si256((__m256i *)C, c00);
+    _mm256_storeu_si256((__m256i *)(C + 8), c01);
+    _mm256_storeu_si256((__m256i *)(C + ldc), c10);
+    _mm256_storeu_si256((__m256i *)(C + ldc + 8), c11);
+    _mm256_storeu_si256((__m256i *)(C + 2 * ldc), c20);
+    _mm256_storeu_si256((__m256i *)(C + 2 * ldc + 8), c21);
+    _mm256_storeu_si256((__m256i *)(C + 3 * ldc), c30);
+    _mm256_storeu_si256((__m256i *)(C + 3 * ldc + 8), c31);
+}
+
+/* AVX-512 int8: 4 x 32 tile of int32 sums, B widened straight to 32 bits */
+__attribute__((target("avx512f")))
+static void kernel_tile_avx512_i8(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                  void *Cv, int ldc)
+{
+    const int8_t *A = Av, *B = Bv;
+    int32_t *C = Cv;
+    __m512i c00 = _mm512_loadu_si512(C), c01 = _mm512_loadu_si512(C + 16);
+    __m512i c10 = _mm512_loadu_si512(C + ldc), c11 = _mm512_loadu_si512(C + ldc + 16);
+    __m512i c20 = _mm512_loadu_si512(C + 2 * ldc), c21 = _mm512_loadu_si512(C + 2 * ldc + 16);
+    __m512i c30 = _mm512_loadu_si512(C + 3 * ldc), c31 = _mm512_loadu_si512(C + 3 * ldc + 16);
+    __m512i a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)&B[p * ldb]));
+        b1 = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)&B[p * ldb + 16]));
+        a = _mm512_set1_epi32(A[p]);
+        c00 = _mm512_add_epi32(c00, _mm512_mullo_epi32(a, b0));
+        c01 = _mm512_add_epi32(c01, _mm512_mullo_epi32(a, b1));
+        a = _mm512_set1_epi32(A[lda + p]);
+        c10 = _mm512_add_epi32(c10, _mm512_mullo_epi32(a, b0));
+        c11 = _mm512_add_epi32(c11, _mm512_mullo_epi32(a, b1));
+        a = _mm512_set1_epi32(A[2 * lda + p]);
+        c20 = _mm512_add_epi32(c20, _mm512_mullo_epi32(a, b0));
+        c21 = _mm512_add_epi32(c21, _mm512_mullo_epi32(a, b1));
+        a = _mm512_set1_epi32(A[3 * lda + p]);
+        c30 = _mm512_add_epi32(c30, _mm512_mullo_epi32(a, b0));
+        c31 = _mm512_add_epi32(c31, _mm512_mullo_epi32(a, b1));
+    }
+
+    _mm512_storeu_si512(C, c00);
+    _mm512_storeu_si512(C + 16, c01);
+    _mm512_storeu_si512(C + ldc, c10);
+    _mm512_storeu_si512(C + ldc + 16, c11);
+    _mm512_storeu_si512(C + 2 * ldc, c20);
+    _mm512_storeu_si512(C + 2 * ldc + 16, c21);
+    _mm512_storeu_si512(C + 3 * ldc, c30);
+    _mm512_storeu_si512(C + 3 * ldc + 16, c31);
+}
+
+/* AVX2 int16: 4 x 8 tile of int64 sums. B is widened to 64-bit lanes and
+   multiplied with the 32 x 32 -> 64 bit signed multiply, which is exact */
+__attribute__((target("avx2")))
+static void kernel_tile_avx2_i16(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                 void *Cv, int ldc)
+{
+    const int16_t *A = Av, *B = Bv;
+    int64_t *C = Cv;
+    __m256i c00 = _mm256_loadu_si256((const __m256i *)C);
+    __m256i c01 = _mm256_loadu_si256((const __m256i *)(C + 4));
+    __m256i c10 = _mm256_loadu_si256((const __m256i *)(C + ldc));
+    __m256i c11 = _mm256_loadu_si256((const __m256i *)(C + ldc + 4));
+    __m256i c20 = _mm256_loadu_si256((const __m256i *)(C + 2 * ldc));
+    __m256i c21 = _mm256_loadu_si256((const __m256i *)(C + 2 * ldc + 4));
+    __m256i c30 = _mm256_loadu_si256((const __m256i *)(C + 3 * ldc));
+    __m256i c31 = _mm256_loadu_si256((const __m256i *)(C + 3 * ldc + 4));
+    __m256i a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *)&B[p * ldb]));
+        b1 = _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *)&B[p * ldb + 4]));
+        a = _mm256_set1_epi64x(A[p]);
+        c00 = _mm256_add_epi64(c00, _mm256_mul_epi32(a, b0));
+        c01 = _mm256_add_epi64(c01, _mm256_mul_epi32(a, b1));
+        a = _mm256_set1_epi64x(A[lda + p]);
+        c10 = _mm256_add_epi64(c10, _mm256_mul_epi32(a, b0));
+        c11 = _mm256_add_epi64(c11, _mm256_mul_epi32(a, b1));
+        a = _mm256_set1_epi64x(A[2 * lda + p]);
+        c20 = _mm256_add_epi64(c20, _mm256_mul_epi32(a, b0));
+        c21 = _mm256_add_epi64(c21, _mm256_mul_epi32(a, b1));
+        a = _mm256_set1_epi64x(A[3 * lda + p]);
+        c30 = _mm256_add_epi64(c30, _mm256_mul_epi32(a, b0));
+        c31 = _mm256_add_epi64(c31, _mm256_mul_epi32(a, b1));
+    }
+
+    _mm256_storeu_si256((__m256i *)C, c00);
+    _mm256_storeu_si256((__m256i *)(C + 4), c01);
+    _mm256_storeu_si256((__m256i *)(C + ldc), c10);
+    _mm256_storeu_si256((__m256i *)(C + ldc + 4), c11);
+    _mm256_storeu_si256((__m256i *)(C + 2 * ldc), c20);
+    _mm256_storeu_si256((__m256i *)(C + 2 * ldc + 4), c21);
+    _mm256_storeu_si256((__m256i *)(C + 3 * ldc), c30);
+    _mm256_storeu_si256((__m256i *)(C + 3 * ldc + 4), c31);
+}
+
+/* AVX-512 int16: 4 x 16 tile of int64 sums, as the AVX2 kernel */
+__attribute__((target("avx512f")))
+static void kernel_tile_avx512_i16(int kc, const void *Av, int lda, const void *Bv, int ldb,
+                                   void *Cv, int ldc)
+{
+    const int16_t *A = Av, *B = Bv;
+    int64_t *C = Cv;
+    __m512i c00 = _mm512_loadu_si512(C), c01 = _mm512_loadu_si512(C + 8);
+    __m512i c10 = _mm512_loadu_si512(C + ldc), c11 = _mm512_loadu_si512(C + ldc + 8);
+    __m512i c20 = _mm512_loadu_si512(C + 2 * ldc), c21 = _mm512_loadu_si512(C + 2 * ldc + 8);
+    __m512i c30 = _mm512_loadu_si512(C + 3 * ldc), c31 = _mm512_loadu_si512(C + 3 * ldc + 8);
+    __m512i a, b0, b1;
+    int p;
+
+    for (p = 0; p < kc; p++) {
+        b0 = _mm512_cvtepi16_epi64(_mm_loadu_si128((const __m128i *)&B[p * ldb]));
+        b1 = _mm512_cvtepi16_epi64(_mm_loadu_si128((const __m128i *)&B[p * ldb + 8]));
+        a = _mm512_set1_epi64(A[p]);
+        c00 = _mm512_add_epi64(c00, _mm512_mul_epi32(a, b0));
+        c01 = _mm512_add_epi64(c01, _mm512_mul_epi32(a, b1));
+        a = _mm512_set1_epi64(A[lda + p]);
+        c10 = _mm512_add_epi64(c10, _mm512_mul_epi32(a, b0));
+        c11 = _mm512_add_epi64(c11, _mm512_mul_epi32(a, b1));
+        a = _mm512_set1_epi64(A[2 * lda + p]);
+        c20 = _mm512_add_epi64(c20, _mm512_mul_epi32(a, b0));
+        c21 = _mm512_add_epi64(c21, _mm512_mul_epi32(a, b1));
+        a = _mm512_set1_epi64(A[3 * lda + p]);
+        c30 = _mm512_add_epi64(c30, _mm512_mul_epi32(a, b0));
+        c31 = _mm512_add_epi64(c31, _mm512_mul_epi32(a, b1));
+    }
+
+    _mm512_storeu_si512(C, c00);
+    _mm512_storeu_si512(C + 8, c01);
+    _mm512_storeu_si512(C + ldc, c10);
+    _mm512_storeu_si512(C + ldc + 8, c11);
+    _mm512_storeu_si512(C + 2 * ldc, c20);
+    _mm512_storeu_si512(C + 2 * ldc + 8, c21);
+    _mm512_storeu_si512(C + 3 * ldc, c30);
+    _mm512_storeu_si512(C + 3 * ldc + 8, c31);
+}
+
+#endif /* KERNEL_X86 */
+
+/* Instruction set a microkernel needs */
+#define KERNEL_ISA_NONE   0
+#define KERNEL_ISA_SSE2   1
+#define KERNEL_ISA_AVX2   2     /* with FMA */
+#define KERNEL_ISA_AVX512 3
+
+/* Microkernels of each element type, best first */
+static const struct {
+    const char *name;
+    int type;                   /* MATRIX_F64, ... */
+    int isa;                    /* KERNEL_ISA_* */
+    int nr;                     /* tile width */
+    kernel_tile_fn tile;
+    kernel_edge_fn edge;
+} kernels[] = {
+#ifdef KERNEL_X86
+    { "avx512", MATRIX_F64, KERNEL_ISA_AVX512, 16, kernel_tile_avx512_f64, kernel_edge_f64 },
+    { "avx2",   MATRIX_F64, KERNEL_ISA_AVX2,    8, kernel_tile_avx2_f64,   kernel_edge_f64 },
+    { "sse2",   MATRIX_F64, KERNEL_ISA_SSE2,    4, kernel_tile_sse2_f64,   kernel_edge_f64 },
+#endif
+    { "scalar", MATRIX_F64, KERNEL_ISA_NONE, KERNEL_NR, kernel_tile_f64, kernel_edge_f64 },
+#ifdef KERNEL_X86
+    { "avx512", MATRIX_F32, KERNEL_ISA_AVX512, 32, kernel_tile_avx512_f32, kernel_edge_f32 },
+    { "avx2",   MATRIX_F32, KERNEL_ISA_AVX2,   16, kernel_tile_avx2_f32,   kernel_edge_f32 },
+    { "sse2",   MATRIX_F32, KERNEL_ISA_SSE2,    8, kernel_tile_sse2_f32,   kernel_edge_f32 },
+#endif
+    { "scalar", MATRIX_F32, KERNEL_ISA_NONE, KERNEL_NR, kernel_tile_f32, kernel_edge_f32 },
+#ifdef KERNEL_X86
+    { "avx512", MATRIX_I8,  KERNEL_ISA_AVX512, 32, kernel_tile_avx512_i8,  kernel_edge_i8 },
+    { "avx2",   MATRIX_I8,  KERNEL_ISA_AVX2,   16, kernel_tile_avx2_i8,    kernel_edge_i8 },
+    { "sse2",   MATRIX_I8,  KERNEL_ISA_SSE2,    8, kernel_tile_sse2_i8,    kernel_edge_i8 },
+#endif
+    { "scalar", MATRIX_I8,  KERNEL_ISA_NONE, KERNEL_NR, kernel_tile_i8, kernel_edge_i8 },
+#ifdef KERNEL_X86
+    /* SSE2 has no widening to, or multiply into, 64-bit lanes */
+    { "avx512", MATRIX_I16, KERNEL_ISA_AVX512, 16, kernel_tile_avx512_i16, kernel_edge_i16 },
+    { "avx2",   MATRIX_I16, KERNEL_ISA_AVX2,    8, kernel_tile_avx2_i16,   kernel_edge_i16 },
+#endif
+    { "scalar", MATRIX_I16, KERNEL_ISA_NONE, KERNEL_NR, kernel_tile_i16, kernel_edge_i16 },
+};
+
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+/* Element and sum sizes of each type */
+static const struct {
+    const char *name;
+    int size;                   /* bytes of an element of A and B */
+    int result;                 /* type of the elements of C */
+} elem_types[MATRIX_ALL_TYPES] = {
+    { "f64", sizeof(double),  MATRIX_F64 },
+    { "f32", sizeof(float),   MATRIX_F32 },
+    { "i8",  sizeof(int8_t),  MATRIX_I32 },
+    { "i16", sizeof(int16_t), MATRIX_I64 },
+    { "i32", sizeof(int32_t), MATRIX_I32 },
+    { "i64", sizeof(int64_t), MATRIX_I64 },
+};
+
+/* kernels[] entry in use for each type, -1 until chosen */
+static int kernel_active[MATRIX_TYPES] = { -1, -1, -1, -1 };
+
+/* Whether this CPU runs kernels[i] */
+static int kernel_supported(int i)
+{
+#ifdef KERNEL_X86
+    __builtin_cpu_init();
+    switch (kernels[i].isa) {
+    case KERNEL_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    case KERNEL_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case KERNEL_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return kernels[i].isa == KERNEL_ISA_NONE;
+}
+
+const char *matrix_kernel_init(void)
+{
+    const char *want = getenv("MATRIX_KERNEL");
+    int type, i;
+
+    for (type = 0; type < MATRIX_TYPES; type++) {
+        int best = -1, chosen = -1;
+
+        for (i = 0; i < KERNEL_COUNT; i++) {
+            if (kernels[i].type != type || !kernel_supported(i))
+                continue;
+            if (best < 0)
+                best = i;
+            if (chosen < 0 && want != NULL && strcmp(want, kernels[i].name) == 0)
+                chosen = i;
+        }
+        /* an unknown or unsupported choice gets the best kernel there is */
+        kernel_active[type] = (chosen >= 0) ? chosen : best;
+    }
+    return kernels[kernel_active[MATRIX_F64]].name;
+}
+
+int matrix_elem_size(int type)
+{
+    return elem_types[type].size;
+}
+
+int matrix_result_type(int type)
+{
+    return elem_types[type].result;
+}
+
+const char *matrix_elem_name(int type)
+{
+    return elem_types[type].name;
+}
+
+int matrix_elem_parse(const char *name)
+{
+    int type;
+
+    for (type = 0; type < MATRIX_TYPES; type++) {
+        if (strcmp(name, elem_types[type].name) == 0)
+            return type;
+    }
+    return -1;
+}
+
+/* v rounded to the nearest integer and clamped to [lo, hi] */
+static double elem_clamp(double v, double lo, double hi)
+{
+    v = nearbyint(v);
+    return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+size_t matrix_from_double(int type, const double *in, void *out, size_t count)
+{
+    size_t i, inexact = 0;
+
+    switch (type) {
+    case MATRIX_F32:
+        for (i = 0; i < count; i++) {
+            ((float *)out)[i] = (float)in[i];
+            inexact += (((float *)out)[i] != in[i]);
+        }
+        break;
+    case MATRIX_I8:
+        for (i = 0; i < count; i++) {
+            ((int8_t *)out)[i] = (int8_t)elem_clamp(in[i], INT8_MIN, INT8_MAX);
+            inexact += (((int8_t *)out)[i] != in[i]);
+        }
+        break;
+    case MATRIX_I16:
+        for (i = 0; i < count; i++) {
+            ((int16_t *)out)[i] = (int16_t)elem_clamp(in[i], INT16_MIN, INT16_MAX);
+            inexact += (((int16_t *)out)[i] != in[i]);
+        }
+        break;
+    default:
+        memcpy(out, in, count * sizeof(double));
+        break;
+    }
+    return inexact;
+}
+
+void matrix_to_double(int type, const void *in, double *out, size_t count)
+{
+    size_t i;
+
+    switch (type) {
+    case MATRIX_F32:
+        for (i = 0; i < count; i++)
+            out[i] = ((const float *)in)[i];
+        break;
+    case MATRIX_I8:
+        for (i = 0; i < count; i++)
+            out[i] = ((const int8_t *)in)[i];
+        break;
+    case MATRIX_I16:
+        for (i = 0; i < count; i++)
+            out[i] = ((const int16_t *)in)[i];
+        break;
+    case MATRIX_I32:
+        for (i = 0; i < count; i++)
+            out[i] = ((const int32_t *)in)[i];
+        break;
+    case MATRIX_I64:
+        for (i = 0; i < count; i++)
+            out[i] = (double)((const int64_t *)in)[i];
+        break;
+    default:
+        memcpy(out, in, count * sizeof(double));
+        break;
+    }
+}
+
+void matrix_add(int type, const void *in, void *out, size_t count)
+{
+    size_t i;
+
+    switch (type) {
+    case MATRIX_F32:
+        for (i = 0; i < count; i++)
+            ((float *)out)[i] += ((const float *)in)[i];
+        break;
+    case MATRIX_I8:
+        for (i = 0; i < count; i++)
+            ((int8_t *)out)[i] += ((const int8_t *)in)[i];
+        break;
+    case MATRIX_I16:
+        for (i = 0; i < count; i++)
+            ((int16_t *)out)[i] += ((const int16_t *)in)[i];
+        break;
+    case MATRIX_I32:
+        for (i = 0; i < count; i++)
+            ((int32_t *)out)[i] += ((const int32_t *)in)[i];
+        break;
+    case MATRIX_I64:
+        for (i = 0; i < count; i++)
+            ((int64_t *)out)[i] += ((const int64_t *)in)[i];
+        break;
+    default:
+        for (i = 0; i < count; i++)
+            ((double *)out)[i] += ((const double *)in)[i];
+        break;
+    }
+}
+
+/* C = A * B for elements of the given type, where panel = 0 means B is
+   row-major with leading dimension ldb, and otherwise B is packed in
+   column panels that many wide */
+static void kernel_multiply(int type, int m, int n, int k, const void *A, int lda,
+                            const void *B, int ldb, int panel,
+                            void *C, int ldc)
+{
+    const char *a8 = A, *b8 = B;
+    char *c8 = C;
+    size_t es = elem_types[type].size;
+    size_t cs = elem_types[elem_types[type].result].size;
+    int jc, pc, ic, jr, NR, step;
+    kernel_tile_fn tile;
+    kernel_edge_fn edge;
+
+    if (kernel_active[type] < 0)
+        matrix_kernel_init();
+    NR = kernels[kernel_active[type]].nr;
+    tile = kernels[kernel_active[type]].tile;
+    edge = kernels[kernel_active[type]].edge;
+    step = panel ? panel : KERNEL_NC;
+
+    for (ic = 0; ic < m; ic++)
+        memset(&c8[(size_t)ic * ldc * cs], 0, n * cs);
+
+    for (jc = 0; jc < n; jc += step) {
+        int nc = (n - jc < step) ? n - jc : step;
+        /* a packed panel is k rows of nc contiguous elements */
+        const char *Bj = panel ? &b8[(size_t)jc * k * es] : &b8[jc * es];
+        int ldbj = panel ? nc : ldb;
+        for (pc = 0; pc < k; pc += KERNEL_KC) {
+            int kc = (k - pc < KERNEL_KC) ? k - pc : KERNEL_KC;
+            /* every row of the block reuses this panel of B */
+            for (ic = 0; ic < m; ic += KERNEL_MR) {
+                int mr = (m - ic < KERNEL_MR) ? m - ic : KERNEL_MR;
+                for (jr = 0; jr < nc; jr += NR) {
+                    int nr = (nc - jr < NR) ? nc - jr : NR;
+                    const char *a = &a8[((size_t)ic * lda + pc) * es];
+                    const char *b = &Bj[((size_t)pc * ldbj + jr) * es];
+                    char *c = &c8[((size_t)ic * ldc + jc + jr) * cs];
+                    if (mr == KERNEL_MR && nr == NR)
+                        tile(kc, a, lda, b, ldbj, c, ldc);
+                    else
+                        edge(mr, nr, kc, a, lda, b, ldbj, c, ldc);
+                }
+            }
+        }
+    }
+}
+
+void matrix_pack_b(int type, int k, int n, const void *B, int ldb, int panel, void *packed)
+{
+    const char *b8 = B;
+    char *p8 = packed;
+    size_t es = elem_types[type].size;
+    int jc, p;
+
+    for (jc = 0; jc < n; jc += panel) {
+        int nc = (n - jc < panel) ? n - jc : panel;
+        for (p = 0; p < k; p++)
+            memcpy(&p8[((size_t)jc * k + (size_t)p * nc) * es], &b8[((size_t)p * ldb + jc) * es],
+                   nc * es);
+    }
+}
+
+/* One thread's share of a parallel multiply */
+struct kernel_part {
+    int type;
+    int m, n, k;
+    const void *A, *B;
+    void *C;
+    int lda, ldb, panel, ldc;
+};
+
+static void *kernel_part_run(void *arg)
+{
+    struct kernel_part *part = arg;
+
+    kernel_multiply(part->type, part->m, part->n, part->k, part->A, part->lda,
+                    part->B, part->ldb, part->panel, part->C, part->ldc);
+    return NULL;
+}
+
+void matrix_multiply(int type, int threads, int m, int n, int k,
+                     const void *A, int lda,
+                     const void *B, int ldb, int panel,
+                     void *C, int ldc)
+{
+    struct kernel_part part[KERNEL_MAX_THREADS];
+    pthread_t tid[KERNEL_MAX_THREADS];
+    int started[KERNEL_MAX_THREADS];
+    const char *a8 = A, *b8 = B;
+    char *c8 = C;
+    size_t es = elem_types[type].size;
+    size_t cs = elem_types[elem_types[type].result].size;
+    int by_cols, units, unit, per, t, nparts;
+
+    if (threads > KERNEL_MAX_THREADS)
+        threads = KERNEL_MAX_THREADS;
+
+    /* Split the columns when there are enough of them: each thread then
+       streams only its own slice of B. A block of few columns is split by
+       rows instead, every thread sharing all of B. Packed B is split on
+       panel boundaries */
+    unit = panel ? panel : KERNEL_SPLIT_COLS;
+    by_cols = (n >= threads * unit);
+    unit = by_cols ? unit : KERNEL_MR;
+    units = ((by_cols ? n : m) + unit - 1) / unit;
+    if (threads > units)
+        threads = units;
+    if (threads <= 1) {
+        kernel_multiply(type, m, n, k, A, lda, B, ldb, panel, C, ldc);
+        return;
+    }
+
+    /* choose the kernel before the threads race to */
+    if (kernel_active[type] < 0)
+        matrix_kernel_init();
+
+    per = (units + threads - 1) / threads * unit;
+    nparts = 0;
+    for (t = 0; t < threads; t++) {
+        int from = t * per, to = from + per;
+        int total = by_cols ? n : m;
+
+        if (from >= total)
+            break;
+        if (to > total)
+            to = total;
+        part[t].type = type;
+        part[t].m = by_cols ? m : to - from;
+        part[t].n = by_cols ? to - from : n;
+        part[t].k = k;
+        part[t].A = by_cols ? A : (const void *)&a8[(size_t)from * lda * es];
+        if (!by_cols)
+            part[t].B = B;
+        else
+            part[t].B = panel ? &b8[(size_t)from * k * es] : &b8[from * es];
+        part[t].C = by_cols ? &c8[from * cs] : &c8[(size_t)from * ldc * cs];
+        part[t].lda = lda;
+        part[t].ldb = ldb;
+        part[t].panel = panel;
+        part[t].ldc = ldc;
+        nparts++;
+    }
+
+    /* the calling thread takes the first part itself; a part whose thread
+       cannot be started is run here too */
+    for (t = 1; t < nparts; t++)
+        started[t] = (pthread_create(&tid[t], NULL, kernel_part_run, &part[t]) == 0);
+    kernel_part_run(&part[0]);
+    for (t = 1; t < nparts; t++) {
+        if (started[t])
+            pthread_join(tid[t], NULL);
+        else
+            kernel_part_run(&part[t]);
+    }
+}
@@ -0,0 +1,100 @@
+/*.........................................................................*/
+/*                  MATRIX_KERNEL.H ------> Worker multiply kernel          */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_KERNEL_H
+#define MATRIX_KERNEL_H
+
+#include <stddef.h>
+
+/* Block sizes: a KC x NC panel of B (256 KB of doubles) stays in L2 while
+   every row of the block passes over it; MR rows of C are held in
+   registers across the k loop, as wide as the microkernel's vectors */
+#define KERNEL_KC 128
+#define KERNEL_NC 256
+#define KERNEL_MR 4
+
+/* Picks the fastest microkernel this CPU supports (AVX-512, AVX2+FMA,
+   SSE2, else portable C) and returns its name; MATRIX_KERNEL in the
+   environment names one to use instead. Called once at startup, or on
+   the first multiply */
+const char *matrix_kernel_init(void);
+
+/* Element types of A and B. Results of a float type are of the same
+   type; integer products are summed exactly in a wider integer */
+#define MATRIX_F64   0      /* double */
+#define MATRIX_F32   1      /* float: half the bytes moved, ~7 digits */
+#define MATRIX_I8    2      /* int8, summed in int32: exact while k < 2^17 */
+#define MATRIX_I16   3      /* int16, summed in int64 */
+#define MATRIX_TYPES 4
+
+/* Depth below which an int8 product always fits its int32 sum */
+#define MATRIX_I8_MAX_K (1 << 17)
+
+/* Types only results have */
+#define MATRIX_I32       4
+#define MATRIX_I64       5
+#define MATRIX_ALL_TYPES 6
+
+/* Bytes of an element, the type of the elements of C, the name used on
+   the command line ("f64", ...) and the type of a name (-1 if none) */
+int matrix_elem_size(int type);
+int matrix_result_type(int type);
+const char *matrix_elem_name(int type);
+int matrix_elem_parse(const char *name);
+
+/* Converts count elements between double and the given type. Integer
+   types take the nearest value in their range; matrix_from_double returns
+   how many elements did not convert exactly */
+size_t matrix_from_double(int type, const double *in, void *out, size_t count);
+void matrix_to_double(int type, const void *in, double *out, size_t count);
+
+/* out += in for count elements of the given type, result types included */
+void matrix_add(int type, const void *in, void *out, size_t count);
+
+/* Most threads one multiply is split across, and the column granularity
+   of the split (a multiple of every microkernel's tile width) */
+#define KERNEL_MAX_THREADS 64
+#define KERNEL_SPLIT_COLS  64
+
+/* Packed layout of B: column panels 'panel' wide (the last one may be
+   narrower), each k rows of contiguous elements, panel after panel. A
+   panel is then streamed with unit stride */
+void matrix_pack_b(int type, int k, int n, const void *B, int ldb, int panel, void *packed);
+
+/* C = A * B for elements of the given type, on up to 'threads' threads
+   each computing its own slice of C; all of them read the one copy of B.
+   B is row-major with leading dimension ldb if panel is 0, else packed in
+   panels that wide. C holds elements of matrix_result_type(type) */
+void matrix_multiply(int type, int threads, int m, int n, int k,
+                     const void *A, int lda,
+                     const void *B, int ldb, int panel,
+                     void *C, int ldc);
+
+/* Files of B: two ints rows, cols and the doubles row by row, or a
+   matrix_file_header and the elements, packed if panel is not 0 */
+#define MATRIX_FILE_MAGIC 0x4b434150  /* "PACK" */
+
+struct matrix_file_header {
+    int magic;          /* MATRIX_FILE_MAGIC */
+    int rows, cols;     /* of B */
+    int panel;          /* panel width in columns, 0: row-major */
+    int type;           /* MATRIX_F64, ... */
+    int reserved;       /* 0, keeps the elements 8-byte aligned */
+};
+
+/* A unit of tiled work: rows x cols of C from depth columns of A and rows
+   of B starting at k0. A tile of a product split along k (kblocks > 1) is
+   a partial sum. The A rows are stored in segments keyed
+   row * kblocks + kblock, the block of B under b_index */
+struct matrix_tile_task {
+    int row0, rows;
+    int col0, cols;
+    int k0, depth;
+    int kblock, kblocks;
+    int b_index;
+    int type;           /* of A and B */
+};
+
+#endif /* MATRIX_KERNEL_H */
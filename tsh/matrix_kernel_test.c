@@ -0,0 +1,131 @@
+/*.........................................................................*/
+/*                  MATRIX_KERNEL_TEST.C ------> Multiply kernel test       */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix_kernel.h"
+
+/* Microkernels that may be chosen through MATRIX_KERNEL */
+static const char *kernel_names[] = { "avx512", "avx2", "sse2", "scalar" };
+
+/* Shapes around the block sizes: rows short of and past a KERNEL_MR tile,
+   columns that fill no vector and cross a KERNEL_NC panel, and depths
+   either side of a KERNEL_KC block */
+static const int test_m[] = { 1, KERNEL_MR - 1, KERNEL_MR + 1, 2 * KERNEL_MR + 3 };
+static const int test_n[] = { 1, 7, 17, 33, 67, KERNEL_NC + 5 };
+static const int test_k[] = { 1, KERNEL_KC - 1, KERNEL_KC + 3 };
+static const int test_panel[] = { 0, 40, KERNEL_NC };
+static const int test_threads[] = { 1, 3 };
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+/* C = A * B of doubles, the plain triple loop */
+static void reference_multiply(int m, int n, int k, const double *A, int lda,
+                               const double *B, int ldb, double *C, int ldc)
+{
+    int i, j, p;
+
+    for (i = 0; i < m; i++) {
+        for (j = 0; j < n; j++) {
+            double sum = 0.0;
+
+            for (p = 0; p < k; p++)
+                sum += A[(size_t)i * lda + p] * B[(size_t)p * ldb + j];
+            C[(size_t)i * ldc + j] = sum;
+        }
+    }
+}
+
+/* Multiplies one shape with the active kernels and checks every element
+   of C against the reference. Inputs are small integers, so every type
+   sums them exactly. 0 if C matches, else the first mismatch is printed
+   and 1 returned */
+static int check_shape(int type, int m, int n, int k, int panel, int threads)
+{
+    int lda = k + 1, ldb = n + 2, ldc = n + 3;
+    size_t es = matrix_elem_size(type);
+    size_t cs = matrix_elem_size(matrix_result_type(type));
+    double *A = malloc((size_t)m * lda * sizeof(double));
+    double *B = malloc((size_t)k * ldb * sizeof(double));
+    double *C = malloc((size_t)m * ldc * sizeof(double));
+    double *R = malloc((size_t)m * ldc * sizeof(double));
+    char *a = malloc((size_t)m * lda * es);
+    char *b = malloc((size_t)k * ldb * es);
+    char *packed = malloc((size_t)k * n * es);
+    char *c = malloc((size_t)m * ldc * cs);
+    int i, j, failed = 0;
+
+    if (!A || !B || !C || !R || !a || !b || !packed || !c) {
+        printf("FAIL (out of memory)\n");
+        exit(1);
+    }
+    for (i = 0; i < m * lda; i++)
+        A[i] = rand() % 17 - 8;
+    for (i = 0; i < k * ldb; i++)
+        B[i] = rand() % 17 - 8;
+    reference_multiply(m, n, k, A, lda, B, ldb, R, ldc);
+
+    matrix_from_double(type, A, a, (size_t)m * lda);
+    matrix_from_double(type, B, b, (size_t)k * ldb);
+    if (panel) {
+        matrix_pack_b(type, k, n, b, ldb, panel, packed);
+        matrix_multiply(type, threads, m, n, k, a, lda, packed, 0, panel, c, ldc);
+    } else {
+        matrix_multiply(type, threads, m, n, k, a, lda, b, ldb, 0, c, ldc);
+    }
+
+    /* Only the m x n block of C is compared; the rest of a row is padding */
+    for (i = 0; i < m && !failed; i++) {
+        matrix_to_double(matrix_result_type(type), c + (size_t)i * ldc * cs, &C[(size_t)i * ldc], n);
+        for (j = 0; j < n && !failed; j++) {
+            if (C[(size_t)i * ldc + j] != R[(size_t)i * ldc + j]) {
+                printf("FAIL (%s m=%d n=%d k=%d panel=%d threads=%d: C[%d][%d] = %g, expected %g)\n",
+                       matrix_elem_name(type), m, n, k, panel, threads, i, j,
+                       C[(size_t)i * ldc + j], R[(size_t)i * ldc + j]);
+                failed = 1;
+            }
+        }
+    }
+
+    free(A);
+    free(B);
+    free(C);
+    free(R);
+    free(a);
+    free(b);
+    free(packed);
+    free(c);
+    return failed;
+}
+
+int main(void)
+{
+    int kernel, type, mi, ni, ki, pi, ti;
+
+    srand(1);
+    for (kernel = 0; kernel < COUNT(kernel_names); kernel++) {
+        const char *active;
+
+        printf("\nTest: %s kernels\n", kernel_names[kernel]);
+        setenv("MATRIX_KERNEL", kernel_names[kernel], 1);
+        active = matrix_kernel_init();
+        if (strcmp(active, kernel_names[kernel]) != 0) {
+            printf("SKIPPED (not supported by this CPU)\n");
+            continue;
+        }
+        for (type = 0; type < MATRIX_TYPES; type++)
+            for (mi = 0; mi < COUNT(test_m); mi++)
+                for (ni = 0; ni < COUNT(test_n); ni++)
+                    for (ki = 0; ki < COUNT(test_k); ki++)
+                        for (pi = 0; pi < COUNT(test_panel); pi++)
+                            for (ti = 0; ti < COUNT(test_threads); ti++)
+                                if (check_shape(type, test_m[mi], test_n[ni], test_k[ki],
+                                                test_panel[pi], test_threads[ti]))
+                                    return 1;
+        printf("PASS\n");
+    }
+    return 0;
+}
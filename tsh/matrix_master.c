@@ -1,6 +1,14 @@
 #include "tshlib.h"
+#include "matrix_kernel.h"
+#include "matrix_mem.h"
+#include "matrix_strassen.h"
+#include "matrix_sparse.h"
+#include "matrix_summa.h"
+#include "matrix_protocol.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -10,20 +18,21 @@
 #define DEFAULT_MATRIX_SIZE 8192  // 2^13, next power of 2 above 5000
 #define RESULTS_CSV_FILE "matrix_performance.csv"
 
-// Add these structures to track work chunks
-typedef struct {
-    int chunk_id;
-    int start_row;
-    int num_rows;
-    time_t issue_time;
-    int attempts;
-    int completed;
-} work_tracker_t;
-
-// Global variables for work tracking
-work_tracker_t *work_chunks = NULL;
-int num_chunks = 0;
-volatile sig_atomic_t alarm_triggered = 0;
+#define DEFAULT_LEASE_MS 10000 // Work chunks are redelivered if not done within this
+#define NOTE_WAIT_MS 1000 // Wait for a result note before checking on the workers
+#define RESULT_IDLE_LEASES 4 // Leases a queued engine may go without a result before giving up
+#define STRASSEN_ERROR_ROWS 16 // Rows of C checked against the classical product
+#define KEYED_PUTS_PENDING 256 // Pipelined puts sent before a reply is collected
+#define DEFAULT_DENSITY 5.0 // Percent of the elements of a sparse matrix that are not zero
+
+// Engines: row chunks against a file of B, Strassen-Winograd, tiles, SUMMA,
+// sparse A times dense B, sparse A times sparse B
+#define ENGINE_ROWS 0
+#define ENGINE_STRASSEN 1
+#define ENGINE_TILES 2
+#define ENGINE_SUMMA 3
+#define ENGINE_SPMM 4
+#define ENGINE_SPGEMM 5
 
 // Flag to indicate if we should continue collecting results
 volatile int continue_collecting = 1;
@@ -33,56 +42,6 @@ void handle_sigint(int sig) {
     continue_collecting = 0;
 }
 
-// Signal handler for SIGALRM
-void handle_alarm(int sig) {
-    alarm_triggered = 1;
-}
-
-// Function to check for timed-out work and reissue as needed
-void check_and_reissue_work(unsigned short port, int timeout_seconds) {
-    time_t current_time = time(NULL);
-    
-    for (int i = 0; i < num_chunks; i++) {
-        // Skip completed chunks
-        if (work_chunks[i].completed)
-            continue;
-            
-        // Check if this chunk has timed out
-        if (work_chunks[i].attempts > 0 && 
-            (current_time - work_chunks[i].issue_time) > timeout_seconds) {
-            
-            printf("Chunk %d (rows %d-%d) timed out after %d seconds. Reissuing (attempt %d)\n",
-                   work_chunks[i].chunk_id, 
-                   work_chunks[i].start_row,
-                   work_chunks[i].start_row + work_chunks[i].num_rows - 1,
-                   timeout_seconds,
-                   work_chunks[i].attempts + 1);
-            
-            // Re-issue the work chunk with higher priority
-            TSH_CONN *conn = tsh_connect(port);
-            if (conn) {
-                char chunk_name[64];
-                snprintf(chunk_name, sizeof(chunk_name), "work_chunk_%d", work_chunks[i].chunk_id);
-                
-                // Use work_data array from original implementation
-                int work_data[2] = {work_chunks[i].start_row, work_chunks[i].num_rows};
-                
-                // Use higher priority for reissued work (original + attempts)
-                tsh_put(conn, chunk_name, 1 + work_chunks[i].attempts, work_data, sizeof(work_data));
-                tsh_disconnect(conn);
-                
-                // Update tracking information
-                work_chunks[i].issue_time = current_time;
-                work_chunks[i].attempts++;
-            }
-        }
-    }
-    
-    // Reset the alarm for the next check
-    alarm_triggered = 0;
-    alarm(timeout_seconds / 2);  // Check twice per timeout period
-}
-
 // Print matrix (full matrix if rows <= 10, otherwise top-left 10x10)
 void print_matrix(double *mat, int rows, int cols) {
     int display_rows = (rows <= 10) ? rows : 10;
@@ -111,6 +70,15 @@ void generate_matrix(double *mat, int rows, int cols)
     }
 }
 
+// Fill a matrix with zeros but for about density percent of its elements
+void generate_sparse_matrix(double *mat, int rows, int cols, double density)
+{
+    for (int i = 0; i < rows * cols; ++i)
+    {
+        mat[i] = (rand() < density / 100.0 * RAND_MAX) ? (double)(1 + rand() % 9) : 0.0;
+    }
+}
+
 // Write a matrix to a temporary file for sharing
 int write_matrix_to_file(double *matrix, int rows, int cols, const char *filename) {
     FILE *file = fopen(filename, "wb");
@@ -140,12 +108,51 @@ int write_matrix_to_file(double *matrix, int rows, int cols, const char *filenam
     return 0;
 }
 
-// Store a single row of matrix A in the tuple space
-int put_matrix_row(TSH_CONN *conn, const char *prefix, int row_idx, double *row, int cols)
+// Write a matrix to a file as elements of the given type, packed in column
+// panels of the worker's multiply unless panel is 0, behind a header
+// describing both
+int write_typed_matrix_to_file(double *matrix, int type, int rows, int cols, int panel,
+                               const char *filename) {
+    size_t count = (size_t)rows * cols;
+    size_t bytes = count * matrix_elem_size(type);
+    void *typed = matrix_alloc(bytes, NULL);
+    void *packed = panel ? matrix_alloc(bytes, NULL) : typed;
+    if (!typed || !packed) {
+        matrix_free(typed, bytes);
+        return -1;
+    }
+    size_t inexact = matrix_from_double(type, matrix, typed, count);
+    if (inexact) {
+        printf("Warning: %zu elements of %s are not exact in %s\n", inexact, filename,
+               matrix_elem_name(type));
+    }
+    if (panel) {
+        matrix_pack_b(type, rows, cols, typed, cols, panel, packed);
+    }
+    
+    int ok = 0;
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Failed to open matrix file for writing");
+    } else {
+        struct matrix_file_header header = { MATRIX_FILE_MAGIC, rows, cols, panel, type, 0 };
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(packed, 1, bytes, file) == bytes;
+        fclose(file);
+    }
+    
+    if (panel) {
+        matrix_free(packed, bytes);
+    }
+    matrix_free(typed, bytes);
+    return ok ? 0 : -1;
+}
+
+// Store a single row of matrix A in the tuple space, under an integer key
+int put_matrix_row(TSH_CONN *conn, unsigned long family, int row_idx, const void *row, int cols,
+                   int elem_size)
 {
-    char tuple_name[64];
-    snprintf(tuple_name, sizeof(tuple_name), "%s_row_%d", prefix, row_idx);
-    return tsh_put(conn, tuple_name, 1, row, cols * sizeof(double));
+    return tsh_kput(conn, family, row_idx, 1, row, (unsigned long)cols * elem_size);
 }
 
 // Store a single row of matrix B in the tuple space
@@ -156,36 +163,73 @@ int put_matrix_b_row(TSH_CONN *conn, int row_idx, double *row, int cols)
     return tsh_put(conn, tuple_name, 1, row, cols * sizeof(double));
 }
 
-// Store a work tuple for multiple result rows in the tuple space
-int put_work_tuple(TSH_CONN *conn, int start_row, int num_rows)
+// Queue a work chunk for multiple result rows
+int enqueue_work_chunk(TSH_CONN *conn, int start_row, int num_rows)
 {
-    char tuple_name[64];
-    snprintf(tuple_name, sizeof(tuple_name), "work_chunk_%d", start_row);
-    
-    // Store start_row and num_rows in the work tuple
+    // Store start_row and num_rows in the queue item
     int work_data[2] = {start_row, num_rows};
-    return tsh_put(conn, tuple_name, 1, work_data, sizeof(work_data));
+    return tsh_enqueue(conn, WORK_QUEUE, work_data, sizeof(work_data));
 }
 
-// Attempt to read a result row (C_row_X) from the tuple space
-// Returns 0 on success, -1 on failure
-int try_get_result_row(TSH_CONN *conn, int row_idx, double *buffer, int max_cols, int *cols_read)
+// Attempt to read a result tuple from the tuple space, on a v2
+// connection the caller keeps for a whole scan. There a miss is answered
+// at once and leaves no pending request on the server, so a single read
+// tells a missing tuple from a stored one.
+// Returns 0 on success, -1 if the tuple is not there yet or on failure
+int try_get_result(TSH_CONN *conn, const char *tuple_name, void *buffer, unsigned long size,
+                   unsigned long *len_read)
+{
+    unsigned long len = size;
+    
+    if (!conn || conn->version != TSH_V2) {
+        return -1;
+    }
+    if (tsh_read(conn, tuple_name, (char*)buffer, &len) != 0) {
+        return -1;  // Not available yet
+    }
+    
+    *len_read = len;
+    return 0;  // Successfully read the tuple
+}
+
+// Attempt to read a result row (C_row_X); as try_get_result
+int try_get_result_row(TSH_CONN *conn, int row_idx, void *buffer, unsigned long size,
+                       unsigned long *len_read)
 {
     char tuple_name[64];
-    unsigned long len = max_cols * sizeof(double);
     
     snprintf(tuple_name, sizeof(tuple_name), "C_row_%d", row_idx);
-    
-    if (tsh_read(conn, tuple_name, (char*)buffer, &len) != 0) {
-        return -1;  // Row not available yet
+    return try_get_result(conn, tuple_name, buffer, size, len_read);
+}
+
+// Take a tuple by name if it exists, on a v2 connection; a get of a
+// missing one would wait for it
+void take_if_present(TSH_CONN *conn, const char *name, char *buffer, size_t size)
+{
+    if (tsh_stat(conn, name, NULL, NULL, NULL) == 1) {
+        unsigned long len = size;
+        tsh_get(conn, name, buffer, &len);
     }
+}
+
+// Empty a work queue without waiting, e.g. of chunks left by an aborted run
+void drain_work_queue(unsigned short port, const char *queue) {
+    int work_data[4];
+    int got;
     
-    *cols_read = len / sizeof(double);
-    return 0;  // Successfully read the row
+    do {
+        unsigned long len = sizeof(work_data);
+        TSH_CONN *conn = tsh_connect(port);
+        if (!conn) {
+            return;
+        }
+        got = tsh_dequeue(conn, queue, (char*)work_data, &len, 0, 0, NULL);
+        tsh_disconnect(conn);
+    } while (got == 1);
 }
 
 // Function to safely clean up tuples from the tuple space server
-void cleanup_tuple_space(unsigned short port, int rows, int cols, int granularity) {
+void cleanup_tuple_space(unsigned short port, int rows, int cols) {
     printf("Starting tuple space cleanup...\n");
     
     // Safety check for dimensions
@@ -203,9 +247,6 @@ void cleanup_tuple_space(unsigned short port, int rows, int cols, int granularit
 
     // Clean up matrix A rows
     for (int i = 0; i < rows; i++) {
-        char tuple_name[64];
-        snprintf(tuple_name, sizeof(tuple_name), "A_row_%d", i);
-        
         // Try to remove the row with a fresh connection
         TSH_CONN *conn = tsh_connect(port);
         if (!conn) {
@@ -213,7 +254,7 @@ void cleanup_tuple_space(unsigned short port, int rows, int cols, int granularit
         }
         
         unsigned long len = cols * sizeof(double);
-        tsh_get(conn, tuple_name, (char*)buffer, &len);
+        tsh_kget(conn, FAMILY_A_ROWS, i, (char*)buffer, &len);
         tsh_disconnect(conn);
     }
     
@@ -249,6 +290,23 @@ void cleanup_tuple_space(unsigned short port, int rows, int cols, int granularit
         tsh_disconnect(conn);
     }
     
+    // The row claims left by the workers: each is overwritten with a 1 ms
+    // TTL on one connection and the server reaps it. A named get would block
+    // on every claim already gone. Without v2 they expire on their own.
+    {
+        TSH_CONN *conn = tsh_connect_v2(port);
+        int claimer = 0;
+        
+        for (int i = 0; conn && conn->version == TSH_V2 && i < rows; i++) {
+            char tuple_name[64];
+            snprintf(tuple_name, sizeof(tuple_name), "C_claim_%d", i);
+            if (tsh_put_ttl(conn, tuple_name, 1, &claimer, sizeof(claimer), 1) != 0)
+                break;
+        }
+        if (conn)
+            tsh_disconnect(conn);
+    }
+    
     // Clean up both old-style and new-style work tuples
     for (int i = 0; i < rows; i++) {
         // Try old format first
@@ -266,35 +324,19 @@ void cleanup_tuple_space(unsigned short port, int rows, int cols, int granularit
         tsh_disconnect(conn);
     }
     
-    // Clean up the new work chunk tuples
-    // Calculate number of chunks based on rows and granularity
-    int num_chunks = (rows + granularity - 1) / granularity;
-    for (int i = 0; i < num_chunks; i++) {
-        char chunk_tuple_name[64];
-        snprintf(chunk_tuple_name, sizeof(chunk_tuple_name), "work_chunk_%d", i);
-        
-        TSH_CONN *conn = tsh_connect(port);
-        if (!conn) {
-            continue;
-        }
-        
-        int work_data[2];
-        unsigned long len = sizeof(work_data);
-        tsh_get(conn, chunk_tuple_name, (char*)work_data, &len);
-        tsh_disconnect(conn);
-    }
+    // Clean up any work chunks still queued
+    drain_work_queue(port, WORK_QUEUE);
     
-    // Clean up the termination signal and chunk count
+    // Clean up the completion counter and chunk count
     {
-        char done_tuple[] = "all_work_complete";
         char chunk_count_tuple[] = "total_chunks";
         
-        // Try to remove the termination signal with a fresh connection
+        // Try to remove the counter with a fresh connection
         TSH_CONN *conn = tsh_connect(port);
         if (conn) {
-            int term_buffer;
-            unsigned long len = sizeof(term_buffer);
-            tsh_get(conn, done_tuple, (char*)&term_buffer, &len);
+            int count_value;
+            unsigned long len = sizeof(count_value);
+            tsh_get(conn, ROWS_DONE_COUNTER, (char*)&count_value, &len);
             tsh_disconnect(conn);
         }
         
@@ -343,16 +385,1126 @@ void save_results_to_csv(int size, int granularity, double total_time, double mu
     printf("Results saved to %s\n", RESULTS_CSV_FILE);
 }
 
+// Drop what a Strassen run leaves in the tuple space: operands and products
+// of its base-case products, read into buffer, and queued tasks
+void cleanup_strassen(unsigned short port, int products, char *buffer, size_t size) {
+    TSH_CONN *conn = tsh_connect_v2(port);
+    if (conn) {
+        for (int i = 0; i < products; i++) {
+            unsigned long len = size;
+            tsh_kget(conn, FAMILY_STRASSEN_OPERANDS, i, buffer, &len);
+            len = size;
+            tsh_kget(conn, FAMILY_STRASSEN_PRODUCTS, i, buffer, &len);
+        }
+        tsh_disconnect(conn);
+    }
+    drain_work_queue(port, STRASSEN_QUEUE);
+}
+
+// Fork count workers running the engine mode given, with the file of B
+// if it has one ("-" if not); the number started. The master's result
+// subscription, if any, is closed in each, or the server would keep
+// sending it notes until the last worker exits
+int spawn_engine_workers(unsigned short port, int n, const char *matrix_b_file, int lease_ms,
+                         int threads, int count, const char *mode, TSH_CONN *sub_conn)
+{
+    printf("Spawning %d worker processes of %d threads\n", count, threads);
+    for (int i = 0; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (sub_conn) {
+                close(sub_conn->sock);
+            }
+            char port_str[16];
+            char rows_str[16];
+            char lease_str[16];
+            char threads_str[16];
+            snprintf(port_str, sizeof(port_str), "%d", port);
+            snprintf(rows_str, sizeof(rows_str), "%d", n);
+            snprintf(lease_str, sizeof(lease_str), "%d", lease_ms);
+            snprintf(threads_str, sizeof(threads_str), "%d", threads);
+            execl("./matrix_worker", "matrix_worker", port_str, rows_str, matrix_b_file, lease_str,
+                  threads_str, mode, (char *)NULL);
+            perror("execl failed");
+            exit(1);
+        } else if (pid < 0) {
+            perror("fork failed");
+            return i;
+        }
+    }
+    return count;
+}
+
+// Start a counter at 0, replacing one an aborted run left
+void start_counter(unsigned short port, const char *counter)
+{
+    TSH_CONN *conn = tsh_connect(port);
+    if (conn) {
+        int zero = 0; // same in any byte order
+        tsh_put(conn, counter, 1, &zero, sizeof(zero));
+        tsh_disconnect(conn);
+    }
+}
+
+// End an engine run, whatever its outcome: raise its done counter, if it
+// has one, to let the workers go, wait for the num_workers of them still
+// running, and drop the counter
+void finish_engine_run(unsigned short port, const char *done_counter, int num_workers)
+{
+    TSH_CONN *conn = done_counter ? tsh_connect(port) : NULL;
+    if (conn) {
+        tsh_incr(conn, done_counter, 1, NULL);
+        tsh_disconnect(conn);
+    }
+    printf("Waiting for worker processes to terminate\n");
+    for (int i = 0; i < num_workers; ++i) {
+        wait(NULL);
+    }
+    
+    conn = done_counter ? tsh_connect_v2(port) : NULL;
+    if (conn) {
+        int done;
+        take_if_present(conn, done_counter, (char*)&done, sizeof(done));
+        tsh_disconnect(conn);
+    }
+}
+
+// The results of an engine run, one per task, that the master collects:
+// how a task's result is named, which task a stored result answers (-1 if
+// none, or if it is the wrong length) and how it is added into C (0, or -1
+// if it is malformed)
+struct result_collector {
+    const char *prefix;         // Of every result name
+    const char *what;           // Results, in messages
+    int tasks;
+    void *run;                  // Engine state passed to the callbacks
+    void (*result_name)(const void *run, int task, char *name, size_t size);
+    int (*result_task)(const void *run, const char *name, unsigned long len);
+    int (*add_result)(void *run, int task, const char *data, unsigned long len);
+    char *received;             // Per task
+    int collected;
+};
+
+// Subscribe to the results, before any worker can store one; NULL if the
+// server takes no subscription, and results are polled for instead
+TSH_CONN *subscribe_results(unsigned short port, const struct result_collector *results,
+                            unsigned long note_size)
+{
+    TSH_CONN *conn = tsh_connect(port);
+    if (conn && tsh_subscribe(conn, results->prefix, note_size) != 0) {
+        tsh_disconnect(conn);
+        conn = NULL;
+    }
+    return conn;
+}
+
+// Add one stored result into C; 1 if it was new, 0 if not
+int accept_result(struct result_collector *results, const char *name, const char *data,
+                  unsigned long len)
+{
+    int task = results->result_task(results->run, name, len);
+    if (task < 0 || results->received[task] || results->add_result(results->run, task, data, len) != 0) {
+        return 0;
+    }
+    results->received[task] = 1;
+    results->collected++;
+    if (results->collected % 10 == 0 || results->collected == results->tasks) {
+        printf("Collected %d/%d %s\n", results->collected, results->tasks, results->what);
+    }
+    return 1;
+}
+
+// Collect every result, read into wire, and close the subscription:
+// results are taken as the server announces them, and when it has been
+// quiet for a while, or there is no subscription, looked for among the
+// stored ones not yet seen. *workers counts the workers still running;
+// those that exit are reaped here. Gives up once every worker has exited
+// and a last look found nothing, or after idle_s seconds without a result
+// (0: no limit). 0 if every result came back
+int collect_results(unsigned short port, TSH_CONN *sub_conn, struct result_collector *results,
+                    char *wire, size_t wire_bytes, int *workers, int idle_s)
+{
+    struct timespec last_progress, now;
+    
+    results->received = calloc(results->tasks, 1);
+    results->collected = 0;
+    clock_gettime(1, &last_progress);
+    while (results->received && results->collected < results->tasks && continue_collecting) {
+        char name[TUPLENAME_LEN];
+        unsigned long length = 0, len = wire_bytes;
+        int note = 0, progress = 0;
+        
+        // Reaped before the look below, so that it still sees what the
+        // last of them stored
+        while (*workers > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+            (*workers)--;
+        }
+        int none_left = (*workers == 0);
+        
+        if (sub_conn) {
+            note = tsh_next_note(sub_conn, name, &length, wire, &len, NOTE_WAIT_MS);
+            if (note < 0) {
+                printf("Lost the result subscription, polling instead\n");
+                tsh_disconnect(sub_conn);
+                sub_conn = NULL;
+            }
+        }
+        // A note cut short of its tuple: read the whole of it
+        TSH_CONN *scan_conn = (note != 1 || length > len) ? tsh_connect_v2(port) : NULL;
+        if (note == 1 && length > len &&
+            try_get_result(scan_conn, name, wire, wire_bytes, &len) != 0) {
+            note = 0;
+        }
+        if (note == 1) {
+            progress = accept_result(results, name, wire, len);
+        }
+        for (int task = 0; scan_conn && note != 1 && task < results->tasks; task++) {
+            if (results->received[task]) {
+                continue;
+            }
+            results->result_name(results->run, task, name, sizeof(name));
+            if (try_get_result(scan_conn, name, wire, wire_bytes, &len) == 0) {
+                progress |= accept_result(results, name, wire, len);
+            }
+        }
+        if (scan_conn) {
+            tsh_disconnect(scan_conn);
+        }
+        
+        clock_gettime(1, &now);
+        if (progress) {
+            last_progress = now;
+        } else if (none_left && note != 1) {
+            printf("All workers exited with %d/%d %s, giving up\n", results->collected,
+                   results->tasks, results->what);
+            break;
+        } else if (idle_s > 0 && now.tv_sec - last_progress.tv_sec > idle_s) {
+            printf("No progress for %d seconds with %d/%d %s, giving up\n", idle_s,
+                   results->collected, results->tasks, results->what);
+            break;
+        } else if (!sub_conn) {
+            usleep(100000); // 100ms
+        }
+    }
+    if (sub_conn) {
+        tsh_disconnect(sub_conn);
+    }
+    
+    int rc = (results->received && results->collected == results->tasks) ? 0 : -1;
+    free(results->received);
+    results->received = NULL;
+    return rc;
+}
+
+// State of a Strassen run shared by its split and combine callbacks
+struct strassen_run {
+    unsigned short port;
+    TSH_CONN *conn;     // Connection the operands and products travel on
+    int type;           // Element type of the operands
+    int result_type;    // and of the products
+    char *wire;         // One operand pair or product, converted
+    size_t inexact;     // Operand elements not exact in type
+    int products;       // Base-case products in all
+    int collected;
+    int idle_s;         // Give up after this long without a product
+    struct timespec last_product;
+};
+
+// Store the operands of one base-case product and queue it for the workers
+int strassen_put_task(void *arg, int index, int s, const double *A, int lda,
+                      const double *B, int ldb)
+{
+    struct strassen_run *run = arg;
+    size_t es = matrix_elem_size(run->type), block = (size_t)s * s;
+    char *wire_B = &run->wire[block * es];
+    
+    for (int i = 0; i < s; i++) {
+        run->inexact += matrix_from_double(run->type, &A[(size_t)i * lda], &run->wire[i * s * es], s);
+        run->inexact += matrix_from_double(run->type, &B[(size_t)i * ldb], &wire_B[i * s * es], s);
+    }
+    if (tsh_kput(run->conn, FAMILY_STRASSEN_OPERANDS, index, 1, run->wire, 2 * block * es) != 0) {
+        return -1;
+    }
+    
+    int task[3] = {index, s, run->type};
+    TSH_CONN *conn = tsh_connect(run->port);
+    if (!conn) {
+        return -1;
+    }
+    int rc = tsh_enqueue(conn, STRASSEN_QUEUE, task, sizeof(task));
+    tsh_disconnect(conn);
+    return rc;
+}
+
+// Wait for one base-case product and take it, dropping its operands
+int strassen_get_product(void *arg, int index, int s, double *P, int ldp)
+{
+    struct strassen_run *run = arg;
+    size_t block = (size_t)s * s;
+    size_t result_size = matrix_elem_size(run->result_type);
+    struct timespec now;
+    
+    for (;;) {
+        unsigned long len = block * result_size;
+        if (tsh_kget(run->conn, FAMILY_STRASSEN_PRODUCTS, index, run->wire, &len) == 0 &&
+            len == block * result_size) {
+            break;
+        }
+        
+        // Products come back in any order, so the wait counts from the
+        // last one that did, whichever it was
+        clock_gettime(1, &now);
+        if (!continue_collecting || now.tv_sec - run->last_product.tv_sec > run->idle_s) {
+            printf("No Strassen product for %d seconds, giving up at product %d\n", run->idle_s, index);
+            return -1;
+        }
+        usleep(1000);
+    }
+    for (int i = 0; i < s; i++) {
+        matrix_to_double(run->result_type, &run->wire[i * s * result_size], &P[(size_t)i * ldp], s);
+    }
+    
+    unsigned long len = 2 * block * matrix_elem_size(run->type);
+    tsh_kget(run->conn, FAMILY_STRASSEN_OPERANDS, index, run->wire, &len);
+    
+    clock_gettime(1, &run->last_product);
+    run->collected++;
+    if (run->collected % ((run->products + 9) / 10) == 0 || run->collected == run->products) {
+        printf("Collected %d/%d Strassen products\n", run->collected, run->products);
+    }
+    return 0;
+}
+
+// Multiply with the Strassen-Winograd engine: the product is split down to
+// blocks smaller than crossover, each base-case product is queued for the
+// workers, and C is built from their results. The matrices are padded with
+// zeros to a size that halves evenly. 0 on success, -1 on failure
+int multiply_strassen(unsigned short port, const double *A, const double *B, double *C, int n,
+                      int elem, int crossover, int lease_ms, int threads,
+                      struct timespec *mult_start, struct timespec *mult_end)
+{
+    int levels = strassen_levels(n, crossover);
+    int padded = strassen_padded(n, levels);
+    int leaf = padded >> levels;
+    struct strassen_run run = { port, NULL, strassen_operand_type(elem, levels), 0, NULL, 0,
+                                strassen_products(levels), 0 };
+    run.result_type = matrix_result_type(run.type);
+    // A product whose worker died is redelivered when its lease runs out,
+    // so the wait spans a few leases
+    run.idle_s = RESULT_IDLE_LEASES * lease_ms / 1000;
+    
+    printf("Strassen-Winograd: %d levels, %d products of %dx%d blocks as %s, crossover %d\n",
+           levels, run.products, leaf, leaf, matrix_elem_name(run.type), crossover);
+    
+    size_t padded_bytes = (size_t)padded * padded * sizeof(double);
+    size_t block = (size_t)leaf * leaf;
+    size_t pair_bytes = 2 * block * matrix_elem_size(run.type);
+    size_t product_bytes = block * matrix_elem_size(run.result_type);
+    size_t wire_bytes = (pair_bytes > product_bytes) ? pair_bytes : product_bytes;
+    const double *Ap = A, *Bp = B;
+    double *Cp = C, *pad = NULL;
+    if (padded != n) {
+        pad = matrix_alloc(3 * padded_bytes, NULL);
+        if (!pad) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            memcpy(&pad[(size_t)i * padded], &A[(size_t)i * n], n * sizeof(double));
+            memcpy(&pad[(size_t)(padded + i) * padded], &B[(size_t)i * n], n * sizeof(double));
+        }
+        Ap = pad;
+        Bp = pad + (size_t)padded * padded;
+        Cp = pad + (size_t)2 * padded * padded;
+    }
+    run.wire = matrix_alloc(wire_bytes, NULL);
+    run.conn = tsh_connect_v2(port);
+    if (!run.wire || !run.conn) {
+        if (run.conn) {
+            tsh_disconnect(run.conn);
+        }
+        matrix_free(run.wire, wire_bytes);
+        matrix_free(pad, 3 * padded_bytes);
+        return -1;
+    }
+    
+    cleanup_strassen(port, run.products, run.wire, wire_bytes);
+    start_counter(port, STRASSEN_DONE);
+    
+    // One worker per 'threads' cores, and no more than there are products
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long worker_slots = (cores + threads - 1) / threads;
+    int num_workers = (run.products < worker_slots) ? run.products : worker_slots;
+    num_workers = (num_workers > 0) ? num_workers : 1;
+    num_workers = spawn_engine_workers(port, n, "-", lease_ms, threads, num_workers, "strassen",
+                                       NULL);
+    
+    // Products are queued as the split produces them, so the workers start
+    // on the first while the master is still splitting
+    clock_gettime(1, mult_start);
+    int rc = strassen_split(levels, padded, Ap, padded, Bp, padded, strassen_put_task, &run);
+    if (run.inexact) {
+        printf("Warning: %zu Strassen operand elements are not exact in %s\n", run.inexact,
+               matrix_elem_name(run.type));
+    }
+    if (rc == 0) {
+        clock_gettime(1, &run.last_product);
+        rc = strassen_combine(levels, padded, Cp, padded, strassen_get_product, &run);
+    }
+    clock_gettime(1, mult_end);
+    
+    tsh_disconnect(run.conn);
+    finish_engine_run(port, STRASSEN_DONE, num_workers);
+    cleanup_strassen(port, run.products, run.wire, wire_bytes);
+    
+    if (pad) {
+        for (int i = 0; rc == 0 && i < n; i++) {
+            memcpy(&C[(size_t)i * n], &Cp[(size_t)i * padded], n * sizeof(double));
+        }
+        matrix_free(pad, 3 * padded_bytes);
+    }
+    matrix_free(run.wire, wire_bytes);
+    return rc ? -1 : 0;
+}
+
+// Store one keyed tuple: submitted on conn if it is a v2 connection, its
+// reply collected later, else put on a connection of its own. Replies are
+// collected as they pile up so the server is never left unable to send
+int submit_keyed_put(TSH_CONN *conn, unsigned short port, unsigned long family,
+                     unsigned long long index, const void *data, unsigned long len)
+{
+    if (conn && conn->version == TSH_V2) {
+        tsh_completion done;
+        int failed = 0;
+        while (tsh_pending(conn) >= KEYED_PUTS_PENDING && tsh_wait(conn, &done, -1) == 1) {
+            failed += (done.status != 0);
+        }
+        if (tsh_submit_kput(conn, family, index, 1, data, len) == 0) {
+            failed++;
+        }
+        return failed ? -1 : 0;
+    }
+    
+    TSH_CONN *put_conn = tsh_connect(port);
+    if (!put_conn) {
+        return -1;
+    }
+    int rc = tsh_kput(put_conn, family, index, 1, data, len);
+    tsh_disconnect(put_conn);
+    return rc;
+}
+
+// Collect the outstanding replies of submit_keyed_put; the number of
+// puts that failed
+int finish_keyed_puts(TSH_CONN *conn)
+{
+    tsh_completion done;
+    int failed = 0;
+    
+    while (conn && conn->version == TSH_V2 && tsh_wait(conn, &done, -1) == 1) {
+        failed += (done.status != 0);
+    }
+    return failed;
+}
+
+// State of a tile engine run
+struct tile_run {
+    int n;
+    int tile_rows, tile_cols, tile_k;
+    int col_blocks, kblocks;
+    int tasks;          // Tiles times k blocks
+    int result_type;
+    double *C;
+    double *tile;       // One tile of C, in doubles
+};
+
+// Name of the result tuple of a task: C_tile_<row0>_<col0>_<kblock>
+void tile_result_name(const void *arg, int task, char *name, size_t size)
+{
+    const struct tile_run *run = arg;
+    int kblock = task % run->kblocks;
+    int tile = task / run->kblocks;
+    snprintf(name, size, "C_tile_%d_%d_%d", (tile / run->col_blocks) * run->tile_rows,
+             (tile % run->col_blocks) * run->tile_cols, kblock);
+}
+
+// Task a returned tile answers, if it is the size of its tile
+int tile_result_task(const void *arg, const char *name, unsigned long len)
+{
+    const struct tile_run *run = arg;
+    int row0, col0, kblock;
+    
+    if (sscanf(name, "C_tile_%d_%d_%d", &row0, &col0, &kblock) != 3 ||
+        row0 < 0 || row0 >= run->n || row0 % run->tile_rows != 0 ||
+        col0 < 0 || col0 >= run->n || col0 % run->tile_cols != 0 ||
+        kblock < 0 || kblock >= run->kblocks) {
+        return -1;
+    }
+    int rows = (row0 + run->tile_rows <= run->n) ? run->tile_rows : run->n - row0;
+    int cols = (col0 + run->tile_cols <= run->n) ? run->tile_cols : run->n - col0;
+    if (len != (unsigned long)rows * cols * matrix_elem_size(run->result_type)) {
+        return -1;
+    }
+    return ((row0 / run->tile_rows) * run->col_blocks + col0 / run->tile_cols) * run->kblocks + kblock;
+}
+
+// Add the tile of a task into C: partial sums over k blocks add up, and C
+// starts zeroed
+int add_tile(void *arg, int task, const char *data, unsigned long len)
+{
+    struct tile_run *run = arg;
+    int tile = task / run->kblocks;
+    int row0 = (tile / run->col_blocks) * run->tile_rows;
+    int col0 = (tile % run->col_blocks) * run->tile_cols;
+    int rows = (row0 + run->tile_rows <= run->n) ? run->tile_rows : run->n - row0;
+    int cols = (col0 + run->tile_cols <= run->n) ? run->tile_cols : run->n - col0;
+    
+    (void)len;
+    matrix_to_double(run->result_type, data, run->tile, (size_t)rows * cols);
+    for (int i = 0; i < rows; i++) {
+        double *row_C = &run->C[(size_t)(row0 + i) * run->n + col0];
+        for (int j = 0; j < cols; j++) {
+            row_C[j] += run->tile[i * cols + j];
+        }
+    }
+    return 0;
+}
+
+// Drop what a tile run leaves in the tuple space: the A row segments and
+// blocks of B, read into buffer, queued tasks and the C tiles
+void cleanup_tiles(unsigned short port, const struct tile_run *run, char *buffer, size_t size)
+{
+    int b_blocks = run->col_blocks * run->kblocks;
+    TSH_CONN *conn = tsh_connect_v2(port);
+    if (conn) {
+        for (int i = 0; i < run->n * run->kblocks || i < b_blocks; i++) {
+            unsigned long len = size;
+            if (i < run->n * run->kblocks)
+                tsh_kget(conn, FAMILY_A_ROWS, i, buffer, &len);
+            len = size;
+            if (i < b_blocks)
+                tsh_kget(conn, FAMILY_B_TILES, i, buffer, &len);
+        }
+        for (int task = 0; task < run->tasks; task++) {
+            char name[64];
+            tile_result_name(run, task, name, sizeof(name));
+            take_if_present(conn, name, buffer, size);
+        }
+        tsh_disconnect(conn);
+    }
+    drain_work_queue(port, TILE_QUEUE);
+}
+
+// Multiply with the tile engine: C is cut into tile_rows x tile_cols tiles,
+// and k into blocks of tile_k (0: a single block). Each tile and k block is
+// a task; its worker fetches only the segments of A rows and the block of
+// B it needs and stores a C tile, which is summed into C here. 0 if every
+// tile came back
+int multiply_tiles(unsigned short port, const double *A, const double *B, double *C, int n,
+                   int elem, int tile_rows, int tile_cols, int tile_k, int lease_ms, int threads,
+                   struct timespec *mult_start, struct timespec *mult_end)
+{
+    struct tile_run run;
+    run.n = n;
+    run.tile_rows = tile_rows;
+    run.tile_cols = tile_cols;
+    run.tile_k = (tile_k > 0 && tile_k < n) ? tile_k : n;
+    run.col_blocks = (n + tile_cols - 1) / tile_cols;
+    run.kblocks = (n + run.tile_k - 1) / run.tile_k;
+    run.tasks = ((n + tile_rows - 1) / tile_rows) * run.col_blocks * run.kblocks;
+    run.result_type = matrix_result_type(elem);
+    run.C = C;
+    
+    printf("Tiles: %dx%d of C, k blocks of %d, %d tasks\n", tile_rows, tile_cols, run.tile_k,
+           run.tasks);
+    
+    // One buffer for whatever goes out or comes in: a block of B, an A row
+    // segment or a C tile
+    size_t elem_size = matrix_elem_size(elem);
+    size_t result_size = matrix_elem_size(run.result_type);
+    size_t b_bytes = (size_t)run.tile_k * tile_cols * elem_size;
+    size_t c_bytes = (size_t)tile_rows * tile_cols * result_size;
+    size_t wire_bytes = (b_bytes > c_bytes) ? b_bytes : c_bytes;
+    size_t tile_bytes = (size_t)tile_rows * tile_cols * sizeof(double);
+    char *wire = matrix_alloc(wire_bytes, NULL);
+    run.tile = matrix_alloc(tile_bytes, NULL);
+    if (!wire || !run.tile) {
+        matrix_free(wire, wire_bytes);
+        matrix_free(run.tile, tile_bytes);
+        return -1;
+    }
+    
+    cleanup_tiles(port, &run, wire, wire_bytes);
+    start_counter(port, TILES_DONE);
+    
+    // Store the segments of A rows and the blocks of B, pipelined on a v2
+    // connection
+    size_t inexact = 0;
+    int failed = 0;
+    TSH_CONN *put_conn = tsh_connect_v2(port);
+    for (int i = 0; i < n; i++) {
+        for (int kb = 0; kb < run.kblocks; kb++) {
+            int k0 = kb * run.tile_k;
+            int depth = (k0 + run.tile_k <= n) ? run.tile_k : n - k0;
+            inexact += matrix_from_double(elem, &A[(size_t)i * n + k0], wire, depth);
+            failed += submit_keyed_put(put_conn, port, FAMILY_A_ROWS, (unsigned long long)i * run.kblocks + kb,
+                                       wire, depth * elem_size) != 0;
+        }
+    }
+    for (int kb = 0; kb < run.kblocks; kb++) {
+        int k0 = kb * run.tile_k;
+        int depth = (k0 + run.tile_k <= n) ? run.tile_k : n - k0;
+        for (int cb = 0; cb < run.col_blocks; cb++) {
+            int col0 = cb * tile_cols;
+            int cols = (col0 + tile_cols <= n) ? tile_cols : n - col0;
+            for (int p = 0; p < depth; p++) {
+                inexact += matrix_from_double(elem, &B[(size_t)(k0 + p) * n + col0],
+                                              &wire[(size_t)p * cols * elem_size], cols);
+            }
+            failed += submit_keyed_put(put_conn, port, FAMILY_B_TILES, kb * run.col_blocks + cb,
+                                       wire, (unsigned long)depth * cols * elem_size) != 0;
+        }
+    }
+    failed += finish_keyed_puts(put_conn);
+    if (put_conn) {
+        tsh_disconnect(put_conn);
+    }
+    if (inexact) {
+        printf("Warning: %zu elements of A and B are not exact in %s\n", inexact,
+               matrix_elem_name(elem));
+    }
+    if (failed) {
+        printf("Failed to store %d blocks of A and B\n", failed);
+    }
+    
+    // Queue the tasks, the tiles of a row block together so that a worker
+    // taking several finds their A rows in its cache
+    for (int task = 0; task < run.tasks; task++) {
+        int kb = task % run.kblocks, tile = task / run.kblocks;
+        struct matrix_tile_task item;
+        item.row0 = (tile / run.col_blocks) * tile_rows;
+        item.rows = (item.row0 + tile_rows <= n) ? tile_rows : n - item.row0;
+        item.col0 = (tile % run.col_blocks) * tile_cols;
+        item.cols = (item.col0 + tile_cols <= n) ? tile_cols : n - item.col0;
+        item.k0 = kb * run.tile_k;
+        item.depth = (item.k0 + run.tile_k <= n) ? run.tile_k : n - item.k0;
+        item.kblock = kb;
+        item.kblocks = run.kblocks;
+        item.b_index = kb * run.col_blocks + tile % run.col_blocks;
+        item.type = elem;
+        
+        TSH_CONN *conn = tsh_connect(port);
+        if (!conn) {
+            break;
+        }
+        tsh_enqueue(conn, TILE_QUEUE, &item, sizeof(item));
+        tsh_disconnect(conn);
+    }
+    
+    struct result_collector results = { "C_tile_", "tiles", run.tasks, &run, tile_result_name,
+                                        tile_result_task, add_tile };
+    TSH_CONN *sub_conn = subscribe_results(port, &results, c_bytes);
+    
+    // One worker per 'threads' cores, and no more than there are tasks
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long worker_slots = (cores + threads - 1) / threads;
+    int num_workers = (run.tasks < worker_slots) ? run.tasks : worker_slots;
+    num_workers = spawn_engine_workers(port, n, "-", lease_ms, threads, (num_workers > 0) ? num_workers : 1,
+                                       "tiles", sub_conn);
+    clock_gettime(1, mult_start);
+    int rc = collect_results(port, sub_conn, &results, wire, wire_bytes, &num_workers,
+                             RESULT_IDLE_LEASES * lease_ms / 1000);
+    clock_gettime(1, mult_end);
+    
+    finish_engine_run(port, TILES_DONE, num_workers);
+    cleanup_tiles(port, &run, wire, wire_bytes);
+    
+    matrix_free(wire, wire_bytes);
+    matrix_free(run.tile, tile_bytes);
+    return rc;
+}
+
+// Drop what a SUMMA run leaves in the tuple space, read into buffer: the
+// grid, rank counter, blocks of A, B and C, and panels with their read
+// counters, which only a failed run leaves behind
+void cleanup_summa(unsigned short port, const struct matrix_summa_grid *grid, char *buffer,
+                   size_t size)
+{
+    TSH_CONN *conn = tsh_connect_v2(port);
+    if (!conn) {
+        return;
+    }
+    take_if_present(conn, SUMMA_GRID, buffer, size);
+    take_if_present(conn, SUMMA_RANK, buffer, size);
+    for (int b = 0; b < grid->q * grid->q; b++) {
+        char name[64];
+        unsigned long len = size;
+        tsh_kget(conn, FAMILY_SUMMA_A, b, buffer, &len);
+        len = size;
+        tsh_kget(conn, FAMILY_SUMMA_B, b, buffer, &len);
+        snprintf(name, sizeof(name), "C_block_%d_%d", b / grid->q, b % grid->q);
+        take_if_present(conn, name, buffer, size);
+    }
+    for (int step = summa_steps(grid) - 1; grid->q > 1 && step >= 0; step--) {
+        for (int b = 0; b < grid->q; b++) {
+            char name[64];
+            unsigned long len = size;
+            tsh_kget(conn, FAMILY_SUMMA_A_PANELS, (unsigned long long)step * grid->q + b, buffer, &len);
+            len = size;
+            tsh_kget(conn, FAMILY_SUMMA_B_PANELS, (unsigned long long)step * grid->q + b, buffer, &len);
+            snprintf(name, sizeof(name), "summa_A_%d_%d", step, b);
+            take_if_present(conn, name, buffer, size);
+            snprintf(name, sizeof(name), "summa_B_%d_%d", step, b);
+            take_if_present(conn, name, buffer, size);
+        }
+    }
+    tsh_disconnect(conn);
+}
+
+// State of a SUMMA run while its blocks of C are collected
+struct summa_run {
+    const struct matrix_summa_grid *grid;
+    int result_type;
+    double *C;
+    double *block;      // One block of C, in doubles
+};
+
+// Name of the result tuple of block b: C_block_<i>_<j>
+void summa_result_name(const void *arg, int b, char *name, size_t size)
+{
+    const struct summa_run *run = arg;
+    snprintf(name, size, "C_block_%d_%d", b / run->grid->q, b % run->grid->q);
+}
+
+// Block a returned block of C is, if it is the size of that block
+int summa_result_task(const void *arg, const char *name, unsigned long len)
+{
+    const struct summa_run *run = arg;
+    int q = run->grid->q, bi, bj, row0, rows, col0, cols;
+    
+    if (sscanf(name, "C_block_%d_%d", &bi, &bj) != 2 || bi < 0 || bi >= q || bj < 0 || bj >= q) {
+        return -1;
+    }
+    summa_block(run->grid, bi, &row0, &rows);
+    summa_block(run->grid, bj, &col0, &cols);
+    if (len != (unsigned long)rows * cols * matrix_elem_size(run->result_type)) {
+        return -1;
+    }
+    return bi * q + bj;
+}
+
+// Copy block b of C into place
+int add_summa_block(void *arg, int b, const char *data, unsigned long len)
+{
+    struct summa_run *run = arg;
+    int n = run->grid->n, row0, rows, col0, cols;
+    
+    (void)len;
+    summa_block(run->grid, b / run->grid->q, &row0, &rows);
+    summa_block(run->grid, b % run->grid->q, &col0, &cols);
+    matrix_to_double(run->result_type, data, run->block, (size_t)rows * cols);
+    for (int r = 0; r < rows; r++) {
+        memcpy(&run->C[(size_t)(row0 + r) * n + col0], &run->block[(size_t)r * cols],
+               cols * sizeof(double));
+    }
+    return 0;
+}
+
+// Multiply with the SUMMA engine on a q x q grid of workers: each takes
+// its blocks of A and B from the tuple space, and at every step the
+// workers owning the step's panels of A and B broadcast them to their
+// grid row and column through it. No worker holds more than its blocks
+// and a panel of each, so the size the run can take grows with the
+// workers. Each block of C comes back whole. 0 if every block came back
+int multiply_summa(unsigned short port, const double *A, const double *B, double *C, int n,
+                   int elem, int q, int panel, int threads,
+                   struct timespec *mult_start, struct timespec *mult_end)
+{
+    struct matrix_summa_grid grid = { n, q, panel, elem };
+    int blocks = q * q;
+    
+    printf("SUMMA: %dx%d grid of workers, %d steps\n", q, q, summa_steps(&grid));
+    
+    // One buffer for a block of A or B, or of C
+    int widest, last;
+    summa_block(&grid, q - 1, &last, &widest);
+    size_t elem_size = matrix_elem_size(elem);
+    int result_type = matrix_result_type(elem);
+    size_t result_size = matrix_elem_size(result_type);
+    size_t c_bytes = (size_t)widest * widest * result_size;
+    size_t wire_bytes = (c_bytes > (size_t)widest * widest * elem_size) ? c_bytes
+                                                                        : (size_t)widest * widest * elem_size;
+    struct summa_run run = { &grid, result_type, C, NULL };
+    char *wire = matrix_alloc(wire_bytes, NULL);
+    run.block = malloc((size_t)widest * widest * sizeof(double));
+    if (!wire || !run.block) {
+        matrix_free(wire, wire_bytes);
+        free(run.block);
+        return -1;
+    }
+    
+    // The grid and the ranks go out first
+    cleanup_summa(port, &grid, wire, wire_bytes);
+    {
+        TSH_CONN *conn = tsh_connect(port);
+        if (conn) {
+            tsh_put(conn, SUMMA_GRID, 1, &grid, sizeof(grid));
+            tsh_disconnect(conn);
+        }
+    }
+    start_counter(port, SUMMA_RANK);
+    
+    // Store the blocks of A and B, pipelined on a v2 connection
+    size_t inexact = 0;
+    int failed = 0;
+    TSH_CONN *put_conn = tsh_connect_v2(port);
+    for (int b = 0; b < blocks; b++) {
+        int row0, rows, col0, cols;
+        summa_block(&grid, b / q, &row0, &rows);
+        summa_block(&grid, b % q, &col0, &cols);
+        for (int r = 0; r < rows; r++) {
+            inexact += matrix_from_double(elem, &A[(size_t)(row0 + r) * n + col0],
+                                          &wire[(size_t)r * cols * elem_size], cols);
+        }
+        failed += submit_keyed_put(put_conn, port, FAMILY_SUMMA_A, b, wire,
+                                   (unsigned long)rows * cols * elem_size) != 0;
+        for (int r = 0; r < rows; r++) {
+            inexact += matrix_from_double(elem, &B[(size_t)(row0 + r) * n + col0],
+                                          &wire[(size_t)r * cols * elem_size], cols);
+        }
+        failed += submit_keyed_put(put_conn, port, FAMILY_SUMMA_B, b, wire,
+                                   (unsigned long)rows * cols * elem_size) != 0;
+    }
+    failed += finish_keyed_puts(put_conn);
+    if (put_conn) {
+        tsh_disconnect(put_conn);
+    }
+    if (inexact) {
+        printf("Warning: %zu elements of A and B are not exact in %s\n", inexact,
+               matrix_elem_name(elem));
+    }
+    if (failed) {
+        printf("Failed to store %d blocks of A and B\n", failed);
+    }
+    
+    struct result_collector results = { "C_block_", "blocks of C", blocks, &run, summa_result_name,
+                                        summa_result_task, add_summa_block };
+    TSH_CONN *sub_conn = subscribe_results(port, &results, c_bytes);
+    
+    // Every block needs its worker at once: the steps go in lockstep
+    int num_workers = spawn_engine_workers(port, n, "-", DEFAULT_LEASE_MS, threads, blocks, "summa",
+                                           sub_conn);
+    clock_gettime(1, mult_start);
+    // A block comes back only after its worker's last step, however long
+    // that takes, so only the workers' exit ends the wait
+    int rc = collect_results(port, sub_conn, &results, wire, wire_bytes, &num_workers, 0);
+    clock_gettime(1, mult_end);
+    
+    // Workers wait on panels for a limited time only, so they all end
+    // without a done counter
+    finish_engine_run(port, NULL, num_workers);
+    cleanup_summa(port, &grid, wire, wire_bytes);
+    
+    free(run.block);
+    matrix_free(wire, wire_bytes);
+    return rc;
+}
+
+// State of a sparse engine run
+struct sparse_run {
+    int n;
+    int sparse_b;       // B in sparse rows, else dense in a file
+    int chunks;
+    int *chunk_start;   // First row of each chunk, and one past the last
+    int *chunk_of_row;  // Chunk starting at a row, -1 for other rows
+    double *C;
+    long c_nonzeros;
+};
+
+// Name of the result tuple of a chunk: C_chunk_<start_row>
+void sparse_result_name(const void *arg, int chunk, char *name, size_t size)
+{
+    const struct sparse_run *run = arg;
+    snprintf(name, size, "C_chunk_%d", run->chunk_start[chunk]);
+}
+
+// Chunk a returned one answers; dense rows must be the size of the chunk
+int sparse_result_task(const void *arg, const char *name, unsigned long len)
+{
+    const struct sparse_run *run = arg;
+    int start, n = run->n;
+    
+    if (sscanf(name, "C_chunk_%d", &start) != 1 || start < 0 || start >= n) {
+        return -1;
+    }
+    int chunk = run->chunk_of_row[start];
+    if (chunk < 0 || (!run->sparse_b &&
+                      len != (unsigned long)(run->chunk_start[chunk + 1] - start) * n * sizeof(double))) {
+        return -1;
+    }
+    return chunk;
+}
+
+// Write a returned chunk into C: dense rows, or sparse rows packed back to
+// back
+int add_sparse_chunk(void *arg, int chunk, const char *data, unsigned long len)
+{
+    struct sparse_run *run = arg;
+    int start = run->chunk_start[chunk], n = run->n;
+    int num_rows = run->chunk_start[chunk + 1] - start;
+    double *C = run->C;
+    
+    if (!run->sparse_b) {
+        memcpy(&C[(size_t)start * n], data, len);
+    } else {
+        // Check every row before writing any
+        size_t offset = 0;
+        long nonzeros = 0;
+        for (int r = 0; r < num_rows; r++) {
+            struct matrix_sparse_vec row;
+            size_t used = matrix_sparse_row_view(&data[offset], len - offset, n, &row);
+            if (used == 0) {
+                return -1;
+            }
+            offset += used;
+        }
+        if (offset != len) {
+            return -1;
+        }
+        offset = 0;
+        for (int r = 0; r < num_rows; r++) {
+            struct matrix_sparse_vec row;
+            double *row_C = &C[(size_t)(start + r) * n];
+            offset += matrix_sparse_row_view(&data[offset], len - offset, n, &row);
+            memset(row_C, 0, n * sizeof(double));
+            for (int p = 0; p < row.nnz; p++) {
+                row_C[row.cols[p]] = row.vals[p];
+            }
+            nonzeros += row.nnz;
+        }
+        run->c_nonzeros += nonzeros;
+    }
+    return 0;
+}
+
+// Drop what a sparse run leaves in the tuple space, read into buffer: the
+// sparse rows of A and B, queued chunks and the C chunks
+void cleanup_sparse(unsigned short port, const struct sparse_run *run, char *buffer, size_t size)
+{
+    TSH_CONN *conn = tsh_connect_v2(port);
+    if (conn) {
+        for (int i = 0; i < run->n; i++) {
+            char name[64];
+            unsigned long len = size;
+            tsh_kget(conn, FAMILY_SPARSE_A_ROWS, i, buffer, &len);
+            len = size;
+            tsh_kget(conn, FAMILY_SPARSE_B_ROWS, i, buffer, &len);
+            if (run->chunk_of_row[i] >= 0) {
+                snprintf(name, sizeof(name), "C_chunk_%d", i);
+                take_if_present(conn, name, buffer, size);
+            }
+        }
+        tsh_disconnect(conn);
+    }
+    drain_work_queue(port, SPARSE_QUEUE);
+}
+
+// Multiply with the sparse engine: A, given in CSR, goes out as sparse
+// row tuples, B as sparse rows too (sparse_b) or as a file of dense rows,
+// and the workers take chunks of consecutive rows of A. Chunks are cut to
+// about equal work, counted in nonzeros, rather than rows: as many chunks
+// as granularity rows would give. 0 if every chunk came back
+int multiply_sparse(unsigned short port, const struct matrix_csr *csr_A, const double *B, double *C,
+                    int n, int sparse_b, int granularity, int lease_ms,
+                    struct timespec *mult_start, struct timespec *mult_end)
+{
+    struct matrix_csr csr_B;
+    struct sparse_run run;
+    const char *matrix_b_file = sparse_b ? "-" : "matrix_b.dat";
+    
+    memset(&run, 0, sizeof(run));
+    run.n = n;
+    run.sparse_b = sparse_b;
+    run.C = C;
+    if (sparse_b ? matrix_csr_from_dense(B, n, n, n, &csr_B) != 0
+                 : write_matrix_to_file((double *)B, n, n, matrix_b_file) != 0) {
+        return -1;
+    }
+    
+    // Work of a row: a dense row of B per nonzero, or the nonzeros of the
+    // sparse rows of B it selects; and one for the row itself
+    long *work = malloc(n * sizeof(long));
+    run.chunk_start = malloc((n + 1) * sizeof(int));
+    run.chunk_of_row = malloc(n * sizeof(int));
+    long total = 0;
+    for (int i = 0; work && i < n; i++) {
+        work[i] = 1;
+        for (long p = csr_A->row_ptr[i]; p < csr_A->row_ptr[i + 1]; p++) {
+            int k = csr_A->col_idx[p];
+            work[i] += sparse_b ? csr_B.row_ptr[k + 1] - csr_B.row_ptr[k] : 1;
+        }
+        total += work[i];
+    }
+    
+    // Cut the rows into chunks of about total / chunks work each; the
+    // largest a chunk's result can be sizes the buffer
+    int target_chunks = (n + granularity - 1) / granularity;
+    long target = (total + target_chunks - 1) / target_chunks;
+    size_t wire_bytes = matrix_sparse_row_bytes(n);
+    for (int i = 0; work && run.chunk_start && run.chunk_of_row && i < n; ) {
+        long sum = 0;
+        size_t bytes = 0;
+        run.chunk_start[run.chunks] = i;
+        run.chunk_of_row[i] = run.chunks++;
+        do {
+            sum += work[i];
+            bytes += sparse_b ? matrix_sparse_row_bytes((work[i] - 1 < n) ? (int)(work[i] - 1) : n)
+                              : (size_t)n * sizeof(double);
+            if (++i < n) {
+                run.chunk_of_row[i] = -1;
+            }
+        } while (i < n && sum + work[i] / 2 < target);
+        wire_bytes = (bytes > wire_bytes) ? bytes : wire_bytes;
+    }
+    if (run.chunk_start) {
+        run.chunk_start[run.chunks] = n;
+    }
+    char *wire = matrix_alloc(wire_bytes, NULL);
+    if (!work || !run.chunk_start || !run.chunk_of_row || !wire) {
+        free(work);
+        free(run.chunk_start);
+        free(run.chunk_of_row);
+        matrix_free(wire, wire_bytes);
+        if (sparse_b) {
+            matrix_csr_free(&csr_B);
+        }
+        return -1;
+    }
+    free(work);
+    
+    printf("Sparse: A has %ld nonzeros (%.2f%%), B %s, %d chunks of about %ld %s\n",
+           csr_A->nnz, 100.0 * csr_A->nnz / ((double)n * n), sparse_b ? "sparse" : "dense",
+           run.chunks, target, sparse_b ? "nonzero products" : "nonzeros of A");
+    
+    cleanup_sparse(port, &run, wire, wire_bytes);
+    start_counter(port, SPARSE_DONE);
+    
+    // Store the sparse rows of A, and of B if it is sparse, pipelined on a
+    // v2 connection
+    int failed = 0;
+    TSH_CONN *put_conn = tsh_connect_v2(port);
+    for (int i = 0; i < n; i++) {
+        struct matrix_sparse_vec row;
+        matrix_csr_row(csr_A, i, &row);
+        failed += submit_keyed_put(put_conn, port, FAMILY_SPARSE_A_ROWS, i, wire,
+                                   matrix_sparse_row_pack(&row, wire)) != 0;
+        if (sparse_b) {
+            matrix_csr_row(&csr_B, i, &row);
+            failed += submit_keyed_put(put_conn, port, FAMILY_SPARSE_B_ROWS, i, wire,
+                                       matrix_sparse_row_pack(&row, wire)) != 0;
+        }
+    }
+    failed += finish_keyed_puts(put_conn);
+    if (put_conn) {
+        tsh_disconnect(put_conn);
+    }
+    if (failed) {
+        printf("Failed to store %d sparse rows\n", failed);
+    }
+    if (sparse_b) {
+        printf("Sparse: B has %ld nonzeros (%.2f%%)\n", csr_B.nnz, 100.0 * csr_B.nnz / ((double)n * n));
+        matrix_csr_free(&csr_B);
+    }
+    
+    for (int c = 0; c < run.chunks; c++) {
+        int task[3] = {run.chunk_start[c], run.chunk_start[c + 1] - run.chunk_start[c], sparse_b};
+        TSH_CONN *conn = tsh_connect(port);
+        if (!conn) {
+            break;
+        }
+        tsh_enqueue(conn, SPARSE_QUEUE, task, sizeof(task));
+        tsh_disconnect(conn);
+    }
+    
+    struct result_collector results = { "C_chunk_", "sparse chunks", run.chunks, &run,
+                                        sparse_result_name, sparse_result_task, add_sparse_chunk };
+    TSH_CONN *sub_conn = subscribe_results(port, &results, wire_bytes);
+    
+    // One worker per core, and no more than there are chunks; the row
+    // kernels are single threaded
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = (run.chunks < cores) ? run.chunks : (int)cores;
+    num_workers = spawn_engine_workers(port, n, matrix_b_file, lease_ms, 1,
+                                       (num_workers > 0) ? num_workers : 1, "sparse", sub_conn);
+    clock_gettime(1, mult_start);
+    int rc = collect_results(port, sub_conn, &results, wire, wire_bytes, &num_workers,
+                             RESULT_IDLE_LEASES * lease_ms / 1000);
+    clock_gettime(1, mult_end);
+    if (sparse_b) {
+        printf("Sparse: C has %ld nonzeros (%.2f%%)\n", run.c_nonzeros,
+               100.0 * run.c_nonzeros / ((double)n * n));
+    }
+    
+    finish_engine_run(port, SPARSE_DONE, num_workers);
+    cleanup_sparse(port, &run, wire, wire_bytes);
+    if (!sparse_b) {
+        unlink(matrix_b_file);
+    }
+    
+    free(run.chunk_start);
+    free(run.chunk_of_row);
+    matrix_free(wire, wire_bytes);
+    return rc;
+}
+
+// Report how far C is from the classical product, computed in double for
+// rows spread over the matrix
+void report_strassen_error(const double *A, const double *B, const double *C, int n, int threads)
+{
+    int samples = (n < STRASSEN_ERROR_ROWS) ? n : STRASSEN_ERROR_ROWS;
+    double *reference = malloc(n * sizeof(double));
+    double max_error = 0.0, max_value = 0.0;
+    
+    if (!reference) {
+        return;
+    }
+    for (int k = 0; k < samples; k++) {
+        int i = (int)((2L * k + 1) * n / (2L * samples));
+        matrix_multiply(MATRIX_F64, threads, 1, n, n, &A[(size_t)i * n], n, B, n, 0, reference, n);
+        for (int j = 0; j < n; j++) {
+            max_error = fmax(max_error, fabs(C[(size_t)i * n + j] - reference[j]));
+            max_value = fmax(max_value, fabs(reference[j]));
+        }
+    }
+    free(reference);
+    
+    printf("Strassen error against the classical product (%d rows): max %.3g, relative %.3g\n",
+           samples, max_error, (max_value > 0.0) ? max_error / max_value : 0.0);
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        printf("Usage: %s <port> [size] [granularity]\n", argv[0]);
+        printf("Usage: %s <port> [size] [granularity] [lease_ms] [threads] [pack_b] [f64|f32|i8|i16]"
+               " [rows|strassen|tiles|summa|spmm|spgemm] [crossover|tile_cols|grid|density]"
+               " [tile_k|panel|csr_file]\n", argv[0]);
         return 1;
     }
     unsigned short port = atoi(argv[1]);
     int rows = DEFAULT_MATRIX_SIZE, cols = DEFAULT_MATRIX_SIZE;
     int granularity = 1; // Default granularity: one row per work tuple
+    int lease_ms = DEFAULT_LEASE_MS;
+    int threads = 1; // Compute threads per worker process
+    int pack_b = 0; // Write B in the panel layout the workers' kernel reads
+    int elem = MATRIX_F64; // Element type of A, B and the result rows on the wire
+    int engine = ENGINE_ROWS;
+    int crossover = 0; // Strassen: blocks this large are split further; 0: measure it
+    int tile_cols = KERNEL_NC; // Tiles: columns of a C tile; its rows are the granularity
+    int tile_k = 0; // Tiles: depth of a k block; 0: all of k
+    int grid = 0; // SUMMA: workers along each side of the grid; 0: as the cores allow
+    int panel = 0; // SUMMA: columns of A and rows of B per step; 0: a block
+    double density = DEFAULT_DENSITY; // Sparse: percent nonzeros of the matrices generated
+    const char *csr_file = NULL; // Sparse: A read from this CSR file instead
     
     if (argc >= 3)
     {
@@ -370,13 +1522,148 @@ int main(int argc, char **argv)
             granularity = rows;
         }
     }
+
+    if (argc >= 5)
+    {
+        lease_ms = atoi(argv[4]);
+        if (lease_ms <= 0) {
+            printf("Invalid lease %d ms, using %d instead\n", lease_ms, DEFAULT_LEASE_MS);
+            lease_ms = DEFAULT_LEASE_MS;
+        }
+    }
+
+    if (argc >= 6)
+    {
+        threads = atoi(argv[5]);
+        if (threads <= 0) {
+            printf("Invalid thread count %d, using 1 instead\n", threads);
+            threads = 1;
+        }
+    }
+
+    if (argc >= 7)
+    {
+        pack_b = atoi(argv[6]) != 0;
+    }
+
+    if (argc >= 8)
+    {
+        elem = matrix_elem_parse(argv[7]);
+        if (elem < 0) {
+            printf("Unknown precision %s, using %s instead\n", argv[7], matrix_elem_name(MATRIX_F64));
+            elem = MATRIX_F64;
+        }
+    }
+
+    if (argc >= 9)
+    {
+        if (strcmp(argv[8], "strassen") == 0) {
+            engine = ENGINE_STRASSEN;
+        } else if (strcmp(argv[8], "tiles") == 0) {
+            engine = ENGINE_TILES;
+        } else if (strcmp(argv[8], "summa") == 0) {
+            engine = ENGINE_SUMMA;
+        } else if (strcmp(argv[8], "spmm") == 0) {
+            engine = ENGINE_SPMM;
+        } else if (strcmp(argv[8], "spgemm") == 0) {
+            engine = ENGINE_SPGEMM;
+        } else if (strcmp(argv[8], "rows") != 0) {
+            printf("Unknown engine %s, using rows instead\n", argv[8]);
+        }
+    }
+
+    if (argc >= 10 && engine == ENGINE_TILES)
+    {
+        tile_cols = atoi(argv[9]);
+        if (tile_cols <= 0) {
+            printf("Invalid tile width %d, using %d instead\n", tile_cols, KERNEL_NC);
+            tile_cols = KERNEL_NC;
+        }
+    }
+    else if (argc >= 10 && (engine == ENGINE_SPMM || engine == ENGINE_SPGEMM))
+    {
+        density = atof(argv[9]);
+        if (density <= 0.0 || density > 100.0) {
+            printf("Invalid density %s, using %.1f%% instead\n", argv[9], DEFAULT_DENSITY);
+            density = DEFAULT_DENSITY;
+        }
+    }
+    else if (argc >= 10 && engine == ENGINE_SUMMA)
+    {
+        grid = atoi(argv[9]);
+        if (grid < 0) {
+            printf("Invalid grid %d, sizing it to the cores instead\n", grid);
+            grid = 0;
+        }
+    }
+    else if (argc >= 10)
+    {
+        crossover = atoi(argv[9]);
+        if (crossover != 0 && crossover < 2) {
+            printf("Invalid crossover %d, measuring it instead\n", crossover);
+            crossover = 0;
+        }
+    }
+    tile_cols = (tile_cols < cols) ? tile_cols : cols;
+    if (engine == ENGINE_SUMMA && grid == 0) {
+        // The largest square of worker processes of 'threads' threads the cores hold
+        grid = (int)sqrt((double)(sysconf(_SC_NPROCESSORS_ONLN) / threads));
+        grid = (grid > 0) ? grid : 1;
+    }
+    grid = (grid < rows) ? grid : rows;
+
+    if (argc >= 11 && (engine == ENGINE_SPMM || engine == ENGINE_SPGEMM))
+    {
+        csr_file = argv[10];
+    }
+    else if (argc >= 11 && engine == ENGINE_SUMMA)
+    {
+        panel = atoi(argv[10]);
+        if (panel < 0) {
+            printf("Invalid panel %d, stepping a block at a time instead\n", panel);
+            panel = 0;
+        }
+    }
+    else if (argc >= 11)
+    {
+        tile_k = atoi(argv[10]);
+        if (tile_k < 0) {
+            printf("Invalid k block %d, using all of k instead\n", tile_k);
+            tile_k = 0;
+        }
+    }
+
+    // A CSR file gives the size of the run
+    struct matrix_csr csr_A = { 0, 0, 0, NULL, NULL, NULL };
+    if (csr_file) {
+        if (matrix_csr_read(csr_file, &csr_A) != 0 || csr_A.rows != csr_A.cols) {
+            printf("Failed to read a square CSR matrix from %s\n", csr_file);
+            matrix_csr_free(&csr_A);
+            return 1;
+        }
+        rows = cols = csr_A.rows;
+        granularity = (granularity < rows) ? granularity : rows;
+    }
+    if ((engine == ENGINE_SPMM || engine == ENGINE_SPGEMM) && elem != MATRIX_F64) {
+        printf("The sparse engines compute in %s, not %s\n", matrix_elem_name(MATRIX_F64),
+               matrix_elem_name(elem));
+        elem = MATRIX_F64;
+    }
+    if (elem == MATRIX_I8 && cols >= MATRIX_I8_MAX_K) {
+        printf("%s sums overflow at size %d, using %s instead\n", matrix_elem_name(MATRIX_I8), cols,
+               matrix_elem_name(MATRIX_I16));
+        elem = MATRIX_I16;
+    }
+    // The master works in doubles; rows are converted on their way out and in
+    int elem_size = matrix_elem_size(elem);
+    int result_type = matrix_result_type(elem);
+    int result_size = matrix_elem_size(result_type);
     
-    printf("Starting matrix multiplication with size %dx%d, granularity %d\n", 
-           rows, cols, granularity);
+    printf("Starting matrix multiplication with size %dx%d, granularity %d, precision %s\n", 
+           rows, cols, granularity, matrix_elem_name(elem));
     
     // Set up signal handler for clean termination
     signal(SIGINT, handle_sigint);
-    signal(SIGALRM, handle_alarm);
     
     srand(time(NULL));
     TSH_CONN *conn = tsh_connect(port);
@@ -386,33 +1673,125 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    // Allocate matrices A and B for input, and C for result
-    double *A = malloc(rows * cols * sizeof(double));
-    double *B = malloc(rows * cols * sizeof(double));
-    double *C = malloc(rows * cols * sizeof(double));
-    if (!A || !B || !C)
+    // Allocate matrices A and B for input, and C for result, on huge pages
+    // where the kernel has them; A read from a CSR file stays in CSR
+    size_t matrix_bytes = (size_t)rows * cols * sizeof(double);
+    int backing_A = MATRIX_MEM_PAGES, backing_B, backing_C;
+    double *A = csr_file ? NULL : matrix_alloc(matrix_bytes, &backing_A);
+    double *B = matrix_alloc(matrix_bytes, &backing_B);
+    double *C = matrix_alloc(matrix_bytes, &backing_C);
+    if ((!A && !csr_file) || !B || !C)
     {
         printf("Failed to allocate matrices.\n");
         tsh_disconnect(conn);
-        free(A);
-        free(B);
-        free(C);
+        matrix_free(A, matrix_bytes);
+        matrix_free(B, matrix_bytes);
+        matrix_free(C, matrix_bytes);
         return 1;
     }
+    printf("Matrix buffers: A %s%s, B on %s, C on %s pages\n", A ? "on " : "in CSR",
+           A ? matrix_backing_name(backing_A) : "", matrix_backing_name(backing_B),
+           matrix_backing_name(backing_C));
     
-    // Generate random input matrices
-    generate_matrix(A, rows, cols);
-    generate_matrix(B, rows, cols);
+    // Generate random input matrices, mostly zeros for the sparse engines,
+    // which take A in CSR; A may come from a CSR file instead
+    if (csr_file) {
+        // Read above
+    } else if (engine == ENGINE_SPMM || engine == ENGINE_SPGEMM) {
+        generate_sparse_matrix(A, rows, cols, density);
+        if (matrix_csr_from_dense(A, rows, cols, cols, &csr_A) != 0) {
+            printf("Failed to allocate matrices.\n");
+            tsh_disconnect(conn);
+            matrix_free(A, matrix_bytes);
+            matrix_free(B, matrix_bytes);
+            matrix_free(C, matrix_bytes);
+            return 1;
+        }
+    } else {
+        generate_matrix(A, rows, cols);
+    }
+    if (engine == ENGINE_SPGEMM) {
+        generate_sparse_matrix(B, rows, cols, density);
+    } else {
+        generate_matrix(B, rows, cols);
+    }
 
     tsh_disconnect(conn);
 
-    // Write matrix B to a file for workers to read directly
+    // Strassen engine, where its crossover is given or measured to pay off
+    // at this size; the master splits and combines, the workers multiply
+    if (engine == ENGINE_STRASSEN) {
+        matrix_kernel_init();
+        if (crossover == 0) {
+            int largest = (rows < STRASSEN_MEASURE_MAX) ? rows : STRASSEN_MEASURE_MAX;
+            crossover = strassen_crossover(elem, threads, largest);
+            if (crossover) {
+                printf("Measured Strassen crossover: %d\n", crossover);
+            } else {
+                printf("Strassen recursion does not beat the classical multiply up to size %d,"
+                       " using rows instead\n", largest);
+                engine = ENGINE_ROWS;
+            }
+        }
+    }
+    // Engines the master drives itself, start to finish
+    if (engine != ENGINE_ROWS) {
+        struct timespec start_time, end_time, mult_start_time, mult_end_time;
+        clock_gettime(1, &start_time);
+        int rc;
+        if (engine == ENGINE_STRASSEN) {
+            rc = multiply_strassen(port, A, B, C, rows, elem, crossover, lease_ms, threads,
+                                   &mult_start_time, &mult_end_time);
+        } else if (engine == ENGINE_TILES) {
+            rc = multiply_tiles(port, A, B, C, rows, elem, granularity, tile_cols, tile_k,
+                                lease_ms, threads, &mult_start_time, &mult_end_time);
+        } else if (engine == ENGINE_SUMMA) {
+            rc = multiply_summa(port, A, B, C, rows, elem, grid, panel, threads,
+                                &mult_start_time, &mult_end_time);
+        } else {
+            rc = multiply_sparse(port, &csr_A, B, C, rows, engine == ENGINE_SPGEMM, granularity,
+                                 lease_ms, &mult_start_time, &mult_end_time);
+            matrix_csr_free(&csr_A);
+        }
+        clock_gettime(1, &end_time);
+        if (rc != 0) {
+            printf("Multiplication failed\n");
+            matrix_free(A, matrix_bytes);
+            matrix_free(B, matrix_bytes);
+            matrix_free(C, matrix_bytes);
+            return 1;
+        }
+        
+        double elapsed = (end_time.tv_sec - start_time.tv_sec) +
+                         (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+        double mult_elapsed = (mult_end_time.tv_sec - mult_start_time.tv_sec) +
+                              (mult_end_time.tv_nsec - mult_start_time.tv_nsec) / 1e9;
+        printf("Matrix multiplication complete.\n");
+        printf("Total time: %.3f seconds\n", elapsed);
+        printf("Pure multiplication time: %.6f seconds\n", mult_elapsed);
+        if (engine == ENGINE_STRASSEN) {
+            report_strassen_error(A, B, C, rows, threads);
+        }
+        save_results_to_csv(rows, granularity, elapsed, mult_elapsed);
+        print_matrix(C, rows, cols);
+        
+        matrix_free(A, matrix_bytes);
+        matrix_free(B, matrix_bytes);
+        matrix_free(C, matrix_bytes);
+        return 0;
+    }
+
+    // Write matrix B to a file for workers to read directly: plain doubles,
+    // or with a header giving the element type and packing
     const char *matrix_b_file = "matrix_b.dat";
-    if (write_matrix_to_file(B, rows, cols, matrix_b_file) != 0) {
+    int b_written = (pack_b || elem != MATRIX_F64)
+                        ? write_typed_matrix_to_file(B, elem, rows, cols, pack_b ? KERNEL_NC : 0, matrix_b_file)
+                        : write_matrix_to_file(B, rows, cols, matrix_b_file);
+    if (b_written != 0) {
         printf("Failed to write matrix B to file\n");
-        free(A);
-        free(B);
-        free(C);
+        matrix_free(A, matrix_bytes);
+        matrix_free(B, matrix_bytes);
+        matrix_free(C, matrix_bytes);
         return 1;
     }
 
@@ -420,29 +1799,62 @@ int main(int argc, char **argv)
     struct timespec start_time, end_time;
     clock_gettime(1, &start_time);
 
-    // Allocate work tracking structures
-    num_chunks = (rows + granularity - 1) / granularity;
-    work_chunks = calloc(num_chunks, sizeof(work_tracker_t));
-    if (!work_chunks) {
-        printf("Failed to allocate work tracking structures\n");
-        free(A);
-        free(B);
-        free(C);
+    int num_chunks = (rows + granularity - 1) / granularity;
+
+    // Matrix A as it goes into the tuple space
+    size_t a_wire_bytes = (size_t)rows * cols * elem_size;
+    char *A_wire = (elem == MATRIX_F64) ? (char *)A : matrix_alloc(a_wire_bytes, NULL);
+    if (!A_wire) {
+        printf("Failed to allocate matrices.\n");
+        matrix_free(A, matrix_bytes);
+        matrix_free(B, matrix_bytes);
+        matrix_free(C, matrix_bytes);
         return 1;
     }
+    if (A_wire != (char *)A) {
+        size_t inexact = matrix_from_double(elem, A, A_wire, (size_t)rows * cols);
+        if (inexact) {
+            printf("Warning: %zu elements of matrix A are not exact in %s\n", inexact,
+                   matrix_elem_name(elem));
+        }
+    }
 
-    // Loop: Store all rows of matrix A (per-row connect/put/disconnect)
-    for (int i = 0; i < rows; ++i)
+    // Store all rows of matrix A. On a v2 connection the puts are
+    // pipelined: every row goes out before the first reply is awaited.
+    int a_rows_put = 0;
+    TSH_CONN *a_conn = tsh_connect_v2(port);
+    if (a_conn && a_conn->version == TSH_V2) {
+        tsh_completion done;
+        for (int i = 0; i < rows; ++i) {
+            if (tsh_submit_kput(a_conn, FAMILY_A_ROWS, i, 1, &A_wire[(size_t)i * cols * elem_size],
+                                (unsigned long)cols * elem_size) == 0)
+                break;
+        }
+        while (tsh_wait(a_conn, &done, -1) == 1) {
+            if (done.status == 0)
+                a_rows_put++;
+        }
+    }
+    if (a_conn)
+        tsh_disconnect(a_conn);
+
+    // Older server, or a pipelined put failed: per-row connect/put/disconnect
+    for (int i = (a_rows_put == rows) ? rows : 0; i < rows; ++i)
     {
         TSH_CONN *conn = tsh_connect(port);
         if (!conn) {
             break;
         }
-        put_matrix_row(conn, "A", i, &A[i * cols], cols);
+        put_matrix_row(conn, FAMILY_A_ROWS, i, &A_wire[(size_t)i * cols * elem_size], cols, elem_size);
         tsh_disconnect(conn);
     }
+    if (A_wire != (char *)A) {
+        matrix_free(A_wire, a_wire_bytes);
+    }
 
-    // Loop: Store all work tuples (per-row connect/put/disconnect)
+    // Loop: Queue all work chunks (per-chunk connect/enqueue/disconnect);
+    // workers dequeue them in order, one round trip each
+    drain_work_queue(port, WORK_QUEUE);
     int chunk_idx = 0;
     for (int i = 0; i < rows; i += granularity)
     {
@@ -452,22 +1864,9 @@ int main(int argc, char **argv)
         }
         int num_rows = (i + granularity <= rows) ? granularity : (rows - i);
         
-        // Use chunk_idx for naming, but still store the actual start row
-        char chunk_name[64];
-        snprintf(chunk_name, sizeof(chunk_name), "work_chunk_%d", chunk_idx);
-        int work_data[2] = {i, num_rows};
-        
-        tsh_put(conn, chunk_name, 1, work_data, sizeof(work_data));
+        enqueue_work_chunk(conn, i, num_rows);
         tsh_disconnect(conn);
         
-        // Track work chunk information
-        work_chunks[chunk_idx].chunk_id = chunk_idx;
-        work_chunks[chunk_idx].start_row = i;
-        work_chunks[chunk_idx].num_rows = num_rows;
-        work_chunks[chunk_idx].issue_time = time(NULL);
-        work_chunks[chunk_idx].attempts = 1;
-        work_chunks[chunk_idx].completed = 0;
-        
         chunk_idx++;
     }
     
@@ -480,15 +1879,27 @@ int main(int argc, char **argv)
             tsh_disconnect(conn);
         }
     }
+    start_counter(port, ROWS_DONE_COUNTER);
 
-    // Calculate number of workers needed (ceiling of rows/granularity)
-    int num_workers = (num_chunks < sysconf(_SC_NPROCESSORS_ONLN)) ? 
-                      num_chunks : sysconf(_SC_NPROCESSORS_ONLN);
+    // One worker per 'threads' cores (ceiling), and no more than there are chunks
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long worker_slots = (cores + threads - 1) / threads;
+    int num_workers = (num_chunks < worker_slots) ? num_chunks : worker_slots;
     
     // Ensure at least one worker
     num_workers = (num_workers > 0) ? num_workers : 1;
     
-    printf("Created %d work chunks, spawning %d worker processes\n", num_chunks, num_workers);
+    printf("Created %d work chunks, spawning %d worker processes of %d threads\n",
+           num_chunks, num_workers, threads);
+    
+    // Subscribe to result rows before any worker can store one. Each note
+    // carries the whole row, so collection needs no polling; if the
+    // subscription fails we fall back to sweeping the rows.
+    TSH_CONN *sub_conn = tsh_connect(port);
+    if (sub_conn && tsh_subscribe(sub_conn, "C_row_", (unsigned long)cols * result_size) != 0) {
+        tsh_disconnect(sub_conn);
+        sub_conn = NULL;
+    }
     
     // Spawn worker processes
     for (int i = 0; i < num_workers; ++i)
@@ -496,12 +1907,20 @@ int main(int argc, char **argv)
         pid_t pid = fork();
         if (pid == 0)
         {
-            // Child: exec worker
+            // Child: exec worker, without the subscription
+            if (sub_conn) {
+                close(sub_conn->sock);
+            }
             char port_str[16];
             char rows_str[16];
+            char lease_str[16];
+            char threads_str[16];
             snprintf(port_str, sizeof(port_str), "%d", port);
             snprintf(rows_str, sizeof(rows_str), "%d", rows);
-            execl("./matrix_worker", "matrix_worker", port_str, rows_str, matrix_b_file, (char *)NULL);
+            snprintf(lease_str, sizeof(lease_str), "%d", lease_ms);
+            snprintf(threads_str, sizeof(threads_str), "%d", threads);
+            execl("./matrix_worker", "matrix_worker", port_str, rows_str, matrix_b_file, lease_str,
+                  threads_str, (char *)NULL);
             perror("execl failed");
             exit(1);
         }
@@ -544,49 +1963,79 @@ int main(int argc, char **argv)
     struct timespec last_check_time;
     clock_gettime(1, &last_check_time);
     
-    // Set an alarm for work reissue checks
-    alarm(5);  // Check every 5 seconds
-    
-    // Continue until all rows are collected or user interrupts
+    // Work lost to a failed worker is redelivered by the server once its
+    // lease expires, so collection only has to watch for results
     while (rows_collected < rows && continue_collecting) {
         had_progress = 0;
         
-        // Check for timed-out work and reissue if needed
-        if (alarm_triggered) {
-            check_and_reissue_work(port, 10);  // Timeout set to 10 seconds
+        // Take rows as the server announces them
+        int note = 0;
+        while (sub_conn && rows_collected < rows) {
+            char note_name[TUPLENAME_LEN];
+            unsigned long note_len = cols * sizeof(double);
+            int i;
+            
+            note = tsh_next_note(sub_conn, note_name, NULL, (char*)row_buffer, &note_len,
+                                 had_progress ? 0 : NOTE_WAIT_MS);
+            if (note != 1) {
+                break;
+            }
+            if (sscanf(note_name, "C_row_%d", &i) != 1 || i < 0 || i >= rows || received_rows[i]) {
+                continue;
+            }
+            had_progress = 1;
+            
+            matrix_to_double(result_type, row_buffer, &C[i * cols], note_len / result_size);
+            received_rows[i] = 1;
+            rows_collected++;
+            
+            if (rows_collected == rows) {
+                clock_gettime(1, &mult_end_time);
+            }
+            
+            if (rows_collected % 10 == 0 || rows_collected == rows) {
+                printf("Collected %d/%d result rows\n", rows_collected, rows);
+            }
+        }
+        if (note < 0) {
+            printf("Lost the result subscription, polling instead\n");
+            tsh_disconnect(sub_conn);
+            sub_conn = NULL;
+        }
+        if (had_progress) {
+            clock_gettime(1, &last_progress_time);
+            idle_time = 0.0;
+            continue;
+        }
+        
+        // Nothing announced for a while (or no subscription): only scan the
+        // rows when the workers have stored ones we have not seen; the
+        // counter costs one small round trip
+        long rows_done = rows;
+        TSH_CONN *count_conn = tsh_connect(port);
+        if (count_conn) {
+            if (tsh_incr(count_conn, ROWS_DONE_COUNTER, 0, &rows_done) != 0)
+                rows_done = rows;
+            tsh_disconnect(count_conn);
         }
         
-        // Try each row in order
-        for (int i = 0; i < rows && rows_collected < rows; i++) {
+        // Try each row in order, all on one connection
+        TSH_CONN *scan_conn = (rows_done > rows_collected) ? tsh_connect_v2(port) : NULL;
+        for (int i = 0; scan_conn && i < rows && rows_collected < rows && rows_done > rows_collected; i++) {
             // Skip rows we've already received
             if (received_rows[i]) {
                 continue;
             }
             
-            // Create a fresh connection for each row check
-            TSH_CONN *conn = tsh_connect(port);
-            if (!conn) {
-                continue;
-            }
-            
-            int cols_read = 0;
-            if (try_get_result_row(conn, i, row_buffer, cols, &cols_read) == 0) {
+            unsigned long len_read = 0;
+            if (try_get_result_row(scan_conn, i, row_buffer, cols * sizeof(double), &len_read) == 0) {
                 had_progress = 1;
                 
                 // Copy the row data to the result matrix
-                memcpy(&C[i * cols], row_buffer, cols_read * sizeof(double));
+                matrix_to_double(result_type, row_buffer, &C[i * cols], len_read / result_size);
                 received_rows[i] = 1;
                 rows_collected++;
                 
-                // Mark the corresponding work chunk as completed
-                for (int j = 0; j < num_chunks; j++) {
-                    if (work_chunks[j].start_row <= i && 
-                        i < work_chunks[j].start_row + work_chunks[j].num_rows) {
-                        work_chunks[j].completed = 1;
-                        break;
-                    }
-                }
-                
                 // If this is the last row, record the end time for pure multiplication
                 if (rows_collected == rows) {
                     clock_gettime(1, &mult_end_time);
@@ -600,8 +2049,9 @@ int main(int argc, char **argv)
                 clock_gettime(1, &last_progress_time);
                 idle_time = 0.0;
             }
-            
-            tsh_disconnect(conn);
+        }
+        if (scan_conn) {
+            tsh_disconnect(scan_conn);
         }
         
         // If no progress was made in this iteration, check idle time
@@ -637,12 +2087,18 @@ int main(int argc, char **argv)
                 break;
             }
             
-            // Sleep a bit to avoid hammering the tuple space
-            usleep(100000); // 100ms
+            // Sleep a bit to avoid hammering the tuple space; waiting
+            // for a note already did
+            if (!sub_conn) {
+                usleep(100000); // 100ms
+            }
         }
     }
     
-    // Clean up row tracking and buffer
+    // Clean up row tracking, buffer and subscription
+    if (sub_conn) {
+        tsh_disconnect(sub_conn);
+    }
     free(received_rows);
     free(row_buffer);
     
@@ -671,15 +2127,14 @@ int main(int argc, char **argv)
     print_matrix(C, rows, cols);
     
     // Clean up tuple space before exiting
-    cleanup_tuple_space(port, rows, cols, granularity);
+    cleanup_tuple_space(port, rows, cols);
     
     // Also remove the matrix_b file we created
     unlink(matrix_b_file);
     
     // Clean up
-    free(A);
-    free(B);
-    free(C);
-    free(work_chunks);
+    matrix_free(A, matrix_bytes);
+    matrix_free(B, matrix_bytes);
+    matrix_free(C, matrix_bytes);
     return 0;
 }
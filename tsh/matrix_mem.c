@@ -0,0 +1,164 @@
+/*.........................................................................*/
+/*                  MATRIX_MEM.C ------> Huge-page matrix buffers           */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "matrix_mem.h"
+
+/* A buffer of a huge page or more is a whole number of them; a smaller
+   one would gain nothing from a huge page and stays on ordinary pages */
+static size_t mem_round(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (bytes == 0)
+        bytes = 1;
+    if (bytes < MATRIX_HUGE_PAGE)
+        return (bytes + page - 1) & ~(page - 1);
+    return (bytes + MATRIX_HUGE_PAGE - 1) & ~(MATRIX_HUGE_PAGE - 1);
+}
+
+/* Kilobytes of field (AnonHugePages, FilePmdMapped) that /proc/self/smaps
+   gives for the mappings overlapping len bytes at addr; -1 if it cannot be
+   read. A mapping merged with its neighbours counts theirs too */
+static long mem_smaps_kb(const void *addr, size_t len, const char *field)
+{
+    uintptr_t first = (uintptr_t)addr, last = first + len;
+    unsigned long start, end;
+    size_t field_len = strlen(field);
+    char line[512];
+    long kb, total = 0;
+    int in_range = 0;
+    FILE *f = fopen("/proc/self/smaps", "r");
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            in_range = start < last && end > first;
+        else if (in_range && strncmp(line, field, field_len) == 0 && line[field_len] == ':' &&
+                 sscanf(line + field_len + 1, "%ld", &kb) == 1)
+            total += kb;
+    }
+    fclose(f);
+    return total;
+}
+
+/* The backing of a region given the huge page hint: THP only if smaps shows
+   huge pages in it, which the caller must have faulted in */
+static int mem_thp_backing(const void *addr, size_t len, const char *field)
+{
+    long kb = mem_smaps_kb(addr, len, field);
+
+    if (kb < 0)
+        return MATRIX_MEM_THP_ADVISED;
+    return kb > 0 ? MATRIX_MEM_THP : MATRIX_MEM_PAGES;
+}
+
+void *matrix_alloc(size_t bytes, int *backing)
+{
+    size_t len = mem_round(bytes);
+    char *map, *aligned;
+    int got = MATRIX_MEM_PAGES;
+
+    if (len < MATRIX_HUGE_PAGE) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return NULL;
+        if (backing)
+            *backing = MATRIX_MEM_PAGES;
+        return map;
+    }
+
+#ifdef MAP_HUGETLB
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+        if (backing)
+            *backing = MATRIX_MEM_HUGETLB;
+        return map;
+    }
+#endif
+
+    /* Over-map by a huge page and trim to a 2 MB boundary, so that
+       khugepaged can back every page of the buffer */
+    map = mmap(NULL, len + MATRIX_HUGE_PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    aligned = (char *)(((uintptr_t)map + MATRIX_HUGE_PAGE - 1) & ~(uintptr_t)(MATRIX_HUGE_PAGE - 1));
+    if (aligned > map)
+        munmap(map, aligned - map);
+    munmap(aligned + len, map + MATRIX_HUGE_PAGE - aligned);
+
+    /* The hint being accepted says nothing of the pages obtained: touch
+       each huge page, as the caller would have, so that a fault can place
+       one if THP is enabled and unfragmented memory is free, then look */
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, len, MADV_HUGEPAGE) == 0) {
+        size_t off;
+
+        for (off = 0; off < len; off += MATRIX_HUGE_PAGE)
+            aligned[off] = 0;
+        got = mem_thp_backing(aligned, len, "AnonHugePages");
+    }
+#endif
+    if (backing)
+        *backing = got;
+    return aligned;
+}
+
+void matrix_free(void *buffer, size_t bytes)
+{
+    if (buffer)
+        munmap(buffer, mem_round(bytes));
+}
+
+void *matrix_map_file(int fd, size_t len, int populate, int hugepage, int *backing)
+{
+    int flags = MAP_SHARED;
+    void *map;
+
+#ifdef MAP_POPULATE
+    if (populate)
+        flags |= MAP_POPULATE;
+#endif
+    map = mmap(NULL, len, PROT_READ, flags, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    /* Page cache pages are huge only where the kernel supports read-only
+       THP for files; the hint is harmless elsewhere. Only a prefaulted
+       mapping can be looked at; the pages of any other come later */
+    *backing = MATRIX_MEM_PAGES;
+#ifdef MADV_HUGEPAGE
+    if (hugepage && madvise(map, len, MADV_HUGEPAGE) == 0)
+        *backing = populate ? mem_thp_backing(map, len, "FilePmdMapped") : MATRIX_MEM_THP_ADVISED;
+#endif
+    return map;
+}
+
+void matrix_unmap_file(void *map, size_t len)
+{
+    if (map)
+        munmap(map, len);
+}
+
+const char *matrix_backing_name(int backing)
+{
+    switch (backing) {
+    case MATRIX_MEM_HUGETLB:
+        return "hugetlb";
+    case MATRIX_MEM_THP:
+        return "thp";
+    case MATRIX_MEM_THP_ADVISED:
+        return "thp-advised";
+    default:
+        return "4k";
+    }
+}
@@ -0,0 +1,43 @@
+/*.........................................................................*/
+/*                  MATRIX_MEM.H ------> Huge-page matrix buffers           */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_MEM_H
+#define MATRIX_MEM_H
+
+#include <stddef.h>
+
+/* Size of the pages the buffers are placed on */
+#define MATRIX_HUGE_PAGE (2UL << 20)
+
+/* Backing a buffer or mapping obtained, best first */
+#define MATRIX_MEM_HUGETLB     0    /* explicit hugetlbfs pages */
+#define MATRIX_MEM_THP         1    /* transparent huge pages, seen in smaps */
+#define MATRIX_MEM_THP_ADVISED 2    /* huge page hint accepted, pages not seen */
+#define MATRIX_MEM_PAGES       3    /* ordinary pages */
+
+/* Allocates bytes on 2 MB pages if the kernel has any to give, trying
+   hugetlb, then transparent huge pages on a 2 MB aligned region, then
+   ordinary pages; buffers under 2 MB always get ordinary pages. The
+   backing obtained goes to *backing if not NULL; transparent huge pages
+   are faulted in to see whether they were obtained. The memory is zeroed.
+   NULL if nothing could be mapped */
+void *matrix_alloc(size_t bytes, int *backing);
+
+/* Releases a buffer of matrix_alloc; bytes as allocated */
+void matrix_free(void *buffer, size_t bytes);
+
+/* Maps len bytes of an open file read-only and shared, prefaulted if
+   populate is set, with the transparent huge page hint if hugepage is set;
+   the backing obtained goes to *backing, as far as a mapping not
+   prefaulted can tell. NULL on failure */
+void *matrix_map_file(int fd, size_t len, int populate, int hugepage, int *backing);
+
+/* Releases a mapping of matrix_map_file */
+void matrix_unmap_file(void *map, size_t len);
+
+/* "hugetlb", "thp", "thp-advised" or "4k" */
+const char *matrix_backing_name(int backing);
+
+#endif /* MATRIX_MEM_H */
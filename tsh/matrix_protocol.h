@@ -0,0 +1,48 @@
+/*.........................................................................*/
+/*                  MATRIX_PROTOCOL.H ------> Master/worker tuple names     */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_PROTOCOL_H
+#define MATRIX_PROTOCOL_H
+
+/* Row engine: server-side FIFO of {start_row, num_rows} chunks, the count
+   of result rows stored, and the key family of the rows of A, indexed by
+   row (the tile engine stores its A row segments there too) */
+#define WORK_QUEUE        "work_chunks"
+#define ROWS_DONE_COUNTER "C_rows_done"
+#define FAMILY_A_ROWS     1
+
+/* Strassen engine: queue of {index, size, type} base-case products, key
+   families of their operand pairs and of the products, and the counter the
+   master raises once it has every product */
+#define STRASSEN_QUEUE           "strassen_tasks"
+#define FAMILY_STRASSEN_OPERANDS 2
+#define FAMILY_STRASSEN_PRODUCTS 3
+#define STRASSEN_DONE            "strassen_done"
+
+/* Tile engine: queue of struct matrix_tile_task, key family of the blocks
+   of B, and the master's done counter */
+#define TILE_QUEUE     "tile_tasks"
+#define FAMILY_B_TILES 4
+#define TILES_DONE     "tiles_done"
+
+/* SUMMA engine: the grid, the counter ranks are drawn from, and key
+   families of the blocks of A and B and of the panels the workers
+   broadcast to each other at each step */
+#define SUMMA_GRID            "summa_grid"
+#define SUMMA_RANK            "summa_rank"
+#define FAMILY_SUMMA_A        5
+#define FAMILY_SUMMA_B        6
+#define FAMILY_SUMMA_A_PANELS 7
+#define FAMILY_SUMMA_B_PANELS 8
+
+/* Sparse engine: queue of {start_row, num_rows, sparse_b} chunks of about
+   equal nonzero work, key families of the sparse rows of A and of B (when
+   B is sparse), and the master's done counter */
+#define SPARSE_QUEUE         "sparse_tasks"
+#define FAMILY_SPARSE_A_ROWS 9
+#define FAMILY_SPARSE_B_ROWS 10
+#define SPARSE_DONE          "sparse_done"
+
+#endif /* MATRIX_PROTOCOL_H */
@@ -0,0 +1,272 @@
+/*.........................................................................*/
+/*                  MATRIX_SPARSE.C ------> CSR matrices and row kernels    */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix_sparse.h"
+
+int matrix_csr_from_dense(const double *dense, int rows, int cols, int ld, struct matrix_csr *csr)
+{
+    long nnz = 0, p = 0;
+    int i, j;
+
+    for (i = 0; i < rows; i++)
+        for (j = 0; j < cols; j++)
+            nnz += (dense[(size_t)i * ld + j] != 0.0);
+
+    csr->rows = rows;
+    csr->cols = cols;
+    csr->nnz = nnz;
+    csr->row_ptr = malloc((rows + 1) * sizeof(long));
+    csr->col_idx = malloc((nnz ? nnz : 1) * sizeof(int));
+    csr->val = malloc((nnz ? nnz : 1) * sizeof(double));
+    if (!csr->row_ptr || !csr->col_idx || !csr->val) {
+        matrix_csr_free(csr);
+        return -1;
+    }
+
+    for (i = 0; i < rows; i++) {
+        csr->row_ptr[i] = p;
+        for (j = 0; j < cols; j++) {
+            double v = dense[(size_t)i * ld + j];
+
+            if (v != 0.0) {
+                csr->col_idx[p] = j;
+                csr->val[p++] = v;
+            }
+        }
+    }
+    csr->row_ptr[rows] = p;
+    return 0;
+}
+
+void matrix_csr_free(struct matrix_csr *csr)
+{
+    free(csr->row_ptr);
+    free(csr->col_idx);
+    free(csr->val);
+    csr->row_ptr = NULL;
+    csr->col_idx = NULL;
+    csr->val = NULL;
+}
+
+void matrix_csr_to_dense(const struct matrix_csr *csr, double *dense, int ld)
+{
+    int i;
+    long p;
+
+    for (i = 0; i < csr->rows; i++) {
+        double *row = dense + (size_t)i * ld;
+
+        memset(row, 0, csr->cols * sizeof(double));
+        for (p = csr->row_ptr[i]; p < csr->row_ptr[i + 1]; p++)
+            row[csr->col_idx[p]] = csr->val[p];
+    }
+}
+
+int matrix_csr_read(const char *path, struct matrix_csr *csr)
+{
+    struct matrix_csr_file_header header;
+    long long *row_ptr = NULL;
+    FILE *f = fopen(path, "rb");
+    int i, ok;
+    long p;
+
+    memset(csr, 0, sizeof(*csr));
+    if (!f)
+        return -1;
+    ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == MATRIX_CSR_MAGIC &&
+         header.rows > 0 && header.cols > 0 && header.nnz >= 0;
+    if (ok) {
+        csr->rows = header.rows;
+        csr->cols = header.cols;
+        csr->nnz = (long)header.nnz;
+        row_ptr = malloc((header.rows + 1) * sizeof(long long));
+        csr->row_ptr = malloc((header.rows + 1) * sizeof(long));
+        csr->col_idx = malloc((csr->nnz ? csr->nnz : 1) * sizeof(int));
+        csr->val = malloc((csr->nnz ? csr->nnz : 1) * sizeof(double));
+        ok = row_ptr && csr->row_ptr && csr->col_idx && csr->val &&
+             fread(row_ptr, sizeof(long long), header.rows + 1, f) == (size_t)header.rows + 1 &&
+             fread(csr->col_idx, sizeof(int), csr->nnz, f) == (size_t)csr->nnz &&
+             fread(csr->val, sizeof(double), csr->nnz, f) == (size_t)csr->nnz;
+    }
+    fclose(f);
+
+    /* Offsets rising from 0 to nnz, and columns ascending within a row. A
+       row's columns are read only once its end is known to be in range */
+    ok = ok && row_ptr[0] == 0 && row_ptr[header.rows] == header.nnz;
+    for (i = 0; ok && i < header.rows; i++) {
+        csr->row_ptr[i] = (long)row_ptr[i];
+        ok = row_ptr[i] <= row_ptr[i + 1] && row_ptr[i + 1] <= header.nnz;
+        for (p = (long)row_ptr[i]; ok && p < (long)row_ptr[i + 1]; p++)
+            ok = csr->col_idx[p] >= 0 && csr->col_idx[p] < header.cols &&
+                 (p == row_ptr[i] || csr->col_idx[p - 1] < csr->col_idx[p]);
+    }
+    if (ok)
+        csr->row_ptr[header.rows] = (long)header.nnz;
+    free(row_ptr);
+    if (!ok) {
+        matrix_csr_free(csr);
+        return -1;
+    }
+    return 0;
+}
+
+int matrix_csr_write(const char *path, const struct matrix_csr *csr)
+{
+    struct matrix_csr_file_header header = { MATRIX_CSR_MAGIC, csr->rows, csr->cols, 0, csr->nnz };
+    FILE *f = fopen(path, "wb");
+    int i, ok;
+
+    if (!f)
+        return -1;
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (i = 0; ok && i <= csr->rows; i++) {
+        long long offset = csr->row_ptr[i];
+
+        ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+    }
+    ok = ok && fwrite(csr->col_idx, sizeof(int), csr->nnz, f) == (size_t)csr->nnz &&
+         fwrite(csr->val, sizeof(double), csr->nnz, f) == (size_t)csr->nnz;
+    return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+void matrix_csr_row(const struct matrix_csr *csr, int i, struct matrix_sparse_vec *row)
+{
+    row->nnz = (int)(csr->row_ptr[i + 1] - csr->row_ptr[i]);
+    row->cols = csr->col_idx + csr->row_ptr[i];
+    row->vals = csr->val + csr->row_ptr[i];
+}
+
+/*.........................................................................*/
+/*                  Sparse rows on the wire                                 */
+/*.........................................................................*/
+
+static size_t sparse_index_bytes(int nnz)
+{
+    return ((size_t)nnz * sizeof(int) + 7) & ~(size_t)7;
+}
+
+size_t matrix_sparse_row_bytes(int nnz)
+{
+    return 2 * sizeof(int) + sparse_index_bytes(nnz) + (size_t)nnz * sizeof(double);
+}
+
+size_t matrix_sparse_row_pack(const struct matrix_sparse_vec *row, void *out)
+{
+    char *p = out;
+    int head[2] = { row->nnz, 0 };
+
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, row->cols, row->nnz * sizeof(int));
+    memset(p + row->nnz * sizeof(int), 0, sparse_index_bytes(row->nnz) - row->nnz * sizeof(int));
+    p += sparse_index_bytes(row->nnz);
+    memcpy(p, row->vals, row->nnz * sizeof(double));
+    return matrix_sparse_row_bytes(row->nnz);
+}
+
+size_t matrix_sparse_row_view(const void *in, size_t len, int cols, struct matrix_sparse_vec *row)
+{
+    const char *p = in;
+    int head[2], i;
+
+    if (len < sizeof(head))
+        return 0;
+    memcpy(head, p, sizeof(head));
+    if (head[0] < 0 || head[0] > cols || matrix_sparse_row_bytes(head[0]) > len)
+        return 0;
+    row->nnz = head[0];
+    row->cols = (const int *)(p + sizeof(head));
+    row->vals = (const double *)(p + sizeof(head) + sparse_index_bytes(head[0]));
+    for (i = 0; i < row->nnz; i++)
+        if (row->cols[i] < 0 || row->cols[i] >= cols)
+            return 0;
+    return matrix_sparse_row_bytes(head[0]);
+}
+
+/*.........................................................................*/
+/*                  Row kernels                                             */
+/*.........................................................................*/
+
+void matrix_spmm_row(const struct matrix_sparse_vec *row, const double *B, int ldb, int n,
+                     double *C_row)
+{
+    int p, j;
+
+    memset(C_row, 0, n * sizeof(double));
+    for (p = 0; p < row->nnz; p++) {
+        const double *b = B + (size_t)row->cols[p] * ldb;
+        double a = row->vals[p];
+
+        for (j = 0; j < n; j++)
+            C_row[j] += a * b[j];
+    }
+}
+
+int matrix_spa_init(struct matrix_spa *spa, int n)
+{
+    spa->n = n;
+    spa->count = 0;
+    spa->values = calloc(n, sizeof(double));
+    spa->marker = calloc(n, sizeof(int));
+    spa->touched = malloc(n * sizeof(int));
+    if (!spa->values || !spa->marker || !spa->touched) {
+        matrix_spa_free(spa);
+        return -1;
+    }
+    return 0;
+}
+
+void matrix_spa_free(struct matrix_spa *spa)
+{
+    free(spa->values);
+    free(spa->marker);
+    free(spa->touched);
+    spa->values = NULL;
+    spa->marker = NULL;
+    spa->touched = NULL;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+void matrix_spa_axpy(struct matrix_spa *spa, double a, const struct matrix_sparse_vec *b)
+{
+    int q;
+
+    for (q = 0; q < b->nnz; q++) {
+        int j = b->cols[q];
+
+        if (!spa->marker[j]) {
+            spa->marker[j] = 1;
+            spa->touched[spa->count++] = j;
+        }
+        spa->values[j] += a * b->vals[q];
+    }
+}
+
+int matrix_spa_gather(struct matrix_spa *spa, int *c_cols, double *c_vals)
+{
+    int q, count = spa->count;
+
+    /* In column order, leaving the accumulator clear */
+    qsort(spa->touched, count, sizeof(int), compare_int);
+    for (q = 0; q < count; q++) {
+        int j = spa->touched[q];
+
+        c_cols[q] = j;
+        c_vals[q] = spa->values[j];
+        spa->values[j] = 0.0;
+        spa->marker[j] = 0;
+    }
+    spa->count = 0;
+    return count;
+}
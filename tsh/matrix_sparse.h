@@ -0,0 +1,93 @@
+/*.........................................................................*/
+/*                  MATRIX_SPARSE.H ------> CSR matrices and row kernels    */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_SPARSE_H
+#define MATRIX_SPARSE_H
+
+#include <stddef.h>
+
+/* A matrix in compressed sparse rows: the nonzeros of row i are
+   col_idx[row_ptr[i]] .. col_idx[row_ptr[i + 1] - 1] with their values,
+   columns ascending. Values are doubles */
+struct matrix_csr {
+    int rows, cols;
+    long nnz;
+    long *row_ptr;      /* rows + 1 offsets */
+    int *col_idx;
+    double *val;
+};
+
+/* A sparse row, or a view of one: nnz column indices, ascending, and
+   their values */
+struct matrix_sparse_vec {
+    int nnz;
+    const int *cols;
+    const double *vals;
+};
+
+/* File holding a CSR matrix: this header, then row_ptr as rows + 1 long
+   longs, col_idx as nnz ints and val as nnz doubles, in host byte order */
+#define MATRIX_CSR_MAGIC 0x52534354     /* "TCSR" */
+
+struct matrix_csr_file_header {
+    int magic;          /* MATRIX_CSR_MAGIC */
+    int rows, cols;
+    int reserved;       /* 0 */
+    long long nnz;
+};
+
+/* Builds csr from the nonzeros of a rows x cols matrix with leading
+   dimension ld; frees it. 0 on success, -1 if out of memory */
+int matrix_csr_from_dense(const double *dense, int rows, int cols, int ld, struct matrix_csr *csr);
+void matrix_csr_free(struct matrix_csr *csr);
+
+/* Writes csr to dense, rows x cols with leading dimension ld, zeros
+   included */
+void matrix_csr_to_dense(const struct matrix_csr *csr, double *dense, int ld);
+
+/* Reads or writes a CSR file; 0 on success, -1 on failure or if the file
+   is not a valid one */
+int matrix_csr_read(const char *path, struct matrix_csr *csr);
+int matrix_csr_write(const char *path, const struct matrix_csr *csr);
+
+/* Row i of csr */
+void matrix_csr_row(const struct matrix_csr *csr, int i, struct matrix_sparse_vec *row);
+
+/* Sparse rows on the wire: an int nnz and an int of padding, the column
+   indices, padded to 8 bytes, then the values. Bytes of a row, the row
+   written to out (returns its bytes), and a row of in, len bytes long,
+   viewed in place (returns its bytes, or 0 if it does not fit in len) */
+size_t matrix_sparse_row_bytes(int nnz);
+size_t matrix_sparse_row_pack(const struct matrix_sparse_vec *row, void *out);
+size_t matrix_sparse_row_view(const void *in, size_t len, int cols, struct matrix_sparse_vec *row);
+
+/* C_row = row * B for a sparse row and a dense matrix B with n columns and
+   leading dimension ldb: the rows of B the nonzeros select, scaled and
+   summed */
+void matrix_spmm_row(const struct matrix_sparse_vec *row, const double *B, int ldb, int n,
+                     double *C_row);
+
+/* Accumulator of a sparse result row, n columns wide (Gustavson's dense
+   accumulator with the list of the columns it touched) */
+struct matrix_spa {
+    int n;
+    int count;          /* columns touched */
+    double *values;
+    int *marker;        /* 1 for a column touched */
+    int *touched;
+};
+
+int matrix_spa_init(struct matrix_spa *spa, int n);
+void matrix_spa_free(struct matrix_spa *spa);
+
+/* Sparse row times sparse matrix, a row of B at a time: spa += a * b for
+   each nonzero a of the row and the row b of B it selects, then the
+   nonzeros of the sum, columns ascending, gathered into c_cols and c_vals
+   (at most n of them), leaving spa clear; returns how many. Products that
+   cancel are kept as explicit zeros */
+void matrix_spa_axpy(struct matrix_spa *spa, double a, const struct matrix_sparse_vec *b);
+int matrix_spa_gather(struct matrix_spa *spa, int *c_cols, double *c_vals);
+
+#endif /* MATRIX_SPARSE_H */
@@ -0,0 +1,235 @@
+/*.........................................................................*/
+/*                  MATRIX_SPARSE_TEST.C ------> CSR and row kernel test    */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "matrix_sparse.h"
+
+#define TEST_ROWS 37
+#define TEST_COLS 29
+#define TEST_FILE "matrix_sparse_test.csr"
+
+/* A rows x cols matrix of small integers, about one element in four
+   nonzero, so that every sum is exact */
+static void fill_sparse(double *M, int rows, int cols)
+{
+    int i;
+
+    for (i = 0; i < rows * cols; i++)
+        M[i] = (rand() % 4 == 0) ? rand() % 17 - 8 : 0.0;
+}
+
+/* 1 if the first n elements of x and y differ */
+static int differ(const double *x, const double *y, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (x[i] != y[i])
+            return 1;
+    return 0;
+}
+
+/* Dense to CSR and back, and through a file */
+static int test_csr(void)
+{
+    double *dense = malloc(TEST_ROWS * TEST_COLS * sizeof(double));
+    double *back = malloc(TEST_ROWS * TEST_COLS * sizeof(double));
+    struct matrix_csr csr, read;
+    long nonzeros = 0;
+    int i, failed = 0;
+
+    fill_sparse(dense, TEST_ROWS, TEST_COLS);
+    if (matrix_csr_from_dense(dense, TEST_ROWS, TEST_COLS, TEST_COLS, &csr) != 0) {
+        printf("FAIL (out of memory)\n");
+        exit(1);
+    }
+    for (i = 0; i < TEST_ROWS * TEST_COLS; i++)
+        nonzeros += (dense[i] != 0.0);
+    if (csr.nnz != nonzeros) {
+        printf("FAIL (%ld nonzeros counted, expected %ld)\n", csr.nnz, nonzeros);
+        failed = 1;
+    }
+
+    if (!failed && (matrix_csr_write(TEST_FILE, &csr) != 0 || matrix_csr_read(TEST_FILE, &read) != 0)) {
+        printf("FAIL (CSR file not written or read back)\n");
+        failed = 1;
+    }
+    if (!failed) {
+        matrix_csr_to_dense(&read, back, TEST_COLS);
+        if (read.nnz != csr.nnz || differ(dense, back, TEST_ROWS * TEST_COLS)) {
+            printf("FAIL (CSR file read back differs)\n");
+            failed = 1;
+        }
+        matrix_csr_free(&read);
+    }
+
+    unlink(TEST_FILE);
+    matrix_csr_free(&csr);
+    free(dense);
+    free(back);
+    return failed;
+}
+
+/* Files that are not valid CSR matrices are refused, however their row
+   offsets are wrong */
+static int test_csr_invalid(void)
+{
+    static const long long offsets[][3] = {
+        { 0, 100000, 1 },       /* a row ending past nnz */
+        { 0, 1, 0 },            /* falling */
+        { 1, 1, 1 },            /* not starting at 0 */
+        { 0, 0, 2 },            /* not ending at nnz */
+    };
+    struct matrix_csr_file_header header = { MATRIX_CSR_MAGIC, 2, 2, 0, 1 };
+    int col = 0, t, failed = 0;
+    double val = 1.0;
+
+    for (t = 0; t < (int)(sizeof(offsets) / sizeof(offsets[0])) && !failed; t++) {
+        struct matrix_csr csr;
+        FILE *f = fopen(TEST_FILE, "wb");
+
+        if (!f || fwrite(&header, sizeof(header), 1, f) != 1 ||
+            fwrite(offsets[t], sizeof(long long), 3, f) != 3 || fwrite(&col, sizeof(col), 1, f) != 1 ||
+            fwrite(&val, sizeof(val), 1, f) != 1 || fclose(f) != 0) {
+            printf("FAIL (test file not written)\n");
+            exit(1);
+        }
+        if (matrix_csr_read(TEST_FILE, &csr) == 0) {
+            printf("FAIL (offsets %lld %lld %lld accepted)\n", offsets[t][0], offsets[t][1],
+                   offsets[t][2]);
+            matrix_csr_free(&csr);
+            failed = 1;
+        }
+    }
+    unlink(TEST_FILE);
+    return failed;
+}
+
+/* Sparse rows packed and viewed in place, and rows that do not fit or
+   name columns past the end refused */
+static int test_pack(void)
+{
+    int cols[] = { 0, 3, 5, 28 };
+    double vals[] = { 1.5, -2.0, 3.25, 4.0 };
+    struct matrix_sparse_vec row = { 4, cols, vals }, view;
+    size_t bytes = matrix_sparse_row_bytes(4);
+    char *wire = malloc(bytes);
+
+    if (matrix_sparse_row_pack(&row, wire) != bytes ||
+        matrix_sparse_row_view(wire, bytes, TEST_COLS, &view) != bytes || view.nnz != 4 ||
+        memcmp(view.cols, cols, sizeof(cols)) != 0 || memcmp(view.vals, vals, sizeof(vals)) != 0) {
+        printf("FAIL (packed row not viewed back)\n");
+        free(wire);
+        return 1;
+    }
+    if (matrix_sparse_row_view(wire, bytes - 1, TEST_COLS, &view) != 0 ||
+        matrix_sparse_row_view(wire, bytes, 28, &view) != 0) {
+        printf("FAIL (short row or column past the end viewed)\n");
+        free(wire);
+        return 1;
+    }
+    free(wire);
+    return 0;
+}
+
+/* Row kernels against the dense product: A sparse times B dense and
+   sparse, a row at a time */
+static int test_row_kernels(void)
+{
+    double *A = malloc(TEST_ROWS * TEST_COLS * sizeof(double));
+    double *B = malloc(TEST_COLS * TEST_ROWS * sizeof(double));
+    double *R = malloc(TEST_ROWS * sizeof(double));
+    double *C = malloc(TEST_ROWS * sizeof(double));
+    double *c_vals = malloc(TEST_ROWS * sizeof(double));
+    int *c_cols = malloc(TEST_ROWS * sizeof(int));
+    struct matrix_csr csr_A, csr_B;
+    struct matrix_spa spa;
+    int i, j, p, q, count, failed = 0;
+
+    fill_sparse(A, TEST_ROWS, TEST_COLS);
+    fill_sparse(B, TEST_COLS, TEST_ROWS);
+    if (matrix_csr_from_dense(A, TEST_ROWS, TEST_COLS, TEST_COLS, &csr_A) != 0 ||
+        matrix_csr_from_dense(B, TEST_COLS, TEST_ROWS, TEST_ROWS, &csr_B) != 0 ||
+        matrix_spa_init(&spa, TEST_ROWS) != 0) {
+        printf("FAIL (out of memory)\n");
+        exit(1);
+    }
+
+    for (i = 0; i < TEST_ROWS && !failed; i++) {
+        struct matrix_sparse_vec row, b;
+
+        for (j = 0; j < TEST_ROWS; j++) {
+            R[j] = 0.0;
+            for (p = 0; p < TEST_COLS; p++)
+                R[j] += A[i * TEST_COLS + p] * B[p * TEST_ROWS + j];
+        }
+
+        matrix_csr_row(&csr_A, i, &row);
+        matrix_spmm_row(&row, B, TEST_ROWS, TEST_ROWS, C);
+        if (differ(C, R, TEST_ROWS)) {
+            printf("FAIL (sparse times dense differs in row %d)\n", i);
+            failed = 1;
+        }
+
+        /* Columns ascending, and every column of the product that is not
+           zero among them */
+        for (p = 0; p < row.nnz; p++) {
+            matrix_csr_row(&csr_B, row.cols[p], &b);
+            matrix_spa_axpy(&spa, row.vals[p], &b);
+        }
+        count = matrix_spa_gather(&spa, c_cols, c_vals);
+        memset(C, 0, TEST_ROWS * sizeof(double));
+        for (q = 0; q < count && !failed; q++) {
+            if (q > 0 && c_cols[q - 1] >= c_cols[q]) {
+                printf("FAIL (gathered columns not ascending in row %d)\n", i);
+                failed = 1;
+            }
+            C[c_cols[q]] = c_vals[q];
+        }
+        if (!failed && (differ(C, R, TEST_ROWS) || spa.count != 0)) {
+            printf("FAIL (sparse times sparse differs in row %d)\n", i);
+            failed = 1;
+        }
+    }
+
+    matrix_spa_free(&spa);
+    matrix_csr_free(&csr_A);
+    matrix_csr_free(&csr_B);
+    free(A);
+    free(B);
+    free(R);
+    free(C);
+    free(c_vals);
+    free(c_cols);
+    return failed;
+}
+
+/* The tests, run in order until one fails */
+static const struct {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    { "CSR from dense and through a file", test_csr },
+    { "invalid CSR files refused", test_csr_invalid },
+    { "sparse rows packed and viewed", test_pack },
+    { "sparse row kernels", test_row_kernels },
+};
+
+int main(void)
+{
+    int t;
+
+    srand(1);
+    for (t = 0; t < (int)(sizeof(tests) / sizeof(tests[0])); t++) {
+        printf("\nTest: %s\n", tests[t].name);
+        if (tests[t].run())
+            return 1;
+        printf("PASS\n");
+    }
+    return 0;
+}
@@ -0,0 +1,280 @@
+/*.........................................................................*/
+/*                  MATRIX_STRASSEN.C ------> Strassen-Winograd recursion   */
+/*                                                                          */
+/*.........................................................................*/
+
+#include <stdlib.h>
+#include <time.h>
+#include "matrix_kernel.h"
+#include "matrix_mem.h"
+#include "matrix_strassen.h"
+
+int strassen_levels(int n, int crossover)
+{
+    int levels = 0;
+
+    if (crossover < 2)
+        crossover = 2;
+    while (n >= crossover) {
+        n = (n + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+int strassen_padded(int n, int levels)
+{
+    int step = 1 << levels;
+
+    return (n + step - 1) / step * step;
+}
+
+int strassen_products(int levels)
+{
+    int count = 1;
+
+    while (levels-- > 0)
+        count *= STRASSEN_BRANCH;
+    return count;
+}
+
+int strassen_operand_type(int type, int levels)
+{
+    long bound = (type == MATRIX_I8) ? 128 : 32768;     /* Largest magnitude */
+    int i;
+
+    if (type != MATRIX_I8 && type != MATRIX_I16)
+        return type;
+    for (i = 0; i < levels; i++)
+        bound *= STRASSEN_GROWTH;
+    return (levels == 0 || bound < 32768) ? MATRIX_I16 : MATRIX_F64;
+}
+
+/* Z = X + Y, or X - Y if subtract is set; s x s blocks */
+static void block_add(int s, const double *X, int ldx, const double *Y, int ldy, int subtract,
+                      double *Z, int ldz)
+{
+    int i, j;
+
+    for (i = 0; i < s; i++) {
+        const double *x = X + (size_t)i * ldx, *y = Y + (size_t)i * ldy;
+        double *z = Z + (size_t)i * ldz;
+
+        if (subtract) {
+            for (j = 0; j < s; j++)
+                z[j] = x[j] - y[j];
+        } else {
+            for (j = 0; j < s; j++)
+                z[j] = x[j] + y[j];
+        }
+    }
+}
+
+/* One node of the split: a leaf, or the seven products of the Winograd
+   variant, which needs 8 block additions where Strassen's has 10:
+
+     S1 = A21 + A22   S2 = S1 - A11    S3 = A11 - A21   S4 = A12 - S2
+     T1 = B12 - B11   T2 = B22 - T1    T3 = B22 - B12   T4 = T2 - B21
+
+     M1 = A11 B11  M2 = A12 B21  M3 = S4 B22  M4 = A22 T4
+     M5 = S1 T1    M6 = S2 T2    M7 = S3 T3 */
+static int split_node(int level, int s, const double *A, int lda, const double *B, int ldb,
+                      int *next, strassen_leaf_fn leaf, void *arg)
+{
+    int h = s / 2, rc = 0, i;
+    size_t block = (size_t)h * h, bytes = 8 * block * sizeof(double);
+    const double *A11, *A12, *A21, *A22, *B11, *B12, *B21, *B22;
+    double *S, *T;
+
+    if (level == 0)
+        return leaf(arg, (*next)++, s, A, lda, B, ldb);
+
+    S = matrix_alloc(bytes, NULL);
+    if (!S)
+        return -1;
+    T = S + 4 * block;
+
+    A11 = A;                        A12 = A + h;
+    A21 = A + (size_t)h * lda;      A22 = A21 + h;
+    B11 = B;                        B12 = B + h;
+    B21 = B + (size_t)h * ldb;      B22 = B21 + h;
+
+    block_add(h, A21, lda, A22, lda, 0, S, h);
+    block_add(h, S, h, A11, lda, 1, S + block, h);
+    block_add(h, A11, lda, A21, lda, 1, S + 2 * block, h);
+    block_add(h, A12, lda, S + block, h, 1, S + 3 * block, h);
+    block_add(h, B12, ldb, B11, ldb, 1, T, h);
+    block_add(h, B22, ldb, T, h, 1, T + block, h);
+    block_add(h, B22, ldb, B12, ldb, 1, T + 2 * block, h);
+    block_add(h, T + block, h, B21, ldb, 1, T + 3 * block, h);
+
+    {
+        const double *a[STRASSEN_BRANCH] = { A11, A12, S + 3 * block, A22, S, S + block, S + 2 * block };
+        const double *b[STRASSEN_BRANCH] = { B11, B21, B22, T + 3 * block, T, T + block, T + 2 * block };
+        int la[STRASSEN_BRANCH] = { lda, lda, h, lda, h, h, h };
+        int lb[STRASSEN_BRANCH] = { ldb, ldb, ldb, h, h, h, h };
+
+        for (i = 0; i < STRASSEN_BRANCH && rc == 0; i++)
+            rc = split_node(level - 1, h, a[i], la[i], b[i], lb[i], next, leaf, arg);
+    }
+
+    matrix_free(S, bytes);
+    return rc;
+}
+
+int strassen_split(int levels, int n, const double *A, int lda, const double *B, int ldb,
+                   strassen_leaf_fn leaf, void *arg)
+{
+    int next = 0;
+
+    return split_node(levels, n, A, lda, B, ldb, &next, leaf, arg);
+}
+
+/* One node of the combine, from its seven products:
+
+     U2 = M1 + M6   U3 = U2 + M7   U4 = U2 + M5
+
+     C11 = M1 + M2  C12 = U4 + M3  C21 = U3 - M4  C22 = U3 + M5 */
+static int combine_node(int level, int s, double *C, int ldc, int *next,
+                        strassen_product_fn product, void *arg)
+{
+    int h = s / 2, rc = 0, i;
+    size_t block = (size_t)h * h, bytes = STRASSEN_BRANCH * block * sizeof(double);
+    double *M, *C12, *C21, *C22;
+
+    if (level == 0)
+        return product(arg, (*next)++, s, C, ldc);
+
+    M = matrix_alloc(bytes, NULL);
+    if (!M)
+        return -1;
+    for (i = 0; i < STRASSEN_BRANCH && rc == 0; i++)
+        rc = combine_node(level - 1, h, M + i * block, h, next, product, arg);
+
+    if (rc == 0) {
+        double *M1 = M, *M2 = M + block, *M3 = M + 2 * block, *M4 = M + 3 * block;
+        double *M5 = M + 4 * block, *M6 = M + 5 * block, *M7 = M + 6 * block;
+
+        C12 = C + h;
+        C21 = C + (size_t)h * ldc;
+        C22 = C21 + h;
+        block_add(h, M1, h, M2, h, 0, C, ldc);
+        block_add(h, M1, h, M6, h, 0, M6, h);       /* U2 */
+        block_add(h, M6, h, M7, h, 0, M7, h);       /* U3 */
+        block_add(h, M6, h, M5, h, 0, M6, h);       /* U4 */
+        block_add(h, M6, h, M3, h, 0, C12, ldc);
+        block_add(h, M7, h, M4, h, 1, C21, ldc);
+        block_add(h, M7, h, M5, h, 0, C22, ldc);
+    }
+
+    matrix_free(M, bytes);
+    return rc;
+}
+
+int strassen_combine(int levels, int n, double *C, int ldc, strassen_product_fn product,
+                     void *arg)
+{
+    int next = 0;
+
+    return combine_node(levels, n, C, ldc, &next, product, arg);
+}
+
+/*.........................................................................*/
+/*                  Crossover measurement                                   */
+/*.........................................................................*/
+
+/* Base-case products of a one-level recursion computed in place, as a
+   worker would: operands converted to the operand type and multiplied */
+struct measure_run {
+    int type, threads;
+    void *operands;     /* one operand pair */
+    void *products;     /* the seven products, of the operand's result type */
+};
+
+static int measure_leaf(void *arg, int index, int s, const double *A, int lda,
+                        const double *B, int ldb)
+{
+    struct measure_run *run = arg;
+    size_t es = matrix_elem_size(run->type), block = (size_t)s * s;
+    size_t rs = matrix_elem_size(matrix_result_type(run->type));
+    char *a = run->operands, *b = a + block * es;
+    int i;
+
+    for (i = 0; i < s; i++) {
+        matrix_from_double(run->type, A + (size_t)i * lda, a + i * s * es, s);
+        matrix_from_double(run->type, B + (size_t)i * ldb, b + i * s * es, s);
+    }
+    matrix_multiply(run->type, run->threads, s, s, s, a, s, b, s, 0,
+                    (char *)run->products + index * block * rs, s);
+    return 0;
+}
+
+static int measure_product(void *arg, int index, int s, double *P, int ldp)
+{
+    struct measure_run *run = arg;
+    int result = matrix_result_type(run->type);
+    size_t block = (size_t)s * s, rs = matrix_elem_size(result);
+    const char *p = (const char *)run->products + index * block * rs;
+    int i;
+
+    for (i = 0; i < s; i++)
+        matrix_to_double(result, p + i * s * rs, P + (size_t)i * ldp, s);
+    return 0;
+}
+
+static double measure_seconds(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+int strassen_crossover(int type, int threads, int max)
+{
+    int operand = strassen_operand_type(type, 1), s, i, found = 0;
+
+    for (s = STRASSEN_MEASURE_MIN; s <= max && !found; s *= 2) {
+        size_t n2 = (size_t)s * s, h2 = n2 / 4;
+        size_t es = matrix_elem_size(type), os = matrix_elem_size(operand);
+        size_t rs = matrix_elem_size(matrix_result_type(type));
+        size_t ors = matrix_elem_size(matrix_result_type(operand));
+        size_t bytes = 3 * n2 * sizeof(double) + 2 * n2 * es + n2 * rs +
+                       2 * h2 * os + STRASSEN_BRANCH * h2 * ors;
+        char *buf = matrix_alloc(bytes, NULL);
+        double *A = (double *)buf, *B = A + n2, *C = B + n2;
+        char *At = (char *)(C + n2), *Bt = At + n2 * es, *Ct = Bt + n2 * es;
+        struct measure_run run = { operand, threads, Ct + n2 * rs, Ct + n2 * rs + 2 * h2 * os };
+        double classical = 0, recursive = 0;
+        struct timespec t0, t1;
+
+        if (!buf)
+            break;
+        for (i = 0; i < (int)n2; i++) {
+            A[i] = rand() % 10;
+            B[i] = rand() % 10;
+        }
+        matrix_from_double(type, A, At, n2);
+        matrix_from_double(type, B, Bt, n2);
+
+        /* Best of two runs each, the first also warms the buffers */
+        for (i = 0; i < 2; i++) {
+            double t;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            matrix_multiply(type, threads, s, s, s, At, s, Bt, s, 0, Ct, s);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            t = measure_seconds(&t0, &t1);
+            classical = (i == 0 || t < classical) ? t : classical;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            strassen_split(1, s, A, s, B, s, measure_leaf, &run);
+            strassen_combine(1, s, C, s, measure_product, &run);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            t = measure_seconds(&t0, &t1);
+            recursive = (i == 0 || t < recursive) ? t : recursive;
+        }
+        matrix_free(buf, bytes);
+
+        if (recursive < classical)
+            found = s;
+    }
+    return found;
+}
@@ -0,0 +1,56 @@
+/*.........................................................................*/
+/*                  MATRIX_STRASSEN.H ------> Strassen-Winograd recursion   */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_STRASSEN_H
+#define MATRIX_STRASSEN_H
+
+/* Products one level of the recursion replaces eight with */
+#define STRASSEN_BRANCH 7
+
+/* Smallest and largest sizes strassen_crossover tries */
+#define STRASSEN_MEASURE_MIN 128
+#define STRASSEN_MEASURE_MAX 2048
+
+/* The base-case products, numbered 0 .. strassen_products(levels) - 1 in
+   the order strassen_split produces them. leaf is handed the operands of
+   one, s x s blocks of doubles; product stores one into P. A nonzero
+   return stops the recursion and is passed on */
+typedef int (*strassen_leaf_fn)(void *arg, int index, int s, const double *A, int lda,
+                                const double *B, int ldb);
+typedef int (*strassen_product_fn)(void *arg, int index, int s, double *P, int ldp);
+
+/* Levels that bring an n x n product down to blocks smaller than
+   crossover, and n rounded up so that it halves evenly that often */
+int strassen_levels(int n, int crossover);
+int strassen_padded(int n, int levels);
+
+/* Base-case products of a recursion levels deep: 7^levels */
+int strassen_products(int levels);
+
+/* Most a level multiplies the largest magnitude of an operand by: S4 and
+   T4 each sum four blocks */
+#define STRASSEN_GROWTH 4
+
+/* Type the base-case operands of a recursion levels deep are carried in:
+   sums of integer elements go as int16 while they fit it, else as
+   doubles, and other types as themselves */
+int strassen_operand_type(int type, int levels);
+
+/* Splits A * B, n x n with n divisible by 2^levels, levels deep and hands
+   each base-case operand pair to leaf */
+int strassen_split(int levels, int n, const double *A, int lda, const double *B, int ldb,
+                   strassen_leaf_fn leaf, void *arg);
+
+/* Builds C = A * B from the base-case products of the same split */
+int strassen_combine(int levels, int n, double *C, int ldc, strassen_product_fn product,
+                     void *arg);
+
+/* Times, for sizes doubling from STRASSEN_MEASURE_MIN up to max, one level
+   of recursion against the classical multiply, both with type kernels on
+   threads threads. The first size where the recursion wins, or 0 if it
+   never does */
+int strassen_crossover(int type, int threads, int max);
+
+#endif /* MATRIX_STRASSEN_H */
@@ -0,0 +1,25 @@
+/*.........................................................................*/
+/*                  MATRIX_SUMMA.C ------> SUMMA grid layout                */
+/*                                                                          */
+/*.........................................................................*/
+
+#include "matrix_summa.h"
+
+void summa_block(const struct matrix_summa_grid *grid, int s, int *start, int *size)
+{
+    *start = (int)((long)s * grid->n / grid->q);
+    *size = (int)((long)(s + 1) * grid->n / grid->q) - *start;
+}
+
+int summa_steps(const struct matrix_summa_grid *grid)
+{
+    int steps = 0, s;
+
+    for (s = 0; s < grid->q; s++) {
+        int start, size;
+
+        summa_block(grid, s, &start, &size);
+        steps += (grid->panel > 0) ? (size + grid->panel - 1) / grid->panel : 1;
+    }
+    return steps;
+}
@@ -0,0 +1,26 @@
+/*.........................................................................*/
+/*                  MATRIX_SUMMA.H ------> SUMMA grid layout                */
+/*                                                                          */
+/*.........................................................................*/
+
+#ifndef MATRIX_SUMMA_H
+#define MATRIX_SUMMA_H
+
+/* The layout of a SUMMA run: C, A and B are cut into q x q blocks, block
+   s spanning rows (and columns) s * n / q up to (s + 1) * n / q, and k is
+   stepped through panel columns of A and rows of B at a time (0: a block
+   per step). Worker rank r owns block r / q, r % q of each */
+struct matrix_summa_grid {
+    int n;
+    int q;
+    int panel;
+    int type;           /* of A and B */
+};
+
+/* Offset and size of block s along either dimension */
+void summa_block(const struct matrix_summa_grid *grid, int s, int *start, int *size);
+
+/* Steps of a run: panels per block, over the blocks along k */
+int summa_steps(const struct matrix_summa_grid *grid);
+
+#endif /* MATRIX_SUMMA_H */
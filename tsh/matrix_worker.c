@@ -2,9 +2,31 @@
 #include <stdlib.h>
 #include <string.h> // For memcpy
 #include "tshlib.h"
+#include "matrix_kernel.h"
+#include "matrix_mem.h"
+#include "matrix_sparse.h"
+#include "matrix_summa.h"
+#include "matrix_protocol.h"
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Lifetimes of the tuples a worker leaves behind, so the server reaps them
+// if the run is aborted before the master cleans up
+#define PROGRESS_TTL_MS 60000  // worker_progress_%d reports
+#define RESULT_TTL_MS   600000 // C_row_%d results
+
+// How long to wait on a work queue before checking whether the run is over
+#define DEQUEUE_WAIT_MS 200
+
+// Tiles whose A segments and B block the cache holds
+#define TILE_CACHE_TILES 4
+
+// How long a SUMMA worker waits for a panel before giving up on the run
+#define SUMMA_IDLE_S 10
 
 // Add alarm signal handling
 volatile sig_atomic_t worker_timeout = 0;
@@ -13,48 +35,159 @@ void handle_worker_alarm(int sig) {
     worker_timeout = 1;
 }
 
-// Read matrix B from file instead of tuple space
-int read_matrix_b_from_file(const char *filename, int *rows_out, int *cols_out, double **matrix_out)
+// Decode the start of a B file, len bytes of it, into *info: either two
+// ints rows, cols of a plain file of doubles or a matrix_file_header.
+// Returns the length of the header, 0 if it is not a valid one
+size_t decode_matrix_b_header(const void *start, size_t len, struct matrix_file_header *info)
+{
+    struct matrix_file_header header;
+    size_t header_len;
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, start, len < sizeof(header) ? len : sizeof(header));
+    if (header.magic == MATRIX_FILE_MAGIC) {
+        header_len = sizeof(header);
+    } else {
+        header.cols = header.rows;
+        header.rows = header.magic;
+        header.panel = 0;
+        header.type = MATRIX_F64;
+        header_len = 2 * sizeof(int);
+    }
+    if (len < header_len || header.rows <= 0 || header.cols <= 0 || header.panel < 0 ||
+        header.type < 0 || header.type >= MATRIX_TYPES) {
+        return 0;
+    }
+    *info = header;
+    return header_len;
+}
+
+// Read matrix B from file instead of tuple space, into huge pages if it
+// can; *info describes the elements read and *backing_out the backing
+// of the copy
+int read_matrix_b_from_file(const char *filename, struct matrix_file_header *info,
+                            void **matrix_out, int *backing_out)
 {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         return -1;
     }
     
-    // Read dimensions
-    int rows, cols;
-    if (fread(&rows, sizeof(int), 1, file) != 1) {
-        fclose(file);
-        return -1;
-    }
-    
-    if (fread(&cols, sizeof(int), 1, file) != 1) {
+    // Read dimensions, element type and packing
+    struct matrix_file_header start;
+    size_t got = fread(&start, 1, sizeof(start), file);
+    size_t header_len = decode_matrix_b_header(&start, got, info);
+    if (header_len == 0 || fseek(file, header_len, SEEK_SET) != 0) {
         fclose(file);
         return -1;
     }
     
     // Allocate memory for the matrix
-    double *matrix = malloc(rows * cols * sizeof(double));
+    size_t bytes = (size_t)info->rows * info->cols * matrix_elem_size(info->type);
+    void *matrix = matrix_alloc(bytes, backing_out);
     if (!matrix) {
         fclose(file);
         return -1;
     }
     
     // Read the entire matrix at once
-    if (fread(matrix, sizeof(double), rows * cols, file) != rows * cols) {
-        free(matrix);
+    if (fread(matrix, 1, bytes, file) != bytes) {
+        matrix_free(matrix, bytes);
         fclose(file);
         return -1;
     }
     
     fclose(file);
     
-    *rows_out = rows;
-    *cols_out = cols;
     *matrix_out = matrix;
     return 0;
 }
 
+// Map matrix B from its file read-only and shared, so every worker on the
+// host uses the one copy in the page cache instead of reading its own.
+// MATRIX_B_POPULATE=0 in the environment skips prefaulting the mapping and
+// MATRIX_B_HUGEPAGE=0 skips the transparent hugepage hint
+int map_matrix_b_file(const char *filename, struct matrix_file_header *info, void **matrix_out,
+                      int *backing_out, void **map_out, size_t *map_len_out)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct matrix_file_header start;
+    struct stat st;
+    ssize_t got = pread(fd, &start, sizeof(start), 0);
+    size_t header_len = (got > 0) ? decode_matrix_b_header(&start, got, info) : 0;
+    size_t map_len = header_len + (size_t)info->rows * info->cols * matrix_elem_size(info->type);
+    if (header_len == 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < map_len) {
+        close(fd);
+        return -1;
+    }
+    
+    const char *populate = getenv("MATRIX_B_POPULATE");
+    const char *hugepage = getenv("MATRIX_B_HUGEPAGE");
+    void *map = matrix_map_file(fd, map_len, !populate || strcmp(populate, "0") != 0,
+                                !hugepage || strcmp(hugepage, "0") != 0, backing_out);
+    close(fd); // The mapping keeps the file open
+    if (!map) {
+        return -1;
+    }
+    
+    *matrix_out = (char *)map + header_len;
+    *map_out = map;
+    *map_len_out = map_len;
+    return 0;
+}
+
+// Release matrix B, whether it was mapped or read; len is the bytes held
+void release_matrix_b(void *matrix, void *map, size_t len)
+{
+    if (map) {
+        matrix_unmap_file(map, len);
+    } else {
+        matrix_free(matrix, len);
+    }
+}
+
+// Grow a chunk buffer kept across chunks to at least need bytes; huge
+// pages are too costly to map and zero afresh for every chunk
+char *grow_chunk_buffer(char **buffer, size_t *bytes, size_t need)
+{
+    if (need > *bytes) {
+        int backing;
+        matrix_free(*buffer, *bytes);
+        *buffer = matrix_alloc(need, &backing);
+        *bytes = *buffer ? need : 0;
+        if (*buffer) {
+            fprintf(stderr, "Worker %d: %zu byte chunk buffer on %s pages\n",
+                    getpid(), need, matrix_backing_name(backing));
+        }
+    }
+    return *buffer;
+}
+
+// Read a keyed tuple, telling a miss from a failure: 1 if read, 0 if the
+// server has no such tuple, -1 if the read failed (a broken connection,
+// say). A pool replaces a connection that broke
+int read_keyed(TSH_CONN *conn, unsigned long family, unsigned long long index, char *buffer,
+               unsigned long *len)
+{
+    tsh_completion done;
+    
+    if (conn->version != TSH_V2) {
+        return tsh_kread(conn, family, index, buffer, len) == 0 ? 1 : -1;
+    }
+    if (tsh_submit_kread(conn, family, index, buffer, *len) == 0 || tsh_wait(conn, &done, -1) != 1) {
+        return -1;
+    }
+    if (done.status != 0) {
+        return done.error == TSH_ER_NOTUPLE ? 0 : -1;
+    }
+    *len = done.length;
+    return 1;
+}
+
 // Get a matrix row from the tuple space
 int get_matrix_row(TSH_CONN *conn, const char *prefix, int row_idx, double **row_out, int *cols_out, unsigned short port)
 {
@@ -157,6 +290,572 @@ int get_matrix_rows(unsigned short port, const char *prefix, int start_row, int
     return 0;
 }
 
+// What a task callback made of its task: leave it for its lease to expire,
+// done here (ack and count it), or nothing left to do because another
+// worker stored the result or the inputs went with a finished run (ack it)
+#define TASK_RETRY 0
+#define TASK_DONE  1
+#define TASK_ACK   2
+
+// Works one task, len bytes long; returns a TASK_* outcome
+typedef int (*task_fn)(void *arg, TSH_POOL *pool, const void *task, unsigned long len);
+
+// Run the tasks of queue, each under a lease of lease_ms, through run until
+// the master raises done_counter or the worker's time is up. task holds one
+// task of at most task_size bytes. Returns the number of tasks done here
+int run_task_queue(unsigned short port, TSH_POOL *pool, const char *queue, const char *done_counter,
+                   unsigned long lease_ms, void *task, unsigned long task_size, task_fn run, void *arg)
+{
+    int tasks_done = 0;
+    int finished = 0;
+    
+    while (!finished && !worker_timeout) {
+        unsigned long len = task_size;
+        unsigned long lease_id = 0;
+        
+        TSH_CONN *conn = tsh_connect(port);
+        int got = conn ? tsh_dequeue(conn, queue, (char*)task, &len, DEQUEUE_WAIT_MS,
+                                     lease_ms, &lease_id) : -1;
+        if (conn) {
+            tsh_disconnect(conn);
+        }
+        
+        if (got != 1) {
+            // Nothing queued: done once the master has collected every result
+            TSH_CONN *done_conn = tsh_pool_acquire(pool);
+            long collected = 0;
+            if (done_conn && tsh_incr(done_conn, done_counter, 0, &collected) == 0 && collected > 0) {
+                finished = 1;
+            }
+            tsh_pool_release(pool, done_conn);
+            if (got < 0) {
+                usleep(1000);
+            }
+            continue;
+        }
+        
+        // A task left alone is redelivered when its lease expires
+        int outcome = run(arg, pool, task, len);
+        if (outcome != TASK_RETRY) {
+            TSH_CONN *ack_conn = tsh_connect(port);
+            if (ack_conn) {
+                tsh_ack(ack_conn, lease_id);
+                tsh_disconnect(ack_conn);
+            }
+            tasks_done += (outcome == TASK_DONE);
+        }
+    }
+    return tasks_done;
+}
+
+// Store a task's result under name, never overwriting one another worker
+// already stored: TASK_DONE if stored, TASK_ACK if one was there, else
+// TASK_RETRY
+int store_task_result(unsigned short port, const char *name, const void *result, size_t bytes)
+{
+    int stored = -1;
+    TSH_CONN *conn = tsh_connect(port);
+    if (conn) {
+        stored = tsh_put_nx(conn, name, 1, result, bytes, RESULT_TTL_MS);
+        tsh_disconnect(conn);
+    }
+    return (stored == 1) ? TASK_DONE : (stored == 0) ? TASK_ACK : TASK_RETRY;
+}
+
+// Strassen engine: multiply the base-case products the master queues,
+// each an operand pair stored under its index, and store each product under
+// the same index, until the master has them all
+struct product_worker {
+    int threads;
+    char *operands, *product;
+    size_t operands_bytes, product_bytes;
+};
+
+// One product, {index, size, type}
+int run_product_task(void *arg, TSH_POOL *pool, const void *task_data, unsigned long len)
+{
+    struct product_worker *w = arg;
+    const int *task = task_data;
+    int index = task[0], size = task[1], type = task[2];
+    if (len != 3 * sizeof(int) || size <= 0 || type < 0 || type >= MATRIX_TYPES) {
+        return TASK_RETRY; // Malformed, let its lease run out
+    }
+    size_t block = (size_t)size * size;
+    size_t pair_bytes = 2 * block * matrix_elem_size(type);
+    size_t result_bytes = block * matrix_elem_size(matrix_result_type(type));
+    grow_chunk_buffer(&w->operands, &w->operands_bytes, pair_bytes);
+    grow_chunk_buffer(&w->product, &w->product_bytes, result_bytes);
+    
+    // Operands that are gone belong to a product the master already has
+    int outcome = TASK_RETRY;
+    TSH_CONN *kconn = tsh_pool_acquire(pool);
+    if (kconn && w->operands && w->product) {
+        unsigned long pair_len = pair_bytes;
+        int found = read_keyed(kconn, FAMILY_STRASSEN_OPERANDS, index, w->operands, &pair_len);
+        if (found == 0) {
+            outcome = TASK_ACK;
+        } else if (found == 1 && pair_len == pair_bytes) {
+            matrix_multiply(type, w->threads, size, size, size, w->operands, size,
+                            w->operands + pair_bytes / 2, size, 0, w->product, size);
+            if (tsh_kput(kconn, FAMILY_STRASSEN_PRODUCTS, index, 1, w->product, result_bytes) == 0) {
+                outcome = TASK_DONE;
+            }
+        }
+    }
+    tsh_pool_release(pool, kconn);
+    return outcome;
+}
+
+int run_product_tasks(unsigned short port, unsigned long lease_ms, int threads)
+{
+    TSH_POOL *pool = tsh_pool_create(port, 1);
+    if (!pool) {
+        return 1;
+    }
+    matrix_kernel_init();
+    
+    struct product_worker w = { threads, NULL, NULL, 0, 0 };
+    int task[3]; // [index, size, type]
+    int products_done = run_task_queue(port, pool, STRASSEN_QUEUE, STRASSEN_DONE, lease_ms,
+                                       task, sizeof(task), run_product_task, &w);
+    
+    fprintf(stderr, "Worker %d: %d Strassen products\n", getpid(), products_done);
+    tsh_pool_destroy(pool);
+    matrix_free(w.operands, w.operands_bytes);
+    matrix_free(w.product, w.product_bytes);
+    return 0;
+}
+
+// Tile engine: compute the C tiles the master queues, each from the A row
+// segments and the block of B it needs, until the master has them all.
+// Both are cached, so tiles sharing rows of A or a block of B fetch them once
+struct tile_worker {
+    unsigned short port;
+    int threads;
+    char *tile_A, *tile_B, *tile_C;
+    size_t tile_A_bytes, tile_B_bytes, tile_C_bytes;
+};
+
+// One tile, a struct matrix_tile_task
+int run_tile_task(void *arg, TSH_POOL *pool, const void *task_data, unsigned long len)
+{
+    struct tile_worker *w = arg;
+    const struct matrix_tile_task *task = task_data;
+    if (len != sizeof(*task) || task->rows <= 0 || task->cols <= 0 || task->depth <= 0 ||
+        task->type < 0 || task->type >= MATRIX_TYPES) {
+        return TASK_RETRY; // Malformed, let its lease run out
+    }
+    size_t elem_size = matrix_elem_size(task->type);
+    size_t segment_bytes = (size_t)task->depth * elem_size;
+    size_t b_bytes = segment_bytes * task->cols;
+    size_t c_bytes = (size_t)task->rows * task->cols * matrix_elem_size(matrix_result_type(task->type));
+    grow_chunk_buffer(&w->tile_A, &w->tile_A_bytes, task->rows * segment_bytes);
+    grow_chunk_buffer(&w->tile_B, &w->tile_B_bytes, b_bytes);
+    grow_chunk_buffer(&w->tile_C, &w->tile_C_bytes, c_bytes);
+    
+    // Cache the inputs of a few tiles only, so what a worker holds stays
+    // the size of a tile however large the matrices
+    tsh_cache_limit(TILE_CACHE_TILES * (task->rows * segment_bytes + b_bytes));
+    
+    // The block of B and the tile's segments of the A rows, from the
+    // cache where an earlier tile fetched them. Inputs that are gone
+    // belong to a run the master has finished
+    TSH_CONN *kconn = tsh_pool_acquire(pool);
+    unsigned long part_len = b_bytes;
+    int found = (kconn && w->tile_A && w->tile_B && w->tile_C) ?
+                read_keyed(kconn, FAMILY_B_TILES, task->b_index, w->tile_B, &part_len) : -1;
+    int fetched = (found == 1 && part_len == b_bytes);
+    for (int r = 0; fetched && r < task->rows; r++) {
+        part_len = segment_bytes;
+        found = read_keyed(kconn, FAMILY_A_ROWS,
+                           (unsigned long long)(task->row0 + r) * task->kblocks + task->kblock,
+                           &w->tile_A[r * segment_bytes], &part_len);
+        fetched = (found == 1 && part_len == segment_bytes);
+    }
+    tsh_pool_release(pool, kconn);
+    if (!fetched) {
+        return (found == 0) ? TASK_ACK : TASK_RETRY;
+    }
+    
+    matrix_multiply(task->type, w->threads, task->rows, task->cols, task->depth, w->tile_A,
+                    task->depth, w->tile_B, task->cols, 0, w->tile_C, task->cols);
+    
+    char result_name[64];
+    snprintf(result_name, sizeof(result_name), "C_tile_%d_%d_%d", task->row0, task->col0,
+             task->kblock);
+    return store_task_result(w->port, result_name, w->tile_C, c_bytes);
+}
+
+int run_tile_tasks(unsigned short port, unsigned long lease_ms, int threads)
+{
+    TSH_POOL *pool = tsh_pool_create(port, 1);
+    if (!pool) {
+        return 1;
+    }
+    tsh_cache_family(FAMILY_A_ROWS);
+    tsh_cache_family(FAMILY_B_TILES);
+    matrix_kernel_init();
+    
+    struct tile_worker w = { port, threads, NULL, NULL, NULL, 0, 0, 0 };
+    struct matrix_tile_task task;
+    int tiles_done = run_task_queue(port, pool, TILE_QUEUE, TILES_DONE, lease_ms,
+                                    &task, sizeof(task), run_tile_task, &w);
+    
+    fprintf(stderr, "Worker %d: %d tiles\n", getpid(), tiles_done);
+    tsh_pool_destroy(pool);
+    matrix_free(w.tile_A, w.tile_A_bytes);
+    matrix_free(w.tile_B, w.tile_B_bytes);
+    matrix_free(w.tile_C, w.tile_C_bytes);
+    return 0;
+}
+
+// Read panel index of family, broadcast by its owner, waiting for it to be
+// stored; the last of the q - 1 readers counted under name takes it and
+// its counter away. 0 on success
+int summa_read_panel(TSH_POOL *pool, unsigned long family, unsigned long long index,
+                     const char *name, int readers, char *panel, unsigned long bytes)
+{
+    struct timespec asked, now;
+    int fetched = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &asked);
+    while (!fetched && !worker_timeout) {
+        TSH_CONN *conn = tsh_pool_acquire(pool);
+        unsigned long len = bytes;
+        fetched = conn && tsh_kread(conn, family, index, panel, &len) == 0 && len == bytes;
+        tsh_pool_release(pool, conn);
+        
+        // A keyed miss is answered at once, so this polls
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!fetched && now.tv_sec - asked.tv_sec > SUMMA_IDLE_S) {
+            return -1;
+        } else if (!fetched) {
+            usleep(1000);
+        }
+    }
+    if (!fetched) {
+        return -1;
+    }
+    
+    long read_by = 0;
+    TSH_CONN *conn = tsh_pool_acquire(pool);
+    if (conn && tsh_incr(conn, name, 1, &read_by) == 0 && read_by == readers) {
+        unsigned long len = bytes;
+        int count;
+        tsh_kget(conn, family, index, panel, &len);
+        len = sizeof(count);
+        tsh_get(conn, name, (char*)&count, &len);
+    }
+    tsh_pool_release(pool, conn);
+    return 0;
+}
+
+// SUMMA engine: take a rank, and with it a block of A, B and C of the
+// grid; at each step the owners of the step's panels store them, every
+// worker in their grid row (for A) or column (for B) reads them, and all
+// add the product of their two panels to their block of C, which is
+// stored once k is done. A worker never holds more than its own blocks
+// and one panel of each
+int run_summa(unsigned short port, int threads)
+{
+    struct matrix_summa_grid grid;
+    TSH_POOL *pool = tsh_pool_create(port, 1);
+    if (!pool) {
+        return 1;
+    }
+    matrix_kernel_init();
+    
+    long rank = 0;
+    unsigned long len = sizeof(grid);
+    TSH_CONN *conn = tsh_pool_acquire(pool);
+    int ok = conn && tsh_read(conn, SUMMA_GRID, (char*)&grid, &len) == 0 && len == sizeof(grid) &&
+             tsh_incr(conn, SUMMA_RANK, 1, &rank) == 0;
+    tsh_pool_release(pool, conn);
+    rank--; // The counter's value after this worker's increment
+    if (!ok || grid.q <= 0 || grid.n < grid.q || grid.type < 0 || grid.type >= MATRIX_TYPES ||
+        rank < 0 || rank >= (long)grid.q * grid.q) {
+        tsh_pool_destroy(pool);
+        return 1; // No grid, or every block has a worker already
+    }
+    int bi = (int)(rank / grid.q), bj = (int)(rank % grid.q);
+    int row0, rows, col0, cols;
+    summa_block(&grid, bi, &row0, &rows);
+    summa_block(&grid, bj, &col0, &cols);
+    
+    // Panels are at most a block wide; the widest block is the last
+    int widest, last;
+    summa_block(&grid, grid.q - 1, &last, &widest);
+    int panel = (grid.panel > 0 && grid.panel < widest) ? grid.panel : widest;
+    int result_type = matrix_result_type(grid.type);
+    size_t elem_size = matrix_elem_size(grid.type);
+    size_t result_size = matrix_elem_size(result_type);
+    size_t a_bytes = (size_t)rows * widest * elem_size;
+    size_t b_bytes = (size_t)widest * cols * elem_size;
+    size_t a_panel_bytes = (size_t)rows * panel * elem_size;
+    size_t b_panel_bytes = (size_t)panel * cols * elem_size;
+    size_t c_bytes = (size_t)rows * cols * result_size;
+    char *block_A = matrix_alloc(a_bytes, NULL);
+    char *block_B = matrix_alloc(b_bytes, NULL);
+    char *panel_A = matrix_alloc(a_panel_bytes, NULL);
+    char *panel_B = matrix_alloc(b_panel_bytes, NULL);
+    char *block_C = matrix_alloc(c_bytes, NULL);
+    char *product = matrix_alloc(c_bytes, NULL);
+    
+    // Take this worker's blocks of A and B; the master stored them before
+    // starting any worker
+    int a_cols = 0, b_rows = 0;
+    conn = tsh_pool_acquire(pool);
+    ok = conn && block_A && block_B && panel_A && panel_B && block_C && product;
+    if (ok) {
+        int start;
+        summa_block(&grid, bj, &start, &a_cols);
+        summa_block(&grid, bi, &start, &b_rows);
+        len = a_bytes;
+        ok = tsh_kget(conn, FAMILY_SUMMA_A, rank, block_A, &len) == 0 &&
+             len == (size_t)rows * a_cols * elem_size;
+        len = b_bytes;
+        ok = ok && tsh_kget(conn, FAMILY_SUMMA_B, rank, block_B, &len) == 0 &&
+             len == (size_t)b_rows * cols * elem_size;
+    }
+    tsh_pool_release(pool, conn);
+    if (ok) {
+        memset(block_C, 0, c_bytes);
+    }
+    
+    int step = 0;
+    for (int s = 0; ok && s < grid.q; s++) {
+        int k0, depth;
+        summa_block(&grid, s, &k0, &depth);
+        for (int off = 0; ok && off < depth; off += panel, step++) {
+            int width = (off + panel <= depth) ? panel : depth - off;
+            char counter[64];
+            
+            // The panel of A: this worker's if its block column is s
+            if (bj == s) {
+                for (int r = 0; r < rows; r++) {
+                    memcpy(&panel_A[r * width * elem_size], &block_A[((size_t)r * a_cols + off) * elem_size],
+                           width * elem_size);
+                }
+                conn = (grid.q > 1) ? tsh_pool_acquire(pool) : NULL;
+                if (conn) {
+                    ok = tsh_kput(conn, FAMILY_SUMMA_A_PANELS, (unsigned long long)step * grid.q + bi, 1,
+                                  panel_A, (unsigned long)rows * width * elem_size) == 0;
+                    tsh_pool_release(pool, conn);
+                }
+            } else {
+                snprintf(counter, sizeof(counter), "summa_A_%d_%d", step, bi);
+                ok = summa_read_panel(pool, FAMILY_SUMMA_A_PANELS, (unsigned long long)step * grid.q + bi,
+                                      counter, grid.q - 1, panel_A,
+                                      (unsigned long)rows * width * elem_size) == 0;
+            }
+            
+            // The panel of B: this worker's if its block row is s; its rows
+            // are contiguous
+            const char *b_source = &block_B[(size_t)off * cols * elem_size];
+            if (ok && bi == s) {
+                conn = (grid.q > 1) ? tsh_pool_acquire(pool) : NULL;
+                if (conn) {
+                    ok = tsh_kput(conn, FAMILY_SUMMA_B_PANELS, (unsigned long long)step * grid.q + bj, 1,
+                                  b_source, (unsigned long)width * cols * elem_size) == 0;
+                    tsh_pool_release(pool, conn);
+                }
+            } else if (ok) {
+                snprintf(counter, sizeof(counter), "summa_B_%d_%d", step, bj);
+                ok = summa_read_panel(pool, FAMILY_SUMMA_B_PANELS, (unsigned long long)step * grid.q + bj,
+                                      counter, grid.q - 1, panel_B,
+                                      (unsigned long)width * cols * elem_size) == 0;
+                b_source = panel_B;
+            }
+            
+            if (ok) {
+                matrix_multiply(grid.type, threads, rows, cols, width, panel_A, width, b_source, cols, 0,
+                                product, cols);
+                matrix_add(result_type, product, block_C, (size_t)rows * cols);
+            }
+        }
+    }
+    
+    if (ok) {
+        char result_name[64];
+        snprintf(result_name, sizeof(result_name), "C_block_%d_%d", bi, bj);
+        conn = tsh_connect(port);
+        ok = conn && tsh_put_nx(conn, result_name, 1, block_C, c_bytes, RESULT_TTL_MS) >= 0;
+        if (conn) {
+            tsh_disconnect(conn);
+        }
+    }
+    fprintf(stderr, "Worker %d: SUMMA block %d,%d (%dx%d), %d steps%s\n", getpid(), bi, bj, rows, cols,
+            step, ok ? "" : ", failed");
+    
+    tsh_pool_destroy(pool);
+    matrix_free(block_A, a_bytes);
+    matrix_free(block_B, b_bytes);
+    matrix_free(panel_A, a_panel_bytes);
+    matrix_free(panel_B, b_panel_bytes);
+    matrix_free(block_C, c_bytes);
+    matrix_free(product, c_bytes);
+    return ok ? 0 : 1;
+}
+
+// Sparse engine: chunks of rows of a sparse A, each row fetched as a
+// sparse row tuple, times B, either dense from matrix_b_file (a chunk of
+// dense result rows) or sparse rows fetched as its nonzeros select them
+// (a chunk of sparse result rows, packed back to back). n is the order of
+// the matrices
+struct sparse_worker {
+    unsigned short port;
+    int n;
+    const void *matrix_B;       // Dense B, NULL if there is none
+    struct matrix_spa spa;
+    size_t row_bytes;           // Of a sparse row n wide
+    char *a_row, *b_row;
+    int *c_cols;
+    double *c_vals;
+    char *chunk_C, *sparse_C;
+    size_t chunk_C_bytes, sparse_C_bytes;
+    long nonzeros;              // Of A, over the chunks done
+};
+
+// One chunk, {start_row, num_rows, sparse_b}
+int run_sparse_task(void *arg, TSH_POOL *pool, const void *task_data, unsigned long len)
+{
+    struct sparse_worker *w = arg;
+    const int *task = task_data;
+    int n = w->n;
+    int start_row = task[0], num_rows = task[1], sparse_b = task[2];
+    if (len != 3 * sizeof(int) || start_row < 0 || num_rows <= 0 || start_row + num_rows > n ||
+        (!sparse_b && !w->matrix_B)) {
+        return TASK_RETRY; // Malformed, let its lease run out
+    }
+    
+    // Dense result rows, or sparse ones appended as they are made
+    size_t c_bytes = sparse_b ? 0 : (size_t)num_rows * n * sizeof(double);
+    if (!sparse_b) {
+        grow_chunk_buffer(&w->chunk_C, &w->chunk_C_bytes, c_bytes);
+    }
+    char *result = sparse_b ? w->sparse_C : w->chunk_C;
+    long nonzeros = 0;
+    TSH_CONN *kconn = tsh_pool_acquire(pool);
+    int ok = kconn && (result || sparse_b);
+    int found = ok ? 1 : -1;
+    for (int r = 0; ok && r < num_rows; r++) {
+        struct matrix_sparse_vec row;
+        unsigned long a_len = w->row_bytes;
+        found = read_keyed(kconn, FAMILY_SPARSE_A_ROWS, start_row + r, w->a_row, &a_len);
+        ok = found == 1 && matrix_sparse_row_view(w->a_row, a_len, n, &row) != 0;
+        if (ok && !sparse_b) {
+            matrix_spmm_row(&row, w->matrix_B, n, n, (double *)&result[(size_t)r * n * sizeof(double)]);
+            nonzeros += row.nnz;
+            continue;
+        }
+        
+        // Row of C = sum of the rows of B the nonzeros select, scaled
+        for (int p = 0; ok && p < row.nnz; p++) {
+            struct matrix_sparse_vec b;
+            unsigned long b_len = w->row_bytes;
+            found = read_keyed(kconn, FAMILY_SPARSE_B_ROWS, row.cols[p], w->b_row, &b_len);
+            ok = found == 1 && matrix_sparse_row_view(w->b_row, b_len, n, &b) != 0;
+            if (ok) {
+                matrix_spa_axpy(&w->spa, row.vals[p], &b);
+            }
+        }
+        struct matrix_sparse_vec c = { 0, w->c_cols, w->c_vals };
+        if (ok) {
+            c.nnz = matrix_spa_gather(&w->spa, w->c_cols, w->c_vals);
+            if (c_bytes + matrix_sparse_row_bytes(c.nnz) > w->sparse_C_bytes) {
+                size_t grown = 2 * (c_bytes + matrix_sparse_row_bytes(c.nnz));
+                char *bigger = realloc(w->sparse_C, grown);
+                ok = bigger != NULL;
+                w->sparse_C = bigger ? bigger : w->sparse_C;
+                w->sparse_C_bytes = bigger ? grown : w->sparse_C_bytes;
+                result = w->sparse_C;
+            }
+        }
+        if (ok) {
+            c_bytes += matrix_sparse_row_pack(&c, &result[c_bytes]);
+            nonzeros += row.nnz;
+        }
+    }
+    tsh_pool_release(pool, kconn);
+    if (!ok) {
+        matrix_spa_gather(&w->spa, w->c_cols, w->c_vals); // Leave it clear
+        return (found == 0) ? TASK_ACK : TASK_RETRY;
+    }
+    
+    char result_name[64];
+    snprintf(result_name, sizeof(result_name), "C_chunk_%d", start_row);
+    int outcome = store_task_result(w->port, result_name, result, c_bytes);
+    if (outcome == TASK_DONE) {
+        w->nonzeros += nonzeros;
+    }
+    return outcome;
+}
+
+int run_sparse_tasks(unsigned short port, int n, const char *matrix_b_file, unsigned long lease_ms)
+{
+    // Dense B, if the master wrote one: plain doubles, shared with the
+    // other workers
+    struct matrix_file_header b_info;
+    void *matrix_B = NULL, *b_map = NULL;
+    size_t b_map_len = 0;
+    int b_backing = MATRIX_MEM_PAGES;
+    if (strcmp(matrix_b_file, "-") != 0) {
+        if (map_matrix_b_file(matrix_b_file, &b_info, &matrix_B, &b_backing, &b_map, &b_map_len) != 0) {
+            if (read_matrix_b_from_file(matrix_b_file, &b_info, &matrix_B, &b_backing) != 0) {
+                return 1;
+            }
+            b_map_len = (size_t)b_info.rows * b_info.cols * matrix_elem_size(b_info.type);
+        }
+        if (b_info.type != MATRIX_F64 || b_info.panel != 0 || b_info.rows != n || b_info.cols != n) {
+            fprintf(stderr, "Worker %d: matrix B is not %dx%d plain doubles\n", getpid(), n, n);
+            release_matrix_b(matrix_B, b_map, b_map_len);
+            return 1;
+        }
+    }
+    
+    TSH_POOL *pool = tsh_pool_create(port, 1);
+    struct sparse_worker w;
+    memset(&w, 0, sizeof(w));
+    w.port = port;
+    w.n = n;
+    w.matrix_B = matrix_B;
+    w.row_bytes = matrix_sparse_row_bytes(n);
+    w.a_row = malloc(w.row_bytes);
+    w.b_row = malloc(w.row_bytes);
+    w.c_cols = malloc(n * sizeof(int));
+    w.c_vals = malloc(n * sizeof(double));
+    if (!pool || !w.a_row || !w.b_row || !w.c_cols || !w.c_vals || matrix_spa_init(&w.spa, n) != 0) {
+        if (pool) {
+            tsh_pool_destroy(pool);
+        }
+        free(w.a_row);
+        free(w.b_row);
+        free(w.c_cols);
+        free(w.c_vals);
+        release_matrix_b(matrix_B, b_map, b_map_len);
+        return 1;
+    }
+    
+    // Rows of a sparse B are read again for every nonzero that selects them
+    tsh_cache_family(FAMILY_SPARSE_B_ROWS);
+    
+    int task[3]; // [start_row, num_rows, sparse_b]
+    int chunks_done = run_task_queue(port, pool, SPARSE_QUEUE, SPARSE_DONE, lease_ms,
+                                     task, sizeof(task), run_sparse_task, &w);
+    
+    fprintf(stderr, "Worker %d: %d sparse chunks, %ld nonzeros of A\n", getpid(), chunks_done, w.nonzeros);
+    tsh_pool_destroy(pool);
+    matrix_spa_free(&w.spa);
+    free(w.a_row);
+    free(w.b_row);
+    free(w.c_cols);
+    free(w.c_vals);
+    matrix_free(w.chunk_C, w.chunk_C_bytes);
+    free(w.sparse_C);
+    release_matrix_b(matrix_B, b_map, b_map_len);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     // Record the worker's start time for enforcing maximum lifetime
@@ -175,15 +874,60 @@ int main(int argc, char **argv)
     unsigned short port = atoi(argv[1]);
     int max_rows = atoi(argv[2]);
     const char *matrix_b_file = argv[3];
+    // Work chunks are taken under a lease; the server redelivers a chunk
+    // whose lease runs out, e.g. because this worker died
+    unsigned long lease_ms = (argc >= 5) ? strtoul(argv[4], NULL, 10) : 10000;
+    // Threads each chunk's multiply is split across; they share matrix_B,
+    // so one worker can keep several cores busy with a single copy of it
+    int threads = (argc >= 6) ? atoi(argv[5]) : 1;
+    if (threads < 1)
+        threads = 1;
+    
+    // Base-case products of the Strassen engine instead of row chunks
+    if (argc >= 7 && strcmp(argv[6], "strassen") == 0)
+        return run_product_tasks(port, lease_ms, threads);
+    
+    // C tiles of the tile engine
+    if (argc >= 7 && strcmp(argv[6], "tiles") == 0)
+        return run_tile_tasks(port, lease_ms, threads);
+    
+    // A block of the SUMMA engine's grid
+    if (argc >= 7 && strcmp(argv[6], "summa") == 0)
+        return run_summa(port, threads);
+    
+    // Chunks of sparse rows of A
+    if (argc >= 7 && strcmp(argv[6], "sparse") == 0)
+        return run_sparse_tasks(port, max_rows, matrix_b_file, lease_ms);
     
     srand(time(NULL) ^ getpid());
     
-    // Read all of matrix B from file at the start - each worker needs a full copy
-    double *matrix_B = NULL;
-    int rows_B = 0, cols_B = 0;
-    if (read_matrix_b_from_file(matrix_b_file, &rows_B, &cols_B, &matrix_B) != 0) {
-        return 1;
+    // Map matrix B from file at the start, shared with the other workers;
+    // read a private copy only if it cannot be mapped
+    struct matrix_file_header b_info;
+    void *matrix_B = NULL;
+    void *b_map = NULL;
+    size_t b_map_len = 0;
+    int b_backing = MATRIX_MEM_PAGES;
+    if (map_matrix_b_file(matrix_b_file, &b_info, &matrix_B, &b_backing, &b_map, &b_map_len) != 0) {
+        if (read_matrix_b_from_file(matrix_b_file, &b_info, &matrix_B, &b_backing) != 0) {
+            return 1;
+        }
+        b_map_len = (size_t)b_info.rows * b_info.cols * matrix_elem_size(b_info.type);
     }
+    int rows_B = b_info.rows, cols_B = b_info.cols;
+    int b_panel = b_info.panel; // Panel width if the master packed B, else 0
+    
+    // The element type of B is that of the A rows too; results are stored
+    // as elements of its result type
+    int elem = b_info.type;
+    size_t elem_size = matrix_elem_size(elem);
+    size_t result_size = matrix_elem_size(matrix_result_type(elem));
+    fprintf(stderr, "Worker %d: matrix B (%s) %s on %s pages\n", getpid(), matrix_elem_name(elem),
+            b_map ? "mapped" : "read", matrix_backing_name(b_backing));
+    
+    // Blocks of A and C, kept for the next chunk
+    char *chunk_A = NULL, *chunk_C = NULL;
+    size_t chunk_A_bytes = 0, chunk_C_bytes = 0;
     
     // First, read the total number of chunks to know when we're done
     int total_chunks = 0;
@@ -201,32 +945,39 @@ int main(int argc, char **argv)
         }
     }
     
-    // Check if the "all_done" termination signal has been placed
-    TSH_CONN *check_conn = tsh_connect(port);
+    // Persistent connections for the ops v2 carries (stat, keyed reads,
+    // counter, plain puts); the queue, lease and conditional put ops still
+    // take a connection each
+    TSH_POOL *pool = tsh_pool_create(port, 1);
+    if (!pool) {
+        release_matrix_b(matrix_B, b_map, b_map_len);
+        return 1;
+    }
+    
+    // A rows never change during a run; a row read again (a chunk
+    // redelivered to this worker) is served from the client cache
+    tsh_cache_family(FAMILY_A_ROWS);
+    
+    // Pick the SIMD multiply kernel for this CPU once, before any chunk
+    matrix_kernel_init();
+    
+    // If every row already has a result there is nothing to do
+    TSH_CONN *check_conn = tsh_pool_acquire(pool);
     if (check_conn) {
-        unsigned long len = sizeof(int);
-        int dummy;
-        char done_tuple[] = "all_work_complete";
+        long rows_done_total = 0;
         
-        // If we can read the termination signal tuple, then all work is already done
-        if (tsh_read(check_conn, done_tuple, (char*)&dummy, &len) == 0) {
-            tsh_disconnect(check_conn);
-            free(matrix_B);
+        if (tsh_incr(check_conn, ROWS_DONE_COUNTER, 0, &rows_done_total) == 0 &&
+            rows_done_total >= max_rows) {
+            tsh_pool_release(pool, check_conn);
+            tsh_pool_destroy(pool);
+            release_matrix_b(matrix_B, b_map, b_map_len);
             return 0; // Exit immediately, all work is done
         }
-        tsh_disconnect(check_conn);
+        tsh_pool_release(pool, check_conn);
     }
     
     // Process loop
     int chunks_processed = 0;
-    int max_chunk_index = total_chunks; // Use the known number of chunks
-    
-    // Pre-allocate result buffer once and reuse
-    double *result_buffer = malloc(max_rows * sizeof(double));
-    if (!result_buffer) {
-        free(matrix_B);
-        return 1;
-    }
     
     int total_results = 0;
     int work_finished = 0;
@@ -242,7 +993,7 @@ int main(int argc, char **argv)
                 snprintf(progress_tuple, sizeof(progress_tuple), "worker_progress_%d", getpid());
                 int progress_data[] = {getpid(), chunks_processed, total_results};
                 
-                tsh_put(report_conn, progress_tuple, 1, progress_data, sizeof(progress_data));
+                tsh_put_ttl(report_conn, progress_tuple, 1, progress_data, sizeof(progress_data), PROGRESS_TTL_MS);
                 tsh_disconnect(report_conn);
             }
             
@@ -258,23 +1009,21 @@ int main(int argc, char **argv)
         
         int claimed = 0;
         
-        // Look for work chunks only within the valid range
-        for (int chunk_idx = 0; chunk_idx < max_chunk_index && !claimed; chunk_idx++) {
-            // Get a work chunk (one connection)
-            TSH_CONN *conn = tsh_connect(port);
-            if (!conn) {
-                usleep(1000); // Short sleep on connection failure
-                continue;
-            }
-            
-            // Try to claim a work chunk
-            char chunk_name[64];
-            snprintf(chunk_name, sizeof(chunk_name), "work_chunk_%d", chunk_idx);
-            
+        // Dequeue the next work chunk under a lease (one connection). This is
+        // one round trip however many chunks are left; a chunk whose lease
+        // runs out goes back to the head of the queue.
+        TSH_CONN *conn = tsh_connect(port);
+        if (!conn) {
+            usleep(1000); // Short sleep on connection failure
+        } else {
             unsigned long len = sizeof(int) * 2;
             int work_data[2]; // [start_row, num_rows]
+            unsigned long lease_id = 0;
+            
+            int got = tsh_dequeue(conn, WORK_QUEUE, (char*)work_data, &len, DEQUEUE_WAIT_MS, lease_ms, &lease_id);
+            tsh_disconnect(conn); // Disconnect immediately after operation
             
-            if (tsh_get(conn, chunk_name, (char*)work_data, &len) == 0) {
+            if (got == 1) {
                 claimed = 1;
                 chunks_processed++;
                 consecutive_misses = 0;
@@ -282,133 +1031,199 @@ int main(int argc, char **argv)
                 int start_row = work_data[0];
                 int num_rows = work_data[1];
                 
-                tsh_disconnect(conn); // Disconnect immediately after operation
-                
                 // Before processing, check if any rows in this chunk already have results
                 int should_process_chunk = 0;
                 
-                // Check if results already exist for this chunk
-                TSH_CONN *check_conn = tsh_connect(port);
-                if (check_conn) {
+                // Check if results already exist for this chunk. Only the
+                // metadata is fetched, never the rows themselves.
+                {
                     int all_rows_exist = 1;
                     for (int row_offset = 0; row_offset < num_rows; row_offset++) {
                         int current_row = start_row + row_offset;
                         char result_name[64];
                         snprintf(result_name, sizeof(result_name), "C_row_%d", current_row);
                         
-                        unsigned long check_len = max_rows * sizeof(double);
-                        double check_buffer[1]; // We just need to see if it exists, don't need the full data
-                        
-                        if (tsh_read(check_conn, result_name, (char*)check_buffer, &check_len) != 0) {
-                            // Row doesn't exist, we need to compute this chunk
+                        TSH_CONN *check_conn = tsh_pool_acquire(pool);
+                        if (!check_conn || tsh_stat(check_conn, result_name, NULL, NULL, NULL) != 1) {
+                            // Row doesn't exist (or we can't tell), we need to compute this chunk
+                            tsh_pool_release(pool, check_conn);
                             all_rows_exist = 0;
                             should_process_chunk = 1;
                             break;
                         }
+                        tsh_pool_release(pool, check_conn);
                     }
                     
-                    tsh_disconnect(check_conn);
-                    
                     if (all_rows_exist) {
+                        // Someone else finished it, just complete the lease
+                        TSH_CONN *ack_conn = tsh_connect(port);
+                        if (ack_conn) {
+                            tsh_ack(ack_conn, lease_id);
+                            tsh_disconnect(ack_conn);
+                        }
                         continue; // Skip this chunk
                     }
-                } else {
-                    // If connection failed, process the chunk anyway
-                    should_process_chunk = 1;
                 }
                 
+                // Rows of this chunk that now have a result
+                int rows_done = 0;
+                
                 // If we've determined we should process the chunk
                 if (should_process_chunk) {
-                    // Process multiple rows in this chunk
-                    for (int row_offset = 0; row_offset < num_rows; row_offset++) {
+                    // Prefetch the chunk's A rows: all reads go out on one v2
+                    // connection now and arrive while earlier rows are being
+                    // multiplied. Without v2 each row is read on its own.
+                    TSH_CONN *rows_conn = tsh_pool_acquire(pool);
+                    size_t row_bytes = (size_t)max_rows * elem_size;
+                    grow_chunk_buffer(&chunk_A, &chunk_A_bytes, num_rows * row_bytes);
+                    int prefetched = (rows_conn && rows_conn->version == TSH_V2 && chunk_A);
+                    for (int row_offset = 0; prefetched && row_offset < num_rows; row_offset++) {
+                        if (tsh_submit_kread(rows_conn, FAMILY_A_ROWS, start_row + row_offset,
+                                             &chunk_A[row_offset * row_bytes], row_bytes) == 0)
+                            prefetched = 0;
+                    }
+                    if (!prefetched && rows_conn) {
+                        tsh_pool_release(pool, rows_conn);
+                        rows_conn = NULL;
+                    }
+                    
+                    // Claim the chunk's rows and gather the A rows of those won
+                    // into the front of chunk_A, so they form one block
+                    int *mine = malloc(num_rows * sizeof(int));
+                    int nmine = 0;
+                    int cols_A = rows_B;
+                    for (int row_offset = 0; chunk_A && mine && row_offset < num_rows; row_offset++) {
                         int current_row = start_row + row_offset;
+                        char *row_A = &chunk_A[nmine * row_bytes];
+                        unsigned long row_len = row_bytes;
                         
-                        // Check one more time if this specific row already exists
-                        TSH_CONN *row_check = tsh_connect(port);
-                        if (row_check) {
-                            char result_name[64];
-                            snprintf(result_name, sizeof(result_name), "C_row_%d", current_row);
-                            
-                            unsigned long check_len = max_rows * sizeof(double);
-                            double check_buffer[1];
-                            
-                            if (tsh_read(row_check, result_name, (char*)check_buffer, &check_len) == 0) {
-                                // This row already has a result, skip it
-                                tsh_disconnect(row_check);
+                        // Completions come in row order, collect this row's
+                        tsh_completion row_done;
+                        if (prefetched && tsh_wait(rows_conn, &row_done, -1) != 1)
+                            row_done.status = -1;
+                        
+                        // Claim the row in one round trip. The claim expires with
+                        // the lease, so rows of a dead worker can be claimed again;
+                        // a lost claim means the row is done or being computed.
+                        // Only a stored result counts as done, otherwise the chunk
+                        // stays unacknowledged and comes back when its lease expires.
+                        char claim_name[64];
+                        snprintf(claim_name, sizeof(claim_name), "C_claim_%d", current_row);
+                        int claimer = getpid();
+                        
+                        TSH_CONN *claim_conn = tsh_connect(port);
+                        if (claim_conn) {
+                            int won = tsh_put_nx(claim_conn, claim_name, 1, &claimer, sizeof(claimer), lease_ms);
+                            tsh_disconnect(claim_conn);
+                            if (won == 0) {
+                                char result_name[64];
+                                snprintf(result_name, sizeof(result_name), "C_row_%d", current_row);
+                                TSH_CONN *check_conn = tsh_pool_acquire(pool);
+                                if (check_conn && tsh_stat(check_conn, result_name, NULL, NULL, NULL) == 1)
+                                    rows_done++;
+                                tsh_pool_release(pool, check_conn);
                                 continue;
                             }
-                            tsh_disconnect(row_check);
                         }
                         
-                        // Read this row from matrix A (one connection)
-                        double *row_A = NULL;
-                        int cols_A = 0;
-                        
-                        TSH_CONN *row_conn = tsh_connect(port);
-                        if (!row_conn) continue;
-                        
-                        char tuple_name[64];
-                        snprintf(tuple_name, sizeof(tuple_name), "A_row_%d", current_row);
-                        
-                        unsigned long row_len = sizeof(double) * max_rows;
-                        double *row_data = malloc(row_len);
-                        
-                        if (!row_data) {
-                            tsh_disconnect(row_conn);
-                            continue;
+                        // This row of matrix A, prefetched or read on its own
+                        if (prefetched) {
+                            if (row_done.status != 0)
+                                continue;
+                            row_len = row_done.length;
+                            if (nmine != row_offset)
+                                memmove(row_A, &chunk_A[row_offset * row_bytes], row_len);
+                        } else {
+                            TSH_CONN *row_conn = tsh_connect(port);
+                            if (!row_conn) continue;
+                            
+                            int got_row = tsh_kread(row_conn, FAMILY_A_ROWS, current_row, row_A, &row_len);
+                            tsh_disconnect(row_conn); // Disconnect immediately after operation
+                            if (got_row != 0)
+                                continue;
                         }
-                        
-                        if (tsh_read(row_conn, tuple_name, (char*)row_data, &row_len) != 0) {
-                            free(row_data);
-                            tsh_disconnect(row_conn);
+                        if (row_len != (unsigned long)cols_A * elem_size)
                             continue;
-                        }
-                        
-                        tsh_disconnect(row_conn); // Disconnect immediately after operation
                         
-                        row_A = row_data;
-                        cols_A = row_len / sizeof(double);
+                        mine[nmine++] = current_row;
+                    }
+                    
+                    // Multiply the whole block at once: each panel of B is loaded
+                    // into cache once per chunk rather than once per row
+                    size_t result_bytes = (size_t)max_rows * result_size;
+                    if (nmine)
+                        grow_chunk_buffer(&chunk_C, &chunk_C_bytes, nmine * result_bytes);
+                    if (nmine && chunk_C && !worker_timeout)
+                        matrix_multiply(elem, threads, nmine, cols_B, cols_A, chunk_A, max_rows,
+                                        matrix_B, cols_B, b_panel, chunk_C, max_rows);
+                    
+                    // Store the result rows
+                    for (int i = 0; chunk_C && i < nmine; i++) {
+                        int current_row = mine[i];
+                        char *row_C = &chunk_C[i * result_bytes];
+                        char claim_name[64];
+                        snprintf(claim_name, sizeof(claim_name), "C_claim_%d", current_row);
+                        int claimer = getpid();
                         
-                        // Check for timeout again before heavy computation
-                        if (worker_timeout) {
-                            free(row_A);
+                        // Leave the chunk to be redelivered when its lease expires
+                        if (worker_timeout)
                             break;
-                        }
-                        
-                        // Clear result buffer
-                        memset(result_buffer, 0, max_rows * sizeof(double));
-                        
-                        // Matrix multiplication (kij order for better cache performance)
-                        for (int k = 0; k < cols_A; k++) {
-                            double a_val = row_A[k]; // Cache this value
-                            for (int j = 0; j < max_rows; j++) {
-                                result_buffer[j] += a_val * matrix_B[k * cols_B + j];
-                            }
-                        }
                         
                         // Store result row (one connection)
                         TSH_CONN *result_conn = tsh_connect(port);
                         if (result_conn) {
                             char result_name[64];
                             snprintf(result_name, sizeof(result_name), "C_row_%d", current_row);
-                            tsh_put(result_conn, result_name, 1, result_buffer, max_rows * sizeof(double));
+                            // Never overwrite a result another worker already stored
+                            int stored = tsh_put_nx(result_conn, result_name, 1, row_C, result_bytes, RESULT_TTL_MS);
+                            if (stored >= 0)
+                                rows_done++;
                             total_results++;
                             tsh_disconnect(result_conn); // Disconnect immediately after operation
+                            
+                            // Count each row once, by the worker whose result was kept
+                            TSH_CONN *count_conn = (stored == 1) ? tsh_connect(port) : NULL;
+                            if (count_conn) {
+                                tsh_incr(count_conn, ROWS_DONE_COUNTER, 1, NULL);
+                                tsh_disconnect(count_conn);
+                            }
                         }
                         
-                        free(row_A); // Clean up matrix A row
+                        // Turn the claim into a lasting done marker
+                        TSH_CONN *done_conn = tsh_connect(port);
+                        if (done_conn) {
+                            tsh_put_ttl(done_conn, claim_name, 1, &claimer, sizeof(claimer), RESULT_TTL_MS);
+                            tsh_disconnect(done_conn);
+                        }
+                        
+                        // Keep the chunk leased while rows are still coming
+                        TSH_CONN *renew_conn = tsh_connect(port);
+                        if (renew_conn) {
+                            tsh_renew(renew_conn, lease_id, lease_ms);
+                            tsh_disconnect(renew_conn);
+                        }
                     }
+                    
+                    free(mine);
+                    tsh_pool_release(pool, rows_conn);
                 }
                 
                 // If timeout occurred during chunk processing, break the loop
+                // and leave the chunk to be redelivered when its lease expires
                 if (worker_timeout) {
                     break;
                 }
                 
-                break; // After processing one chunk
+                // Chunk done, it must not be redelivered. A partly done chunk
+                // is left to expire so another worker fills the gaps.
+                if (rows_done == num_rows) {
+                    TSH_CONN *ack_conn = tsh_connect(port);
+                    if (ack_conn) {
+                        tsh_ack(ack_conn, lease_id);
+                        tsh_disconnect(ack_conn);
+                    }
+                }
             }
-            
-            tsh_disconnect(conn); // Disconnect immediately after operation
         }
         
         // If we didn't claim any work this round, implement better termination logic:
@@ -440,25 +1255,17 @@ int main(int argc, char **argv)
                 }
             }
             
-            // 2. Check for explicit termination signal
-            TSH_CONN *term_conn = tsh_connect(port);
+            // 2. Every row has a result, whoever computed it
+            TSH_CONN *term_conn = tsh_pool_acquire(pool);
             if (term_conn) {
-                char done_tuple[] = "all_work_complete";
-                int done_val;
-                unsigned long len = sizeof(done_val);
-                
-                if (tsh_read(term_conn, done_tuple, (char*)&done_val, &len) == 0) {
-                    work_finished = 1;
-                }
+                long rows_done_total = 0;
                 
-                // If we've processed more than 60% of chunks, place termination signal
-                if (chunks_processed > 0 && chunks_processed >= (total_chunks * 6 / 10) && consecutive_misses >= 5) {
-                    int done_val = 1;
-                    tsh_put(term_conn, done_tuple, 1, &done_val, sizeof(done_val));
+                if (tsh_incr(term_conn, ROWS_DONE_COUNTER, 0, &rows_done_total) == 0 &&
+                    rows_done_total >= max_rows) {
                     work_finished = 1;
                 }
                 
-                tsh_disconnect(term_conn);
+                tsh_pool_release(pool, term_conn);
             }
             
             // Reduce the sleep time to make checks more frequent
@@ -466,7 +1273,9 @@ int main(int argc, char **argv)
         }
     }
     
-    free(result_buffer);
-    free(matrix_B);
+    tsh_pool_destroy(pool);
+    matrix_free(chunk_A, chunk_A_bytes);
+    matrix_free(chunk_C, chunk_C_bytes);
+    release_matrix_b(matrix_B, b_map, b_map_len);
     return 0;
 }
\ No newline at end of file
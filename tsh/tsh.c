@@ -5,6 +5,7 @@
 #include "tsh.h"
 #include <regex.h>
 #include <signal.h>
+#include <time.h>
 
 
 char** tokenize_input(char* line, const char* delimiters) {
@@ -357,6 +358,7 @@ int shell_exit(char **args)
 int initCommon(unsigned short port)
 {
    signal(SIGTERM, sigtermHandler);
+   signal(SIGPIPE, SIG_IGN); /* a vanished client must not kill TSH */
    /* get a port to accept requests */
    if ((oldsock = getTshport(htons(port))) == -1)
       return 0;
@@ -365,6 +367,16 @@ int initCommon(unsigned short port)
    tsh.space = NULL;
    tsh.retrieve = NULL;
    tsh.queue_hd = tsh.queue_tl = NULL;
+   tsh.jobs = NULL;
+   tsh.leases = NULL;
+   tsh.wqueues = NULL;
+   tsh.subs = NULL;
+   tsh.families = NULL;
+   tsh.v2conns = NULL;
+   memset(tsh.wheel, 0, sizeof(tsh.wheel));
+   tsh.wheel_tick = nowMs() / TTL_TICK;
+   tsh.ttl_count = 0;
+   refreshShellPrompt();
 
    return 1;
 }
@@ -381,15 +393,98 @@ int initCommon(unsigned short port)
       & TSH_OP_READ.
   Date        : April '93
   Coded by    : N. Isaac Rajkumar
-  Modification:
+  Modification: October '26. select() loop so shell commands run as
+      child processes while tuple requests keep being served.
+      Extended ops dispatched from TSH_OP_XMIN; the select timeout
+      tracks the nearest lease expiry and the TTL wheel. Consumers
+      blocked on a work queue are watched for hangups and timeouts,
+      subscribers for hangups. Connections that switched to v2 are
+      served a frame at a time as they turn readable. Only sockets
+      below FD_SETSIZE are kept for the loop to watch; OpDeq, OpSub,
+      OpHello and startShellJob refuse the rest with TSH_ER_NOMEM.
 ---------------------------------------------------------------------------*/
 
 void start()
 {
    static void (*op_func[])() = {OpPut, OpGet, OpGet, OpExit, OpShell}; // function pointers (position dependent)
+   static void (*xop_func[])() = {OpTake, OpRenew, OpAck, OpPut,        // from TSH_OP_XMIN
+                                   OpPutCond, OpPutCond, OpStat, OpIncr,
+                                  OpEnq, OpDeq, OpSub, OpKPut, OpKGet,
+                                  OpKGet, OpHello};
+   shelljob_t *j, *next;
+   wqueue_t *q;
+   waiter_t *w;
+   sub_t *u;
+   v2conn_t *c, **pc;
+   struct timeval tv;
+   fd_set rset;
+   int maxfd;
 
    while (TRUE)
-   { /* read operation on TSH port */
+   { /* wait for a request or output from running shell commands */
+      FD_ZERO(&rset);
+      FD_SET(oldsock, &rset);
+      maxfd = oldsock;
+      for (j = tsh.jobs; j != NULL; j = j->next)
+      {
+         FD_SET(j->fd, &rset);
+         if (j->fd > maxfd)
+            maxfd = j->fd;
+      }
+      for (q = tsh.wqueues; q != NULL; q = q->next)
+      { /* a blocked consumer's socket turns readable if it hangs up */
+         for (w = q->waiters; w != NULL; w = w->next)
+         {
+            FD_SET(w->sock, &rset);
+            if (w->sock > maxfd)
+               maxfd = w->sock;
+         }
+      }
+      for (u = tsh.subs; u != NULL; u = u->next)
+      { /* likewise a subscriber */
+         FD_SET(u->sock, &rset);
+         if (u->sock > maxfd)
+            maxfd = u->sock;
+      }
+      for (c = tsh.v2conns; c != NULL; c = c->next)
+      {
+         FD_SET(c->sock, &rset);
+         if (c->sock > maxfd)
+            maxfd = c->sock;
+      }
+      if (select(maxfd + 1, &rset, NULL, NULL, loopTimeout(&tv)) == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         exit(1);
+      }
+      serviceWaiters(&rset);
+      serviceSubscribers(&rset);
+      expireLeases();
+      reapTuples();
+      while (waitpid(-1, NULL, WNOHANG) > 0)
+         ; /* reap finished shell commands */
+      for (j = tsh.jobs; j != NULL; j = next)
+      {
+         next = j->next;
+         if (FD_ISSET(j->fd, &rset))
+            serviceShellJob(j);
+      }
+      pc = &tsh.v2conns;
+      while ((c = *pc) != NULL)
+      { /* one frame per ready v2 connection and pass */
+         if (!FD_ISSET(c->sock, &rset) || serviceV2(c))
+         {
+            pc = &c->next;
+            continue;
+         }
+         *pc = c->next;
+         close(c->sock);
+         free(c);
+      }
+      if (!FD_ISSET(oldsock, &rset))
+         continue;
+      /* read operation on TSH port */
       if ((newsock = get_connection(oldsock, NULL)) == -1)
       {
          exit(1);
@@ -404,8 +499,11 @@ void start()
 
       if (this_op >= TSH_OP_MIN && this_op <= TSH_OP_MAX)
          (*op_func[this_op - TSH_OP_MIN])();
+      else if (this_op >= TSH_OP_XMIN && this_op <= TSH_OP_XMAX)
+         (*xop_func[this_op - TSH_OP_XMIN])();
 
-      close(newsock);
+      if (newsock != -1) /* an op may keep the connection (shell jobs) */
+         close(newsock);
    }
 }
 
@@ -414,21 +512,24 @@ void start()
   Parameters  : -
   Returns     : -
   Called by   : start
-  Calls       : createTuple, consumeTuple, storeTuple, readn, writen,
-                ntohs, ntohl, malloc, free
+  Calls       : createTuple, putTuple, readn, writen, ntohs, ntohl,
+                malloc, free
   Notes       : A tuple is created based on the data received. If there are
                 pending requests for this tuple they are processed. If the
       tuple is not consumed by them (i.e. no GET) the tuple is
       stored in the tuple space.
+      The same function serves TSH_OP_PUTTTL, where a tsh_ttl_it
+      follows the header and the stored tuple expires after ttl_ms.
   Date        : April '93
   Coded by    : N. Isaac Rajkumar
-  Modification:
+  Modification: October '26. TTL puts; subscribers are notified.
 ---------------------------------------------------------------------------*/
 
 void OpPut()
 {
    tsh_put_it in;
    tsh_put_ot out;
+   tsh_ttl_it ttl;
    space1_t *s;
    char *t;
 
@@ -437,6 +538,9 @@ void OpPut()
    /* read tuple length, priority, name */
    if (!readn(newsock, (char *)&in, sizeof(tsh_put_it)))
       return;
+   ttl.ttl_ms = 0;
+   if (this_op == TSH_OP_PUTTTL && !readn(newsock, (char *)&ttl, sizeof(tsh_ttl_it)))
+      return;
    printf("[TSH SERVER] Storing tuple: %s\n", in.name);
    in.proc_id = ntohl(in.proc_id);
    if (guardf(in.host, in.proc_id))
@@ -453,175 +557,2018 @@ void OpPut()
    } /* read the tuple */
    if (!readn(newsock, t, ntohl(in.length)))
    {
-      free(t);
-      return;
-   } /* create and store tuple in space */
-   s = createTuple(in.name, t, ntohl(in.length), ntohs(in.priority));
-   if (s == NULL)
+      free(t);
+      return;
+   } /* create and store tuple in space */
+   s = createTuple(in.name, t, ntohl(in.length), ntohs(in.priority));
+   if (s == NULL)
+   {
+      free(t);
+      out.status = htons((short int)FAILURE);
+      out.error = htons((short int)TSH_ER_NOMEM);
+   }
+   else
+   { /* satisfy pending requests, if possible */
+      if (ntohl(ttl.ttl_ms) != 0)
+         s->expires = nowMs() + ntohl(ttl.ttl_ms);
+      out.error = htons(putTuple(s));
+      out.status = htons((short int)SUCCESS);
+   }
+   writen(newsock, (char *)&out, sizeof(tsh_put_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpShell(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : tokenize_input, shell_cd, startShellJob, readn, writen
+  Notes       : The command is started in a child process and the reply
+                header (status, cached username and cwd) is sent at once.
+      The connection is then handed to the shell job, whose output
+      the main loop streams back in tsh_shell_chunk frames ending
+      with an empty frame. 'cd' changes TSH's own directory, so it
+      runs in place and ends the stream immediately.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpShell()
+{
+   tsh_shell_it in;
+   tsh_shell_ot out;
+   tsh_shell_chunk end;
+   shelljob_t *job = NULL;
+   struct timeval tv;
+   char *t;
+   char **args;
+
+   memset(&out, 0, sizeof(tsh_shell_ot));
+   out.error = htons((short int)TSH_ER_NOERROR);
+   out.status = htons((short int)SUCCESS);
+   end.length = htonl(0);
+
+   /* read cmd line length */
+   if (!readn(newsock, (char *)&in, sizeof(tsh_shell_it)))
+      return;
+
+   if ((t = (char *)malloc(ntohl(in.length) + 1)) == NULL)
+   {
+      out.status = htons((short int)FAILURE);
+      out.error = htons((short int)TSH_ER_NOMEM);
+      writen(newsock, (char *)&out, sizeof(tsh_shell_ot));
+      writen(newsock, (char *)&end, sizeof(tsh_shell_chunk));
+      return;
+   } /* read command */
+   if (!readn(newsock, t, ntohl(in.length)))
+   {
+      free(t);
+      return;
+   }
+   t[ntohl(in.length)] = '\0';
+
+   args = tokenize_input(t, SHELL_LINE_DELIM); // parse t into args
+
+   if (args[0] != NULL && strcmp(args[0], "cd") == 0)
+   {
+      shell_cd(args);
+      refreshShellPrompt();
+   }
+   else if (args[0] != NULL && (job = startShellJob(args)) == NULL)
+   {
+      out.status = htons((short int)FAILURE);
+      out.error = htons((short int)TSH_ER_NOMEM);
+   }
+   free(t);
+   free(args);
+
+   strcpy(out.username, shell_user);
+   strcpy(out.cwd_loc, shell_cwd);
+   if (!writen(newsock, (char *)&out, sizeof(tsh_shell_ot)))
+   {
+      if (job != NULL)
+      {
+         kill(-job->pid, SIGKILL);
+         job->sock = -1;
+         endShellJob(job);
+      }
+      return;
+   }
+   if (job == NULL)
+   {
+      writen(newsock, (char *)&end, sizeof(tsh_shell_chunk));
+      return;
+   }
+   tv.tv_sec = 1;
+   tv.tv_usec = 0;
+   setsockopt(newsock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+   newsock = -1; /* connection now belongs to the shell job */
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : shelljob_t *startShellJob(char **args)
+  Parameters  : args - tokenized command line
+  Returns     : pointer to the new shell job [or] NULL on failure
+  Called by   : OpShell
+  Calls       : pipe, fork, handle_pipes_and_redirection, malloc
+  Notes       : The command runs in its own process group with stdout on
+                a pipe. The job is linked into tsh.jobs with the current
+      connection; the main loop relays its output.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+shelljob_t *startShellJob(char **args)
+{
+   shelljob_t *j, *p;
+   int fds[2];
+
+   if ((j = (shelljob_t *)malloc(sizeof(shelljob_t))) == NULL)
+      return NULL;
+   if (pipe(fds) == -1)
+   {
+      free(j);
+      return NULL;
+   }
+   if (fds[0] >= FD_SETSIZE)
+   { /* the main loop could not watch it */
+      close(fds[0]);
+      close(fds[1]);
+      free(j);
+      return NULL;
+   }
+   fflush(stdout); /* don't let the child replay buffered server logs */
+   if ((j->pid = fork()) == 0)
+   { /* child: run the command with stdout on the pipe */
+      setpgid(0, 0);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+      close(oldsock);
+      for (p = tsh.jobs; p != NULL; p = p->next)
+      {
+         close(p->fd);
+         close(p->sock);
+      }
+      close(fds[0]);
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[1]);
+      handle_pipes_and_redirection(args);
+      exit(0);
+   }
+   close(fds[1]);
+   if (j->pid < 0)
+   {
+      close(fds[0]);
+      free(j);
+      return NULL;
+   }
+   j->fd = fds[0];
+   j->sock = newsock;
+   j->next = tsh.jobs;
+   tsh.jobs = j;
+   return j;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void serviceShellJob(shelljob_t *j)
+  Parameters  : j - shell job whose pipe is readable
+  Returns     : -
+  Called by   : start
+  Calls       : read, writen, kill, endShellJob
+  Notes       : Whatever output is available is forwarded as one chunk.
+                On EOF the terminating empty chunk is sent and the job
+      ends. If the client has gone away, or has stopped reading
+      so that a write times out (OpShell sets SO_SNDTIMEO), the
+      command is killed rather than stall the main loop.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void serviceShellJob(shelljob_t *j)
+{
+   tsh_shell_chunk chunk;
+   char buf[SHELL_CHUNK];
+   int n;
+
+   if ((n = read(j->fd, buf, SHELL_CHUNK)) == -1 && errno == EINTR)
+      return;
+   if (n < 0)
+      n = 0;
+   chunk.length = htonl(n);
+   if (!writen(j->sock, (char *)&chunk, sizeof(tsh_shell_chunk)) ||
+       (n > 0 && !writen(j->sock, buf, n)))
+   { /* client is gone, stop the command */
+      kill(-j->pid, SIGKILL);
+      endShellJob(j);
+   }
+   else if (n == 0)
+      endShellJob(j);
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void endShellJob(shelljob_t *j)
+  Parameters  : j - shell job to be removed
+  Returns     : -
+  Called by   : OpShell, serviceShellJob
+  Calls       : close, free
+  Notes       : The job is unlinked and its pipe and connection closed.
+                The child itself is reaped by the main loop.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void endShellJob(shelljob_t *j)
+{
+   shelljob_t **pp;
+
+   for (pp = &tsh.jobs; *pp != NULL; pp = &(*pp)->next)
+   {
+      if (*pp == j)
+      {
+         *pp = j->next;
+         break;
+      }
+   }
+   close(j->fd);
+   if (j->sock != -1)
+      close(j->sock);
+   free(j);
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void refreshShellPrompt(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : initCommon, OpShell
+  Calls       : getpwuid, getcwd
+  Notes       : Caches the username and working directory reported with
+                every shell reply, instead of running whoami/pwd per call.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void refreshShellPrompt()
+{
+   struct passwd *pw;
+
+   if ((pw = getpwuid(geteuid())) != NULL)
+   {
+      strncpy(shell_user, pw->pw_name, sizeof(shell_user) - 1);
+      shell_user[sizeof(shell_user) - 1] = '\0';
+   }
+   if (getcwd(shell_cwd, sizeof(shell_cwd)) == NULL)
+      shell_cwd[0] = '\0';
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpPutCond(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findName, createTuple, putTuple, readn, writen, malloc,
+                free
+  Notes       : Serves TSH_OP_PUTNX and TSH_OP_CAS. The tuple is put as
+                by OpPut only if no tuple has this exact name (PUTNX), or
+      if the stored tuple's version equals the expected one (CAS,
+      where 0 means absent). Test and store happen in one step, so
+      exactly one of several racing clients wins. The reply carries
+      the new version, or the current one with TSH_ER_CONFLICT.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpPutCond()
+{
+   tsh_put_it in;
+   tsh_cond_it cond;
+   tsh_cond_ot out;
+   space1_t *s, *cur;
+   unsigned long version;
+   int won;
+   char *t;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_put_it)) ||
+       !readn(newsock, (char *)&cond, sizeof(tsh_cond_it)))
+      return;
+   in.proc_id = ntohl(in.proc_id);
+   if (guardf(in.host, in.proc_id))
+      return;
+   out.status = htons((short int)FAILURE);
+   out.error = htons((short int)TSH_ER_NOMEM);
+   out.version = 0;
+   if ((t = (char *)malloc(ntohl(in.length))) == NULL)
+   {
+      writen(newsock, (char *)&out, sizeof(tsh_cond_ot));
+      return;
+   }
+   if (!readn(newsock, t, ntohl(in.length)))
+   {
+      free(t);
+      return;
+   }
+   in.name[TUPLENAME_LEN - 1] = '\0';
+   cur = findName(in.name);
+   if (this_op == TSH_OP_PUTNX || ntohl(cond.version) == 0)
+      won = (cur == NULL);
+   else
+      won = (cur != NULL && cur->version == ntohl(cond.version));
+   if (!won)
+   {
+      free(t);
+      out.status = htons((short int)SUCCESS);
+      out.error = htons((short int)TSH_ER_CONFLICT);
+      out.version = htonl(cur != NULL ? cur->version : 0);
+      writen(newsock, (char *)&out, sizeof(tsh_cond_ot));
+      return;
+   }
+   if ((s = createTuple(in.name, t, ntohl(in.length), ntohs(in.priority))) == NULL)
+   {
+      free(t);
+      writen(newsock, (char *)&out, sizeof(tsh_cond_ot));
+      return;
+   }
+   printf("[TSH SERVER] Storing tuple: %s (conditional)\n", in.name);
+   if (ntohl(cond.ttl_ms) != 0)
+      s->expires = nowMs() + ntohl(cond.ttl_ms);
+   version = s->version;
+   putTuple(s);
+   out.status = htons((short int)SUCCESS);
+   out.error = htons((short int)TSH_ER_NOERROR);
+   out.version = htonl(version);
+   writen(newsock, (char *)&out, sizeof(tsh_cond_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpStat(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findTuple, readn, writen
+  Notes       : Reports whether a tuple matches and its length, priority
+                and version, without sending the tuple. A miss is not
+      queued as a pending request.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpStat()
+{
+   tsh_stat_it in;
+   tsh_stat_ot out;
+   space1_t *s;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_stat_it)))
+      return;
+   memset(&out, 0, sizeof(tsh_stat_ot));
+   if ((s = findTuple(in.expr)) == NULL)
+   {
+      out.status = htons(FAILURE);
+      out.error = htons(TSH_ER_NOTUPLE);
+   }
+   else
+   {
+      out.status = htons(SUCCESS);
+      out.error = htons(TSH_ER_NOERROR);
+      out.length = htonl(s->length);
+      out.version = htonl(s->version);
+      out.priority = htons(s->priority);
+   }
+   writen(newsock, (char *)&out, sizeof(tsh_stat_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpIncr(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : addCounter, readn, writen
+  Notes       : Adds a signed delta to a counter tuple and replies with
+                the new value.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpIncr()
+{
+   tsh_incr_it in;
+   tsh_incr_ot out;
+   sng_int32 value = 0;
+   short int error;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_incr_it)))
+      return;
+   in.name[TUPLENAME_LEN - 1] = '\0';
+   error = addCounter(in.name, ntohl(in.delta), ntohs(in.priority), &value);
+   out.status = htons((short int)(error == TSH_ER_NOERROR ? SUCCESS : FAILURE));
+   out.error = htons(error);
+   out.value = htonl(value);
+   writen(newsock, (char *)&out, sizeof(tsh_incr_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : short int addCounter(char *name, sng_int32 delta,
+                                     unsigned short priority,
+                                     sng_int32 *value)
+  Parameters  : name     - exact name of the counter
+                delta    - amount to add
+                priority - priority of a counter created here
+                value    - the value after the add
+  Returns     : TSH_ER_NOERROR, TSH_ER_NOTCTR, TSH_ER_NOTUPLE [or]
+                TSH_ER_NOMEM
+  Called by   : OpIncr, serviceV2
+  Calls       : findName, createTuple, putTuple, notifySubscribers,
+                malloc, free
+  Notes       : A counter is a 4 byte tuple holding an integer in network
+                byte order, so it can also be read with OpGet. A missing
+      counter is created as if it held 0, unless delta is 0: a
+      fetch of a missing counter fails with TSH_ER_NOTUPLE. The add
+      is done in place and bumps the version like an overwrite.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+short int addCounter(char *name, sng_int32 delta, unsigned short priority,
+                     sng_int32 *value)
+{
+   space1_t *s;
+   sng_int32 stored;
+   char *t;
+
+   if ((s = findName(name)) != NULL)
+   {
+      if (s->length != sizeof(sng_int32))
+         return ((short int)TSH_ER_NOTCTR);
+      memcpy(&stored, s->tuple, sizeof(sng_int32));
+      *value = ntohl(stored) + delta;
+      stored = htonl(*value);
+      memcpy(s->tuple, &stored, sizeof(sng_int32));
+      if (delta != 0)
+      {
+         s->version = next_version++;
+         notifySubscribers(s);
+      }
+      return ((short int)TSH_ER_NOERROR);
+   }
+   if (delta == 0)
+      return ((short int)TSH_ER_NOTUPLE); /* a fetch creates nothing */
+   if ((t = (char *)malloc(sizeof(sng_int32))) == NULL ||
+       (s = createTuple(name, t, sizeof(sng_int32), priority)) == NULL)
+   {
+      free(t);
+      return ((short int)TSH_ER_NOMEM);
+   }
+   *value = delta;
+   stored = htonl(delta);
+   memcpy(t, &stored, sizeof(sng_int32));
+   putTuple(s);
+   return ((short int)TSH_ER_NOERROR);
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : short int putTuple(space1_t *s)
+  Parameters  : s - tuple just created
+  Returns     : error code for the put, as from storeTuple
+  Called by   : OpPut, OpPutCond, addCounter, serviceV2
+  Calls       : notifySubscribers, consumeTuple, storeTuple
+  Notes       : Subscribers are told first, then pending requests are
+                served; a tuple none of them consumes is stored.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+short int putTuple(space1_t *s)
+{
+   notifySubscribers(s);
+   if (!consumeTuple(s))
+      return storeTuple(s, 0);
+   return ((short int)TSH_ER_NOERROR);
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpEnq(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findQueue, createTuple, queueItem, readn, writen, malloc,
+                free
+  Notes       : Appends an item to the named work queue, creating the
+                queue on first use. A consumer already blocked on the
+      queue gets the item straight away.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpEnq()
+{
+   tsh_enq_it in;
+   tsh_enq_ot out;
+   wqueue_t *q;
+   space1_t *s;
+   char *t;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_enq_it)))
+      return;
+   in.name[TUPLENAME_LEN - 1] = '\0';
+   out.status = htons((short int)FAILURE);
+   out.error = htons((short int)TSH_ER_NOMEM);
+   out.count = 0;
+   if ((t = (char *)malloc(ntohl(in.length))) == NULL)
+   {
+      writen(newsock, (char *)&out, sizeof(tsh_enq_ot));
+      return;
+   }
+   if (!readn(newsock, t, ntohl(in.length)))
+   {
+      free(t);
+      return;
+   }
+   if ((q = findQueue(in.name, 1)) == NULL ||
+       (s = createTuple(in.name, t, ntohl(in.length), 0)) == NULL)
+   {
+      free(t);
+      writen(newsock, (char *)&out, sizeof(tsh_enq_ot));
+      return;
+   }
+   queueItem(q, s, 0);
+   out.status = htons((short int)SUCCESS);
+   out.error = htons((short int)TSH_ER_NOERROR);
+   out.count = htonl(q->count);
+   writen(newsock, (char *)&out, sizeof(tsh_enq_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpDeq(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findQueue, sendItem, queueItem, nowMs, readn, writen,
+                malloc
+  Notes       : Removes the item at the head of the named queue and
+                sends it, optionally under a lease as for TSH_OP_TAKE.
+      If the queue is empty and wait_ms is not 0 the connection is
+      kept and the consumer waits for the next enqueue; serviceWaiters
+      fails the wait when wait_ms has passed.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpDeq()
+{
+   tsh_deq_it in;
+   tsh_deq_ot out;
+   wqueue_t *q;
+   waiter_t *w, **pp;
+   space1_t *s;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_deq_it)))
+      return;
+   in.name[TUPLENAME_LEN - 1] = '\0';
+   memset(&out, 0, sizeof(tsh_deq_ot));
+   out.status = htons(FAILURE);
+   out.error = htons(TSH_ER_NOMEM);
+   if ((q = findQueue(in.name, ntohl(in.wait_ms) != 0)) != NULL &&
+       (s = q->head) != NULL)
+   {
+      q->head = s->next;
+      if (q->head == NULL)
+         q->tail = NULL;
+      q->count--;
+      if (!sendItem(newsock, q, s, ntohl(in.len), ntohl(in.lease_ms)))
+         queueItem(q, s, 1);
+      return;
+   }
+   if (ntohl(in.wait_ms) == 0)
+   {
+      out.error = htons(TSH_ER_NOTUPLE);
+      writen(newsock, (char *)&out, sizeof(tsh_deq_ot));
+      return;
+   }
+   if (q == NULL || newsock >= FD_SETSIZE || (w = (waiter_t *)malloc(sizeof(waiter_t))) == NULL)
+   {
+      writen(newsock, (char *)&out, sizeof(tsh_deq_ot));
+      return;
+   }
+   w->sock = newsock;
+   w->len = ntohl(in.len);
+   w->lease_ms = ntohl(in.lease_ms);
+   w->deadline = (ntohl(in.wait_ms) == TSH_WAIT_FOREVER) ? 0 : nowMs() + ntohl(in.wait_ms);
+   w->next = NULL;
+   for (pp = &q->waiters; *pp != NULL; pp = &(*pp)->next)
+      ;
+   *pp = w;
+   newsock = -1; /* answered by queueItem or serviceWaiters */
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpSub(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : setsockopt, readn, writen, malloc
+  Notes       : Registers the connection as a subscriber and keeps it.
+                From then on notifySubscribers sends it a tsh_note_ot
+      for every put whose name matches expr. The client ends the
+      subscription by closing the connection. Notes are written
+      with a send timeout so a stalled subscriber cannot hold up
+      the server; it is dropped instead.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpSub()
+{
+   tsh_sub_it in;
+   tsh_sub_ot out;
+   struct timeval tv;
+   sub_t *u;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_sub_it)))
+      return;
+   in.expr[TUPLENAME_LEN - 1] = '\0';
+   if (newsock >= FD_SETSIZE || (u = (sub_t *)malloc(sizeof(sub_t))) == NULL)
+   {
+      out.status = htons(FAILURE);
+      out.error = htons(TSH_ER_NOMEM);
+      writen(newsock, (char *)&out, sizeof(tsh_sub_ot));
+      return;
+   }
+   out.status = htons(SUCCESS);
+   out.error = htons(TSH_ER_NOERROR);
+   if (!writen(newsock, (char *)&out, sizeof(tsh_sub_ot)))
+   {
+      free(u);
+      return;
+   }
+   tv.tv_sec = 1;
+   tv.tv_usec = 0;
+   setsockopt(newsock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+   u->sock = newsock;
+   strcpy(u->expr, in.expr);
+   u->max_len = ntohl(in.max_len);
+   u->next = tsh.subs;
+   tsh.subs = u;
+   newsock = -1; /* kept until the subscriber hangs up */
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpKPut(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : storeKeyed, readn, writen, malloc, free
+  Notes       : Stores a tuple under (family, index), replacing any tuple
+                with that key.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpKPut()
+{
+   tsh_kput_it in;
+   tsh_put_ot out;
+   short int error = TSH_ER_NOMEM;
+   char *t;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_kput_it)))
+      return;
+   if ((t = (char *)malloc(ntohl(in.length))) != NULL)
+   {
+      if (!readn(newsock, t, ntohl(in.length)))
+      {
+         free(t);
+         return;
+      }
+      error = storeKeyed(ntohl(in.key.family),
+                         ((unsigned long long)ntohl(in.key.index_hi) << 32) | ntohl(in.key.index_lo),
+                         t, ntohl(in.length), ntohs(in.priority));
+      if (error == TSH_ER_NOMEM)
+         free(t);
+   }
+   out.status = htons((short int)(error == TSH_ER_NOMEM ? FAILURE : SUCCESS));
+   out.error = htons(error);
+   writen(newsock, (char *)&out, sizeof(tsh_put_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpKGet(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : lookupKeyed, readn, writen, free
+  Notes       : Serves TSH_OP_KGET and TSH_OP_KREAD. The tuple with the
+                key is sent, up to the length the client accepts, and
+      removed for a KGET. A miss is answered at once with
+      TSH_ER_NOTUPLE; keyed requests are never queued.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpKGet()
+{
+   tsh_kget_it in;
+   tsh_kget_ot out;
+   ktuple_t *k;
+   unsigned long len;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_kget_it)))
+      return;
+   memset(&out, 0, sizeof(tsh_kget_ot));
+   k = lookupKeyed(ntohl(in.key.family),
+                   ((unsigned long long)ntohl(in.key.index_hi) << 32) | ntohl(in.key.index_lo),
+                   this_op == TSH_OP_KGET);
+   if (k == NULL)
+   {
+      out.status = htons(FAILURE);
+      out.error = htons(TSH_ER_NOTUPLE);
+      writen(newsock, (char *)&out, sizeof(tsh_kget_ot));
+      return;
+   }
+   len = k->length;
+   if (ntohl(in.len) != 0 && ntohl(in.len) < len)
+      len = ntohl(in.len);
+   out.status = htons(SUCCESS);
+   out.error = htons(TSH_ER_NOERROR);
+   out.length = htonl(len);
+   if (writen(newsock, (char *)&out, sizeof(tsh_kget_ot)))
+      writen(newsock, k->tuple, len);
+   if (this_op == TSH_OP_KGET)
+   {
+      free(k->tuple);
+      free(k);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : short int storeKeyed(unsigned long family,
+                                     unsigned long long index, char *t,
+                                     unsigned long length,
+                                     unsigned short priority)
+  Parameters  : family   - family id
+                index    - index within the family
+                t        - tuple data, owned by the space on success
+                length   - length of the tuple
+                priority - priority of the tuple
+  Returns     : TSH_ER_NOERROR, TSH_ER_OVERRT [or] TSH_ER_NOMEM (t is
+                then still the caller's)
+  Called by   : OpKPut, serviceV2
+  Calls       : findFamily, findKey, growFamily, malloc, free
+  Notes       : No names are compared and no pattern is matched, so the
+                cost does not depend on how many tuples there are. Keyed
+      tuples have no TTL, lease or subscribers.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+short int storeKeyed(unsigned long family, unsigned long long index, char *t,
+                     unsigned long length, unsigned short priority)
+{
+   family_t *f;
+   ktuple_t **pp, *k;
+   short int error = TSH_ER_NOERROR;
+
+   if ((f = findFamily(family, 1)) == NULL)
+      return ((short int)TSH_ER_NOMEM);
+   if ((k = *(pp = findKey(f, index))) != NULL)
+   { /* overwrite existing tuple */
+      free(k->tuple);
+      error = TSH_ER_OVERRT;
+   }
+   else
+   {
+      if ((k = (ktuple_t *)malloc(sizeof(ktuple_t))) == NULL)
+         return ((short int)TSH_ER_NOMEM);
+      k->index = index;
+      k->next = NULL;
+      *pp = k;
+      f->count++;
+   }
+   k->tuple = t;
+   k->length = length;
+   k->priority = priority;
+   if (f->count > f->nbuckets)
+      growFamily(f); /* chains just get longer if this fails */
+   return error;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : ktuple_t *lookupKeyed(unsigned long family,
+                                      unsigned long long index, int unlink)
+  Parameters  : family - family id
+                index  - index within the family
+                unlink - take the tuple out of the space
+  Returns     : pointer to the tuple [or] NULL if there is none
+  Called by   : OpKGet, serviceV2
+  Calls       : findFamily, findKey
+  Notes       : An unlinked tuple is the caller's to free.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+ktuple_t *lookupKeyed(unsigned long family, unsigned long long index, int unlink)
+{
+   family_t *f;
+   ktuple_t **pp, *k;
+
+   if ((f = findFamily(family, 0)) == NULL || (k = *(pp = findKey(f, index))) == NULL)
+      return NULL;
+   if (unlink)
+   {
+      *pp = k->next;
+      f->count--;
+   }
+   return k;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpHello(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : readn, writen, malloc
+  Notes       : Capability handshake. If the client asks for v2 the
+                connection is kept and from now on carries v2 frames,
+      served by serviceV2. A client that never says hello is served
+      the v1 way, one op per connection; one that says hello to an
+      older TSH sees the connection closed and falls back likewise.
+      Replies are written with a send timeout, as notes are, so a
+      client that stops reading them is dropped rather than waited
+      for.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpHello()
+{
+   tsh_hello_it in;
+   tsh_hello_ot out;
+   struct timeval tv;
+   v2conn_t *c;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_hello_it)))
+      return;
+   out.status = htons(FAILURE);
+   out.error = htons(TSH_ER_PROTO);
+   out.version = htons(1);
+   out.caps = 0;
+   if (ntohl(in.magic) != TSH_V2_MAGIC || ntohs(in.version) < TSH_V2)
+   {
+      writen(newsock, (char *)&out, sizeof(tsh_hello_ot));
+      return;
+   }
+   if (newsock >= FD_SETSIZE || (c = (v2conn_t *)malloc(sizeof(v2conn_t))) == NULL)
+   {
+      out.error = htons(TSH_ER_NOMEM);
+      writen(newsock, (char *)&out, sizeof(tsh_hello_ot));
+      return;
+   }
+   c->sock = newsock;
+   c->caps = ntohl(in.caps) & TSH_CAP_ALL;
+   out.status = htons(SUCCESS);
+   out.error = htons(TSH_ER_NOERROR);
+   out.version = htons(TSH_V2);
+   out.caps = htonl(c->caps);
+   if (!writen(newsock, (char *)&out, sizeof(tsh_hello_ot)))
+   {
+      free(c);
+      return;
+   }
+   tv.tv_sec = 1;
+   tv.tv_usec = 0;
+   setsockopt(newsock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+   c->next = tsh.v2conns;
+   tsh.v2conns = c;
+   newsock = -1; /* kept for v2 frames */
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpGet(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findTuple, deleteTuple, storeRequest, readn, writen,
+                strcpy, htons
+  Notes       : This function is called for both TSH_OP_READ and TSH_OP_GET.
+                If the tuple is present in the tuple space it is returned,
+      or else the request is queued.
+  Date        : April '93
+  Coded by    : N. Isaac Rajkumar
+  Modification:
+---------------------------------------------------------------------------*/
+
+void OpGet()
+{
+   tsh_get_it in;
+   tsh_get_ot1 out1;
+   tsh_get_ot2 out2;
+   space1_t *s;
+   int request_len;
+   /* read tuple name */
+   if (!readn(newsock, (char *)&in, sizeof(tsh_get_it)))
+      return;
+   printf("[TSH SERVER] Received tuple get request for: %s\n", in.expr);
+   in.proc_id = ntohl(in.proc_id);
+   if (guardf(in.host, in.proc_id))
+      return;
+   request_len = ntohl(in.len); /* get user requested length */
+                                /* locate tuple in tuple space */
+   if ((s = findTuple(in.expr)) == NULL)
+   {
+      out1.status = htons(FAILURE);
+      if (request_len != -1) /* -1: async read/get. Do not queue */
+      {
+         if (!storeRequest(in))
+            out1.error = htons(TSH_ER_NOMEM);
+         else
+            out1.error = htons(TSH_ER_NOTUPLE);
+      }
+      writen(newsock, (char *)&out1, sizeof(tsh_get_ot1));
+      return;
+   }
+   /* report that tuple exists */
+   out1.status = htons(SUCCESS);
+   out1.error = htons(TSH_ER_NOERROR);
+   if (!writen(newsock, (char *)&out1, sizeof(tsh_get_ot1)))
+      return;
+   /* send tuple name, length and priority */
+   strcpy(out2.name, s->name);
+   if ((s->length > request_len) && (request_len != 0))
+      out2.length = in.len;
+   else
+      out2.length = htonl(s->length);
+   out2.priority = htons(s->priority);
+   if (!writen(newsock, (char *)&out2, sizeof(tsh_get_ot2)))
+      return;
+   /* send the tuple */
+   if (!writen(newsock, s->tuple, ntohl(out2.length) /*s->length*/))
+      return;
+
+   if (this_op == TSH_OP_GET) {
+      printf("[TSH SERVER] Deleted tuple: %s\n", s->name);
+      deleteTuple(s, &in);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpTake(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findTuple, removeTuple, readn, writen, malloc
+  Notes       : Like TSH_OP_GET, but the tuple is moved to the lease list
+                instead of being dropped. Unless the taker renews or
+      acknowledges the lease before it expires, expireLeases puts the
+      tuple back with raised priority. Never queued: a miss is
+      reported as TSH_ER_NOTUPLE.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpTake()
+{
+   tsh_take_it in;
+   tsh_take_ot out;
+   space1_t *s;
+   lease_t *l;
+   unsigned long len;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_take_it)))
+      return;
+   memset(&out, 0, sizeof(tsh_take_ot));
+   out.status = htons(FAILURE);
+   if ((s = findTuple(in.expr)) == NULL)
+   {
+      out.error = htons(TSH_ER_NOTUPLE);
+      writen(newsock, (char *)&out, sizeof(tsh_take_ot));
+      return;
+   }
+   if ((l = (lease_t *)malloc(sizeof(lease_t))) == NULL)
+   {
+      out.error = htons(TSH_ER_NOMEM);
+      writen(newsock, (char *)&out, sizeof(tsh_take_ot));
+      return;
+   }
+   removeTuple(s);
+   l->id = next_lease++;
+   l->deadline = nowMs() + ntohl(in.lease_ms);
+   l->s = s;
+   l->q = NULL;
+   l->next = tsh.leases;
+   tsh.leases = l;
+
+   len = s->length;
+   if (ntohl(in.len) != 0 && ntohl(in.len) < len)
+      len = ntohl(in.len);
+   out.status = htons(SUCCESS);
+   out.error = htons(TSH_ER_NOERROR);
+   out.lease_id = htonl(l->id);
+   strcpy(out.name, s->name);
+   out.length = htonl(len);
+   out.priority = htons(s->priority);
+   printf("[TSH SERVER] Leased tuple: %s (lease %lu, %u ms)\n", s->name,
+          l->id, ntohl(in.lease_ms));
+   if (writen(newsock, (char *)&out, sizeof(tsh_take_ot)))
+      writen(newsock, s->tuple, len);
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpRenew(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findLease, nowMs, readn, writen
+  Notes       : Moves the lease deadline to lease_ms from now.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpRenew()
+{
+   tsh_lease_it in;
+   tsh_lease_ot out;
+   lease_t *l;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_lease_it)))
+      return;
+   if ((l = findLease(ntohl(in.lease_id))) == NULL)
+   {
+      out.status = htons(FAILURE);
+      out.error = htons(TSH_ER_NOLEASE);
+   }
+   else
+   {
+      l->deadline = nowMs() + ntohl(in.lease_ms);
+      out.status = htons(SUCCESS);
+      out.error = htons(TSH_ER_NOERROR);
+   }
+   writen(newsock, (char *)&out, sizeof(tsh_lease_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void OpAck(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : findLease, readn, writen, free
+  Notes       : The work held under the lease is done; the tuple is
+                discarded for good.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void OpAck()
+{
+   tsh_lease_it in;
+   tsh_lease_ot out;
+   lease_t *l, **pp;
+
+   if (!readn(newsock, (char *)&in, sizeof(tsh_lease_it)))
+      return;
+   out.status = htons(FAILURE);
+   out.error = htons(TSH_ER_NOLEASE);
+   for (pp = &tsh.leases; (l = *pp) != NULL; pp = &l->next)
+   {
+      if (l->id == ntohl(in.lease_id))
+      {
+         *pp = l->next;
+         free(l->s->tuple);
+         free(l->s);
+         free(l);
+         out.status = htons(SUCCESS);
+         out.error = htons(TSH_ER_NOERROR);
+         break;
+      }
+   }
+   writen(newsock, (char *)&out, sizeof(tsh_lease_ot));
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : lease_t *findLease(unsigned long id)
+  Parameters  : id - lease id
+  Returns     : pointer to the lease [or] NULL if unknown/expired
+  Called by   : OpRenew
+  Calls       : -
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+lease_t *findLease(unsigned long id)
+{
+   lease_t *l;
+
+   for (l = tsh.leases; l != NULL; l = l->next)
+   {
+      if (l->id == id)
+         return l;
+   }
+   return NULL;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void expireLeases(void)
+  Parameters  : -
+  Returns     : -
+  Called by   : start
+  Calls       : nowMs, consumeTuple, storeTuple, queueItem, free
+  Notes       : Every lease past its deadline is dropped and its tuple
+                put back, one priority level higher so redelivered work
+      is taken before fresh work. Pending requests are served first,
+      as for a TSH_OP_PUT. A queue item goes back to the head of its
+      queue for the same reason.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void expireLeases()
+{
+   lease_t *l, **pp;
+   long long now = nowMs();
+
+   pp = &tsh.leases;
+   while ((l = *pp) != NULL)
+   {
+      if (l->deadline > now)
+      {
+         pp = &l->next;
+         continue;
+      }
+      *pp = l->next;
+      printf("[TSH SERVER] Lease %lu expired, requeueing: %s\n", l->id, l->s->name);
+      if (l->q != NULL)
+         queueItem(l->q, l->s, 1);
+      else
+      {
+         if (l->s->priority < 0xffff)
+            l->s->priority++;
+         if (!consumeTuple(l->s))
+            storeTuple(l->s, 0);
+      }
+      free(l);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : wqueue_t *findQueue(char *name, int create)
+  Parameters  : name   - queue name
+                create - make an empty queue if there is none
+  Returns     : pointer to the queue [or] NULL
+  Called by   : OpEnq, OpDeq
+  Calls       : strcmp, strcpy, malloc
+  Notes       : Queues are few, so a list will do; the items within a
+                queue are never searched.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+wqueue_t *findQueue(char *name, int create)
+{
+   wqueue_t *q;
+
+   for (q = tsh.wqueues; q != NULL; q = q->next)
+   {
+      if (!strcmp(q->name, name))
+         return q;
+   }
+   if (!create || (q = (wqueue_t *)malloc(sizeof(wqueue_t))) == NULL)
+      return NULL;
+   strcpy(q->name, name);
+   q->head = q->tail = NULL;
+   q->count = 0;
+   q->waiters = NULL;
+   q->next = tsh.wqueues;
+   tsh.wqueues = q;
+   return q;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void queueItem(wqueue_t *q, space1_t *s, int front)
+  Parameters  : q     - the queue
+                s     - item to queue
+                front - put the item at the head rather than the tail
+  Returns     : -
+  Called by   : OpEnq, OpDeq, expireLeases
+  Calls       : sendItem, close, free
+  Notes       : The oldest blocked consumer is served first. One whose
+                connection has failed is dropped and the next one tried;
+      the item is linked into the queue only when nobody takes it.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void queueItem(wqueue_t *q, space1_t *s, int front)
+{
+   waiter_t *w;
+   int sent;
+
+   while ((w = q->waiters) != NULL)
+   {
+      q->waiters = w->next;
+      sent = sendItem(w->sock, q, s, w->len, w->lease_ms);
+      close(w->sock);
+      free(w);
+      if (sent)
+         return;
+   }
+   if (front)
+   {
+      s->next = q->head;
+      q->head = s;
+      if (q->tail == NULL)
+         q->tail = s;
+   }
+   else
+   {
+      s->next = NULL;
+      if (q->tail != NULL)
+         q->tail->next = s;
+      else
+         q->head = s;
+      q->tail = s;
+   }
+   q->count++;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int sendItem(int sock, wqueue_t *q, space1_t *s,
+                             unsigned long len, unsigned long lease_ms)
+  Parameters  : sock     - consumer connection
+                q        - queue the item was removed from
+                s        - the item, already unlinked
+                len      - max bytes accepted, 0: whole item
+                lease_ms - lease duration, 0: no lease
+  Returns     : 1 - item sent (and leased or freed)
+                0 - not sent, the item still belongs to the caller
+  Called by   : OpDeq, queueItem
+  Calls       : nowMs, writen, malloc, free
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int sendItem(int sock, wqueue_t *q, space1_t *s, unsigned long len,
+             unsigned long lease_ms)
+{
+   tsh_deq_ot out;
+   lease_t *l = NULL;
+
+   if (lease_ms != 0 && (l = (lease_t *)malloc(sizeof(lease_t))) == NULL)
+      return 0;
+   if (len == 0 || len > s->length)
+      len = s->length;
+   out.status = htons(SUCCESS);
+   out.error = htons(TSH_ER_NOERROR);
+   out.lease_id = htonl(l != NULL ? next_lease : 0);
+   out.length = htonl(len);
+   if (!writen(sock, (char *)&out, sizeof(tsh_deq_ot)) ||
+       !writen(sock, s->tuple, len))
+   {
+      free(l);
+      return 0;
+   }
+   if (l == NULL)
+   {
+      free(s->tuple);
+      free(s);
+      return 1;
+   }
+   l->id = next_lease++;
+   l->deadline = nowMs() + lease_ms;
+   l->s = s;
+   l->q = q;
+   l->next = tsh.leases;
+   tsh.leases = l;
+   return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void serviceWaiters(fd_set *rset)
+  Parameters  : rset - descriptors select found readable
+  Returns     : -
+  Called by   : start
+  Calls       : nowMs, writen, close, free
+  Notes       : A blocked consumer whose socket is readable has hung up
+                (it sends nothing while waiting) and is dropped, so no
+      item is lost on it. One whose wait has run out is told the
+      queue stayed empty.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void serviceWaiters(fd_set *rset)
+{
+   wqueue_t *q;
+   waiter_t *w, **pp;
+   tsh_deq_ot out;
+   long long now = nowMs();
+
+   memset(&out, 0, sizeof(tsh_deq_ot));
+   out.status = htons(FAILURE);
+   out.error = htons(TSH_ER_NOTUPLE);
+   for (q = tsh.wqueues; q != NULL; q = q->next)
+   {
+      pp = &q->waiters;
+      while ((w = *pp) != NULL)
+      {
+         if (FD_ISSET(w->sock, rset))
+            FD_CLR(w->sock, rset);
+         else if (w->deadline == 0 || w->deadline > now)
+         {
+            pp = &w->next;
+            continue;
+         }
+         else
+            writen(w->sock, (char *)&out, sizeof(tsh_deq_ot));
+         *pp = w->next;
+         close(w->sock);
+         free(w);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void notifySubscribers(space1_t *s)
+  Parameters  : s - tuple being put
+  Returns     : -
+  Called by   : putTuple, addCounter
+  Calls       : match, writen, close, free
+  Notes       : Called before the tuple is offered to pending requests,
+                which may consume it. A subscriber that cannot take the
+      note is dropped.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void notifySubscribers(space1_t *s)
+{
+   tsh_note_ot out;
+   sub_t *u, **pp;
+   unsigned long sent;
+
+   pp = &tsh.subs;
+   while ((u = *pp) != NULL)
+   {
+      if (match(u->expr, s->name))
+      {
+         sent = (s->length < u->max_len) ? s->length : u->max_len;
+         memset(&out, 0, sizeof(tsh_note_ot));
+         strcpy(out.name, s->name);
+         out.length = htonl(s->length);
+         out.sent = htonl(sent);
+         out.priority = htons(s->priority);
+         if (!writen(u->sock, (char *)&out, sizeof(tsh_note_ot)) ||
+             (sent > 0 && !writen(u->sock, s->tuple, sent)))
+         {
+            *pp = u->next;
+            close(u->sock);
+            free(u);
+            continue;
+         }
+      }
+      pp = &u->next;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void serviceSubscribers(fd_set *rset)
+  Parameters  : rset - descriptors select found readable
+  Returns     : -
+  Called by   : start
+  Calls       : close, free
+  Notes       : Subscribers send nothing after subscribing, so a readable
+                socket means the client has hung up.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void serviceSubscribers(fd_set *rset)
+{
+   sub_t *u, **pp;
+
+   pp = &tsh.subs;
+   while ((u = *pp) != NULL)
+   {
+      if (!FD_ISSET(u->sock, rset))
+      {
+         pp = &u->next;
+         continue;
+      }
+      FD_CLR(u->sock, rset);
+      *pp = u->next;
+      close(u->sock);
+      free(u);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : family_t *findFamily(unsigned long id, int create)
+  Parameters  : id     - family id
+                create - make an empty family if there is none
+  Returns     : pointer to the family [or] NULL
+  Called by   : storeKeyed, lookupKeyed
+  Calls       : malloc, calloc, free
+  Notes       : Families are few; the tuples within one are hashed.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+family_t *findFamily(unsigned long id, int create)
+{
+   family_t *f;
+
+   for (f = tsh.families; f != NULL; f = f->next)
+   {
+      if (f->id == id)
+         return f;
+   }
+   if (!create || (f = (family_t *)malloc(sizeof(family_t))) == NULL)
+      return NULL;
+   if ((f->buckets = (ktuple_t **)calloc(KEY_BUCKETS, sizeof(ktuple_t *))) == NULL)
+   {
+      free(f);
+      return NULL;
+   }
+   f->id = id;
+   f->nbuckets = KEY_BUCKETS;
+   f->count = 0;
+   f->next = tsh.families;
+   tsh.families = f;
+   return f;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : ktuple_t **findKey(family_t *f, unsigned long long index)
+  Parameters  : f     - family
+                index - index within the family
+  Returns     : the link that points to the tuple with this index, or
+                the NULL link ending its chain if there is none
+  Called by   : storeKeyed, lookupKeyed
+  Calls       : -
+  Notes       : The bucket is the index modulo the bucket count.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+ktuple_t **findKey(family_t *f, unsigned long long index)
+{
+   ktuple_t **pp;
+
+   for (pp = &f->buckets[index & (f->nbuckets - 1)]; *pp != NULL; pp = &(*pp)->next)
+   {
+      if ((*pp)->index == index)
+         break;
+   }
+   return pp;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int growFamily(family_t *f)
+  Parameters  : f - family
+  Returns     : 1 - bucket array doubled
+                0 - no memory, left as it was
+  Called by   : storeKeyed
+  Calls       : calloc, free
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int growFamily(family_t *f)
+{
+   ktuple_t **buckets, *k;
+   unsigned long n = f->nbuckets * 2, b;
+
+   if ((buckets = (ktuple_t **)calloc(n, sizeof(ktuple_t *))) == NULL)
+      return 0;
+   for (b = 0; b < f->nbuckets; b++)
+   {
+      while ((k = f->buckets[b]) != NULL)
+      {
+         f->buckets[b] = k->next;
+         k->next = buckets[k->index & (n - 1)];
+         buckets[k->index & (n - 1)] = k;
+      }
+   }
+   free(f->buckets);
+   f->buckets = buckets;
+   f->nbuckets = n;
+   return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int serviceV2(v2conn_t *c)
+  Parameters  : c - v2 connection with a frame waiting
+  Returns     : 1 - frame served, keep the connection
+                0 - the client hung up or broke the framing
+  Called by   : start
+  Calls       : readVarint, getVarint, getString, putVarint, putString,
+                readLong, sendV2, findTuple, removeTuple, createTuple,
+                putTuple, addCounter, storeKeyed, lookupKeyed, nowMs,
+                readn, malloc, free
+  Notes       : Reads one request frame and sends its reply frame; the
+                framing is described with TSH_OP_HELLO in synergy.h.
+      A request the server does not know is answered with
+      TSH_ER_PROTO after its payload is skipped, so the connection
+      stays usable.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int serviceV2(v2conn_t *c)
+{
+   unsigned char hdr[TSH_V2_MAXHDR], rep[TSH_V2_MAXHDR], fld[TSH_V2_MAXHDR];
+   unsigned char *p, *end;
+   unsigned long long hdr_len, payload_len, op, id, a, b, d, data_len = 0;
+   char name[TUPLENAME_LEN], *t = NULL, *data = NULL;
+   space1_t *s, *taken = NULL;
+   ktuple_t *k = NULL;
+   sng_int32 value;
+   short int error = TSH_ER_PROTO;
+   int n, m = 0, ok;
+
+   if (!readVarint(c->sock, &hdr_len) || !readVarint(c->sock, &payload_len) ||
+       hdr_len > TSH_V2_MAXHDR || !readn(c->sock, (char *)hdr, hdr_len))
+      return 0;
+   p = hdr;
+   end = hdr + hdr_len;
+   if (!getVarint(&p, end, &op) || !getVarint(&p, end, &id))
+      return 0;
+   /* the payload of a put becomes the tuple, any other is skipped */
+   if (op == TSH_OP_PUT || op == TSH_OP_KPUT)
+      t = (char *)malloc(payload_len ? payload_len : 1);
+   if (!readLong(c->sock, t, payload_len))
+   {
+      free(t);
+      return 0;
+   }
+
+   switch (op)
+   {
+   case TSH_OP_PUT: /* name, priority, ttl_ms */
+      if (!getString(&p, end, name, TUPLENAME_LEN) || !getVarint(&p, end, &a) ||
+          !getVarint(&p, end, &b))
+         break;
+      error = TSH_ER_NOMEM;
+      if (t == NULL || (s = createTuple(name, t, payload_len, (unsigned short)a)) == NULL)
+         break;
+      t = NULL; /* the space's now */
+      if (b != 0)
+         s->expires = nowMs() + b;
+      error = putTuple(s);
+      break;
+   case TSH_OP_GET: /* expr, max_len / name, priority, length */
+   case TSH_OP_READ:
+      if (!getString(&p, end, name, TUPLENAME_LEN) || !getVarint(&p, end, &a))
+         break;
+      error = TSH_ER_NOTUPLE;
+      if ((s = findTuple(name)) == NULL)
+         break;
+      error = TSH_ER_NOERROR;
+      m = putString(fld, s->name);
+      m += putVarint(fld + m, s->priority);
+      m += putVarint(fld + m, s->length);
+      data = s->tuple;
+      data_len = (a != 0 && a < s->length) ? a : s->length;
+      if (op == TSH_OP_GET)
+         taken = s;
+      break;
+   case TSH_OP_STAT: /* expr / length, priority, version */
+      if (!getString(&p, end, name, TUPLENAME_LEN))
+         break;
+      error = TSH_ER_NOTUPLE;
+      if ((s = findTuple(name)) == NULL)
+         break;
+      error = TSH_ER_NOERROR;
+      m = putVarint(fld, s->length);
+      m += putVarint(fld + m, s->priority);
+      m += putVarint(fld + m, s->version);
+      break;
+   case TSH_OP_INCR: /* name, delta / value, both zigzag */
+      if (!getString(&p, end, name, TUPLENAME_LEN) || !getVarint(&p, end, &d))
+         break;
+      value = 0;
+      error = addCounter(name, (sng_int32)((d >> 1) ^ -(d & 1)), 1, &value);
+      m = putVarint(fld, ((unsigned long long)(long long)(int)value << 1) ^
+                         (unsigned long long)((long long)(int)value >> 63));
+      break;
+   case TSH_OP_KPUT: /* family, index, priority */
+      if (!(c->caps & TSH_CAP_KEYS) || !getVarint(&p, end, &a) ||
+          !getVarint(&p, end, &b) || !getVarint(&p, end, &d))
+         break;
+      error = TSH_ER_NOMEM;
+      if (t != NULL && (error = storeKeyed(a, b, t, payload_len, (unsigned short)d)) != TSH_ER_NOMEM)
+         t = NULL;
+      break;
+   case TSH_OP_KGET: /* family, index, max_len / length */
+   case TSH_OP_KREAD:
+      if (!(c->caps & TSH_CAP_KEYS) || !getVarint(&p, end, &a) ||
+          !getVarint(&p, end, &b) || !getVarint(&p, end, &d))
+         break;
+      error = TSH_ER_NOTUPLE;
+      if ((k = lookupKeyed(a, b, op == TSH_OP_KGET)) == NULL)
+         break;
+      error = TSH_ER_NOERROR;
+      m = putVarint(fld, k->length);
+      data = k->tuple;
+      data_len = (d != 0 && d < k->length) ? d : k->length;
+      if (op == TSH_OP_KREAD)
+         k = NULL; /* still in the space */
+      break;
+   }
+   free(t);
+
+   ok = (error == TSH_ER_NOERROR || error == TSH_ER_OVERRT);
+   n = putVarint(rep, id);
+   n += putVarint(rep + n, error);
+   if (ok)
+   {
+      memcpy(rep + n, fld, m);
+      n += m;
+   }
+   ok = sendV2(c->sock, rep, n, data, ok ? data_len : 0);
+   if (taken != NULL)
    {
-      free(t);
-      out.status = htons((short int)FAILURE);
-      out.error = htons((short int)TSH_ER_NOMEM);
+      printf("[TSH SERVER] Deleted tuple: %s\n", taken->name);
+      removeTuple(taken);
+      free(taken->tuple);
+      free(taken);
    }
-   else
-   { /* satisfy pending requests, if possible */
-      if (!consumeTuple(s))
-      {
-         out.error = htons(storeTuple(s, 0));
-      }
-      else
-      {
-         out.error = htons((short int)TSH_ER_NOERROR);
-      }
-      out.status = htons((short int)SUCCESS);
+   if (k != NULL)
+   {
+      free(k->tuple);
+      free(k);
    }
-   writen(newsock, (char *)&out, sizeof(tsh_put_ot));
+   return ok;
 }
 
-// SHELL
-void OpShell()
+/*---------------------------------------------------------------------------
+  Prototype   : int sendV2(int sock, unsigned char *hdr, int hdr_len,
+                           char *payload, unsigned long long payload_len)
+  Parameters  : sock        - v2 connection
+                hdr         - encoded reply header
+                hdr_len     - its length
+                payload     - payload, NULL if payload_len is 0
+                payload_len - payload bytes
+  Returns     : 1 - frame sent
+                0 - write failed or timed out; serviceV2 then drops the
+                    connection
+  Called by   : serviceV2
+  Calls       : putVarint, writen, writeLong
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int sendV2(int sock, unsigned char *hdr, int hdr_len, char *payload,
+           unsigned long long payload_len)
 {
+   unsigned char lens[20];
+   int n;
 
-   tsh_shell_it in;
-   tsh_shell_ot out;
-   char *t;
-   char **args;
-   FILE *myFile;
+   n = putVarint(lens, hdr_len);
+   n += putVarint(lens + n, payload_len);
+   return writen(sock, (char *)lens, n) && writen(sock, (char *)hdr, hdr_len) &&
+          writeLong(sock, payload, payload_len);
+}
 
-   out.error = htons((short int)TSH_ER_NOERROR);
-   out.status = htons((short int)SUCCESS);
+/*---------------------------------------------------------------------------
+  Prototype   : int readVarint(int sock, unsigned long long *v)
+  Parameters  : sock - v2 connection
+                v    - the value read
+  Returns     : 1 - read
+                0 - connection closed or value too long
+  Called by   : serviceV2
+  Calls       : readn
+  Notes       : Reads a byte at a time; only the two frame lengths are
+                read this way, the header is decoded from memory.
+  Date        : October '26
+---------------------------------------------------------------------------*/
 
-   /* read cmd line length */
-   if (!readn(newsock, (char *)&in, sizeof(tsh_shell_it)))
-      return;
+int readVarint(int sock, unsigned long long *v)
+{
+   unsigned char byte;
+   int shift;
 
-   if ((t = (char *)malloc(ntohl(in.length))) == NULL)
+   *v = 0;
+   for (shift = 0; shift < 64; shift += 7)
    {
-      free(t);
-      out.status = htons((short int)FAILURE);
-      out.error = htons((short int)TSH_ER_NOMEM);
-      writen(newsock, (char *)&out, sizeof(tsh_shell_ot));
-      return;
-   } /* read command */
-   if (!readn(newsock, t, ntohl(in.length)))
+      if (!readn(sock, (char *)&byte, 1))
+         return 0;
+      *v |= (unsigned long long)(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+         return 1;
+   }
+   return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int getVarint(unsigned char **p, unsigned char *end,
+                              unsigned long long *v)
+  Parameters  : p   - read position, advanced past the value
+                end - end of the header
+                v   - the value decoded
+  Returns     : 1 - decoded
+                0 - header ran out
+  Called by   : serviceV2
+  Calls       : -
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int getVarint(unsigned char **p, unsigned char *end, unsigned long long *v)
+{
+   int shift;
+
+   *v = 0;
+   for (shift = 0; shift < 64 && *p < end; shift += 7)
    {
-      free(t);
-      return;
+      *v |= (unsigned long long)(**p & 0x7f) << shift;
+      if (!(*(*p)++ & 0x80))
+         return 1;
    }
+   return 0;
+}
 
-   args = tokenize_input(t, SHELL_LINE_DELIM); // parse t into args
+/*---------------------------------------------------------------------------
+  Prototype   : int getString(unsigned char **p, unsigned char *end,
+                              char *str, int size)
+  Parameters  : p    - read position, advanced past the string
+                end  - end of the header
+                str  - buffer for the string, NUL terminated
+                size - size of str
+  Returns     : 1 - decoded
+                0 - header ran out or the string does not fit
+  Called by   : serviceV2
+  Calls       : getVarint, memcpy
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int getString(unsigned char **p, unsigned char *end, char *str, int size)
+{
+   unsigned long long len;
+
+   if (!getVarint(p, end, &len) || len >= (unsigned long long)size ||
+       len > (unsigned long long)(end - *p))
+      return 0;
+   memcpy(str, *p, len);
+   str[len] = '\0';
+   *p += len;
+   return 1;
+}
 
-   // Set up pipe to capture output
-   pipe(filedes);
-   int stdout_backup = dup(STDOUT_FILENO); // Backup stdout
+/*---------------------------------------------------------------------------
+  Prototype   : int putVarint(unsigned char *p, unsigned long long v)
+  Parameters  : p - where to encode, room for 10 bytes
+                v - value
+  Returns     : bytes written
+  Called by   : serviceV2, sendV2, putString
+  Calls       : -
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
 
-   // Redirect stdout to our pipe
-   dup2(filedes[1], STDOUT_FILENO);
-   close(filedes[1]);
+int putVarint(unsigned char *p, unsigned long long v)
+{
+   int n = 0;
 
-   // Execute command with pipe support
-   handle_pipes_and_redirection(args);
+   while (v >= 0x80)
+   {
+      p[n++] = (unsigned char)(v | 0x80);
+      v >>= 7;
+   }
+   p[n++] = (unsigned char)v;
+   return n;
+}
 
-   // Restore stdout
-   dup2(stdout_backup, STDOUT_FILENO);
-   close(stdout_backup);
+/*---------------------------------------------------------------------------
+  Prototype   : int putString(unsigned char *p, char *str)
+  Parameters  : p   - where to encode
+                str - NUL terminated string, shorter than TUPLENAME_LEN
+  Returns     : bytes written
+  Called by   : serviceV2
+  Calls       : putVarint, strlen, memcpy
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
 
-   // Read captured output from the pipe
-   memset(MyShell_output, 0, MAX_STDOUT);
-   read(filedes[0], MyShell_output, MAX_STDOUT - 1);
-   close(filedes[0]);
+int putString(unsigned char *p, char *str)
+{
+   int len = strlen(str), n;
 
-   free(t);
-   free(args);
+   n = putVarint(p, len);
+   memcpy(p + n, str, len);
+   return n + len;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int readLong(int sock, char *buf, unsigned long long len)
+  Parameters  : sock - connection
+                buf  - destination, NULL to read and discard
+                len  - bytes to read
+  Returns     : 1 - read
+                0 - connection closed
+  Called by   : serviceV2
+  Calls       : readn
+  Notes       : readn takes an int length; v2 payloads may be larger.
+  Date        : October '26
+---------------------------------------------------------------------------*/
 
-   myFile = popen("whoami", "r");
-   if (myFile == NULL)
+int readLong(int sock, char *buf, unsigned long long len)
+{
+   char skip[4096];
+   int chunk;
+
+   while (len > 0)
    {
-      perror("myShell");
-      exit(1);
+      chunk = (buf == NULL) ? (len < sizeof(skip) ? len : sizeof(skip))
+                            : (len < 0x40000000 ? len : 0x40000000);
+      if (!readn(sock, buf != NULL ? buf : skip, chunk))
+         return 0;
+      if (buf != NULL)
+         buf += chunk;
+      len -= chunk;
    }
-   while (fgets(out.username, sizeof(out.username), myFile) != NULL)
-      ;
+   return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : int writeLong(int sock, char *buf, unsigned long long len)
+  Parameters  : sock - connection
+                buf  - data
+                len  - bytes to write
+  Returns     : 1 - written
+                0 - write failed
+  Called by   : sendV2
+  Calls       : writen
+  Notes       : As readLong, for writes.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+int writeLong(int sock, char *buf, unsigned long long len)
+{
+   int chunk;
 
-   myFile = popen("pwd", "r");
-   if (myFile == NULL)
+   while (len > 0)
    {
-      perror("myShell");
-      exit(1);
+      chunk = len < 0x40000000 ? len : 0x40000000;
+      if (!writen(sock, buf, chunk))
+         return 0;
+      buf += chunk;
+      len -= chunk;
    }
-   while (fgets(out.cwd_loc, sizeof(out.cwd_loc), myFile) != NULL)
-      ;
+   return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void scheduleTuple(space1_t *s)
+  Parameters  : s - tuple just linked into the space
+  Returns     : -
+  Called by   : storeTuple
+  Calls       : -
+  Notes       : A tuple with an expiry is put in the wheel slot of its
+                expiry tick. Tuples without a TTL are left alone.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void scheduleTuple(space1_t *s)
+{
+   space1_t **slot;
 
-   memcpy(out.out_buffer, MyShell_output, MAX_STDOUT);
-   writen(newsock, (char *)&out, sizeof(tsh_shell_ot));
+   if (s->expires == 0)
+      return;
+   slot = &tsh.wheel[(s->expires / TTL_TICK) % TTL_SLOTS];
+   s->tprev = NULL;
+   s->tnext = *slot;
+   if (*slot != NULL)
+      (*slot)->tprev = s;
+   *slot = s;
+   tsh.ttl_count++;
 }
 
 /*---------------------------------------------------------------------------
-  Prototype   : void OpGet(void)
+  Prototype   : void unscheduleTuple(space1_t *s)
+  Parameters  : s - tuple leaving the space or being overwritten
+  Returns     : -
+  Called by   : removeTuple, storeTuple
+  Calls       : -
+  Notes       : Takes the tuple off the timer wheel, if it is on it.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void unscheduleTuple(space1_t *s)
+{
+   if (s->expires == 0)
+      return;
+   if (s->tprev != NULL)
+      s->tprev->tnext = s->tnext;
+   else if (tsh.wheel[(s->expires / TTL_TICK) % TTL_SLOTS] == s)
+      tsh.wheel[(s->expires / TTL_TICK) % TTL_SLOTS] = s->tnext;
+   else
+      return; /* not on the wheel */
+   if (s->tnext != NULL)
+      s->tnext->tprev = s->tprev;
+   s->tnext = s->tprev = NULL;
+   tsh.ttl_count--;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : void reapTuples(void)
   Parameters  : -
   Returns     : -
   Called by   : start
-  Calls       : findTuple, deleteTuple, storeRequest, readn, writen,
-                strcpy, htons
-  Notes       : This function is called for both TSH_OP_READ and TSH_OP_GET.
-                If the tuple is present in the tuple space it is returned,
-      or else the request is queued.
-  Date        : April '93
-  Coded by    : N. Isaac Rajkumar
-  Modification:
+  Calls       : nowMs, removeTuple, free
+  Notes       : Visits the wheel slots of every tick since the last call
+                (all of them after a full revolution) and deletes the tuples whose
+      TTL has run out. No client is involved.
+  Date        : October '26
 ---------------------------------------------------------------------------*/
 
-void OpGet()
+void reapTuples()
+{
+   space1_t *s, *next;
+   long long now = nowMs();
+   long long tick = now / TTL_TICK, t;
+
+   /* After a revolution or more every slot is visited, once */
+   t = (tick - tsh.wheel_tick < TTL_SLOTS) ? tsh.wheel_tick : tick - TTL_SLOTS + 1;
+   for (; tsh.ttl_count > 0 && t <= tick; t++)
+   {
+      for (s = tsh.wheel[t % TTL_SLOTS]; s != NULL; s = next)
+      {
+         next = s->tnext;
+         if (s->expires <= now)
+         {
+            printf("[TSH SERVER] Expired tuple: %s\n", s->name);
+            removeTuple(s);
+            free(s->tuple);
+            free(s);
+         }
+      }
+   }
+   tsh.wheel_tick = tick; /* the current tick may still hold later entries */
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : long long nextExpiry(void)
+  Parameters  : -
+  Returns     : the nearest tuple expiry in ms [or] the start of the next
+                revolution if every entry is further away [or] -1 if the
+      wheel is empty
+  Called by   : loopTimeout
+  Calls       : -
+  Notes       : Walks the slots from the current tick and stops at the
+                first one holding an entry due in this revolution.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+long long nextExpiry()
 {
-   tsh_get_it in;
-   tsh_get_ot1 out1;
-   tsh_get_ot2 out2;
    space1_t *s;
-   int request_len;
-   /* read tuple name */
-   if (!readn(newsock, (char *)&in, sizeof(tsh_get_it)))
-      return;
-   printf("[TSH SERVER] Received tuple get request for: %s\n", in.expr);
-   in.proc_id = ntohl(in.proc_id);
-   if (guardf(in.host, in.proc_id))
-      return;
-   request_len = ntohl(in.len); /* get user requested length */
-                                /* locate tuple in tuple space */
-   if ((s = findTuple(in.expr)) == NULL)
+   long long t, next = -1;
+
+   if (tsh.ttl_count == 0)
+      return -1;
+   for (t = tsh.wheel_tick; t < tsh.wheel_tick + TTL_SLOTS; t++)
    {
-      out1.status = htons(FAILURE);
-      if (request_len != -1) /* -1: async read/get. Do not queue */
+      for (s = tsh.wheel[t % TTL_SLOTS]; s != NULL; s = s->tnext)
       {
-         if (!storeRequest(in))
-            out1.error = htons(TSH_ER_NOMEM);
-         else
-            out1.error = htons(TSH_ER_NOTUPLE);
+         if (s->expires / TTL_TICK <= t && (next == -1 || s->expires < next))
+            next = s->expires;
       }
-      writen(newsock, (char *)&out1, sizeof(tsh_get_ot1));
-      return;
+      if (next != -1)
+         return next;
    }
-   /* report that tuple exists */
-   out1.status = htons(SUCCESS);
-   out1.error = htons(TSH_ER_NOERROR);
-   if (!writen(newsock, (char *)&out1, sizeof(tsh_get_ot1)))
-      return;
-   /* send tuple name, length and priority */
-   strcpy(out2.name, s->name);
-   if ((s->length > request_len) && (request_len != 0))
-      out2.length = in.len;
-   else
-      out2.length = htonl(s->length);
-   out2.priority = htons(s->priority);
-   if (!writen(newsock, (char *)&out2, sizeof(tsh_get_ot2)))
-      return;
-   /* send the tuple */
-   if (!writen(newsock, s->tuple, ntohl(out2.length) /*s->length*/))
-      return;
+   return (tsh.wheel_tick + TTL_SLOTS) * TTL_TICK;
+}
 
-   if (this_op == TSH_OP_GET) {
-      printf("[TSH SERVER] Deleted tuple: %s\n", s->name);
-      deleteTuple(s, &in);
+/*---------------------------------------------------------------------------
+  Prototype   : struct timeval *loopTimeout(struct timeval *tv)
+  Parameters  : tv - storage for the timeout
+  Returns     : tv set to the time left until the nearest lease, queue
+                wait or tuple expiry [or] NULL (wait forever) if nothing
+      is timed
+  Called by   : start
+  Calls       : nextExpiry, nowMs
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+struct timeval *loopTimeout(struct timeval *tv)
+{
+   lease_t *l;
+   wqueue_t *q;
+   waiter_t *w;
+   long long next = -1, ttl, left;
+
+   for (l = tsh.leases; l != NULL; l = l->next)
+   {
+      if (next == -1 || l->deadline < next)
+         next = l->deadline;
+   }
+   for (q = tsh.wqueues; q != NULL; q = q->next)
+   {
+      for (w = q->waiters; w != NULL; w = w->next)
+      {
+         if (w->deadline != 0 && (next == -1 || w->deadline < next))
+            next = w->deadline;
+      }
    }
+   ttl = nextExpiry();
+   if (ttl != -1 && (next == -1 || ttl < next))
+      next = ttl;
+   if (next == -1)
+      return NULL;
+   left = next - nowMs();
+   if (left < 0)
+      left = 0;
+   tv->tv_sec = left / 1000;
+   tv->tv_usec = (left % 1000) * 1000;
+   return tv;
+}
+
+/*---------------------------------------------------------------------------
+  Prototype   : long long nowMs(void)
+  Parameters  : -
+  Returns     : milliseconds on the monotonic clock
+  Called by   : OpPut, OpTake, OpRenew, expireLeases, reapTuples,
+                loopTimeout
+  Calls       : clock_gettime
+  Notes       : -
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+long long nowMs()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*---------------------------------------------------------------------------
@@ -670,6 +2617,14 @@ void deleteSpace()
 {
    space1_t *s;
    space2_t *p_q;
+   lease_t *l;
+   wqueue_t *q;
+   waiter_t *w;
+   sub_t *u;
+   family_t *f;
+   ktuple_t *k;
+   v2conn_t *c;
+   unsigned long b;
 
    while (tsh.space != NULL)
    {
@@ -685,6 +2640,61 @@ void deleteSpace()
       free(p_q->tuple);
       free(p_q);
    }
+   while (tsh.leases != NULL)
+   {
+      l = tsh.leases;
+      tsh.leases = tsh.leases->next;
+      free(l->s->tuple);
+      free(l->s);
+      free(l);
+   }
+   while (tsh.wqueues != NULL)
+   {
+      q = tsh.wqueues;
+      tsh.wqueues = tsh.wqueues->next;
+      while ((s = q->head) != NULL)
+      {
+         q->head = s->next;
+         free(s->tuple);
+         free(s);
+      }
+      while ((w = q->waiters) != NULL)
+      {
+         q->waiters = w->next;
+         close(w->sock);
+         free(w);
+      }
+      free(q);
+   }
+   while ((u = tsh.subs) != NULL)
+   {
+      tsh.subs = u->next;
+      close(u->sock);
+      free(u);
+   }
+   while ((f = tsh.families) != NULL)
+   {
+      tsh.families = f->next;
+      for (b = 0; b < f->nbuckets; b++)
+      {
+         while ((k = f->buckets[b]) != NULL)
+         {
+            f->buckets[b] = k->next;
+            free(k->tuple);
+            free(k);
+         }
+      }
+      free(f->buckets);
+      free(f);
+   }
+   while ((c = tsh.v2conns) != NULL)
+   {
+      tsh.v2conns = c->next;
+      close(c->sock);
+      free(c);
+   }
+   memset(tsh.wheel, 0, sizeof(tsh.wheel));
+   tsh.ttl_count = 0;
 }
 
 /*---------------------------------------------------------------------------
@@ -812,7 +2822,7 @@ int consumeTuple(space1_t *s)
   Notes       : This function creates a tuple and fills up the attributes.
   Date        : April '93
   Coded by    : N. Isaac Rajkumar
-  Modification:
+  Modification: October '26. Versions come from next_version.
 ---------------------------------------------------------------------------*/
 
 space1_t *createTuple(char *name, char *tuple, unsigned long length, unsigned short priority)
@@ -825,6 +2835,9 @@ space1_t *createTuple(char *name, char *tuple, unsigned long length, unsigned sh
    s->length = length;
    s->tuple = tuple;
    s->priority = priority;
+   s->expires = 0;
+   s->version = next_version++;
+   s->tnext = s->tprev = NULL;
 
    return s; /* return new tuple */
 }
@@ -836,10 +2849,11 @@ space1_t *createTuple(char *name, char *tuple, unsigned long length, unsigned sh
   Called by   : OpPut
   Calls       : strcmp, free
   Notes       : The tuple is stored in the tuple space. If another tuple
-                exists with the same name it is replaced.
+                exists with the same name it is replaced, TTL included.
   Date        : April '93
   Coded by    : N. Isaac Rajkumar
   Modification: Made FIFO from LIFO.
+      October '26. Tuples with a TTL go on the timer wheel.
 ---------------------------------------------------------------------------*/
 
 short int storeTuple(space1_t *s, int f)
@@ -854,6 +2868,10 @@ short int storeTuple(space1_t *s, int f)
          ptr->tuple = s->tuple;
          ptr->length = s->length;
          ptr->priority = s->priority;
+         ptr->version = s->version;
+         unscheduleTuple(ptr);
+         ptr->expires = s->expires;
+         scheduleTuple(ptr);
          free(s);
 
          return ((short int)TSH_ER_OVERRT);
@@ -874,8 +2892,11 @@ short int storeTuple(space1_t *s, int f)
    { /* add tuple retrieved to header of space */
       s->next = tsh.space;
       s->prev = NULL;
+      if (tsh.space != NULL)
+         tsh.space->prev = s;
       tsh.space = s;
    }
+   scheduleTuple(s);
    return ((short int)TSH_ER_NOERROR);
 }
 
@@ -908,6 +2929,29 @@ space1_t *findTuple(char *expr)
    return high; /* return tuple or NULL if no match */
 }
 
+/*---------------------------------------------------------------------------
+  Prototype   : space1_t *findName(char *name)
+  Parameters  : name - exact tuple name
+  Returns     : pointer to the tuple with this name [or] NULL
+  Called by   : OpPutCond, addCounter
+  Calls       : strcmp
+  Notes       : Unlike findTuple there are no wildcards; this is the
+                tuple a put of the same name would overwrite.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+space1_t *findName(char *name)
+{
+   space1_t *s;
+
+   for (s = tsh.space; s != NULL; s = s->next)
+   {
+      if (!strcmp(s->name, name))
+         return s;
+   }
+   return NULL;
+}
+
 /*---------------------------------------------------------------------------
   Prototype   : void deleteTuple(space1_t *s)
   Parameters  : s - pointer to tuple to be deleted from tuple space
@@ -923,13 +2967,7 @@ void deleteTuple(space1_t *s, tsh_get_it *r)
 {
    space2_t *p_q;
 
-   if (s == tsh.space) /* remove tuple from space */
-      tsh.space = s->next;
-   else
-      s->prev->next = s->next;
-
-   if (s->next != NULL)
-      s->next->prev = s->prev;
+   removeTuple(s); /* remove tuple from space */
 
    /* add the tuple into backup queue. FSUN 10/94. */
    p_q = tsh.retrieve;
@@ -971,6 +3009,29 @@ void deleteTuple(space1_t *s, tsh_get_it *r)
    free(s);
 }
 
+/*---------------------------------------------------------------------------
+  Prototype   : void removeTuple(space1_t *s)
+  Parameters  : s - pointer to tuple to be unlinked from tuple space
+  Returns     : -
+  Called by   : deleteTuple, OpTake
+  Calls       : -
+  Notes       : The tuple is unlinked from the space and the timer wheel;
+                the node and its data are left to the caller.
+  Date        : October '26
+---------------------------------------------------------------------------*/
+
+void removeTuple(space1_t *s)
+{
+   unscheduleTuple(s);
+   if (s == tsh.space)
+      tsh.space = s->next;
+   else
+      s->prev->next = s->next;
+
+   if (s->next != NULL)
+      s->next->prev = s->prev;
+}
+
 /*---------------------------------------------------------------------------
   Prototype   : int sendTuple(queue1_t *q, space1_t *s)
   Parameters  : q - pointer to pending request entry in the queue
@@ -1156,7 +3217,8 @@ int getTshport(unsigned short port)
                 I like this function.
   Date        : April '93
   Coded by    : N. Isaac Rajkumar
-  Modification:
+  Modification: October '26. Free the compiled expression; every scan
+      leaked one per tuple.
 ---------------------------------------------------------------------------*/
 
 int match(char *expr, char *name)
@@ -1170,7 +3232,9 @@ int match(char *expr, char *name)
       exit(EXIT_FAILURE);
    }
 
-   if (0 != (rc = regexec(&preg, name, 0, NULL, 0)))
+   rc = regexec(&preg, name, 0, NULL, 0);
+   regfree(&preg);
+   if (0 != rc)
    {
       return 0; /* no match found */
    }
@@ -6,12 +6,18 @@
 #include "synergy.h"
 
 /* Shell-specific constants and variables */
-#define MAX_STDOUT 4096
+#define SHELL_CHUNK 4096 /* bytes forwarded per streamed output chunk */
 #define fixed_buff 64
 #define SHELL_LINE_DELIM " \t\r\n\a"
-int filedes[2]; /* Pipe for shell output capture */
 int background = 0;
-char MyShell_output[MAX_STDOUT];
+char shell_user[64];  /* cached username for the shell prompt */
+char shell_cwd[256];  /* cached working directory, refreshed on cd */
+
+/*  Timer wheel for tuples put with a TTL. A tuple sits in the slot of
+    its expiry tick; entries more than a revolution away are skipped
+    until their turn comes round.  */
+#define TTL_TICK  10  /* ms per wheel slot */
+#define TTL_SLOTS 256 /* slots per revolution */
 
 /*  Tuples data structure.  */
 
@@ -21,11 +27,41 @@ struct t_space1
    char *tuple;              /* pointer to tuple */
    unsigned short priority;  /* priority of the tuple */
    unsigned long length;     /* length of tuple */
+   long long expires;        /* ms on the monotonic clock, 0: never */
+   unsigned long version;    /* from next_version on every change */
    struct t_space1 *next;
    struct t_space1 *prev;
+   struct t_space1 *tnext;   /* timer wheel slot chain */
+   struct t_space1 *tprev;
 };
 typedef struct t_space1 space1_t;
 
+/*  Integer-keyed tuples, by family. A family hashes its 64-bit indexes
+    into a power-of-two bucket array that grows with it, so a dense
+    family of indexes 0..n-1 ends up one tuple per bucket, as in an
+    array. Keyed tuples are apart from the named space.  */
+#define KEY_BUCKETS 64 /* buckets of a new family */
+
+struct t_ktuple
+{
+   unsigned long long index; /* index within the family */
+   char *tuple;              /* pointer to tuple */
+   unsigned long length;     /* length of tuple */
+   unsigned short priority;  /* priority of the tuple */
+   struct t_ktuple *next;    /* bucket chain */
+};
+typedef struct t_ktuple ktuple_t;
+
+struct t_family
+{
+   unsigned long id;          /* family id */
+   ktuple_t **buckets;        /* nbuckets chains */
+   unsigned long nbuckets;    /* power of two */
+   unsigned long count;       /* tuples in the family */
+   struct t_family *next;
+};
+typedef struct t_family family_t;
+
 /*  Backup tuple list. FSUN 09/94 */
 /*  host1(tp) -> host2(tp) -> ... */
 struct t_space2
@@ -56,8 +92,24 @@ typedef struct
    short int error;             /* Error code if any */
    char username[64];           /* Username for prompt */
    char cwd_loc[256];           /* Current working directory for prompt */
-   char out_buffer[MAX_STDOUT]; /* Command output buffer (4096 bytes) */
-} tsh_shell_ot;
+} tsh_shell_ot;                 /* followed by tsh_shell_chunk stream */
+
+typedef struct
+{
+   sng_int32 length; /* bytes of output that follow, 0 ends the stream */
+} tsh_shell_chunk;
+
+/*  Running shell commands. Output is relayed from the child's pipe to
+    the requesting client by the main loop.  */
+
+struct t_shelljob
+{
+   int sock;  /* client connection receiving the output */
+   int fd;    /* read end of the child's stdout pipe */
+   pid_t pid; /* child running the command */
+   struct t_shelljob *next;
+};
+typedef struct t_shelljob shelljob_t;
 
 /*  Pending requests data structure.  */
 
@@ -74,6 +126,68 @@ struct t_queue
 };
 typedef struct t_queue queue1_t;
 
+/*  Named FIFO work queues. Items are tuple nodes chained through next,
+    so a dequeue is O(1) whatever the depth. Consumers blocked on an
+    empty queue hold their connection and are served in arrival order.  */
+
+struct t_waiter
+{
+   int sock;                 /* connection of the blocked consumer */
+   unsigned long len;        /* max bytes accepted, 0: whole item */
+   unsigned long lease_ms;   /* 0: not leased */
+   long long deadline;       /* ms on the monotonic clock, 0: forever */
+   struct t_waiter *next;
+};
+typedef struct t_waiter waiter_t;
+
+struct t_wqueue
+{
+   char name[TUPLENAME_LEN]; /* queue name */
+   space1_t *head;           /* next item dequeued */
+   space1_t *tail;           /* items enqueued here */
+   unsigned long count;      /* items queued */
+   waiter_t *waiters;        /* blocked consumers, oldest first */
+   struct t_wqueue *next;
+};
+typedef struct t_wqueue wqueue_t;
+
+/*  Clients subscribed to tuple arrivals. Each keeps its connection and
+    is sent a note for every tuple put under a name matching expr.  */
+
+struct t_sub
+{
+   int sock;                 /* subscriber connection */
+   char expr[TUPLENAME_LEN]; /* wildcard expression (*, ?) */
+   unsigned long max_len;    /* payload bytes sent with a note */
+   struct t_sub *next;
+};
+typedef struct t_sub sub_t;
+
+/*  Connections that negotiated the v2 framing. They stay open and are
+    served one frame at a time from the main loop.  */
+
+struct t_v2conn
+{
+   int sock;            /* client connection */
+   unsigned long caps;  /* capabilities granted at hello */
+   struct t_v2conn *next;
+};
+typedef struct t_v2conn v2conn_t;
+
+/*  Tuples taken under a lease. They stay out of the space until
+    acknowledged, or are put back with raised priority on expiry.
+    Leased queue items go back to the head of their queue.  */
+
+struct t_lease
+{
+   unsigned long id;    /* lease id handed to the taker */
+   long long deadline;  /* expiry, ms on the monotonic clock */
+   space1_t *s;         /* the tuple, unlinked from the space */
+   wqueue_t *q;         /* queue the item came from, NULL: the space */
+   struct t_lease *next;
+};
+typedef struct t_lease lease_t;
+
 /*  Tuple space data structure.  */
 
 struct
@@ -86,6 +200,15 @@ struct
    space2_t *retrieve; /* list of tuples propobly retrieved. FSUN 09/94 */
    queue1_t *queue_hd; /* queue of waiting requests */
    queue1_t *queue_tl; /* new requests added at the end */
+   shelljob_t *jobs;   /* shell commands still producing output */
+   lease_t *leases;    /* tuples in flight under a lease */
+   wqueue_t *wqueues;  /* named work queues */
+   sub_t *subs;        /* subscribers to tuple arrivals */
+   family_t *families; /* integer-keyed tuples */
+   v2conn_t *v2conns;  /* open v2 connections */
+   space1_t *wheel[TTL_SLOTS]; /* tuples with a TTL, by expiry tick */
+   long long wheel_tick;       /* last tick reaped */
+   unsigned long ttl_count;    /* tuples on the wheel */
 } tsh;
 
 queue1_t *tid_q;
@@ -96,6 +219,9 @@ char mapid[MAP_LEN];
 int EOT = 0; /* End of task tuples mark */
 int TIDS = 0;
 int total_fetched = 0;
+unsigned long next_lease = 1; /* id for the next lease */
+unsigned long next_version = 1; /* never reused, so a re-created tuple
+                                   cannot look unchanged to a cache */
 
 /*  Prototypes.  */
 
@@ -103,6 +229,18 @@ void OpPut(/*void*/);
 void OpGet(/*void*/);
 void OpExit(/*void*/);
 void OpShell(/*void*/); /* Added shell operation */
+void OpTake(/*void*/);
+void OpRenew(/*void*/);
+void OpAck(/*void*/);
+void OpPutCond(/*void*/);
+void OpStat(/*void*/);
+void OpIncr(/*void*/);
+void OpEnq(/*void*/);
+void OpDeq(/*void*/);
+void OpSub(/*void*/);
+void OpKPut(/*void*/);
+void OpKGet(/*void*/);
+void OpHello(/*void*/);
 
 int initCommon(unsigned short);
 void start(/*void*/);
@@ -110,7 +248,40 @@ space1_t *createTuple(char *, char *, unsigned long, unsigned short);
 int consumeTuple(space1_t *);
 short int storeTuple(space1_t *, int);
 space1_t *findTuple(char *);
+space1_t *findName(char *);
 void deleteTuple(space1_t *, tsh_get_it *);
+void removeTuple(space1_t *);
+lease_t *findLease(unsigned long);
+void expireLeases(/*void*/);
+void scheduleTuple(space1_t *);
+void unscheduleTuple(space1_t *);
+void reapTuples(/*void*/);
+long long nextExpiry(/*void*/);
+wqueue_t *findQueue(char *, int);
+void queueItem(wqueue_t *, space1_t *, int);
+int sendItem(int, wqueue_t *, space1_t *, unsigned long, unsigned long);
+void serviceWaiters(fd_set *);
+void notifySubscribers(space1_t *);
+void serviceSubscribers(fd_set *);
+family_t *findFamily(unsigned long, int);
+ktuple_t **findKey(family_t *, unsigned long long);
+int growFamily(family_t *);
+short int storeKeyed(unsigned long, unsigned long long, char *, unsigned long,
+                     unsigned short);
+ktuple_t *lookupKeyed(unsigned long, unsigned long long, int);
+short int addCounter(char *, sng_int32, unsigned short, sng_int32 *);
+short int putTuple(space1_t *);
+int serviceV2(v2conn_t *);
+int sendV2(int, unsigned char *, int, char *, unsigned long long);
+int readVarint(int, unsigned long long *);
+int getVarint(unsigned char **, unsigned char *, unsigned long long *);
+int getString(unsigned char **, unsigned char *, char *, int);
+int putVarint(unsigned char *, unsigned long long);
+int putString(unsigned char *, char *);
+int readLong(int, char *, unsigned long long);
+int writeLong(int, char *, unsigned long long);
+struct timeval *loopTimeout(struct timeval *);
+long long nowMs(/*void*/);
 int storeRequest(tsh_get_it);
 int sendTuple(queue1_t *, space1_t *);
 void deleteSpace(/*void*/);
@@ -135,4 +306,8 @@ int (*builtin_func[])(char **);
 int shell_num_builtins();
 int shell_cd(char **args);
 int shell_help(char **args);
-int shell_exit(char **args);
\ No newline at end of file
+int shell_exit(char **args);
+void refreshShellPrompt(/*void*/);
+shelljob_t *startShellJob(char **args);
+void serviceShellJob(shelljob_t *);
+void endShellJob(shelljob_t *);
\ No newline at end of file
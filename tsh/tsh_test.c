@@ -6,8 +6,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "tshlib.h"
 
+/* Counts streamed shell output bytes */
+static int count_output(const char *chunk, unsigned long len, void *arg)
+{
+    (void)chunk;
+    *(unsigned long *)arg += len;
+    return 0;
+}
+
+/* Adds 1 to the pool test counter 50 times through a shared pool */
+static void *pool_adder(void *arg)
+{
+    TSH_POOL *pool = (TSH_POOL *)arg;
+    TSH_CONN *conn;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        if ((conn = tsh_pool_acquire(pool)) == NULL ||
+            tsh_incr(conn, "pool_counter", 1, NULL) != 0)
+            return (void *)1;
+        tsh_pool_release(pool, conn);
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     TSH_CONN *conn;
@@ -72,7 +98,7 @@ int main(int argc, char **argv)
     printf("Successfully reconnected to TSH server on port %d\n", atoi(argv[1]));
 
     char read_buf[1024];
-    unsigned long read_len;
+    unsigned long read_len = sizeof(read_buf);
     if (tsh_read(conn, "test_tuple", read_buf, &read_len) == 0)
     {
         printf("Read tuple: %s\n", read_buf);
@@ -98,7 +124,7 @@ int main(int argc, char **argv)
     printf("Successfully reconnected to TSH server on port %d\n", atoi(argv[1]));
 
     char buf[1024];
-    unsigned long len;
+    unsigned long len = sizeof(buf);
     if (tsh_get(conn, "test_tuple", buf, &len) == 0)
     {
         printf("Got tuple: %s\n", buf);
@@ -264,5 +290,654 @@ int main(int argc, char **argv)
     }
     printf("PASS\n");
 
+    // Test: shell output larger than MAX_STDOUT is streamed in full
+    printf("\nTest: shell streaming\n");
+    unsigned long streamed = 0;
+    char shell_user[64], shell_cwd[256];
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn) { printf("FAIL (connect for shell)\n"); return 1; }
+    if (tsh_shell_stream(conn, "seq 1 5000", count_output, &streamed, shell_user, shell_cwd) != SUCCESS) {
+        printf("FAIL (shell)\n"); tsh_disconnect(conn); return 1;
+    }
+    tsh_disconnect(conn);
+    if (streamed != 23893) { /* bytes printed by seq 1 5000 */
+        printf("FAIL (streamed %lu bytes, expected 23893)\n", streamed);
+        return 1;
+    }
+    printf("PASS\n");
+
+    // Test: tuple operations are served while a shell command runs
+    printf("\nTest: tuple ops during shell command\n");
+    fflush(stdout);
+    pid_t shell_pid = fork();
+    if (shell_pid == 0) {
+        TSH_CONN *sc = tsh_connect(atoi(argv[1]));
+        if (sc) {
+            tsh_shell(sc, "sleep 2", NULL, NULL, NULL);
+            tsh_disconnect(sc);
+        }
+        exit(0);
+    }
+    usleep(200000);
+    struct timespec op_start, op_end;
+    clock_gettime(CLOCK_MONOTONIC, &op_start);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_during_shell", 1, &test_double, sizeof(double)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    double_len = sizeof(double);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_get(conn, "test_during_shell", (char*)&double_out, &double_len) != 0) {
+        printf("FAIL (get)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    clock_gettime(CLOCK_MONOTONIC, &op_end);
+    waitpid(shell_pid, NULL, 0);
+    if ((op_end.tv_sec - op_start.tv_sec) + (op_end.tv_nsec - op_start.tv_nsec) / 1e9 > 1.0) {
+        printf("FAIL (tuple ops blocked behind shell command)\n");
+        return 1;
+    }
+    printf("PASS\n");
+
+    // Test: leased take is redelivered on expiry and gone after ack
+    printf("\nTest: lease redelivery\n");
+    unsigned long lease_id = 0, lease_id2 = 0;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_lease", 1, &test_double, sizeof(double)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    double_len = sizeof(double);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_take(conn, "test_lease", 200, (char*)&double_out, &double_len, &lease_id) != 0) {
+        printf("FAIL (take)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_take(conn, "test_lease", 200, (char*)&double_out, &double_len, &lease_id2) == 0) {
+        printf("FAIL (tuple visible while leased)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    usleep(400000);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_renew(conn, lease_id, 200) == 0) {
+        printf("FAIL (renewed an expired lease)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_take(conn, "test_lease", 5000, (char*)&double_out, &double_len, &lease_id2) != 0) {
+        printf("FAIL (not redelivered)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_ack(conn, lease_id2) != 0) {
+        printf("FAIL (ack)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    if (double_out != test_double) {
+        printf("FAIL (value mismatch)\n"); return 1;
+    }
+    printf("PASS\n");
+
+    // Test: tuples put with a TTL are reaped by the server
+    printf("\nTest: tuple TTL\n");
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put_ttl(conn, "test_ttl", 1, &test_double, sizeof(double), 150) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    double_len = sizeof(double);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_read(conn, "test_ttl", (char*)&double_out, &double_len) != 0) {
+        printf("FAIL (expired early)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    usleep(300000);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_take(conn, "test_ttl", 1000, (char*)&double_out, &double_len, &lease_id) == 0) {
+        printf("FAIL (still present after TTL)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: put-if-absent and compare-and-swap report the winner
+    printf("\nTest: conditional put\n");
+    unsigned long version = 0;
+    int first = 1, second = 2;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put_nx(conn, "test_cond", 1, &first, sizeof(int), 0) != 1) {
+        printf("FAIL (first put_nx)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put_nx(conn, "test_cond", 1, &second, sizeof(int), 0) != 0) {
+        printf("FAIL (second put_nx won)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_cas(conn, "test_cond", 1, &second, sizeof(int), 0, &version) != 0 || version == 0) {
+        printf("FAIL (cas with stale version)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    unsigned long old_version = version;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_cas(conn, "test_cond", 1, &second, sizeof(int), old_version, &version) != 1 ||
+        version <= old_version) {
+        printf("FAIL (cas with current version)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    int cond_out = 0;
+    unsigned long cond_len = sizeof(int);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_get(conn, "test_cond", (char*)&cond_out, &cond_len) != 0 || cond_out != second) {
+        printf("FAIL (stored value)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: stat reports metadata only, and reads honor the buffer size
+    printf("\nTest: stat\n");
+    unsigned long stat_len = 0, stat_version = 0;
+    unsigned short stat_priority = 0;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_stat", 3, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_stat(conn, "test_stat", &stat_len, &stat_priority, &stat_version) != 1) {
+        printf("FAIL (stat)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    if (stat_len != sizeof(test_array) || stat_priority != 3 || stat_version == 0) {
+        printf("FAIL (stat got len %lu prio %u version %lu)\n", stat_len, stat_priority, stat_version);
+        return 1;
+    }
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_stat(conn, "test_stat_missing", NULL, NULL, NULL) != 0) {
+        printf("FAIL (stat of missing tuple)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    double short_buf[2] = {0, 0};
+    unsigned long short_len = sizeof(double);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_get(conn, "test_stat", (char*)short_buf, &short_len) != 0) {
+        printf("FAIL (get)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    if (short_len != sizeof(double) || short_buf[0] != test_array[0] || short_buf[1] != 0) {
+        printf("FAIL (get overran the buffer)\n"); return 1;
+    }
+    printf("PASS\n");
+
+    // Test: counter tuples add atomically and read back as 4 bytes
+    printf("\nTest: counter\n");
+    long counter = 0;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "test_counter", 5, &counter) != 0 || counter != 5) {
+        printf("FAIL (create, got %ld)\n", counter); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "test_counter", -7, &counter) != 0 || counter != -2) {
+        printf("FAIL (add, got %ld)\n", counter); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "test_counter", 0, &counter) != 0 || counter != -2) {
+        printf("FAIL (fetch, got %ld)\n", counter); return 1;
+    }
+    tsh_disconnect(conn);
+    int counter_raw = 0;
+    unsigned long counter_len = sizeof(counter_raw);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_get(conn, "test_counter", (char*)&counter_raw, &counter_len) != 0 ||
+        counter_len != sizeof(counter_raw) || (int)ntohl(counter_raw) != -2) {
+        printf("FAIL (get)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "test_counter", 0, &counter) != -1) {
+        printf("FAIL (fetch of a missing counter)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_stat(conn, "test_counter", NULL, NULL, NULL) != 0) {
+        printf("FAIL (fetch created the counter)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_not_counter", 1, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "test_not_counter", 1, NULL) != -1) {
+        printf("FAIL (add to a non-counter)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: work queues are FIFO, can block, and redeliver expired leases
+    printf("\nTest: work queue\n");
+    int item, item_out = -1;
+    unsigned long item_len;
+    for (item = 1; item <= 3; item++) {
+        conn = tsh_connect(atoi(argv[1]));
+        if (!conn || tsh_enqueue(conn, "test_queue", &item, sizeof(item)) != 0) {
+            printf("FAIL (enqueue)\n"); return 1;
+        }
+        tsh_disconnect(conn);
+    }
+    for (item = 1; item <= 3; item++) {
+        item_len = sizeof(item_out);
+        conn = tsh_connect(atoi(argv[1]));
+        if (!conn || tsh_dequeue(conn, "test_queue", (char*)&item_out, &item_len, 0, 0, NULL) != 1 ||
+            item_out != item) {
+            printf("FAIL (dequeue %d got %d)\n", item, item_out); return 1;
+        }
+        tsh_disconnect(conn);
+    }
+    item_len = sizeof(item_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_dequeue(conn, "test_queue", (char*)&item_out, &item_len, 0, 0, NULL) != 0) {
+        printf("FAIL (dequeue from an empty queue)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    item_len = sizeof(item_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_dequeue(conn, "test_queue", (char*)&item_out, &item_len, 200, 0, NULL) != 0) {
+        printf("FAIL (timed wait on an empty queue)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    fflush(stdout);
+    pid_t producer = fork();
+    if (producer == 0) {
+        usleep(200000);
+        int late = 42;
+        TSH_CONN *pc = tsh_connect(atoi(argv[1]));
+        if (pc) {
+            tsh_enqueue(pc, "test_queue", &late, sizeof(late));
+            tsh_disconnect(pc);
+        }
+        exit(0);
+    }
+    item_len = sizeof(item_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_dequeue(conn, "test_queue", (char*)&item_out, &item_len, TSH_WAIT_FOREVER, 200,
+                             &lease_id) != 1 || item_out != 42) {
+        printf("FAIL (blocking dequeue)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    waitpid(producer, NULL, 0);
+    item_out = -1;
+    item_len = sizeof(item_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_dequeue(conn, "test_queue", (char*)&item_out, &item_len, 2000, 0, NULL) != 1 ||
+        item_out != 42) {
+        printf("FAIL (expired lease not redelivered)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: subscribers are notified of matching puts only
+    printf("\nTest: subscribe\n");
+    char note_name[TUPLENAME_LEN];
+    unsigned long note_length = 0, note_len;
+    int note_payload = 0;
+    TSH_CONN *sub = tsh_connect(atoi(argv[1]));
+    if (!sub || tsh_subscribe(sub, "test_sub_", sizeof(note_payload)) != 0) {
+        printf("FAIL (subscribe)\n"); return 1;
+    }
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_unwatched", 1, &test_double, sizeof(double)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_sub_a", 1, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    note_len = sizeof(note_payload);
+    if (tsh_next_note(sub, note_name, &note_length, (char*)&note_payload, &note_len, 1000) != 1 ||
+        strcmp(note_name, "test_sub_a") != 0 || note_length != sizeof(test_array) ||
+        note_len != sizeof(note_payload) || memcmp(&note_payload, test_array, sizeof(note_payload)) != 0) {
+        printf("FAIL (note)\n"); return 1;
+    }
+    note_len = sizeof(note_payload);
+    if (tsh_next_note(sub, note_name, &note_length, (char*)&note_payload, &note_len, 100) != 0) {
+        printf("FAIL (note for an unwatched name)\n"); return 1;
+    }
+    tsh_disconnect(sub);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_sub_b", 1, &test_double, sizeof(double)) != 0) {
+        printf("FAIL (put after unsubscribing)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: keyed tuples, dense enough to make the family grow
+    printf("\nTest: integer keys\n");
+    unsigned long long key_index;
+    long key_value, key_out;
+    unsigned long key_len;
+    for (key_index = 0; key_index < 200; key_index++) {
+        key_value = (long)key_index * 3;
+        conn = tsh_connect(atoi(argv[1]));
+        if (!conn || tsh_kput(conn, 7, key_index, 1, &key_value, sizeof(key_value)) != 0) {
+            printf("FAIL (kput %llu)\n", key_index); return 1;
+        }
+        tsh_disconnect(conn);
+    }
+    key_value = -1;
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_kput(conn, 7, 1ULL << 40, 1, &key_value, sizeof(key_value)) != 0) {
+        printf("FAIL (kput of a 64-bit index)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    for (key_index = 0; key_index < 200; key_index++) {
+        key_len = sizeof(key_out);
+        conn = tsh_connect(atoi(argv[1]));
+        if (!conn || tsh_kread(conn, 7, key_index, (char*)&key_out, &key_len) != 0 ||
+            key_out != (long)key_index * 3) {
+            printf("FAIL (kread %llu)\n", key_index); return 1;
+        }
+        tsh_disconnect(conn);
+    }
+    key_len = sizeof(key_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_kget(conn, 7, 1ULL << 40, (char*)&key_out, &key_len) != 0 || key_out != -1) {
+        printf("FAIL (kget of a 64-bit index)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    key_len = sizeof(key_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_kread(conn, 7, 1ULL << 40, (char*)&key_out, &key_len) != -1) {
+        printf("FAIL (kget did not remove)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    key_len = sizeof(key_out);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_kread(conn, 8, 0, (char*)&key_out, &key_len) != -1) {
+        printf("FAIL (families are separate)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: one v2 connection carrying many ops, interoperating with v1
+    printf("\nTest: v2 protocol\n");
+    TSH_CONN *v2;
+    double v2_array[16];
+    unsigned long v2_len, v2_length, v2_version;
+    unsigned short v2_priority;
+    long v2_value;
+    v2 = tsh_connect_v2(atoi(argv[1]));
+    if (!v2 || v2->version != TSH_V2 || !(v2->caps & TSH_CAP_KEYS)) {
+        printf("FAIL (hello)\n"); return 1;
+    }
+    if (tsh_put(v2, "v2_tuple", 4, test_array, sizeof(test_array)) != 0 ||
+        tsh_put_ttl(v2, "v2_ttl_tuple", 1, &test_double, sizeof(double), 60000) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    if (tsh_stat(v2, "v2_tuple", &v2_length, &v2_priority, &v2_version) != 1 ||
+        v2_length != sizeof(test_array) || v2_priority != 4 || v2_version == 0 ||
+        tsh_stat(v2, "v2_absent", NULL, NULL, NULL) != 0) {
+        printf("FAIL (stat)\n"); return 1;
+    }
+    v2_len = sizeof(double);
+    if (tsh_read(v2, "v2_tuple", (char*)v2_array, &v2_len) != 0 || v2_len != sizeof(double) ||
+        v2_array[0] != test_array[0]) {
+        printf("FAIL (read cut to the buffer)\n"); return 1;
+    }
+    if (tsh_incr(v2, "v2_counter", -5, &v2_value) != 0 || v2_value != -5 ||
+        tsh_incr(v2, "v2_counter", 7, &v2_value) != 0 || v2_value != 2) {
+        printf("FAIL (incr)\n"); return 1;
+    }
+    if (tsh_kput(v2, 9, 1ULL << 33, 1, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (kput)\n"); return 1;
+    }
+    v2_len = sizeof(v2_array);
+    if (tsh_kread(v2, 9, 1ULL << 33, (char*)v2_array, &v2_len) != 0 ||
+        v2_len != sizeof(test_array) || memcmp(v2_array, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (kread)\n"); return 1;
+    }
+    v2_len = sizeof(v2_array);
+    if (tsh_get(v2, "v2_tuple", (char*)v2_array, &v2_len) != 0 ||
+        v2_len != sizeof(test_array) || memcmp(v2_array, test_array, sizeof(test_array)) != 0) {
+        printf("FAIL (get)\n"); return 1;
+    }
+    v2_len = sizeof(v2_array);
+    if (tsh_get(v2, "v2_tuple", (char*)v2_array, &v2_len) != -1 ||
+        tsh_send_op(v2, TSH_OP_GET) != -1) {
+        printf("FAIL (miss or v1 op on a v2 connection)\n"); return 1;
+    }
+    conn = tsh_connect(atoi(argv[1]));
+    v2_len = sizeof(v2_array);
+    if (!conn || tsh_kget(conn, 9, 1ULL << 33, (char*)v2_array, &v2_len) != 0 ||
+        v2_len != sizeof(test_array)) {
+        printf("FAIL (v1 kget of a v2 kput)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_incr(conn, "v2_counter", 0, &v2_value) != 0 || v2_value != 2) {
+        printf("FAIL (v1 view of a v2 counter)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    v2_len = sizeof(v2_array);
+    if (tsh_get(v2, "v2_ttl_tuple", (char*)v2_array, &v2_len) != 0 || v2_array[0] != test_double) {
+        printf("FAIL (get after v1 use)\n"); return 1;
+    }
+    tsh_disconnect(v2);
+    printf("PASS\n");
+
+    // Test: pipelined requests, completions in submission order
+    printf("\nTest: async requests\n");
+    TSH_CONN *as;
+    tsh_completion as_done;
+    unsigned long long as_id[100], as_index;
+    long as_out[100];
+    int as_count;
+    as = tsh_connect_v2(atoi(argv[1]));
+    if (!as) {
+        printf("FAIL (connect)\n"); return 1;
+    }
+    for (as_index = 0; as_index < 100; as_index++) {
+        key_value = (long)as_index + 1000;
+        as_id[as_index] = tsh_submit_kput(as, 11, as_index, 1, &key_value, sizeof(key_value));
+        if (as_id[as_index] == 0 || (as_index > 0 && as_id[as_index] <= as_id[as_index - 1])) {
+            printf("FAIL (submit kput %llu)\n", as_index); return 1;
+        }
+    }
+    if (tsh_submit_put(as, "async_tuple", 1, &test_double, sizeof(double), 0) == 0) {
+        printf("FAIL (submit put)\n"); return 1;
+    }
+    for (as_count = 0; tsh_wait(as, &as_done, 1000) == 1; as_count++) {
+        if (as_done.status != 0 || (as_count < 100 && as_done.id != as_id[as_count])) {
+            printf("FAIL (put completion %d)\n", as_count); return 1;
+        }
+    }
+    if (as_count != 101 || tsh_pending(as) != 0) {
+        printf("FAIL (%d put completions)\n", as_count); return 1;
+    }
+    for (as_index = 0; as_index < 100; as_index++)
+        as_id[as_index] = tsh_submit_kread(as, 11, as_index, (char*)&as_out[as_index], sizeof(long));
+    tsh_submit_read(as, "async_absent", (char*)&key_out, sizeof(key_out));
+    if (tsh_pending(as) != 101 || tsh_stat(as, "async_tuple", NULL, NULL, NULL) != 1) {
+        printf("FAIL (blocking call between submissions)\n"); return 1;
+    }
+    for (as_count = 0; as_count < 100; as_count++) {
+        if (tsh_wait(as, &as_done, -1) != 1 || as_done.id != as_id[as_count] ||
+            as_done.status != 0 || as_done.length != sizeof(long) ||
+            as_out[as_count] != as_count + 1000) {
+            printf("FAIL (read completion %d)\n", as_count); return 1;
+        }
+    }
+    if (tsh_poll(as, &as_done) != 1 || as_done.status != -1 || as_done.op != TSH_OP_READ ||
+        tsh_poll(as, &as_done) != 0) {
+        printf("FAIL (miss completion)\n"); return 1;
+    }
+    tsh_disconnect(as);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_submit_get(conn, "async_tuple", (char*)&key_out, sizeof(key_out)) != 0) {
+        printf("FAIL (submit on a v1 connection)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: a v2 client that stops reading its replies is dropped rather
+    // than holding up every other client
+    printf("\nTest: stalled v2 client\n");
+    unsigned long stall_size = 1 << 20;
+    char *stall_buf = malloc(stall_size);
+    TSH_CONN *stall = tsh_connect_v2(atoi(argv[1]));
+    if (!stall_buf || !stall) {
+        printf("FAIL (connect)\n"); return 1;
+    }
+    memset(stall_buf, 1, stall_size);
+    if (tsh_kput(stall, 12, 0, 1, stall_buf, stall_size) != 0) {
+        printf("FAIL (kput)\n"); return 1;
+    }
+    // Far more reply bytes than the socket buffers hold, never collected
+    for (as_index = 0; as_index < 64; as_index++)
+        tsh_submit_kread(stall, 12, 0, stall_buf, stall_size);
+    usleep(200000);
+    clock_gettime(CLOCK_MONOTONIC, &op_start);
+    conn = tsh_connect(atoi(argv[1]));
+    if (!conn || tsh_put(conn, "test_after_stall", 1, &test_double, sizeof(double)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    clock_gettime(CLOCK_MONOTONIC, &op_end);
+    tsh_disconnect(stall);
+    free(stall_buf);
+    if ((op_end.tv_sec - op_start.tv_sec) + (op_end.tv_nsec - op_start.tv_nsec) / 1e9 > 3.0) {
+        printf("FAIL (tuple ops blocked behind a stalled v2 client)\n");
+        return 1;
+    }
+    conn = tsh_connect(atoi(argv[1]));
+    double_len = sizeof(double);
+    if (!conn || tsh_get(conn, "test_after_stall", (char*)&double_out, &double_len) != 0) {
+        printf("FAIL (get)\n"); return 1;
+    }
+    tsh_disconnect(conn);
+    printf("PASS\n");
+
+    // Test: a pool shared by more threads than it has connections, then
+    // used on both sides of a fork
+    printf("\nTest: connection pool\n");
+    TSH_POOL *pool = tsh_pool_create(atoi(argv[1]), 2);
+    TSH_CONN *pool_conn, *pool_again;
+    pthread_t pool_threads[4];
+    void *pool_ret;
+    long pool_total;
+    int pool_i, pool_failed = 0;
+    if (!pool) {
+        printf("FAIL (create)\n"); return 1;
+    }
+    for (pool_i = 0; pool_i < 4; pool_i++)
+        pthread_create(&pool_threads[pool_i], NULL, pool_adder, pool);
+    for (pool_i = 0; pool_i < 4; pool_i++) {
+        pthread_join(pool_threads[pool_i], &pool_ret);
+        if (pool_ret != NULL)
+            pool_failed = 1;
+    }
+    pool_conn = tsh_pool_acquire(pool);
+    if (pool_failed || !pool_conn || tsh_incr(pool_conn, "pool_counter", 0, &pool_total) != 0 ||
+        pool_total != 200) {
+        printf("FAIL (threads)\n"); return 1;
+    }
+    tsh_pool_release(pool, pool_conn);
+    fflush(stdout);
+    pid_t pool_child = fork();
+    if (pool_child == 0) {
+        pool_conn = tsh_pool_acquire(pool);
+        exit(!pool_conn || tsh_incr(pool_conn, "pool_counter", 1, NULL) != 0);
+    }
+    waitpid(pool_child, &pool_i, 0);
+    pool_again = tsh_pool_acquire(pool);
+    if (pool_i != 0 || pool_again != pool_conn ||
+        tsh_incr(pool_again, "pool_counter", 0, &pool_total) != 0 || pool_total != 201) {
+        printf("FAIL (fork)\n"); return 1;
+    }
+    tsh_pool_release(pool, pool_again);
+    tsh_pool_destroy(pool);
+    printf("PASS\n");
+
+    // Test: client cache; another process changes the tuples behind it
+    printf("\nTest: client cache\n");
+    TSH_CONN *cc;
+    unsigned long cache_hits, cache_misses, cache_len;
+    long cache_out;
+    pid_t cache_child;
+    tsh_cache_family(13);
+    tsh_cache_names("cached_", TSH_CACHE_VERSIONED);
+    cc = tsh_connect_v2(atoi(argv[1]));
+    key_value = 1;
+    if (!cc || tsh_kput(cc, 13, 5, 1, &key_value, sizeof(key_value)) != 0 ||
+        tsh_put(cc, "cached_v", 1, &key_value, sizeof(key_value)) != 0) {
+        printf("FAIL (put)\n"); return 1;
+    }
+    for (pool_i = 0; pool_i < 2; pool_i++) {
+        cache_len = sizeof(cache_out);
+        if (tsh_kread(cc, 13, 5, (char*)&cache_out, &cache_len) != 0 || cache_out != 1) {
+            printf("FAIL (kread)\n"); return 1;
+        }
+        cache_len = sizeof(cache_out);
+        if (tsh_read(cc, "cached_v", (char*)&cache_out, &cache_len) != 0 || cache_out != 1) {
+            printf("FAIL (read)\n"); return 1;
+        }
+    }
+    tsh_cache_stats(&cache_hits, &cache_misses);
+    if (cache_hits != 2 || cache_misses != 2) {
+        printf("FAIL (%lu hits, %lu misses)\n", cache_hits, cache_misses); return 1;
+    }
+    fflush(stdout);
+    if ((cache_child = fork()) == 0) {
+        cache_len = sizeof(cache_out);
+        conn = tsh_connect_v2(atoi(argv[1]));
+        key_value = 3;
+        exit(!conn || tsh_get(conn, "cached_v", (char*)&cache_out, &cache_len) != 0 ||
+             tsh_put(conn, "cached_v", 1, &key_value, sizeof(key_value)) != 0);
+    }
+    waitpid(cache_child, NULL, 0);
+    cache_len = sizeof(cache_out);
+    if (tsh_read(cc, "cached_v", (char*)&cache_out, &cache_len) != 0 || cache_out != 3) {
+        printf("FAIL (re-created tuple served from the cache)\n"); return 1;
+    }
+    if ((cache_child = fork()) == 0) {
+        conn = tsh_connect(atoi(argv[1]));
+        key_value = 2;
+        exit(!conn || tsh_kput(conn, 13, 5, 1, &key_value, sizeof(key_value)) != 0);
+    }
+    waitpid(cache_child, NULL, 0);
+    if ((cache_child = fork()) == 0) {
+        conn = tsh_connect(atoi(argv[1]));
+        key_value = 2;
+        exit(!conn || tsh_put(conn, "cached_v", 1, &key_value, sizeof(key_value)) != 0);
+    }
+    waitpid(cache_child, NULL, 0);
+    cache_len = sizeof(cache_out);
+    if (tsh_kread(cc, 13, 5, (char*)&cache_out, &cache_len) != 0 || cache_out != 1) {
+        printf("FAIL (immutable tuple not served locally)\n"); return 1;
+    }
+    cache_len = sizeof(cache_out);
+    if (tsh_read(cc, "cached_v", (char*)&cache_out, &cache_len) != 0 || cache_out != 2) {
+        printf("FAIL (stale versioned tuple)\n"); return 1;
+    }
+    key_value = 3;
+    if (tsh_kput(cc, 13, 5, 1, &key_value, sizeof(key_value)) != 0 ||
+        tsh_submit_kread(cc, 13, 5, (char*)&cache_out, sizeof(cache_out)) == 0 ||
+        tsh_wait(cc, &as_done, 1000) != 1 || as_done.status != 0 || cache_out != 3) {
+        printf("FAIL (own kput not seen)\n"); return 1;
+    }
+    if (tsh_submit_kread(cc, 13, 5, (char*)&cache_out, sizeof(cache_out)) == 0 ||
+        tsh_poll(cc, &as_done) != 1 || cache_out != 3) {
+        printf("FAIL (async read not served locally)\n"); return 1;
+    }
+    tsh_disconnect(cc);
+    printf("PASS\n");
+
     return 0;
-}
\ No newline at end of file
+}
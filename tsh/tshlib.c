@@ -8,8 +8,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include "tshlib.h"
 
+/* An asynchronous request, kept from submission until its completion has
+   been collected */
+struct tsh_req {
+    unsigned long long id;
+    unsigned short op;
+    char *outbuf;          /* where the reply payload goes, NULL if none */
+    unsigned long max;     /* size of outbuf, 0 if unchecked */
+    int answered;          /* reply read */
+    int error;             /* its error code */
+    unsigned long length;  /* payload bytes placed in outbuf */
+    int cache;             /* a keyed read to cache once complete */
+    unsigned long family;
+    unsigned long long index;
+    struct tsh_req *next;
+};
+
 /*---------------------------------------------------------------------------
   Function    : tsh_connect
   Parameters  : port - port number of the TSH server
@@ -55,6 +74,11 @@ TSH_CONN *tsh_connect(unsigned short port)
     /* Store connection information */
     conn->sock = sock;
     conn->port = port;
+    conn->version = 1;
+    conn->caps = 0;
+    conn->next_id = 1;
+    conn->pending = NULL;
+    conn->pending_tail = NULL;
 
     return conn;
 }
@@ -76,6 +100,14 @@ int tsh_disconnect(TSH_CONN *conn)
     /* Close the socket */
     close(conn->sock);
 
+    /* Completions nobody collected are dropped */
+    while (conn->pending != NULL)
+    {
+        struct tsh_req *req = conn->pending;
+        conn->pending = req->next;
+        free(req);
+    }
+
     /* Free the connection structure */
     free(conn);
 
@@ -83,263 +115,2462 @@ int tsh_disconnect(TSH_CONN *conn)
 }
 
 /*---------------------------------------------------------------------------
-  Function    : tsh_put
-  Parameters  : conn - pointer to TSH connection handle
-                name - name of the tuple to store
-                priority - priority of the tuple (higher value = higher priority)
-                tuple - pointer to the tuple data
-                length - length of the tuple data in bytes
-  Returns     : 0 on success, -1 on failure
-  Description : Puts a tuple into the tuple space
+  Function    : tsh_connect_v2
+  Parameters  : port - port number of the TSH server
+  Returns     : Pointer to TSH_CONN structure or NULL on failure
+  Description : Connects and asks the server for the v2 protocol. On a v2
+                connection requests are framed, lengths are 64 bit and
+                the connection stays open for any number of requests. An
+                older server refuses the hello by closing the connection;
+                the handle returned is then a v1 one (conn->version 1),
+                good for one op as with tsh_connect.
 ---------------------------------------------------------------------------*/
-int tsh_put(TSH_CONN *conn, const char *name, unsigned short priority,
-            const void *tuple, unsigned long length)
+TSH_CONN *tsh_connect_v2(unsigned short port)
 {
-    tsh_put_it out;
-    tsh_put_ot in;
+    TSH_CONN *conn;
+    tsh_hello_it out;
+    tsh_hello_ot in;
 
-    if (conn == NULL || name == NULL || tuple == NULL)
-    {
-        fprintf(stderr, "tsh_put: Invalid parameters\n");
-        return -1;
-    }
+    if ((conn = tsh_connect(port)) == NULL)
+        return NULL;
 
-    /* Send PUT operation code to TSH */
-    if (tsh_send_op(conn, TSH_OP_PUT) != 0)
+    out.magic = htonl(TSH_V2_MAGIC);
+    out.version = htons(TSH_V2);
+    out.caps = htonl(TSH_CAP_ALL);
+
+    if (tsh_send_op(conn, TSH_OP_HELLO) == 0 &&
+        writen(conn->sock, (char *)&out, sizeof(out)) &&
+        readn(conn->sock, (char *)&in, sizeof(in)) &&
+        ntohs(in.status) == SUCCESS && ntohs(in.version) == TSH_V2)
     {
-        return -1;
+        conn->version = TSH_V2;
+        conn->caps = ntohl(in.caps);
+        return conn;
     }
 
-    /* Initialize the PUT input structure */
-    memset(&out, 0, sizeof(out));
-    strncpy(out.name, name, TUPLENAME_LEN - 1);
-    out.name[TUPLENAME_LEN - 1] = '\0'; /* ensure null-termination */
-    out.priority = htons(priority);     /* convert to network byte order */
-    out.length = htonl(length);         /* convert to network byte order */
-    out.host = inet_addr("127.0.0.1");  /* localhost for now */
-    out.proc_id = htonl(getpid());      /* process ID */
+    /* Refused: fall back to a fresh v1 connection */
+    tsh_disconnect(conn);
+    return tsh_connect(port);
+}
 
-    /* Send tuple metadata to TSH server */
-    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+/* Encodes v as a LEB128 varint, returns the bytes written */
+static int tsh_v2_varint(unsigned char *p, unsigned long long v)
+{
+    int n = 0;
+
+    while (v >= 0x80)
     {
-        perror("tsh_put: Failed to send tuple metadata");
-        return -1;
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
     }
+    p[n++] = (unsigned char)v;
+    return n;
+}
 
-    /* Send the actual tuple data to TSH server */
-    if (!writen(conn->sock, (char *)tuple, length))
+/* Encodes a string as its length and bytes, cut to a tuple name */
+static int tsh_v2_string(unsigned char *p, const char *str)
+{
+    int len = strlen(str), n;
+
+    if (len > TUPLENAME_LEN - 1)
+        len = TUPLENAME_LEN - 1;
+    n = tsh_v2_varint(p, len);
+    memcpy(p + n, str, len);
+    return n + len;
+}
+
+/* Starts a request header with op and the connection's next request id */
+static int tsh_v2_begin(TSH_CONN *conn, unsigned char *hdr, unsigned short op_code)
+{
+    int n = tsh_v2_varint(hdr, op_code);
+
+    return n + tsh_v2_varint(hdr + n, conn->next_id++);
+}
+
+/* Decodes a varint of a reply header, 0 if the header ran out */
+static int tsh_v2_field(unsigned char **p, unsigned char *end, unsigned long long *v)
+{
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64 && *p < end; shift += 7)
     {
-        perror("tsh_put: Failed to send tuple data");
-        return -1;
+        *v |= (unsigned long long)(**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80))
+            return 1;
     }
+    return 0;
+}
 
-    /* Read response from TSH server */
-    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+/* Reads a frame length a byte at a time */
+static int tsh_v2_length(int sock, unsigned long long *v)
+{
+    unsigned char byte;
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7)
     {
-        perror("tsh_put: Failed to read server response");
-        return -1;
+        if (!readn(sock, (char *)&byte, 1))
+            return 0;
+        *v |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 1;
     }
+    return 0;
+}
 
-    /* Check response status */
-    if (ntohs(in.status) != SUCCESS)
+/* readn/writen take an int length; these move 64-bit lengths in chunks,
+   tsh_v2_readn discarding the data when buf is NULL */
+static int tsh_v2_readn(int sock, char *buf, unsigned long long len)
+{
+    char skip[4096];
+    int chunk;
+
+    while (len > 0)
     {
-        fprintf(stderr, "tsh_put: Server reported failure, error code: %d\n",
-                ntohs(in.error));
-        return -1;
+        chunk = (buf == NULL) ? (len < sizeof(skip) ? len : sizeof(skip))
+                              : (len < 0x40000000 ? len : 0x40000000);
+        if (!readn(sock, buf != NULL ? buf : skip, chunk))
+            return 0;
+        if (buf != NULL)
+            buf += chunk;
+        len -= chunk;
     }
-
-    return 0;
+    return 1;
 }
 
-/*---------------------------------------------------------------------------
-  Function    : tsh_send_op
-  Parameters  : conn - pointer to TSH connection handle
-                op_code - operation code to send
-  Returns     : 0 on success, -1 on failure
-  Description : Sends an operation code to the TSH server
----------------------------------------------------------------------------*/
-int tsh_send_op(TSH_CONN *conn, unsigned short op_code)
+static int tsh_v2_writen(int sock, const char *buf, unsigned long long len)
 {
-    unsigned short network_op;
+    int chunk;
 
-    if (conn == NULL)
+    while (len > 0)
     {
-        fprintf(stderr, "tsh_send_op: NULL connection handle\n");
-        return -1;
+        chunk = len < 0x40000000 ? len : 0x40000000;
+        if (!writen(sock, (char *)buf, chunk))
+            return 0;
+        buf += chunk;
+        len -= chunk;
     }
+    return 1;
+}
 
-    /* Convert operation code to network byte order */
-    network_op = htons(op_code);
+/* Sends one request frame */
+static int tsh_v2_send(TSH_CONN *conn, const unsigned char *hdr, int hdr_len,
+                       const void *payload, unsigned long long payload_len)
+{
+    unsigned char lens[20];
+    int n;
 
-    /* Send operation code to TSH */
-    if (!writen(conn->sock, (char *)&network_op, sizeof(network_op)))
+    n = tsh_v2_varint(lens, hdr_len);
+    n += tsh_v2_varint(lens + n, payload_len);
+    if (!writen(conn->sock, (char *)lens, n) ||
+        !writen(conn->sock, (char *)hdr, hdr_len) ||
+        !tsh_v2_writen(conn->sock, (const char *)payload, payload_len))
     {
-        perror("tsh_send_op: Failed to send operation code");
+        perror("tsh_v2_send: Failed to send request");
         return -1;
     }
-
     return 0;
 }
 
-/*---------------------------------------------------------------------------
-  Function    : tsh_get
-  Parameters  : conn - pointer to TSH connection handle
-                expr - expression to match the tuple
-                outbuf - buffer to store the tuple data
-                outlen - pointer to store the length of the tuple data
-  Returns     : 0 on success, -1 on failure
-  Description : Retrieves a tuple from the tuple space
----------------------------------------------------------------------------*/
-int tsh_get(TSH_CONN *conn, const char *expr, char *outbuf, unsigned long *outlen)
+/* Reads one reply frame: its request id, its fields into fld (TSH_V2_MAXHDR
+   bytes, length to *fld_len) and up to max payload bytes (0: all) into
+   outbuf, discarding the rest. Returns the reply's error code, -1 if the
+   connection broke */
+static int tsh_v2_recv(TSH_CONN *conn, unsigned long long *id, unsigned char *fld,
+                       int *fld_len, char *outbuf, unsigned long max,
+                       unsigned long *outlen)
 {
-    tsh_get_it out;
-    tsh_get_ot1 in1;
-    tsh_get_ot2 in2;
-
-    memset(&out, 0, sizeof(out));
-    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
-    out.proc_id = htonl(getpid());
-    out.host = inet_addr("127.0.0.1");
+    unsigned char hdr[TSH_V2_MAXHDR], *p;
+    unsigned long long hdr_len, payload_len, error, keep;
 
-    /* Send GET operation code */
-    if (tsh_send_op(conn, TSH_OP_GET) != 0)
+    if (!tsh_v2_length(conn->sock, &hdr_len) ||
+        !tsh_v2_length(conn->sock, &payload_len) || hdr_len > TSH_V2_MAXHDR ||
+        !readn(conn->sock, (char *)hdr, hdr_len))
         return -1;
 
-    /* Send GET request structure */
-    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+    p = hdr;
+    if (!tsh_v2_field(&p, hdr + hdr_len, id) ||
+        !tsh_v2_field(&p, hdr + hdr_len, &error))
         return -1;
+    if (fld != NULL)
+    {
+        *fld_len = hdr + hdr_len - p;
+        memcpy(fld, p, *fld_len);
+    }
 
-    /* Read status */
-    if (!readn(conn->sock, (char *)&in1, sizeof(in1)))
+    keep = (outbuf == NULL) ? 0 : payload_len;
+    if (max != 0 && keep > max)
+        keep = max;
+    if (!tsh_v2_readn(conn->sock, outbuf, keep) ||
+        !tsh_v2_readn(conn->sock, NULL, payload_len - keep))
         return -1;
+    if (outlen)
+        *outlen = keep;
 
-    if (ntohs(in1.status) != SUCCESS)
-        return -1;
+    return (int)error;
+}
 
-    /* Read tuple metadata */
-    if (!readn(conn->sock, (char *)&in2, sizeof(in2)))
-        return -1;
+/* Whole tuple length from the fields of a fetch reply, 0 if absent */
+static unsigned long tsh_v2_total(unsigned short op_code, unsigned char *fld, int len)
+{
+    unsigned char *p = fld, *end = fld + len;
+    unsigned long long v;
 
-    unsigned long len = ntohl(in2.length);
+    if (op_code == TSH_OP_GET || op_code == TSH_OP_READ)
+    {
+        /* after the name and priority */
+        if (!tsh_v2_field(&p, end, &v) || v > (unsigned long long)(end - p))
+            return 0;
+        p += v;
+        if (!tsh_v2_field(&p, end, &v))
+            return 0;
+    }
+    return tsh_v2_field(&p, end, &v) ? v : 0;
+}
 
-    /* Read tuple data */
-    if (!readn(conn->sock, outbuf, len))
-        return -1;
+static void tsh_cache_store(int keyed, unsigned long family, unsigned long long index,
+                            const char *name, unsigned long version,
+                            const char *data, unsigned long length);
 
-    if (outlen)
-        *outlen = len;
+/* Reads the next reply into the oldest unanswered request */
+static int tsh_v2_answer(TSH_CONN *conn)
+{
+    struct tsh_req *req = conn->pending;
+    unsigned char fld[TSH_V2_MAXHDR];
+    unsigned long long id;
+    int m;
+
+    while (req != NULL && req->answered)
+        req = req->next;
+    if (req == NULL)
+        return -1;
 
+    req->error = tsh_v2_recv(conn, &id, fld, &m, req->outbuf, req->max, &req->length);
+    if (req->error == -1 || id != req->id)
+    {
+        fprintf(stderr, "tsh_v2: Lost the reply to request %llu\n", req->id);
+        return -1;
+    }
+    req->answered = 1;
+    if (req->cache && req->error == TSH_ER_NOERROR &&
+        tsh_v2_total(req->op, fld, m) == req->length)
+        tsh_cache_store(1, req->family, req->index, NULL, 0, req->outbuf, req->length);
     return 0;
 }
 
-/*---------------------------------------------------------------------------
-  Function    : tsh_read
-  Parameters  : conn - pointer to TSH connection handle
-                expr - expression to match the tuple
-                outbuf - buffer to store the tuple data
-                outlen - pointer to store the length of the tuple data
-  Returns     : 0 on success, -1 on failure
-  Description : Reads a tuple from the tuple space without removing it
----------------------------------------------------------------------------*/
-int tsh_read(TSH_CONN *conn, const char *expr, char *outbuf, unsigned long *outlen)
+/* Reads the replies of all submitted requests, so that the next reply
+   on the connection belongs to a new request */
+static int tsh_v2_drain(TSH_CONN *conn)
 {
-    tsh_get_it out;
-    tsh_get_ot1 in1;
-    tsh_get_ot2 in2;
+    while (conn->pending_tail != NULL && !conn->pending_tail->answered)
+    {
+        if (tsh_v2_answer(conn) != 0)
+            return -1;
+    }
+    return 0;
+}
 
-    memset(&out, 0, sizeof(out));
-    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
-    out.proc_id = htonl(getpid());
-    out.host = inet_addr("127.0.0.1");
+/* Sends a request and reads its reply, see tsh_v2_recv */
+static int tsh_v2_call(TSH_CONN *conn, const unsigned char *hdr, int hdr_len,
+                       const void *payload, unsigned long long payload_len,
+                       unsigned char *fld, int *fld_len, char *outbuf,
+                       unsigned long max, unsigned long *outlen)
+{
+    unsigned long long sent = conn->next_id - 1, id;
+    int error;
 
-    /* Send READ operation code (TSH_OP_READ = 403) */
-    if (tsh_send_op(conn, TSH_OP_READ) != 0)
+    if (tsh_v2_drain(conn) != 0)
         return -1;
-
-    /* Send READ request structure */
-    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+    if (tsh_v2_send(conn, hdr, hdr_len, payload, payload_len) != 0)
         return -1;
-
-    /* Read status */
-    if (!readn(conn->sock, (char *)&in1, sizeof(in1)))
+    error = tsh_v2_recv(conn, &id, fld, fld_len, outbuf, max, outlen);
+    if (error != -1 && id != sent)
+    {
+        fprintf(stderr, "tsh_v2: Reply to request %llu, expected %llu\n", id, sent);
         return -1;
+    }
+    return error;
+}
 
-    if (ntohs(in1.status) != SUCCESS)
-        return -1;
+/* Whether a v2 reply error code means the op succeeded. Not a macro: the
+   argument is often the call itself, which must be made only once */
+static int tsh_v2_ok(int error)
+{
+    return error == TSH_ER_NOERROR || error == TSH_ER_OVERRT;
+}
 
-    /* Read tuple metadata */
-    if (!readn(conn->sock, (char *)&in2, sizeof(in2)))
-        return -1;
+/* A tuple held by the client cache */
+typedef struct tsh_centry {
+    int keyed;                  /* family/index, else name */
+    unsigned long family;
+    unsigned long long index;
+    char name[TUPLENAME_LEN];   /* read expression it was cached under */
+    unsigned long version;      /* version cached, 0 if immutable */
+    char *data;
+    unsigned long length;
+    struct tsh_centry *hnext;   /* hash chain */
+    struct tsh_centry *newer;   /* LRU list, newest first */
+    struct tsh_centry *older;
+} tsh_centry;
 
-    unsigned long len = ntohl(in2.length);
+/* What may be cached: a keyed family, or named tuples by prefix */
+typedef struct {
+    int keyed;
+    unsigned long family;
+    char prefix[TUPLENAME_LEN];
+    int mode;                   /* TSH_CACHE_IMMUTABLE or TSH_CACHE_VERSIONED */
+} tsh_crule;
 
-    /* Read tuple data */
-    if (!readn(conn->sock, outbuf, len))
-        return -1;
+#define TSH_CACHE_BUCKETS 1024
+#define TSH_CACHE_RULES   16
 
-    if (outlen)
-        *outlen = len;
+/* The per-process cache, shared by all connections and threads */
+static struct {
+    pthread_mutex_t lock;
+    tsh_crule rules[TSH_CACHE_RULES];
+    int nrules;
+    tsh_centry *buckets[TSH_CACHE_BUCKETS];
+    tsh_centry *newest, *oldest;
+    unsigned long bytes;        /* tuple bytes held */
+    unsigned long limit;        /* most tuple bytes to hold */
+    unsigned long hits, misses;
+} tsh_cache = { PTHREAD_MUTEX_INITIALIZER, {{0}}, 0, {0}, NULL, NULL, 0,
+                TSH_CACHE_DEFAULT_BYTES, 0, 0 };
 
-    return 0;
+/* Fork handlers for the cache and the connection pools, registered once */
+static pthread_once_t tsh_pools_once = PTHREAD_ONCE_INIT;
+static void tsh_pool_atfork(void);
+
+/* Hashes a cache key */
+static unsigned int tsh_cache_hash(int keyed, unsigned long family,
+                                   unsigned long long index, const char *name)
+{
+    unsigned long long h = 1469598103934665603ULL;
+
+    if (keyed)
+        h ^= family * 0x9e3779b97f4a7c15ULL ^ index;
+    else
+        while (*name)
+            h = (h ^ (unsigned char)*name++) * 1099511628211ULL;
+    h ^= h >> 29;
+    return (unsigned int)(h % TSH_CACHE_BUCKETS);
 }
 
-/*---------------------------------------------------------------------------
-  Function    : tsh_shell
-  Parameters  : conn - pointer to TSH connection handle
-                command - shell command to execute
-                output - buffer to store the command output
-                username - buffer to store the username
-                cwd - buffer to store the current working directory
-  Returns     : 0 on success, -1 on failure
-  Description : Executes a shell command through TSH
----------------------------------------------------------------------------*/
-int tsh_shell(TSH_CONN *conn, char *command, char *output, char *username, char *cwd)
+/* Caching mode of a tuple, 0 if it is not cached */
+static int tsh_cache_mode(int keyed, unsigned long family, const char *name)
 {
-    if (conn == NULL || command == NULL) {
-        return -1; // Invalid parameters
+    int i, mode = 0;
+
+    if (tsh_cache.nrules == 0)
+        return 0;
+    pthread_mutex_lock(&tsh_cache.lock);
+    for (i = 0; i < tsh_cache.nrules && mode == 0; i++)
+    {
+        tsh_crule *r = &tsh_cache.rules[i];
+        if (keyed ? (r->keyed && r->family == family)
+                  : (!r->keyed && strncmp(name, r->prefix, strlen(r->prefix)) == 0))
+            mode = r->mode;
     }
+    pthread_mutex_unlock(&tsh_cache.lock);
+    return mode;
+}
 
-    tsh_shell_it out;
-    tsh_shell_ot in;
-    unsigned short op = TSH_OP_SHELL;
-    int result;
+/* Finds an entry, NULL if absent; the lock is held */
+static tsh_centry **tsh_cache_slot(int keyed, unsigned long family,
+                                   unsigned long long index, const char *name)
+{
+    tsh_centry **pp = &tsh_cache.buckets[tsh_cache_hash(keyed, family, index, name)];
 
-    /* Send operation code */
-    if (tsh_send_op(conn, TSH_OP_SHELL) != 0) {
-        return -1;
+    for (; *pp != NULL; pp = &(*pp)->hnext)
+    {
+        if ((*pp)->keyed == keyed &&
+            (keyed ? ((*pp)->family == family && (*pp)->index == index)
+                   : strcmp((*pp)->name, name) == 0))
+            break;
     }
+    return pp;
+}
 
-    /* Prepare shell command parameters */
-    out.length = htonl(strlen(command) + 1);
+/* Unlinks and frees the entry *pp points to; the lock is held */
+static void tsh_cache_evict(tsh_centry **pp)
+{
+    tsh_centry *e = *pp;
 
-    /* Send command structure */
-    if (!writen(conn->sock, (char *)&out, sizeof(out))) {
-        return -1;
-    }
+    *pp = e->hnext;
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        tsh_cache.newest = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        tsh_cache.oldest = e->newer;
+    tsh_cache.bytes -= e->length;
+    free(e->data);
+    free(e);
+}
 
-    /* Send command string */
-    if (!writen(conn->sock, command, ntohl(out.length))) {
-        return -1;
-    }
+/* Copies a cached tuple to outbuf, cut to *outlen as the server would;
+   1 on a hit. A versioned entry only hits if version matches */
+static int tsh_cache_lookup(int keyed, unsigned long family, unsigned long long index,
+                            const char *name, unsigned long version,
+                            char *outbuf, unsigned long *outlen)
+{
+    tsh_centry **pp, *e;
+    unsigned long len;
+    int hit = 0;
 
-    /* Read response */
-    if (!readn(conn->sock, (char *)&in, sizeof(in))) {
-        return -1;
+    pthread_mutex_lock(&tsh_cache.lock);
+    pp = tsh_cache_slot(keyed, family, index, name);
+    if ((e = *pp) != NULL && e->version != version)
+    {
+        tsh_cache_evict(pp); /* changed on the server */
+        e = NULL;
     }
+    if (e != NULL)
+    {
+        len = e->length;
+        if (outlen && *outlen != 0 && *outlen < len)
+            len = *outlen;
+        memcpy(outbuf, e->data, len);
+        if (outlen)
+            *outlen = len;
+        /* move to the front of the LRU list */
+        if (e->newer)
+        {
+            e->newer->older = e->older;
+            if (e->older)
+                e->older->newer = e->newer;
+            else
+                tsh_cache.oldest = e->newer;
+            e->newer = NULL;
+            e->older = tsh_cache.newest;
+            tsh_cache.newest->newer = e;
+            tsh_cache.newest = e;
+        }
+        hit = 1;
+        tsh_cache.hits++;
+    }
+    else
+        tsh_cache.misses++;
+    pthread_mutex_unlock(&tsh_cache.lock);
+    return hit;
+}
+
+/* Caches a complete tuple, evicting the least recently used ones to
+   stay within the limit */
+static void tsh_cache_store(int keyed, unsigned long family, unsigned long long index,
+                            const char *name, unsigned long version,
+                            const char *data, unsigned long length)
+{
+    tsh_centry **pp, *e;
 
-    /* Copy results to provided buffers if not NULL */
-    if (output != NULL) {
-        strcpy(output, in.out_buffer);
+    if (length > tsh_cache.limit || (e = calloc(1, sizeof(tsh_centry))) == NULL)
+        return;
+    if ((e->data = malloc(length ? length : 1)) == NULL)
+    {
+        free(e);
+        return;
     }
+    e->keyed = keyed;
+    e->family = family;
+    e->index = index;
+    if (!keyed)
+        strncpy(e->name, name, TUPLENAME_LEN - 1);
+    e->version = version;
+    memcpy(e->data, data, length);
+    e->length = length;
 
-    if (username != NULL) {
-        strcpy(username, in.username);
+    pthread_mutex_lock(&tsh_cache.lock);
+    pp = tsh_cache_slot(keyed, family, index, e->name);
+    if (*pp != NULL)
+        tsh_cache_evict(pp);
+    while (tsh_cache.oldest != NULL && tsh_cache.bytes + length > tsh_cache.limit)
+    {
+        tsh_centry *old = tsh_cache.oldest;
+        tsh_cache_evict(tsh_cache_slot(old->keyed, old->family, old->index, old->name));
     }
+    pp = &tsh_cache.buckets[tsh_cache_hash(keyed, family, index, e->name)];
+    e->hnext = *pp;
+    *pp = e;
+    e->older = tsh_cache.newest;
+    if (tsh_cache.newest)
+        tsh_cache.newest->newer = e;
+    else
+        tsh_cache.oldest = e;
+    tsh_cache.newest = e;
+    tsh_cache.bytes += length;
+    pthread_mutex_unlock(&tsh_cache.lock);
+}
 
-    if (cwd != NULL) {
-        strcpy(cwd, in.cwd_loc);
+/* Forgets a tuple this process is about to change or remove */
+static void tsh_cache_drop(int keyed, unsigned long family, unsigned long long index,
+                           const char *name)
+{
+    tsh_centry **pp;
+
+    if (tsh_cache.nrules == 0)
+        return;
+    pthread_mutex_lock(&tsh_cache.lock);
+    pp = tsh_cache_slot(keyed, family, index, name);
+    if (*pp != NULL)
+        tsh_cache_evict(pp);
+    pthread_mutex_unlock(&tsh_cache.lock);
+}
+
+/* Adds a caching rule */
+static int tsh_cache_rule(int keyed, unsigned long family, const char *prefix, int mode)
+{
+    int rc = -1;
+
+    pthread_once(&tsh_pools_once, tsh_pool_atfork);
+
+    pthread_mutex_lock(&tsh_cache.lock);
+    if (tsh_cache.nrules < TSH_CACHE_RULES)
+    {
+        tsh_crule *r = &tsh_cache.rules[tsh_cache.nrules];
+        r->keyed = keyed;
+        r->family = family;
+        if (prefix)
+            strncpy(r->prefix, prefix, TUPLENAME_LEN - 1);
+        r->mode = mode;
+        tsh_cache.nrules++;
+        rc = 0;
     }
+    pthread_mutex_unlock(&tsh_cache.lock);
+    if (rc != 0)
+        fprintf(stderr, "tsh_cache: At most %d caching rules\n", TSH_CACHE_RULES);
+    return rc;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_cache_family
+  Parameters  : family - keyed tuple family
+  Returns     : 0 on success, -1 if there are too many rules
+  Description : Declares the tuples of a keyed family immutable: once
+                read, tsh_kread and tsh_submit_kread serve them from the
+                process's cache without asking the server. Keyed tuples
+                have no version, so only the application can promise
+                this; kput/kget from this process drop the cached copy.
+---------------------------------------------------------------------------*/
+int tsh_cache_family(unsigned long family)
+{
+    return tsh_cache_rule(1, family, NULL, TSH_CACHE_IMMUTABLE);
+}
 
-    result = ntohs(in.status);
-    return result;
-}
\ No newline at end of file
+/*---------------------------------------------------------------------------
+  Function    : tsh_cache_names
+  Parameters  : prefix - tuples whose name starts with this are cached
+                mode - TSH_CACHE_IMMUTABLE or TSH_CACHE_VERSIONED
+  Returns     : 0 on success, -1 on failure
+  Description : Caches tsh_read results for matching names. Immutable
+                ones are served locally. Versioned ones are served
+                locally after a tsh_stat shows the version unchanged, so
+                only a changed tuple is transferred again; this needs a
+                v2 connection, on v1 they are read as usual. Reads are
+                cached under the expression they were issued with, which
+                should therefore name a single tuple.
+---------------------------------------------------------------------------*/
+int tsh_cache_names(const char *prefix, int mode)
+{
+    if (prefix == NULL || (mode != TSH_CACHE_IMMUTABLE && mode != TSH_CACHE_VERSIONED))
+    {
+        fprintf(stderr, "tsh_cache_names: Invalid parameters\n");
+        return -1;
+    }
+    return tsh_cache_rule(0, 0, prefix, mode);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_cache_limit
+  Parameters  : bytes - most tuple bytes to cache, 0 to cache nothing
+  Returns     : -
+  Description : Bounds the cache (TSH_CACHE_DEFAULT_BYTES by default);
+                least recently used tuples are evicted first
+---------------------------------------------------------------------------*/
+void tsh_cache_limit(unsigned long bytes)
+{
+    pthread_mutex_lock(&tsh_cache.lock);
+    tsh_cache.limit = bytes;
+    while (tsh_cache.oldest != NULL && tsh_cache.bytes > bytes)
+    {
+        tsh_centry *old = tsh_cache.oldest;
+        tsh_cache_evict(tsh_cache_slot(old->keyed, old->family, old->index, old->name));
+    }
+    pthread_mutex_unlock(&tsh_cache.lock);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_cache_stats
+  Parameters  : hits - pointer to store the reads served locally (may be NULL)
+                misses - pointer to store the cacheable reads that went
+                         to the server (may be NULL)
+  Returns     : Tuple bytes currently cached
+  Description : -
+---------------------------------------------------------------------------*/
+unsigned long tsh_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    unsigned long bytes;
+
+    pthread_mutex_lock(&tsh_cache.lock);
+    if (hits)
+        *hits = tsh_cache.hits;
+    if (misses)
+        *misses = tsh_cache.misses;
+    bytes = tsh_cache.bytes;
+    pthread_mutex_unlock(&tsh_cache.lock);
+    return bytes;
+}
+
+/* Fills the tsh_put_it header shared by all put variants */
+static void tsh_fill_put(tsh_put_it *out, const char *name, unsigned short priority,
+                         unsigned long length)
+{
+    memset(out, 0, sizeof(*out));
+    strncpy(out->name, name, TUPLENAME_LEN - 1);
+    out->name[TUPLENAME_LEN - 1] = '\0'; /* ensure null-termination */
+    out->priority = htons(priority);     /* convert to network byte order */
+    out->length = htonl(length);         /* convert to network byte order */
+    out->host = inet_addr("127.0.0.1");  /* localhost for now */
+    out->proc_id = htonl(getpid());      /* process ID */
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_put
+  Parameters  : conn - pointer to TSH connection handle
+                name - name of the tuple to store
+                priority - priority of the tuple (higher value = higher priority)
+                tuple - pointer to the tuple data
+                length - length of the tuple data in bytes
+  Returns     : 0 on success, -1 on failure
+  Description : Puts a tuple into the tuple space
+---------------------------------------------------------------------------*/
+int tsh_put(TSH_CONN *conn, const char *name, unsigned short priority,
+            const void *tuple, unsigned long length)
+{
+    return tsh_put_ttl(conn, name, priority, tuple, length, 0);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_put_ttl
+  Parameters  : conn - pointer to TSH connection handle
+                name - name of the tuple to store
+                priority - priority of the tuple (higher value = higher priority)
+                tuple - pointer to the tuple data
+                length - length of the tuple data in bytes
+                ttl_ms - lifetime in milliseconds, 0 for none
+  Returns     : 0 on success, -1 on failure
+  Description : Puts a tuple into the tuple space. With a TTL the request
+                is sent as TSH_OP_PUTTTL and the server deletes the tuple
+                once it has been in the space for ttl_ms.
+---------------------------------------------------------------------------*/
+int tsh_put_ttl(TSH_CONN *conn, const char *name, unsigned short priority,
+                const void *tuple, unsigned long length, unsigned long ttl_ms)
+{
+    tsh_put_it out;
+    tsh_put_ot in;
+    tsh_ttl_it ttl;
+    unsigned char hdr[TSH_V2_MAXHDR];
+    int n, error;
+
+    if (conn == NULL || name == NULL || tuple == NULL)
+    {
+        fprintf(stderr, "tsh_put: Invalid parameters\n");
+        return -1;
+    }
+
+    tsh_cache_drop(0, 0, 0, name);
+
+    if (conn->version == TSH_V2)
+    {
+        n = tsh_v2_begin(conn, hdr, TSH_OP_PUT);
+        n += tsh_v2_string(hdr + n, name);
+        n += tsh_v2_varint(hdr + n, priority);
+        n += tsh_v2_varint(hdr + n, ttl_ms);
+        error = tsh_v2_call(conn, hdr, n, tuple, length, NULL, NULL, NULL, 0, NULL);
+        if (error == -1)
+            return -1;
+        if (!tsh_v2_ok(error))
+        {
+            fprintf(stderr, "tsh_put: Server reported failure, error code: %d\n",
+                    error);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Send PUT operation code to TSH */
+    if (tsh_send_op(conn, ttl_ms ? TSH_OP_PUTTTL : TSH_OP_PUT) != 0)
+    {
+        return -1;
+    }
+
+    /* Initialize the PUT input structure */
+    tsh_fill_put(&out, name, priority, length);
+
+    /* Send tuple metadata to TSH server */
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+    {
+        perror("tsh_put: Failed to send tuple metadata");
+        return -1;
+    }
+
+    /* The TTL extends the metadata */
+    ttl.ttl_ms = htonl(ttl_ms);
+    if (ttl_ms && !writen(conn->sock, (char *)&ttl, sizeof(ttl)))
+    {
+        perror("tsh_put: Failed to send tuple TTL");
+        return -1;
+    }
+
+    /* Send the actual tuple data to TSH server */
+    if (!writen(conn->sock, (char *)tuple, length))
+    {
+        perror("tsh_put: Failed to send tuple data");
+        return -1;
+    }
+
+    /* Read response from TSH server */
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+    {
+        perror("tsh_put: Failed to read server response");
+        return -1;
+    }
+
+    /* Check response status */
+    if (ntohs(in.status) != SUCCESS)
+    {
+        fprintf(stderr, "tsh_put: Server reported failure, error code: %d\n",
+                ntohs(in.error));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Sends a conditional put and reads the outcome */
+static int tsh_put_cond(TSH_CONN *conn, unsigned short op_code, const char *name,
+                        unsigned short priority, const void *tuple, unsigned long length,
+                        unsigned long version, unsigned long ttl_ms,
+                        unsigned long *version_out)
+{
+    tsh_put_it out;
+    tsh_cond_it cond;
+    tsh_cond_ot in;
+
+    if (conn == NULL || name == NULL || tuple == NULL)
+    {
+        fprintf(stderr, "tsh_put_cond: Invalid parameters\n");
+        return -1;
+    }
+
+    tsh_cache_drop(0, 0, 0, name);
+
+    if (tsh_send_op(conn, op_code) != 0)
+        return -1;
+
+    tsh_fill_put(&out, name, priority, length);
+    cond.version = htonl(version);
+    cond.ttl_ms = htonl(ttl_ms);
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)) ||
+        !writen(conn->sock, (char *)&cond, sizeof(cond)) ||
+        !writen(conn->sock, (char *)tuple, length))
+    {
+        perror("tsh_put_cond: Failed to send tuple");
+        return -1;
+    }
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+        return -1;
+
+    if (version_out)
+        *version_out = ntohl(in.version);
+
+    return (ntohs(in.error) == TSH_ER_CONFLICT) ? 0 : 1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_put_nx
+  Parameters  : conn - pointer to TSH connection handle
+                name - name of the tuple to store
+                priority - priority of the tuple
+                tuple - pointer to the tuple data
+                length - length of the tuple data in bytes
+                ttl_ms - lifetime in milliseconds, 0 for none
+  Returns     : 1 if stored, 0 if a tuple of that name already exists,
+                -1 on failure
+  Description : Atomically puts a tuple unless one with the same name is
+                already in the tuple space. Of several clients racing on
+                one name exactly one gets 1.
+---------------------------------------------------------------------------*/
+int tsh_put_nx(TSH_CONN *conn, const char *name, unsigned short priority,
+               const void *tuple, unsigned long length, unsigned long ttl_ms)
+{
+    return tsh_put_cond(conn, TSH_OP_PUTNX, name, priority, tuple, length,
+                        0, ttl_ms, NULL);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_cas
+  Parameters  : conn - pointer to TSH connection handle
+                name - name of the tuple to store
+                priority - priority of the tuple
+                tuple - pointer to the tuple data
+                length - length of the tuple data in bytes
+                expected - version the stored tuple must have, 0 if it
+                           must be absent
+                version - pointer to store the new version, or the
+                          current one if the swap lost (may be NULL)
+  Returns     : 1 if stored, 0 if the version did not match, -1 on failure
+  Description : Atomically replaces a tuple if nobody changed it since
+                the caller saw version 'expected'. Versions are never 0
+                and grow on every change; a deleted and re-created tuple
+                never gets back a version it had.
+---------------------------------------------------------------------------*/
+int tsh_cas(TSH_CONN *conn, const char *name, unsigned short priority,
+            const void *tuple, unsigned long length, unsigned long expected,
+            unsigned long *version)
+{
+    return tsh_put_cond(conn, TSH_OP_CAS, name, priority, tuple, length,
+                        expected, 0, version);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_send_op
+  Parameters  : conn - pointer to TSH connection handle
+                op_code - operation code to send
+  Returns     : 0 on success, -1 on failure
+  Description : Sends an operation code to the TSH server
+---------------------------------------------------------------------------*/
+int tsh_send_op(TSH_CONN *conn, unsigned short op_code)
+{
+    unsigned short network_op;
+
+    if (conn == NULL)
+    {
+        fprintf(stderr, "tsh_send_op: NULL connection handle\n");
+        return -1;
+    }
+
+    /* Once switched, the connection only carries v2 frames */
+    if (conn->version == TSH_V2)
+    {
+        fprintf(stderr, "tsh_send_op: Op %d is not available on a v2 connection\n",
+                op_code);
+        return -1;
+    }
+
+    /* Convert operation code to network byte order */
+    network_op = htons(op_code);
+
+    /* Send operation code to TSH */
+    if (!writen(conn->sock, (char *)&network_op, sizeof(network_op)))
+    {
+        perror("tsh_send_op: Failed to send operation code");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Buffer size to announce to the server, 0 when unknown or too large */
+static unsigned long tsh_capacity(const unsigned long *outlen)
+{
+    if (outlen == NULL || *outlen > 0x7fffffffUL)
+        return 0;
+    return *outlen;
+}
+
+/* Sends a v2 get/read and reads the tuple, -1 on a miss. The length of
+   the whole tuple goes to *total (may be NULL) */
+static int tsh_v2_fetch(TSH_CONN *conn, unsigned short op_code, const char *expr,
+                        char *outbuf, unsigned long *outlen, unsigned long *total)
+{
+    unsigned char hdr[TSH_V2_MAXHDR], fld[TSH_V2_MAXHDR];
+    unsigned long max = tsh_capacity(outlen);
+    int n, m;
+
+    n = tsh_v2_begin(conn, hdr, op_code);
+    n += tsh_v2_string(hdr + n, expr);
+    n += tsh_v2_varint(hdr + n, max);
+    if (!tsh_v2_ok(tsh_v2_call(conn, hdr, n, NULL, 0, fld, &m, outbuf, max, outlen)))
+        return -1;
+    if (total)
+        *total = tsh_v2_total(op_code, fld, m);
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_get
+  Parameters  : conn - pointer to TSH connection handle
+                expr - expression to match the tuple
+                outbuf - buffer to store the tuple data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the tuple data
+  Returns     : 0 on success, -1 on failure
+  Description : Retrieves a tuple from the tuple space. A tuple larger than
+                outbuf is cut to *outlen bytes by the server.
+---------------------------------------------------------------------------*/
+int tsh_get(TSH_CONN *conn, const char *expr, char *outbuf, unsigned long *outlen)
+{
+    tsh_get_it out;
+    tsh_get_ot1 in1;
+    tsh_get_ot2 in2;
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
+    out.proc_id = htonl(getpid());
+    out.host = inet_addr("127.0.0.1");
+    out.len = htonl(tsh_capacity(outlen)); /* server never sends more */
+
+    tsh_cache_drop(0, 0, 0, expr);
+
+    if (conn != NULL && conn->version == TSH_V2)
+        return tsh_v2_fetch(conn, TSH_OP_GET, expr, outbuf, outlen, NULL);
+
+    /* Send GET operation code */
+    if (tsh_send_op(conn, TSH_OP_GET) != 0)
+        return -1;
+
+    /* Send GET request structure */
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    /* Read status */
+    if (!readn(conn->sock, (char *)&in1, sizeof(in1)))
+        return -1;
+
+    if (ntohs(in1.status) != SUCCESS)
+        return -1;
+
+    /* Read tuple metadata */
+    if (!readn(conn->sock, (char *)&in2, sizeof(in2)))
+        return -1;
+
+    unsigned long len = ntohl(in2.length);
+
+    /* Read tuple data */
+    if (!readn(conn->sock, outbuf, len))
+        return -1;
+
+    if (outlen)
+        *outlen = len;
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_read
+  Parameters  : conn - pointer to TSH connection handle
+                expr - expression to match the tuple
+                outbuf - buffer to store the tuple data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the tuple data
+  Returns     : 0 on success, -1 on failure
+  Description : Reads a tuple from the tuple space without removing it.
+                A tuple larger than outbuf is cut to *outlen bytes. Names
+                covered by tsh_cache_names may be served from the cache.
+---------------------------------------------------------------------------*/
+static int tsh_read_remote(TSH_CONN *conn, const char *expr, char *outbuf,
+                           unsigned long *outlen);
+
+int tsh_read(TSH_CONN *conn, const char *expr, char *outbuf, unsigned long *outlen)
+{
+    unsigned long cap = tsh_capacity(outlen), total = 0, version = 0;
+    int mode;
+
+    mode = (conn != NULL && expr != NULL) ? tsh_cache_mode(0, 0, expr) : 0;
+    if (mode == TSH_CACHE_VERSIONED && conn->version != TSH_V2)
+        mode = 0; /* no second op on a v1 connection */
+    if (mode == 0)
+        return tsh_read_remote(conn, expr, outbuf, outlen);
+
+    /* a versioned copy is only good while the version is unchanged */
+    if (mode == TSH_CACHE_VERSIONED &&
+        tsh_stat(conn, expr, &total, NULL, &version) != 1)
+        return -1;
+    if (tsh_cache_lookup(0, 0, 0, expr, version, outbuf, outlen))
+        return 0;
+
+    if (conn->version == TSH_V2)
+    {
+        if (tsh_v2_fetch(conn, TSH_OP_READ, expr, outbuf, outlen, &total) != 0)
+            return -1;
+    }
+    else
+    {
+        if (tsh_read_remote(conn, expr, outbuf, outlen) != 0)
+            return -1;
+        /* v1 only says how much was sent; a full buffer may be cut */
+        total = (outlen && (cap == 0 || *outlen < cap)) ? *outlen : 0;
+    }
+    if (outlen && total == *outlen)
+        tsh_cache_store(0, 0, 0, expr, version, outbuf, total);
+    return 0;
+}
+
+/* tsh_read without the cache */
+static int tsh_read_remote(TSH_CONN *conn, const char *expr, char *outbuf,
+                           unsigned long *outlen)
+{
+    tsh_get_it out;
+    tsh_get_ot1 in1;
+    tsh_get_ot2 in2;
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
+    out.proc_id = htonl(getpid());
+    out.host = inet_addr("127.0.0.1");
+    out.len = htonl(tsh_capacity(outlen)); /* server never sends more */
+
+    if (conn != NULL && conn->version == TSH_V2)
+        return tsh_v2_fetch(conn, TSH_OP_READ, expr, outbuf, outlen, NULL);
+
+    /* Send READ operation code (TSH_OP_READ = 403) */
+    if (tsh_send_op(conn, TSH_OP_READ) != 0)
+        return -1;
+
+    /* Send READ request structure */
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    /* Read status */
+    if (!readn(conn->sock, (char *)&in1, sizeof(in1)))
+        return -1;
+
+    if (ntohs(in1.status) != SUCCESS)
+        return -1;
+
+    /* Read tuple metadata */
+    if (!readn(conn->sock, (char *)&in2, sizeof(in2)))
+        return -1;
+
+    unsigned long len = ntohl(in2.length);
+
+    /* Read tuple data */
+    if (!readn(conn->sock, outbuf, len))
+        return -1;
+
+    if (outlen)
+        *outlen = len;
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_stat
+  Parameters  : conn - pointer to TSH connection handle
+                expr - expression to match the tuple
+                length - pointer to store the tuple length (may be NULL)
+                priority - pointer to store the priority (may be NULL)
+                version - pointer to store the version (may be NULL)
+  Returns     : 1 if a tuple matches, 0 if none does, -1 on failure
+  Description : Looks a tuple up without transferring its data. Unlike a
+                failed tsh_read, a miss leaves no pending request behind.
+---------------------------------------------------------------------------*/
+int tsh_stat(TSH_CONN *conn, const char *expr, unsigned long *length,
+             unsigned short *priority, unsigned long *version)
+{
+    tsh_stat_it out;
+    tsh_stat_ot in;
+    unsigned char hdr[TSH_V2_MAXHDR], fld[TSH_V2_MAXHDR], *p;
+    unsigned long long len, prio, ver;
+    int n, m, error;
+
+    if (conn == NULL || expr == NULL)
+    {
+        fprintf(stderr, "tsh_stat: Invalid parameters\n");
+        return -1;
+    }
+
+    if (conn->version == TSH_V2)
+    {
+        n = tsh_v2_begin(conn, hdr, TSH_OP_STAT);
+        n += tsh_v2_string(hdr + n, expr);
+        error = tsh_v2_call(conn, hdr, n, NULL, 0, fld, &m, NULL, 0, NULL);
+        if (error == -1)
+            return -1;
+        if (error != TSH_ER_NOERROR)
+            return 0;
+        p = fld;
+        if (!tsh_v2_field(&p, fld + m, &len) || !tsh_v2_field(&p, fld + m, &prio) ||
+            !tsh_v2_field(&p, fld + m, &ver))
+            return -1;
+        if (length)
+            *length = len;
+        if (priority)
+            *priority = prio;
+        if (version)
+            *version = ver;
+        return 1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
+
+    if (tsh_send_op(conn, TSH_OP_STAT) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+        return 0;
+
+    if (length)
+        *length = ntohl(in.length);
+    if (priority)
+        *priority = ntohs(in.priority);
+    if (version)
+        *version = ntohl(in.version);
+
+    return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_incr
+  Parameters  : conn - pointer to TSH connection handle
+                name - exact name of the counter tuple
+                delta - signed amount to add, 0 to only fetch
+                new_value - pointer to store the resulting value (may be NULL)
+  Returns     : 0 on success, -1 on failure
+  Description : Adds to a counter in one round trip; concurrent adds are
+                never lost. A missing counter starts at 0, but a fetch
+                (delta 0) of one fails and creates nothing. The counter is
+                a 4 byte tuple in network byte order, so tsh_read works on
+                it too; a tuple of another size is refused.
+---------------------------------------------------------------------------*/
+int tsh_incr(TSH_CONN *conn, const char *name, long delta, long *new_value)
+{
+    tsh_incr_it out;
+    tsh_incr_ot in;
+    unsigned char hdr[TSH_V2_MAXHDR], fld[TSH_V2_MAXHDR], *p;
+    unsigned long long v;
+    int n, m, error;
+
+    if (conn == NULL || name == NULL)
+    {
+        fprintf(stderr, "tsh_incr: Invalid parameters\n");
+        return -1;
+    }
+
+    if (conn->version == TSH_V2)
+    {
+        /* signed values travel zigzag encoded */
+        n = tsh_v2_begin(conn, hdr, TSH_OP_INCR);
+        n += tsh_v2_string(hdr + n, name);
+        n += tsh_v2_varint(hdr + n, ((unsigned long long)(long long)delta << 1) ^
+                                    (unsigned long long)((long long)delta >> 63));
+        error = tsh_v2_call(conn, hdr, n, NULL, 0, fld, &m, NULL, 0, NULL);
+        if (error == -1)
+            return -1;
+        if (error != TSH_ER_NOERROR)
+        {
+            if (error != TSH_ER_NOTUPLE)
+                fprintf(stderr, "tsh_incr: Server reported failure, error code: %d\n",
+                        error);
+            return -1;
+        }
+        p = fld;
+        if (!tsh_v2_field(&p, fld + m, &v))
+            return -1;
+        if (new_value)
+            *new_value = (long)((v >> 1) ^ -(v & 1));
+        return 0;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.name, name, TUPLENAME_LEN - 1);
+    out.delta = htonl((sng_int32)delta);
+    out.priority = htons(1);
+
+    if (tsh_send_op(conn, TSH_OP_INCR) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+    {
+        if (ntohs(in.error) != TSH_ER_NOTUPLE)
+            fprintf(stderr, "tsh_incr: Server reported failure, error code: %d\n",
+                    ntohs(in.error));
+        return -1;
+    }
+
+    if (new_value)
+        *new_value = (int)ntohl(in.value);
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_take
+  Parameters  : conn - pointer to TSH connection handle
+                expr - expression to match the tuple
+                lease_ms - lease duration in milliseconds
+                outbuf - buffer to store the tuple data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the tuple data
+                lease_id - pointer to store the lease id
+  Returns     : 0 on success, -1 on failure or if no tuple matches
+  Description : Removes a tuple from the tuple space under a lease. The
+                tuple is gone for good once tsh_ack is called; if the lease
+                expires first the server requeues it with raised priority.
+---------------------------------------------------------------------------*/
+int tsh_take(TSH_CONN *conn, const char *expr, unsigned long lease_ms,
+             char *outbuf, unsigned long *outlen, unsigned long *lease_id)
+{
+    tsh_take_it out;
+    tsh_take_ot in;
+
+    if (conn == NULL || expr == NULL || outbuf == NULL)
+    {
+        fprintf(stderr, "tsh_take: Invalid parameters\n");
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
+    out.len = htonl(outlen ? *outlen : 0);
+    out.lease_ms = htonl(lease_ms);
+
+    if (tsh_send_op(conn, TSH_OP_TAKE) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+        return -1;
+
+    if (!readn(conn->sock, outbuf, ntohl(in.length)))
+        return -1;
+
+    if (outlen)
+        *outlen = ntohl(in.length);
+    if (lease_id)
+        *lease_id = ntohl(in.lease_id);
+
+    return 0;
+}
+
+/* Sends a renew/ack request and reads the status */
+static int tsh_lease_op(TSH_CONN *conn, unsigned short op_code,
+                        unsigned long lease_id, unsigned long lease_ms)
+{
+    tsh_lease_it out;
+    tsh_lease_ot in;
+
+    out.lease_id = htonl(lease_id);
+    out.lease_ms = htonl(lease_ms);
+
+    if (tsh_send_op(conn, op_code) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    return (ntohs(in.status) == SUCCESS) ? 0 : -1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_renew
+  Parameters  : conn - pointer to TSH connection handle
+                lease_id - lease returned by tsh_take
+                lease_ms - new lease duration from now, in milliseconds
+  Returns     : 0 on success, -1 on failure or if the lease already expired
+  Description : Keeps a taken tuple out of the tuple space for longer
+---------------------------------------------------------------------------*/
+int tsh_renew(TSH_CONN *conn, unsigned long lease_id, unsigned long lease_ms)
+{
+    return tsh_lease_op(conn, TSH_OP_RENEW, lease_id, lease_ms);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_ack
+  Parameters  : conn - pointer to TSH connection handle
+                lease_id - lease returned by tsh_take
+  Returns     : 0 on success, -1 on failure or if the lease already expired
+  Description : Completes a lease; the taken tuple will not be redelivered
+---------------------------------------------------------------------------*/
+int tsh_ack(TSH_CONN *conn, unsigned long lease_id)
+{
+    return tsh_lease_op(conn, TSH_OP_ACK, lease_id, 0);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_enqueue
+  Parameters  : conn - pointer to TSH connection handle
+                queue - name of the work queue
+                item - pointer to the item data
+                length - length of the item data
+  Returns     : 0 on success, -1 on failure
+  Description : Appends an item to a server-side FIFO work queue. The
+                queue is created on first use.
+---------------------------------------------------------------------------*/
+int tsh_enqueue(TSH_CONN *conn, const char *queue, const void *item,
+                unsigned long length)
+{
+    tsh_enq_it out;
+    tsh_enq_ot in;
+
+    if (conn == NULL || queue == NULL || item == NULL)
+    {
+        fprintf(stderr, "tsh_enqueue: Invalid parameters\n");
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.name, queue, TUPLENAME_LEN - 1);
+    out.length = htonl(length);
+
+    if (tsh_send_op(conn, TSH_OP_ENQ) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)) ||
+        !writen(conn->sock, (char *)item, length))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    return (ntohs(in.status) == SUCCESS) ? 0 : -1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_dequeue
+  Parameters  : conn - pointer to TSH connection handle
+                queue - name of the work queue
+                outbuf - buffer to store the item data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the item data
+                wait_ms - how long to wait for an item if the queue is
+                          empty; 0 not at all, TSH_WAIT_FOREVER no limit
+                lease_ms - 0 to remove the item for good, else the lease
+                           duration, as for tsh_take
+                lease_id - pointer to store the lease id (may be NULL)
+  Returns     : 1 if an item was dequeued, 0 if the queue stayed empty,
+                -1 on failure
+  Description : Removes the oldest item of a work queue in one round trip,
+                however many items are queued. A leased item goes back to
+                the head of the queue unless acknowledged with tsh_ack
+                before the lease runs out.
+---------------------------------------------------------------------------*/
+int tsh_dequeue(TSH_CONN *conn, const char *queue, char *outbuf,
+                unsigned long *outlen, unsigned long wait_ms,
+                unsigned long lease_ms, unsigned long *lease_id)
+{
+    tsh_deq_it out;
+    tsh_deq_ot in;
+
+    if (conn == NULL || queue == NULL || outbuf == NULL)
+    {
+        fprintf(stderr, "tsh_dequeue: Invalid parameters\n");
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.name, queue, TUPLENAME_LEN - 1);
+    out.len = htonl(tsh_capacity(outlen));
+    out.lease_ms = htonl(lease_ms);
+    out.wait_ms = htonl(wait_ms);
+
+    if (tsh_send_op(conn, TSH_OP_DEQ) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+        return (ntohs(in.error) == TSH_ER_NOTUPLE) ? 0 : -1;
+
+    if (!readn(conn->sock, outbuf, ntohl(in.length)))
+        return -1;
+
+    if (outlen)
+        *outlen = ntohl(in.length);
+    if (lease_id)
+        *lease_id = ntohl(in.lease_id);
+
+    return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_subscribe
+  Parameters  : conn - pointer to TSH connection handle
+                expr - expression to match the names of tuples put
+                max_payload - tuple bytes to send with each note, 0: none
+  Returns     : 0 on success, -1 on failure
+  Description : Turns conn into a subscription. The server then sends a
+                note for every tuple put under a matching name; read them
+                with tsh_next_note. Disconnecting ends the subscription.
+                No other operation may be sent on conn.
+---------------------------------------------------------------------------*/
+int tsh_subscribe(TSH_CONN *conn, const char *expr, unsigned long max_payload)
+{
+    tsh_sub_it out;
+    tsh_sub_ot in;
+
+    if (conn == NULL || expr == NULL)
+    {
+        fprintf(stderr, "tsh_subscribe: Invalid parameters\n");
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    strncpy(out.expr, expr, TUPLENAME_LEN - 1);
+    out.max_len = htonl(max_payload);
+
+    if (tsh_send_op(conn, TSH_OP_SUB) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    return (ntohs(in.status) == SUCCESS) ? 0 : -1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_next_note
+  Parameters  : conn - pointer to a subscribed TSH connection handle
+                name - buffer of TUPLENAME_LEN for the tuple name (may be NULL)
+                length - pointer to store the full tuple length (may be NULL)
+                outbuf - buffer for the payload sent with the note (may be
+                         NULL if subscribed without payload)
+                outlen - in: size of outbuf, out: payload bytes stored
+                timeout_ms - how long to wait, negative: no limit
+  Returns     : 1 if a note was read, 0 on timeout, -1 on failure
+  Description : Waits for the next note of a subscription. Payload beyond
+                *outlen is read and discarded.
+---------------------------------------------------------------------------*/
+int tsh_next_note(TSH_CONN *conn, char *name, unsigned long *length,
+                  char *outbuf, unsigned long *outlen, long timeout_ms)
+{
+    tsh_note_ot in;
+    struct pollfd pfd;
+    unsigned long sent, keep, chunk;
+    char discard[256];
+
+    if (conn == NULL)
+    {
+        fprintf(stderr, "tsh_next_note: Invalid parameters\n");
+        return -1;
+    }
+
+    pfd.fd = conn->sock;
+    pfd.events = POLLIN;
+    switch (poll(&pfd, 1, timeout_ms < 0 ? -1 : (int)timeout_ms))
+    {
+    case -1:
+        return -1;
+    case 0:
+        return 0;
+    }
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    sent = ntohl(in.sent);
+    keep = (outbuf != NULL && outlen != NULL) ? *outlen : 0;
+    if (keep > sent)
+        keep = sent;
+    if (keep > 0 && !readn(conn->sock, outbuf, keep))
+        return -1;
+    for (sent -= keep; sent > 0; sent -= chunk)
+    {
+        chunk = (sent < sizeof(discard)) ? sent : sizeof(discard);
+        if (!readn(conn->sock, discard, chunk))
+            return -1;
+    }
+
+    if (name)
+    {
+        memcpy(name, in.name, TUPLENAME_LEN);
+        name[TUPLENAME_LEN - 1] = '\0';
+    }
+    if (length)
+        *length = ntohl(in.length);
+    if (outlen)
+        *outlen = keep;
+
+    return 1;
+}
+
+/* Fills the compact key shared by the keyed ops */
+static void tsh_fill_key(tsh_key_t *key, unsigned long family,
+                         unsigned long long index)
+{
+    key->family = htonl(family);
+    key->index_hi = htonl((sng_int32)(index >> 32));
+    key->index_lo = htonl((sng_int32)index);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_kput
+  Parameters  : conn - pointer to TSH connection handle
+                family - family id chosen by the application
+                index - index of the tuple within the family
+                priority - priority of the tuple
+                tuple - pointer to the tuple data
+                length - length of the tuple data
+  Returns     : 0 on success, -1 on failure
+  Description : Puts a tuple under an integer key instead of a name. The
+                request header is a few bytes rather than a name and appid,
+                and the server finds the slot by hashing the index. Keyed
+                tuples are separate from named ones.
+---------------------------------------------------------------------------*/
+int tsh_kput(TSH_CONN *conn, unsigned long family, unsigned long long index,
+             unsigned short priority, const void *tuple, unsigned long length)
+{
+    tsh_kput_it out;
+    tsh_put_ot in;
+    unsigned char hdr[TSH_V2_MAXHDR];
+    int n;
+
+    if (conn == NULL || tuple == NULL)
+    {
+        fprintf(stderr, "tsh_kput: Invalid parameters\n");
+        return -1;
+    }
+
+    tsh_cache_drop(1, family, index, NULL);
+
+    if (conn->version == TSH_V2)
+    {
+        n = tsh_v2_begin(conn, hdr, TSH_OP_KPUT);
+        n += tsh_v2_varint(hdr + n, family);
+        n += tsh_v2_varint(hdr + n, index);
+        n += tsh_v2_varint(hdr + n, priority);
+        return tsh_v2_ok(tsh_v2_call(conn, hdr, n, tuple, length, NULL, NULL,
+                                     NULL, 0, NULL)) ? 0 : -1;
+    }
+
+    tsh_fill_key(&out.key, family, index);
+    out.length = htonl(length);
+    out.priority = htons(priority);
+
+    if (tsh_send_op(conn, TSH_OP_KPUT) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)) ||
+        !writen(conn->sock, (char *)tuple, length))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    return (ntohs(in.status) == SUCCESS) ? 0 : -1;
+}
+
+/* Sends a keyed get/read and reads the tuple. The length of the whole
+   tuple goes to *total (may be NULL), 0 if a v1 reply leaves it open */
+static int tsh_kfetch(TSH_CONN *conn, unsigned short op_code,
+                      unsigned long family, unsigned long long index,
+                      char *outbuf, unsigned long *outlen, unsigned long *total)
+{
+    tsh_kget_it out;
+    tsh_kget_ot in;
+    unsigned char hdr[TSH_V2_MAXHDR], fld[TSH_V2_MAXHDR];
+    unsigned long cap = tsh_capacity(outlen);
+    int n, m;
+
+    if (conn == NULL || outbuf == NULL)
+    {
+        fprintf(stderr, "tsh_kget: Invalid parameters\n");
+        return -1;
+    }
+
+    if (conn->version == TSH_V2)
+    {
+        n = tsh_v2_begin(conn, hdr, op_code);
+        n += tsh_v2_varint(hdr + n, family);
+        n += tsh_v2_varint(hdr + n, index);
+        n += tsh_v2_varint(hdr + n, cap);
+        if (!tsh_v2_ok(tsh_v2_call(conn, hdr, n, NULL, 0, fld, &m, outbuf, cap,
+                                   outlen)))
+            return -1;
+        if (total)
+            *total = tsh_v2_total(op_code, fld, m);
+        return 0;
+    }
+
+    tsh_fill_key(&out.key, family, index);
+    out.len = htonl(cap);
+
+    if (tsh_send_op(conn, op_code) != 0)
+        return -1;
+
+    if (!writen(conn->sock, (char *)&out, sizeof(out)))
+        return -1;
+
+    if (!readn(conn->sock, (char *)&in, sizeof(in)))
+        return -1;
+
+    if (ntohs(in.status) != SUCCESS)
+        return -1;
+
+    if (!readn(conn->sock, outbuf, ntohl(in.length)))
+        return -1;
+
+    if (outlen)
+        *outlen = ntohl(in.length);
+    if (total)
+        *total = (cap == 0 || ntohl(in.length) < cap) ? ntohl(in.length) : 0;
+
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_kget
+  Parameters  : conn - pointer to TSH connection handle
+                family - family id
+                index - index of the tuple within the family
+                outbuf - buffer to store the tuple data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the tuple data
+  Returns     : 0 on success, -1 on failure or if there is no such tuple
+  Description : Removes and returns the tuple with this key. Unlike
+                tsh_get, a miss is not queued on the server.
+---------------------------------------------------------------------------*/
+int tsh_kget(TSH_CONN *conn, unsigned long family, unsigned long long index,
+             char *outbuf, unsigned long *outlen)
+{
+    tsh_cache_drop(1, family, index, NULL);
+    return tsh_kfetch(conn, TSH_OP_KGET, family, index, outbuf, outlen, NULL);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_kread
+  Parameters  : conn - pointer to TSH connection handle
+                family - family id
+                index - index of the tuple within the family
+                outbuf - buffer to store the tuple data
+                outlen - in: size of outbuf (0 or NULL: unchecked),
+                         out: length of the tuple data
+  Returns     : 0 on success, -1 on failure or if there is no such tuple
+  Description : Returns a copy of the tuple with this key, leaving it in
+                place. Tuples of a family marked with tsh_cache_family are
+                fetched once and then served from the cache.
+---------------------------------------------------------------------------*/
+int tsh_kread(TSH_CONN *conn, unsigned long family, unsigned long long index,
+              char *outbuf, unsigned long *outlen)
+{
+    unsigned long total = 0;
+
+    if (outbuf == NULL || !tsh_cache_mode(1, family, NULL))
+        return tsh_kfetch(conn, TSH_OP_KREAD, family, index, outbuf, outlen, NULL);
+
+    if (tsh_cache_lookup(1, family, index, NULL, 0, outbuf, outlen))
+        return 0;
+    if (tsh_kfetch(conn, TSH_OP_KREAD, family, index, outbuf, outlen, &total) != 0)
+        return -1;
+    if (outlen && total != 0 && total == *outlen)
+        tsh_cache_store(1, family, index, NULL, 0, outbuf, total);
+    return 0;
+}
+
+/* Queues a request record and sends the request; returns its id or 0.
+   Replies already waiting are read first, so a long run of submissions
+   never leaves the server blocked writing replies nobody reads */
+static unsigned long long tsh_v2_submit(TSH_CONN *conn, unsigned short op_code,
+                                        const unsigned char *hdr, int hdr_len,
+                                        const void *payload, unsigned long long payload_len,
+                                        char *outbuf, unsigned long max)
+{
+    struct tsh_req *req;
+    struct pollfd pfd;
+
+    pfd.fd = conn->sock;
+    pfd.events = POLLIN;
+    while (conn->pending_tail != NULL && !conn->pending_tail->answered &&
+           poll(&pfd, 1, 0) == 1)
+    {
+        if (tsh_v2_answer(conn) != 0)
+            return 0;
+    }
+
+    if ((req = (struct tsh_req *)malloc(sizeof(struct tsh_req))) == NULL)
+    {
+        perror("tsh_submit: Failed to allocate request");
+        return 0;
+    }
+    req->id = conn->next_id - 1;
+    req->op = op_code;
+    req->outbuf = outbuf;
+    req->max = max;
+    req->answered = 0;
+    req->error = 0;
+    req->length = 0;
+    req->cache = 0;
+    req->next = NULL;
+
+    if (tsh_v2_send(conn, hdr, hdr_len, payload, payload_len) != 0)
+    {
+        free(req);
+        return 0;
+    }
+    if (conn->pending_tail != NULL)
+        conn->pending_tail->next = req;
+    else
+        conn->pending = req;
+    conn->pending_tail = req;
+
+    return req->id;
+}
+
+/* Whether conn may carry asynchronous requests */
+static int tsh_pipelined(TSH_CONN *conn, const char *func)
+{
+    if (conn == NULL || conn->version != TSH_V2 || !(conn->caps & TSH_CAP_PIPELINE))
+    {
+        fprintf(stderr, "%s: Needs a v2 connection from tsh_connect_v2\n", func);
+        return 0;
+    }
+    return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_put
+  Parameters  : conn - v2 connection handle
+                name - name of the tuple to store
+                priority - priority of the tuple
+                tuple - pointer to the tuple data
+                length - length of the tuple data in bytes
+                ttl_ms - lifetime in milliseconds, 0 for none
+  Returns     : Request id, 0 on failure
+  Description : Sends a put without waiting for the server. The tuple has
+                been handed to the socket on return, so the caller may
+                reuse it. The outcome is collected with tsh_poll or
+                tsh_wait.
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_put(TSH_CONN *conn, const char *name,
+                                  unsigned short priority, const void *tuple,
+                                  unsigned long length, unsigned long ttl_ms)
+{
+    unsigned char hdr[TSH_V2_MAXHDR];
+    int n;
+
+    if (!tsh_pipelined(conn, "tsh_submit_put") || name == NULL || tuple == NULL)
+        return 0;
+
+    tsh_cache_drop(0, 0, 0, name);
+
+    n = tsh_v2_begin(conn, hdr, TSH_OP_PUT);
+    n += tsh_v2_string(hdr + n, name);
+    n += tsh_v2_varint(hdr + n, priority);
+    n += tsh_v2_varint(hdr + n, ttl_ms);
+    return tsh_v2_submit(conn, TSH_OP_PUT, hdr, n, tuple, length, NULL, 0);
+}
+
+/* Submits a get or read by name */
+static unsigned long long tsh_submit_fetch(TSH_CONN *conn, unsigned short op_code,
+                                           const char *expr, char *outbuf,
+                                           unsigned long size)
+{
+    unsigned char hdr[TSH_V2_MAXHDR];
+    int n;
+
+    if (!tsh_pipelined(conn, "tsh_submit_get") || expr == NULL || outbuf == NULL)
+        return 0;
+
+    n = tsh_v2_begin(conn, hdr, op_code);
+    n += tsh_v2_string(hdr + n, expr);
+    n += tsh_v2_varint(hdr + n, size);
+    return tsh_v2_submit(conn, op_code, hdr, n, NULL, 0, outbuf, size);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_get
+  Parameters  : conn - v2 connection handle
+                expr - expression to match the tuple
+                outbuf - buffer the tuple data will be placed in; it must
+                         stay valid until the completion is collected
+                size - size of outbuf (0: unchecked)
+  Returns     : Request id, 0 on failure
+  Description : Asynchronous tsh_get. A miss completes with status -1 and
+                is not queued on the server.
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_get(TSH_CONN *conn, const char *expr,
+                                  char *outbuf, unsigned long size)
+{
+    return tsh_submit_fetch(conn, TSH_OP_GET, expr, outbuf, size);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_read
+  Parameters  : as tsh_submit_get
+  Returns     : Request id, 0 on failure
+  Description : Asynchronous tsh_read
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_read(TSH_CONN *conn, const char *expr,
+                                   char *outbuf, unsigned long size)
+{
+    return tsh_submit_fetch(conn, TSH_OP_READ, expr, outbuf, size);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_kput
+  Parameters  : conn - v2 connection handle
+                family - family id
+                index - index of the tuple within the family
+                priority - priority of the tuple
+                tuple - pointer to the tuple data
+                length - length of the tuple data
+  Returns     : Request id, 0 on failure
+  Description : Asynchronous tsh_kput; the tuple may be reused on return
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_kput(TSH_CONN *conn, unsigned long family,
+                                   unsigned long long index, unsigned short priority,
+                                   const void *tuple, unsigned long length)
+{
+    unsigned char hdr[TSH_V2_MAXHDR];
+    int n;
+
+    if (!tsh_pipelined(conn, "tsh_submit_kput") || tuple == NULL)
+        return 0;
+
+    tsh_cache_drop(1, family, index, NULL);
+
+    n = tsh_v2_begin(conn, hdr, TSH_OP_KPUT);
+    n += tsh_v2_varint(hdr + n, family);
+    n += tsh_v2_varint(hdr + n, index);
+    n += tsh_v2_varint(hdr + n, priority);
+    return tsh_v2_submit(conn, TSH_OP_KPUT, hdr, n, tuple, length, NULL, 0);
+}
+
+/* Submits a keyed get or read */
+static unsigned long long tsh_submit_kfetch(TSH_CONN *conn, unsigned short op_code,
+                                            unsigned long family,
+                                            unsigned long long index,
+                                            char *outbuf, unsigned long size)
+{
+    unsigned char hdr[TSH_V2_MAXHDR];
+    struct tsh_req *req;
+    unsigned long long id;
+    unsigned long len = size;
+    int n, cache;
+
+    if (!tsh_pipelined(conn, "tsh_submit_kget") || outbuf == NULL)
+        return 0;
+
+    cache = (op_code == TSH_OP_KREAD && tsh_cache_mode(1, family, NULL));
+    if (op_code == TSH_OP_KGET)
+        tsh_cache_drop(1, family, index, NULL);
+
+    n = tsh_v2_begin(conn, hdr, op_code);
+
+    /* A cached tuple completes at once, in its turn among the others */
+    if (cache && tsh_cache_lookup(1, family, index, NULL, 0, outbuf, &len))
+    {
+        if ((req = (struct tsh_req *)calloc(1, sizeof(struct tsh_req))) == NULL)
+            return 0;
+        req->id = conn->next_id - 1;
+        req->op = op_code;
+        req->answered = 1;
+        req->error = TSH_ER_NOERROR;
+        req->length = len;
+        if (conn->pending_tail != NULL)
+            conn->pending_tail->next = req;
+        else
+            conn->pending = req;
+        conn->pending_tail = req;
+        return req->id;
+    }
+
+    n += tsh_v2_varint(hdr + n, family);
+    n += tsh_v2_varint(hdr + n, index);
+    n += tsh_v2_varint(hdr + n, size);
+    if ((id = tsh_v2_submit(conn, op_code, hdr, n, NULL, 0, outbuf, size)) != 0 && cache)
+    {
+        conn->pending_tail->cache = 1;
+        conn->pending_tail->family = family;
+        conn->pending_tail->index = index;
+    }
+    return id;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_kget
+  Parameters  : conn - v2 connection handle
+                family - family id
+                index - index of the tuple within the family
+                outbuf - buffer the tuple data will be placed in; it must
+                         stay valid until the completion is collected
+                size - size of outbuf (0: unchecked)
+  Returns     : Request id, 0 on failure
+  Description : Asynchronous tsh_kget
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_kget(TSH_CONN *conn, unsigned long family,
+                                   unsigned long long index, char *outbuf,
+                                   unsigned long size)
+{
+    return tsh_submit_kfetch(conn, TSH_OP_KGET, family, index, outbuf, size);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_submit_kread
+  Parameters  : as tsh_submit_kget
+  Returns     : Request id, 0 on failure
+  Description : Asynchronous tsh_kread
+---------------------------------------------------------------------------*/
+unsigned long long tsh_submit_kread(TSH_CONN *conn, unsigned long family,
+                                    unsigned long long index, char *outbuf,
+                                    unsigned long size)
+{
+    return tsh_submit_kfetch(conn, TSH_OP_KREAD, family, index, outbuf, size);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_wait
+  Parameters  : conn - v2 connection handle
+                done - where the completion is stored
+                timeout_ms - how long to wait, 0 to only check, negative
+                             for no limit
+  Returns     : 1 if a completion was collected, 0 if none arrived in
+                time or nothing is outstanding, -1 if the connection broke
+  Description : Collects the completion of the oldest outstanding request.
+                Requests complete in the order they were submitted.
+---------------------------------------------------------------------------*/
+int tsh_wait(TSH_CONN *conn, tsh_completion *done, long timeout_ms)
+{
+    struct tsh_req *req;
+    struct pollfd pfd;
+    int ready;
+
+    if (conn == NULL || done == NULL)
+    {
+        fprintf(stderr, "tsh_wait: Invalid parameters\n");
+        return -1;
+    }
+
+    if ((req = conn->pending) == NULL)
+        return 0;
+
+    if (!req->answered)
+    {
+        pfd.fd = conn->sock;
+        pfd.events = POLLIN;
+        ready = poll(&pfd, 1, timeout_ms < 0 ? -1 : (int)timeout_ms);
+        if (ready < 0)
+            return -1;
+        if (ready == 0)
+            return 0;
+        if (tsh_v2_answer(conn) != 0)
+            return -1;
+    }
+
+    done->id = req->id;
+    done->op = req->op;
+    done->error = req->error;
+    done->status = tsh_v2_ok(req->error) ? 0 : -1;
+    done->length = req->length;
+
+    conn->pending = req->next;
+    if (conn->pending == NULL)
+        conn->pending_tail = NULL;
+    free(req);
+
+    return 1;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_poll
+  Parameters  : conn - v2 connection handle
+                done - where the completion is stored
+  Returns     : 1 if a completion was collected, 0 if none is ready,
+                -1 if the connection broke
+  Description : tsh_wait without waiting
+---------------------------------------------------------------------------*/
+int tsh_poll(TSH_CONN *conn, tsh_completion *done)
+{
+    return tsh_wait(conn, done, 0);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_fd
+  Parameters  : conn - connection handle
+  Returns     : The connection's socket
+  Description : For select/poll/epoll based event loops: when the socket
+                is readable, call tsh_poll until it returns 0. Submitting
+                can collect replies early, so call tsh_poll after
+                submitting too rather than waiting on the socket alone.
+---------------------------------------------------------------------------*/
+int tsh_fd(TSH_CONN *conn)
+{
+    return conn->sock;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_pending
+  Parameters  : conn - connection handle
+  Returns     : Number of submitted requests whose completion has not
+                been collected
+  Description : -
+---------------------------------------------------------------------------*/
+int tsh_pending(TSH_CONN *conn)
+{
+    struct tsh_req *req;
+    int n = 0;
+
+    for (req = conn->pending; req != NULL; req = req->next)
+        n++;
+    return n;
+}
+
+/* One connection of a pool */
+typedef struct {
+    TSH_CONN *conn;          /* NULL until (re)connected */
+    int busy;                /* handed out by tsh_pool_acquire */
+    int owned;               /* owner is valid */
+    pthread_t owner;         /* thread the slot last served */
+    unsigned int failures;   /* connects failed in a row */
+    long long retry_at;      /* no reconnect before this (ms) */
+} tsh_pool_slot;
+
+struct tsh_pool {
+    unsigned short port;
+    int size;
+    tsh_pool_slot *slots;
+    pthread_mutex_t lock;    /* guards busy, owner and the retry state */
+    pthread_cond_t freed;    /* signalled on release */
+    unsigned int seed;       /* rand_r state of the backoff jitter, under lock */
+    struct tsh_pool *next;   /* all pools, for the fork handlers */
+};
+
+/* Pools of this process; the fork handlers lock every one of them, so a
+   child never inherits a pool locked by a thread that did not follow */
+static TSH_POOL *tsh_pools = NULL;
+static pthread_mutex_t tsh_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TSH_POOL_BACKOFF_MS     10   /* first reconnect delay */
+#define TSH_POOL_BACKOFF_MAX_MS 2000 /* longest reconnect delay */
+
+/* Milliseconds of a monotonic clock */
+static long long tsh_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void tsh_pool_prepare(void)
+{
+    TSH_POOL *pool;
+
+    pthread_mutex_lock(&tsh_pools_lock);
+    for (pool = tsh_pools; pool != NULL; pool = pool->next)
+        pthread_mutex_lock(&pool->lock);
+    pthread_mutex_lock(&tsh_cache.lock);
+}
+
+static void tsh_pool_parent(void)
+{
+    TSH_POOL *pool;
+
+    pthread_mutex_unlock(&tsh_cache.lock);
+    for (pool = tsh_pools; pool != NULL; pool = pool->next)
+        pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&tsh_pools_lock);
+}
+
+/* The child shares the parent's sockets; replies meant for one would be
+   read by the other. It closes its copies, which leaves the parent's
+   connections alone, and connects again when it needs to */
+static void tsh_pool_child(void)
+{
+    TSH_POOL *pool;
+    int i;
+
+    for (pool = tsh_pools; pool != NULL; pool = pool->next)
+    {
+        for (i = 0; i < pool->size; i++)
+        {
+            if (pool->slots[i].conn != NULL)
+                tsh_disconnect(pool->slots[i].conn);
+            memset(&pool->slots[i], 0, sizeof(tsh_pool_slot));
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->freed, NULL);
+        pool->seed ^= (unsigned int)getpid(); /* siblings back off apart */
+    }
+    pthread_mutex_init(&tsh_pools_lock, NULL);
+    pthread_mutex_init(&tsh_cache.lock, NULL); /* the cached tuples stay valid */
+}
+
+static void tsh_pool_atfork(void)
+{
+    pthread_atfork(tsh_pool_prepare, tsh_pool_parent, tsh_pool_child);
+}
+
+/* Whether a pooled connection still looks usable. With nothing
+   outstanding the server never sends, so a readable socket means it
+   closed the connection or the stream is out of step */
+static int tsh_pool_healthy(TSH_CONN *conn)
+{
+    struct pollfd pfd;
+
+    if (conn->version != TSH_V2 || conn->pending != NULL)
+        return 0;
+    pfd.fd = conn->sock;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_pool_create
+  Parameters  : port - port number of the TSH server
+                size - number of connections, at least 1
+  Returns     : Pointer to the pool or NULL on failure
+  Description : Creates a pool of up to size persistent v2 connections,
+                shared by the threads of a process. Connections are made
+                on first use, so many pools or many forked children do
+                not all connect at once.
+---------------------------------------------------------------------------*/
+TSH_POOL *tsh_pool_create(unsigned short port, int size)
+{
+    TSH_POOL *pool;
+
+    if (size < 1)
+    {
+        fprintf(stderr, "tsh_pool_create: Invalid parameters\n");
+        return NULL;
+    }
+
+    pthread_once(&tsh_pools_once, tsh_pool_atfork);
+
+    pool = (TSH_POOL *)calloc(1, sizeof(TSH_POOL));
+    if (pool == NULL || (pool->slots = calloc(size, sizeof(tsh_pool_slot))) == NULL)
+    {
+        perror("tsh_pool_create: Failed to allocate pool");
+        free(pool);
+        return NULL;
+    }
+    pool->port = port;
+    pool->size = size;
+    pool->seed = (unsigned int)getpid() ^ (unsigned int)tsh_now_ms();
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->freed, NULL);
+
+    pthread_mutex_lock(&tsh_pools_lock);
+    pool->next = tsh_pools;
+    tsh_pools = pool;
+    pthread_mutex_unlock(&tsh_pools_lock);
+
+    return pool;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_pool_destroy
+  Parameters  : pool - pool to close
+  Returns     : -
+  Description : Closes all connections and frees the pool. No connection
+                may still be acquired.
+---------------------------------------------------------------------------*/
+void tsh_pool_destroy(TSH_POOL *pool)
+{
+    TSH_POOL **pp;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&tsh_pools_lock);
+    for (pp = &tsh_pools; *pp != NULL; pp = &(*pp)->next)
+    {
+        if (*pp == pool)
+        {
+            *pp = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tsh_pools_lock);
+
+    for (i = 0; i < pool->size; i++)
+    {
+        if (pool->slots[i].conn != NULL)
+            tsh_disconnect(pool->slots[i].conn);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->freed);
+    free(pool->slots);
+    free(pool);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_pool_acquire
+  Parameters  : pool - pool to take a connection from
+  Returns     : Connection for the calling thread's exclusive use, NULL
+                if the server cannot be reached
+  Description : Hands out a connection, waiting while all are in use. A
+                thread gets back the connection it used last if that is
+                free. The connection is checked first and replaced if the
+                server closed it; a slot whose connects keep failing is
+                retried with a growing, jittered delay instead of on
+                every call. If the server does not speak v2 the result is
+                a v1 connection, good for one op.
+---------------------------------------------------------------------------*/
+TSH_CONN *tsh_pool_acquire(TSH_POOL *pool)
+{
+    pthread_t self = pthread_self();
+    tsh_pool_slot *slot = NULL;
+    long long wait_ms;
+    unsigned int delay;
+    int i;
+
+    if (pool == NULL)
+    {
+        fprintf(stderr, "tsh_pool_acquire: Invalid parameters\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (slot == NULL)
+    {
+        /* this thread's own slot first, then a connected one, then any */
+        for (i = 0; i < pool->size; i++)
+        {
+            tsh_pool_slot *s = &pool->slots[i];
+            if (s->busy)
+                continue;
+            if (s->owned && pthread_equal(s->owner, self))
+            {
+                slot = s;
+                break;
+            }
+            if (slot == NULL || (slot->conn == NULL && s->conn != NULL))
+                slot = s;
+        }
+        if (slot == NULL)
+            pthread_cond_wait(&pool->freed, &pool->lock);
+    }
+    slot->busy = 1;
+    slot->owned = 1;
+    slot->owner = self;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the slot is ours now, check and connect outside the lock */
+    if (slot->conn != NULL && !tsh_pool_healthy(slot->conn))
+    {
+        tsh_disconnect(slot->conn);
+        slot->conn = NULL;
+    }
+    if (slot->conn == NULL)
+    {
+        wait_ms = slot->retry_at - tsh_now_ms();
+        if (wait_ms > 0)
+            usleep(wait_ms * 1000);
+        slot->conn = tsh_connect_v2(pool->port);
+        if (slot->conn == NULL)
+        {
+            delay = TSH_POOL_BACKOFF_MS << (slot->failures < 8 ? slot->failures : 8);
+            if (delay > TSH_POOL_BACKOFF_MAX_MS)
+                delay = TSH_POOL_BACKOFF_MAX_MS;
+            slot->failures++;
+            pthread_mutex_lock(&pool->lock);
+            slot->retry_at = tsh_now_ms() + delay / 2 + rand_r(&pool->seed) % (delay / 2 + 1);
+            slot->busy = 0;
+            pthread_cond_signal(&pool->freed);
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        slot->failures = 0;
+    }
+
+    return slot->conn;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_pool_release
+  Parameters  : pool - pool the connection came from
+                conn - connection from tsh_pool_acquire
+  Returns     : -
+  Description : Returns a connection to the pool. A v1 connection, or one
+                with completions left uncollected, is closed rather than
+                handed to the next thread.
+---------------------------------------------------------------------------*/
+void tsh_pool_release(TSH_POOL *pool, TSH_CONN *conn)
+{
+    int i;
+
+    if (pool == NULL || conn == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->size; i++)
+    {
+        tsh_pool_slot *s = &pool->slots[i];
+        if (s->busy && s->conn == conn)
+        {
+            if (conn->version != TSH_V2 || conn->pending != NULL)
+            {
+                tsh_disconnect(conn);
+                s->conn = NULL;
+            }
+            s->busy = 0;
+            pthread_cond_signal(&pool->freed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Collects streamed output into a fixed MAX_STDOUT buffer for tsh_shell */
+typedef struct {
+    char *buf;
+    unsigned long used;
+} shell_capture_t;
+
+static int shell_capture(const char *chunk, unsigned long len, void *arg)
+{
+    shell_capture_t *cap = (shell_capture_t *)arg;
+
+    if (cap->used + len > MAX_STDOUT - 1)
+        len = MAX_STDOUT - 1 - cap->used;
+    memcpy(cap->buf + cap->used, chunk, len);
+    cap->used += len;
+    cap->buf[cap->used] = '\0';
+    return 0;
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_shell
+  Parameters  : conn - pointer to TSH connection handle
+                command - shell command to execute
+                output - buffer of MAX_STDOUT bytes for the command output
+                username - buffer to store the username
+                cwd - buffer to store the current working directory
+  Returns     : status reported by the server, -1 on failure
+  Description : Executes a shell command through TSH. Output beyond
+                MAX_STDOUT - 1 bytes is discarded; use tsh_shell_stream
+                for commands with larger output.
+---------------------------------------------------------------------------*/
+int tsh_shell(TSH_CONN *conn, char *command, char *output, char *username, char *cwd)
+{
+    char scratch[MAX_STDOUT];
+    shell_capture_t cap;
+
+    cap.buf = (output != NULL) ? output : scratch;
+    cap.used = 0;
+    cap.buf[0] = '\0';
+
+    return tsh_shell_stream(conn, command, shell_capture, &cap, username, cwd);
+}
+
+/*---------------------------------------------------------------------------
+  Function    : tsh_shell_stream
+  Parameters  : conn - pointer to TSH connection handle
+                command - shell command to execute
+                cb - called with each chunk of output, may be NULL
+                arg - passed through to cb
+                username - buffer to store the username (64 bytes)
+                cwd - buffer to store the current working directory (256 bytes)
+  Returns     : status reported by the server, -1 on failure
+  Description : Executes a shell command through TSH. The server runs it
+                in a child process and streams the output back as it is
+                produced, so there is no limit on its length. If cb
+                returns nonzero the call fails; disconnecting then makes
+                the server stop the command.
+---------------------------------------------------------------------------*/
+int tsh_shell_stream(TSH_CONN *conn, char *command, tsh_shell_cb cb, void *arg,
+                     char *username, char *cwd)
+{
+    tsh_shell_it out;
+    tsh_shell_ot in;
+    tsh_shell_chunk chunk;
+    char *buf;
+    unsigned long len, size = 0;
+
+    if (conn == NULL || command == NULL) {
+        return -1; // Invalid parameters
+    }
+
+    /* Send operation code */
+    if (tsh_send_op(conn, TSH_OP_SHELL) != 0) {
+        return -1;
+    }
+
+    /* Prepare shell command parameters */
+    memset(&out, 0, sizeof(out));
+    out.length = htonl(strlen(command) + 1);
+
+    /* Send command structure */
+    if (!writen(conn->sock, (char *)&out, sizeof(out))) {
+        return -1;
+    }
+
+    /* Send command string */
+    if (!writen(conn->sock, command, ntohl(out.length))) {
+        return -1;
+    }
+
+    /* Read response header */
+    if (!readn(conn->sock, (char *)&in, sizeof(in))) {
+        return -1;
+    }
+
+    if (username != NULL) {
+        strcpy(username, in.username);
+    }
+
+    if (cwd != NULL) {
+        strcpy(cwd, in.cwd_loc);
+    }
+
+    /* Relay output chunks until the empty terminating chunk */
+    buf = NULL;
+    while (1) {
+        if (!readn(conn->sock, (char *)&chunk, sizeof(chunk))) {
+            free(buf);
+            return -1;
+        }
+        len = ntohl(chunk.length);
+        if (len == 0)
+            break;
+        if (len > size) {
+            char *grown = realloc(buf, len);
+            if (grown == NULL) {
+                free(buf);
+                return -1;
+            }
+            buf = grown;
+            size = len;
+        }
+        if (!readn(conn->sock, buf, len)) {
+            free(buf);
+            return -1;
+        }
+        if (cb != NULL && cb(buf, len, arg) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+
+    return ntohs(in.status);
+}
@@ -8,17 +8,33 @@
 
 #include "synergy.h"
 
+struct tsh_req;
+
 /* Connection handle for TSH operations */
 typedef struct {
     int sock;            /* Socket connection to TSH server */
     unsigned short port; /* Port number of TSH server */
+    int version;         /* 1: one op per connection, TSH_V2: framed */
+    unsigned long caps;  /* TSH_CAP_* granted on a v2 connection */
+    unsigned long long next_id; /* id of the next v2 request */
+    struct tsh_req *pending;      /* submitted requests, oldest first */
+    struct tsh_req *pending_tail;
 } TSH_CONN;
 
-/* Shell operation code */
-#define TSH_OP_SHELL 0x0005
+/* Outcome of a request submitted with tsh_submit_* */
+typedef struct {
+    unsigned long long id;       /* id tsh_submit_* returned */
+    unsigned short op;           /* TSH_OP_PUT, TSH_OP_GET, ... */
+    int status;                  /* 0 on success, -1 on failure or miss */
+    int error;                   /* server error code */
+    unsigned long length;        /* bytes placed in the request's outbuf */
+} tsh_completion;
+
+/* Shell operation code (served in the fifth slot of the TSH op table) */
+#define TSH_OP_SHELL 405
 
 /* Shell-specific constants */
-#define MAX_STDOUT 4096
+#define MAX_STDOUT 4096 /* output kept by tsh_shell, tsh_shell_stream has no limit */
 
 /* Shell operation structures */
 typedef struct {
@@ -31,13 +47,24 @@ typedef struct {
     short int error;             /* Error code if any */
     char username[64];           /* Username for prompt */
     char cwd_loc[256];           /* Current working directory for prompt */
-    char out_buffer[MAX_STDOUT]; /* Command output buffer */
-} tsh_shell_ot;
+} tsh_shell_ot;                  /* followed by tsh_shell_chunk stream */
+
+typedef struct {
+    sng_int32 length;            /* bytes of output that follow, 0 ends the stream */
+} tsh_shell_chunk;
+
+/* Receives one chunk of streamed shell output, nonzero return stops reading */
+typedef int (*tsh_shell_cb)(const char* chunk, unsigned long len, void* arg);
 
 /* Function prototypes */
 /* Initialize connection to TSH server */
 TSH_CONN* tsh_connect(unsigned short port);
 
+/* Connect and switch to the v2 protocol, which keeps the connection for
+   any number of tsh_put/get/read/stat/incr/kput/kget/kread calls; falls
+   back to a v1 connection if the server is older */
+TSH_CONN* tsh_connect_v2(unsigned short port);
+
 /* Close connection to TSH server */
 int tsh_disconnect(TSH_CONN* conn);
 
@@ -45,15 +72,146 @@ int tsh_disconnect(TSH_CONN* conn);
 int tsh_put(TSH_CONN* conn, const char* name, unsigned short priority, 
             const void* tuple, unsigned long length);
 
-/* Get a tuple from the tuple space (API version, returns tuple data in outbuf, length in outlen) */
+/* Put a tuple that the server deletes after ttl_ms (0: never expires) */
+int tsh_put_ttl(TSH_CONN* conn, const char* name, unsigned short priority,
+                const void* tuple, unsigned long length, unsigned long ttl_ms);
+
+/* Put a tuple only if none of that name exists; 1 if stored, 0 if not */
+int tsh_put_nx(TSH_CONN* conn, const char* name, unsigned short priority,
+               const void* tuple, unsigned long length, unsigned long ttl_ms);
+
+/* Replace a tuple only if its version is still 'expected' (0: absent);
+   1 if stored, 0 if not. The resulting/current version goes to *version */
+int tsh_cas(TSH_CONN* conn, const char* name, unsigned short priority,
+            const void* tuple, unsigned long length, unsigned long expected,
+            unsigned long* version);
+
+/* Get a tuple from the tuple space (API version, returns tuple data in outbuf, length in outlen;
+   *outlen on entry is the size of outbuf, 0 if unchecked) */
 int tsh_get(TSH_CONN* conn, const char* expr, char* outbuf, unsigned long* outlen);
 
-/* Read a tuple from the tuple space (API version, returns tuple data in outbuf, length in outlen) */
+/* Read a tuple from the tuple space (API version, returns tuple data in outbuf, length in outlen;
+   *outlen on entry is the size of outbuf, 0 if unchecked) */
 int tsh_read(TSH_CONN* conn, const char* expr, char* outbuf, unsigned long* outlen);
 
+/* Look up a tuple's length, priority and version without its data;
+   1 if a tuple matches, 0 if none does */
+int tsh_stat(TSH_CONN* conn, const char* expr, unsigned long* length,
+             unsigned short* priority, unsigned long* version);
+
+/* Atomically add delta to a counter tuple, creating it at 0 if absent;
+   the resulting value goes to *new_value. A delta of 0 just fetches it,
+   and fails if there is no such counter */
+int tsh_incr(TSH_CONN* conn, const char* name, long delta, long* new_value);
+
+/* Take a tuple under a lease; unless renewed or acknowledged within lease_ms
+   the server puts it back with raised priority */
+int tsh_take(TSH_CONN* conn, const char* expr, unsigned long lease_ms,
+             char* outbuf, unsigned long* outlen, unsigned long* lease_id);
+
+/* Extend a lease to lease_ms from now */
+int tsh_renew(TSH_CONN* conn, unsigned long lease_id, unsigned long lease_ms);
+
+/* Complete a lease, discarding the taken tuple */
+int tsh_ack(TSH_CONN* conn, unsigned long lease_id);
+
+/* Append an item to a server-side FIFO work queue */
+int tsh_enqueue(TSH_CONN* conn, const char* queue, const void* item,
+                unsigned long length);
+
+/* Remove the oldest item of a work queue, waiting up to wait_ms
+   (TSH_WAIT_FOREVER: no limit) if it is empty; leased if lease_ms is not 0.
+   1 if an item was dequeued, 0 if the queue stayed empty */
+int tsh_dequeue(TSH_CONN* conn, const char* queue, char* outbuf,
+                unsigned long* outlen, unsigned long wait_ms,
+                unsigned long lease_ms, unsigned long* lease_id);
+
+/* Subscribe conn to puts of tuples whose name matches expr, each note
+   carrying up to max_payload bytes of the tuple; conn is then only used
+   with tsh_next_note */
+int tsh_subscribe(TSH_CONN* conn, const char* expr, unsigned long max_payload);
+
+/* Wait up to timeout_ms (negative: no limit) for the next note of a
+   subscription; 1 if one was read, 0 on timeout */
+int tsh_next_note(TSH_CONN* conn, char* name, unsigned long* length,
+                  char* outbuf, unsigned long* outlen, long timeout_ms);
+
+/* Put, get or read a tuple by (family, index) rather than by name; keyed
+   tuples are a separate space and a keyed miss is never queued */
+int tsh_kput(TSH_CONN* conn, unsigned long family, unsigned long long index,
+             unsigned short priority, const void* tuple, unsigned long length);
+int tsh_kget(TSH_CONN* conn, unsigned long family, unsigned long long index,
+             char* outbuf, unsigned long* outlen);
+int tsh_kread(TSH_CONN* conn, unsigned long family, unsigned long long index,
+              char* outbuf, unsigned long* outlen);
+
+/* Pipelined requests on a v2 connection: each tsh_submit_* call sends its
+   request and returns its id (0 on failure) without waiting; completions
+   are collected in submission order with tsh_poll/tsh_wait. A fetch's
+   outbuf must stay valid until its completion is collected. Blocking
+   calls may be mixed in; they first read the outstanding replies */
+unsigned long long tsh_submit_put(TSH_CONN* conn, const char* name,
+                                  unsigned short priority, const void* tuple,
+                                  unsigned long length, unsigned long ttl_ms);
+unsigned long long tsh_submit_get(TSH_CONN* conn, const char* expr,
+                                  char* outbuf, unsigned long size);
+unsigned long long tsh_submit_read(TSH_CONN* conn, const char* expr,
+                                   char* outbuf, unsigned long size);
+unsigned long long tsh_submit_kput(TSH_CONN* conn, unsigned long family,
+                                   unsigned long long index, unsigned short priority,
+                                   const void* tuple, unsigned long length);
+unsigned long long tsh_submit_kget(TSH_CONN* conn, unsigned long family,
+                                   unsigned long long index, char* outbuf,
+                                   unsigned long size);
+unsigned long long tsh_submit_kread(TSH_CONN* conn, unsigned long family,
+                                    unsigned long long index, char* outbuf,
+                                    unsigned long size);
+
+/* Collect the oldest completion, waiting up to timeout_ms (negative: no
+   limit); 1 if collected, 0 if none (yet), -1 if the connection broke */
+int tsh_wait(TSH_CONN* conn, tsh_completion* done, long timeout_ms);
+
+/* tsh_wait with a timeout of 0 */
+int tsh_poll(TSH_CONN* conn, tsh_completion* done);
+
+/* Socket to watch in an event loop, and the number of uncollected requests */
+int tsh_fd(TSH_CONN* conn);
+int tsh_pending(TSH_CONN* conn);
+
+/* Client cache of tuples that do not change, or whose version shows when
+   they do. Cached reads are served from a per-process LRU bounded to
+   tsh_cache_limit bytes; puts and gets from this process drop the copy */
+#define TSH_CACHE_IMMUTABLE     1        /* never changes once written */
+#define TSH_CACHE_VERSIONED     2        /* revalidated with tsh_stat */
+#define TSH_CACHE_DEFAULT_BYTES (64UL << 20)
+
+int tsh_cache_family(unsigned long family);
+int tsh_cache_names(const char* prefix, int mode);
+void tsh_cache_limit(unsigned long bytes);
+
+/* Reads served from the cache and cacheable reads that were not;
+   returns the bytes cached */
+unsigned long tsh_cache_stats(unsigned long* hits, unsigned long* misses);
+
+/* Thread-safe pool of persistent v2 connections. A thread holds a
+   connection between tsh_pool_acquire and tsh_pool_release and gets its
+   previous one back when it is free; broken connections are replaced on
+   acquire. A forked child starts with the pool empty and connects on
+   demand, so connections must be released before fork */
+typedef struct tsh_pool TSH_POOL;
+
+TSH_POOL* tsh_pool_create(unsigned short port, int size);
+void tsh_pool_destroy(TSH_POOL* pool);
+TSH_CONN* tsh_pool_acquire(TSH_POOL* pool);
+void tsh_pool_release(TSH_POOL* pool, TSH_CONN* conn);
+
 /* Execute a shell command through TSH server */
 int tsh_shell(TSH_CONN* conn, char* command, char* output, char* username, char* cwd);
 
+/* Execute a shell command, handing its output to cb as it is produced */
+int tsh_shell_stream(TSH_CONN* conn, char* command, tsh_shell_cb cb, void* arg,
+                     char* username, char* cwd);
+
 /* Helper function - internal use only */
 int tsh_send_op(TSH_CONN* conn, unsigned short op_code);
 
@@ -74,6 +74,7 @@ void OpShell()
 {
    tsh_shell_it out;
    tsh_shell_ot in;
+   tsh_shell_chunk chunk;
    char *buff, *st;
 
    status = system("clear");
@@ -115,11 +116,25 @@ void OpShell()
    /* print result from TSH */
    printf("\n\nFrom TSH :\n");
    printf("Process PID(%d) \n", getpid());
-   printf("Username: %s", in.username);
-   printf("CWD: %s", in.cwd_loc);
+   printf("Username: %s\n", in.username);
+   printf("CWD: %s\n", in.cwd_loc);
    printf("Status: %d \n", ntohs(in.status));
    printf("Error: %d\n", ntohs(in.error));
-   printf("\nServer returned:\n%s\n", in.out_buffer);
+   printf("\nServer returned:\n");
+   /* output arrives in chunks until an empty one */
+   while (readn(tshsock, (char *)&chunk, sizeof(chunk)) && ntohl(chunk.length) > 0)
+   {
+      buff = (char *)malloc(ntohl(chunk.length));
+      if (!readn(tshsock, buff, ntohl(chunk.length)))
+      {
+         perror("\nOpShell::readn\n");
+         free(buff);
+         break;
+      }
+      fwrite(buff, 1, ntohl(chunk.length), stdout);
+      free(buff);
+   }
+   printf("\n");
    getchar();
 }
 
@@ -6,7 +6,6 @@
 #include "synergy.h"
 
 /* Shell-specific constants */
-#define MAX_STDOUT 4096
 #define fixed_buff 64
 #define SHELL_LINE_DELIM " \t\r\n\a"
 
@@ -23,8 +22,12 @@ typedef struct
    short int error;             /* Error code if any */
    char username[64];           /* Username for prompt */
    char cwd_loc[256];           /* Current working directory for prompt */
-   char out_buffer[MAX_STDOUT]; /* Command output buffer */
-} tsh_shell_ot;
+} tsh_shell_ot;                 /* followed by tsh_shell_chunk stream */
+
+typedef struct
+{
+   sng_int32 length; /* bytes of output that follow, 0 ends the stream */
+} tsh_shell_chunk;
 
 char login[NAME_LEN];
 